@@ -58,6 +58,7 @@ class FlagCommand extends ImageCommand {
 
   static requiresParam = true;
   static noParam = "You need to provide an emoji of a flag to overlay!";
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to overlay a flag onto!";
   static command = "flag";
 }
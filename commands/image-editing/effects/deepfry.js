@@ -4,6 +4,7 @@ class DeepfryCommand extends ImageCommand {
   static description = "Deep-fries an image";
   static aliases = ["fry", "jpeg2", "nuke", "df"];
 
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to fry!";
   static command = "deepfry";
 }
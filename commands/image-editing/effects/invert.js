@@ -4,6 +4,7 @@ class InvertCommand extends ImageCommand {
   static description = "Inverts an image";
   static aliases = ["inverse", "negate", "negative"];
 
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to invert!";
   static command = "invert";
 }
@@ -4,6 +4,7 @@ class SwirlCommand extends ImageCommand {
   static description = "Swirls an image";
   static aliases = ["whirlpool", "distort"];
 
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to swirl!";
   static command = "swirl";
 }
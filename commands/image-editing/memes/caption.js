@@ -50,6 +50,7 @@ class CaptionCommand extends ImageCommand {
 
   static requiresParam = true;
   static noParam = "You need to provide some text to add a caption!";
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to add a caption!";
   static command = "caption";
 }
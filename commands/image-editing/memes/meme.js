@@ -63,6 +63,7 @@ class MemeCommand extends ImageCommand {
 
   static requiresParam = true;
   static noParam = "You need to provide some text to generate a meme!";
+  static supportsVideo = true;
   static noImage = "You need to provide an image/GIF to generate a meme!";
   static command = "meme";
 }
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cfloat>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+
+enum class ArgType { String, Int, Float, Bool, Buffer };
+
+// One entry of a command's argument schema. Exactly one of the member pointers is set, matching the type.
+// Numbers are clamped to [min, max] when they are decoded, and required fields have no default.
+template <typename P> struct ArgField {
+  const char *name;
+  ArgType type;
+  bool required;
+  std::string P::*stringMember;
+  int P::*intMember;
+  float P::*floatMember;
+  bool P::*boolMember;
+  const char *stringDefault;
+  double numberDefault;
+  double min;
+  double max;
+};
+
+template <typename P> constexpr ArgField<P> RequiredArg(const char *name, std::string P::*member) {
+  return {name, ArgType::String, true, member, nullptr, nullptr, nullptr, nullptr, 0, 0, 0};
+}
+
+template <typename P> constexpr ArgField<P> Arg(const char *name, std::string P::*member, const char *fallback) {
+  return {name, ArgType::String, false, member, nullptr, nullptr, nullptr, fallback, 0, 0, 0};
+}
+
+template <typename P>
+constexpr ArgField<P> Arg(const char *name, int P::*member, int fallback, int min = INT_MIN, int max = INT_MAX) {
+  return {name, ArgType::Int, false, nullptr, member, nullptr, nullptr, nullptr, (double)fallback, (double)min,
+          (double)max};
+}
+
+template <typename P>
+constexpr ArgField<P> Arg(const char *name, float P::*member, float fallback, float min = -FLT_MAX,
+                          float max = FLT_MAX) {
+  return {name, ArgType::Float, false, nullptr, nullptr, member, nullptr, nullptr, fallback, min, max};
+}
+
+template <typename P> constexpr ArgField<P> Arg(const char *name, bool P::*member, bool fallback) {
+  return {name, ArgType::Bool, false, nullptr, nullptr, nullptr, member, nullptr, (double)fallback, 0, 1};
+}
+
+// Raw bytes (e.g. a second input file), only the N-API front end can pass these
+template <typename P> constexpr ArgField<P> BufferArg(const char *name, std::string P::*member) {
+  return {name, ArgType::Buffer, false, member, nullptr, nullptr, nullptr, "", 0, 0, 0};
+}
+
+/*
+  Type-erased view of a command's parameter struct, so the front ends can decode JS/JSON values straight into it
+  without knowing which command they're for. Keys that aren't part of the command's schema are ignored, and the
+  setters return false if the value has the wrong type for the field.
+*/
+class CommandArgs {
+public:
+  virtual ~CommandArgs() {}
+
+  virtual bool SetString(const std::string &key, std::string value) = 0;
+  virtual bool SetBuffer(const std::string &key, const char *data, size_t length) = 0;
+  virtual bool SetNumber(const std::string &key, double value) = 0;
+  virtual bool SetBool(const std::string &key, bool value) = 0;
+  // Returns the name of the first required field that was never set, or NULL if everything's there
+  virtual const char *Missing() const = 0;
+
+  // Shared by every command, decides whether the output gets converted to a GIF
+  bool togif = false;
+};
+
+template <typename P> class Args : public CommandArgs, public P {
+public:
+  Args() {
+    for (const ArgField<P> &field : P::fields) {
+      switch (field.type) {
+        case ArgType::String:
+        case ArgType::Buffer:
+          if (field.stringDefault != nullptr) this->*field.stringMember = field.stringDefault;
+          break;
+        case ArgType::Int:
+          this->*field.intMember = (int)field.numberDefault;
+          break;
+        case ArgType::Float:
+          this->*field.floatMember = (float)field.numberDefault;
+          break;
+        case ArgType::Bool:
+          this->*field.boolMember = field.numberDefault != 0;
+          break;
+      }
+    }
+  }
+
+  bool SetString(const std::string &key, std::string value) override {
+    const ArgField<P> *field = Find(key);
+    if (field == nullptr) return true;
+    if (field->type != ArgType::String) return false;
+    this->*field->stringMember = std::move(value);
+    MarkSet(field);
+    return true;
+  }
+
+  bool SetBuffer(const std::string &key, const char *data, size_t length) override {
+    const ArgField<P> *field = Find(key);
+    if (field == nullptr) return true;
+    if (field->type != ArgType::Buffer) return false;
+    (this->*field->stringMember).assign(data, length);
+    MarkSet(field);
+    return true;
+  }
+
+  bool SetNumber(const std::string &key, double value) override {
+    const ArgField<P> *field = Find(key);
+    if (field == nullptr) return true;
+    if (value < field->min) value = field->min;
+    if (value > field->max) value = field->max;
+    if (field->type == ArgType::Int) {
+      this->*field->intMember = (int)value;
+    } else if (field->type == ArgType::Float) {
+      this->*field->floatMember = (float)value;
+    } else {
+      return false;
+    }
+    MarkSet(field);
+    return true;
+  }
+
+  bool SetBool(const std::string &key, bool value) override {
+    if (key == "togif") togif = value;
+    const ArgField<P> *field = Find(key);
+    if (field == nullptr) return true;
+    if (field->type != ArgType::Bool) return false;
+    this->*field->boolMember = value;
+    MarkSet(field);
+    return true;
+  }
+
+  const char *Missing() const override {
+    for (size_t i = 0; i < P::fields.size(); i++) {
+      if (P::fields[i].required && !(set & (1ull << i))) return P::fields[i].name;
+    }
+    return nullptr;
+  }
+
+private:
+  static_assert(P::fields.size() <= 64, "Too many arguments for one command");
+
+  const ArgField<P> *Find(const std::string &key) const {
+    for (const ArgField<P> &field : P::fields) {
+      if (strcmp(field.name, key.c_str()) == 0) return &field;
+    }
+    return nullptr;
+  }
+
+  void MarkSet(const ArgField<P> *field) { set |= 1ull << (field - P::fields.data()); }
+
+  unsigned long long set = 0;
+};
+
+template <typename P> CommandArgs *NewArgs() { return new Args<P>(); }
@@ -0,0 +1,475 @@
+/*
+  Offline benchmark for the generic build. Generates (or loads) a fixed set of input files, runs every command in
+  FunctionMap and NoInputFunctionMap through esmb_image_process and prints the results as JSON on stdout, so runs
+  from different commits can be diffed. Progress goes to stderr.
+
+  Usage: image_bench [--assets DIR] [--fixtures DIR] [--iterations N] [--commands a,b,...] [--inputs a,b,...]
+
+  --assets points at the directory that contains assets/ (defaults to the current directory). If --fixtures is
+  given, inputs are read from there and any that are missing get generated and written back.
+*/
+
+#include "../common.h"
+#include "../generic/image.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace vips;
+using std::vector;
+
+enum class Input { Image, Video, None };
+
+struct BenchCase {
+  const char *command;
+  Input input;
+  // JSON members, basePath gets added to every command
+  const char *args;
+  // Set for commands that can't be run through the generic ABI
+  const char *skip;
+};
+
+// Arguments are roughly what the matching bot commands send
+static const BenchCase benchCases[] = {
+  {"blur",         Input::Image, "",                                                                       NULL},
+  {"bounce",       Input::Image, "",                                                                       NULL},
+  {"caption",      Input::Image, R"("caption":"when the code compiles first try","font":"futura")",       NULL},
+  {"captionTwo",   Input::Image, R"("caption":"bottom text","font":"helvetica")",                          NULL},
+  {"circle",       Input::Image, "",                                                                       NULL},
+  {"colors",       Input::Image, R"("color":"sepia")",                                                     NULL},
+  {"crop",         Input::Image, "",                                                                       NULL},
+  {"deepfry",      Input::Image, "",                                                                       NULL},
+  {"distort",      Input::Image, R"("mapName":"linearimplode.png")",                                       NULL},
+  {"fade",         Input::Image, "",                                                                       NULL},
+  {"flag",         Input::Image, R"("overlay":"assets/images/pirateflag.png")",                            NULL},
+  {"flip",         Input::Image, "",                                                                       NULL},
+  {"freeze",       Input::Image, R"("loop":false)",                                                        NULL},
+  {"gamexplain",   Input::Image, "",                                                                       NULL},
+  {"globe",        Input::Image, "",                                                                       NULL},
+  {"invert",       Input::Image, "",                                                                       NULL},
+  {"jpeg",         Input::Image, R"("quality":1)",                                                         NULL},
+  {"magik",        Input::Image, "",                                                                       NULL},
+  {"meme",         Input::Image, R"("topText":"top text","bottomText":"bottom text","font":"impact")",     NULL},
+  {"mirror",       Input::Image, "",                                                                       NULL},
+  {"motivate",     Input::Image, R"("topText":"benchmarks","bottomText":"they go fast","font":"times")",  NULL},
+  {"quote",        Input::Image, R"("text":"this is a quote","username":"bench")",                         NULL},
+  {"qrread",       Input::Image, "",                                                                       NULL},
+  {"reddit",       Input::Image, R"("caption":"bench")",                                                   NULL},
+  {"resize",       Input::Image, "",                                                                       NULL},
+  {"reverse",      Input::Image, "",                                                                       NULL},
+  {"scott",        Input::Image, "",                                                                       NULL},
+  {"snapchat",     Input::Image, R"("caption":"snapchat caption")",                                        NULL},
+  {"speed",        Input::Image, "",                                                                       NULL},
+  {"spin",         Input::Image, "",                                                                       NULL},
+  {"spotify",      Input::Image, R"("caption":"bench")",                                                   NULL},
+  {"squish",       Input::Image, "",                                                                       NULL},
+  {"swirl",        Input::Image, "",                                                                       NULL},
+  {"tile",         Input::Image, "",                                                                       NULL},
+  {"togif",        Input::Image, "",                                                                       NULL},
+  {"uncanny",      Input::Image,
+   R"("caption":"bench","caption2":"bench again","font":"helvetica","path":"assets/images/uncanny/canny.png")", NULL},
+  {"uncaption",    Input::Image, "",                                                                       NULL},
+  {"wall",         Input::Image, "",                                                                       NULL},
+  {"watermark",    Input::Image, R"("water":"assets/images/9gag.png","gravity":6)",                        NULL},
+  {"whisper",      Input::Image, R"("caption":"bench")",                                                   NULL},
+  {"videospeed",   Input::Video, "",                                                                       NULL},
+  {"videoreverse", Input::Video, "",                                                                       NULL},
+  {"videocaption", Input::Video, R"("caption":"bench")",                                                   NULL},
+  {"videotogif",   Input::Video, "",                                                                       NULL},
+  {"videotrim",    Input::Video, R"("duration":1)",                                                        NULL},
+  {"videomeme",    Input::Video, R"("top":"top text","bottom":"bottom text")",                             NULL},
+  {"videostitch",  Input::Video, "",                   "buffer arguments can't be passed through the generic ABI"},
+  {"videoaudio",   Input::Video, "",                                                                       NULL},
+  {"homebrew",     Input::None,  R"("caption":"bench")",                                                   NULL},
+  {"qrcreate",     Input::None,  R"("text":"https://example.com")",                                        NULL},
+  {"sonic",        Input::None,  R"("text":"gotta go fast")",                                              NULL},
+};
+
+struct Fixture {
+  string name;
+  string type;
+  Input kind;
+  string data;
+};
+
+struct Options {
+  string assets = "./";
+  string fixtures;
+  int iterations = 5;
+  std::set<string> commands;
+  std::set<string> inputs;
+};
+
+static string JsonEscape(const string &input) {
+  std::ostringstream out;
+  for (unsigned char c : input) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  return out.str();
+}
+
+static std::set<string> SplitList(const char *list) {
+  std::set<string> out;
+  std::istringstream in(list);
+  string item;
+  while (std::getline(in, item, ',')) {
+    if (!item.empty()) out.insert(item);
+  }
+  return out;
+}
+
+static double Ms(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// A gradient that moves a bit on every frame, plus some noise so that the encoders have real work to do
+static VImage FixtureFrame(int width, int height, int index) {
+  VImage xy = VImage::xyz(width, height);
+  VImage red = (xy[0] * (255.0 / width) + index * 7) % 256.0;
+  VImage green = (xy[1] * (255.0 / height) + index * 3) % 256.0;
+  VImage blue = ((xy[0] + xy[1]) * (127.0 / (width + height)) + index * 11) % 256.0;
+  VImage noise = VImage::gaussnoise(width, height, VImage::option()->set("sigma", 12.0));
+  return (VImage::bandjoin({red, green, blue}) + noise).cast(VIPS_FORMAT_UCHAR);
+}
+
+static string EncodeFixture(int width, int height, int frames, const string &type) {
+  VImage image;
+  if (frames > 1) {
+    vector<VImage> pages;
+    for (int i = 0; i < frames; i++) pages.push_back(FixtureFrame(width, height, i));
+    image = VImage::arrayjoin(pages, VImage::option()->set("across", 1)).copy();
+    image.set("page-height", height);
+    image.set("delay", vector<int>(frames, 40));
+    image.set("loop", 0);
+  } else {
+    image = FixtureFrame(width, height, 0);
+  }
+
+  void *buf;
+  size_t length;
+  image.write_to_buffer(("." + type).c_str(), &buf, &length);
+  string data((const char *)buf, length);
+  g_free(buf);
+  return data;
+}
+
+// A short clip with sound, made by ffmpeg's own test sources so no network is needed
+static string EncodeVideoFixture() {
+  string path = "/tmp/image_bench_" + std::to_string(getpid()) + ".mp4";
+  string cmd = "ffmpeg -v error -y -f lavfi -i testsrc=duration=3:size=480x270:rate=30 -f lavfi -i "
+               "sine=frequency=440:duration=3 -c:v libx264 -pix_fmt yuv420p -c:a aac -shortest " +
+               path + " < /dev/null";
+  if (system(cmd.c_str()) != 0) throw std::runtime_error("ffmpeg couldn't generate the test clip");
+  std::ifstream file(path, std::ios::binary);
+  std::stringstream data;
+  data << file.rdbuf();
+  remove(path.c_str());
+  return data.str();
+}
+
+static bool ReadFile(const string &path, string &data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+  std::stringstream contents;
+  contents << file.rdbuf();
+  data = contents.str();
+  return true;
+}
+
+static vector<Fixture> LoadFixtures(const Options &options) {
+  struct Spec {
+    const char *name;
+    const char *type;
+    Input kind;
+    int width;
+    int height;
+    int frames;
+  };
+  static const Spec specs[] = {
+    {"png_small",  "png",  Input::Image, 320,  240,  1  },
+    {"png_large",  "png",  Input::Image, 2048, 1536, 1  },
+    {"jpeg_small", "jpeg", Input::Image, 320,  240,  1  },
+    {"jpeg_large", "jpeg", Input::Image, 2048, 1536, 1  },
+    {"gif_10",     "gif",  Input::Image, 240,  180,  10 },
+    {"gif_100",    "gif",  Input::Image, 240,  180,  100},
+    {"gif_500",    "gif",  Input::Image, 160,  120,  500},
+    {"webp_10",    "webp", Input::Image, 240,  180,  10 },
+    {"webp_100",   "webp", Input::Image, 240,  180,  100},
+    {"webp_500",   "webp", Input::Image, 160,  120,  500},
+    {"avif",       "avif", Input::Image, 640,  480,  1  },
+    {"video",      "mp4",  Input::Video, 0,    0,    0  },
+  };
+
+  vector<Fixture> fixtures;
+  for (const Spec &spec : specs) {
+    if (!options.inputs.empty() && options.inputs.count(spec.name) == 0) continue;
+    Fixture fixture{spec.name, spec.type, spec.kind, ""};
+    string path = options.fixtures.empty() ? "" : options.fixtures + "/" + spec.name + "." + spec.type;
+    if (path.empty() || !ReadFile(path, fixture.data)) {
+      std::cerr << "Generating " << spec.name << std::endl;
+      try {
+        fixture.data = spec.kind == Input::Video ? EncodeVideoFixture()
+                                                 : EncodeFixture(spec.width, spec.height, spec.frames, spec.type);
+      } catch (std::exception &e) {
+        // e.g. libvips built without an AVIF encoder
+        std::cerr << "Skipping " << spec.name << ": " << e.what() << std::endl;
+        continue;
+      }
+      if (!path.empty()) std::ofstream(path, std::ios::binary) << fixture.data;
+    }
+    fixtures.push_back(fixture);
+  }
+  return fixtures;
+}
+
+struct RunResult {
+  bool ok;
+  double ms;
+  size_t outputBytes;
+  string outputType;
+  string error;
+};
+
+static RunResult RunOnce(const string &command, const string &args, const string &type, const string &data) {
+  RunResult result{false, 0, 0, "", ""};
+  auto start = std::chrono::steady_clock::now();
+  try {
+    image_result *out =
+      esmb_image_process(command.c_str(), args.c_str(), args.length(), type.c_str(), data.data(), data.length());
+    result.ms = Ms(std::chrono::steady_clock::now() - start);
+    result.ok = true;
+    result.outputBytes = out->length;
+    result.outputType = out->type;
+    esmb_image_free(out->buf, out);
+    free(out);
+  } catch (const char *e) {
+    result.error = e;
+  } catch (const string &e) {
+    result.error = e;
+  } catch (std::exception &e) {
+    result.error = e.what();
+  } catch (...) {
+    result.error = "unknown exception";
+  }
+  if (!result.ok) {
+    result.ms = Ms(std::chrono::steady_clock::now() - start);
+    string detail = vips_error_buffer();
+    if (!detail.empty()) result.error += ": " + detail;
+    vips_error_clear();
+  }
+  return result;
+}
+
+static string CaseArgs(const Options &options, const char *members) {
+  string args = "{\"basePath\":\"" + JsonEscape(options.assets) + "\"";
+  if (members[0] != '\0') args += string(",") + members;
+  return args + "}";
+}
+
+static double Percentile(const vector<double> &sorted, double q) {
+  if (sorted.empty()) return 0;
+  size_t index = std::min(sorted.size() - 1, (size_t)(q * (double)sorted.size()));
+  return sorted[index];
+}
+
+/*
+  Text rendering latency with nothing loaded yet (fontconfig setup, font registry and text cache miss), with fonts
+  loaded but a caption that isn't cached, and with a cached caption. Has to run before anything else touches fonts.
+*/
+static void BenchText(std::ostream &out, const Options &options, const vector<Fixture> &fixtures) {
+  const Fixture *input = NULL;
+  for (const Fixture &fixture : fixtures) {
+    if (fixture.kind == Input::Image) {
+      input = &fixture;
+      break;
+    }
+  }
+  if (input == NULL) {
+    out << "null";
+    return;
+  }
+
+  string cached = CaseArgs(options, R"("caption":"cold start","font":"futura")");
+  RunResult cold = RunOnce("caption", cached, input->type, input->data);
+  vector<double> warm, hit;
+  for (int i = 0; i < options.iterations; i++) {
+    string caption = R"("caption":"warm start )" + std::to_string(i) + R"(","font":"futura")";
+    string fresh = CaseArgs(options, caption.c_str());
+    warm.push_back(RunOnce("caption", fresh, input->type, input->data).ms);
+    hit.push_back(RunOnce("caption", cached, input->type, input->data).ms);
+  }
+  std::sort(warm.begin(), warm.end());
+  std::sort(hit.begin(), hit.end());
+
+  out << "{\"command\":\"caption\",\"input\":\"" << input->name << "\",\"font_load_ms\":"
+      << GetFonts(options.assets).LoadTime() << ",\"cold_ms\":" << cold.ms
+      << ",\"warm_ms\":" << Percentile(warm, 0.5) << ",\"cached_ms\":" << Percentile(hit, 0.5) << "}";
+}
+
+/*
+  Main-thread cost of copying a result into a JS buffer, which is what OnOK used to do before results were handed
+  over as external buffers. Only the malloc + memcpy + free part is measured, that's all the copy added.
+*/
+static void BenchHandoff(std::ostream &out) {
+  const size_t sizes[] = {1 << 20, 8 << 20, 32 << 20};
+  out << "[";
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+    char *source = (char *)malloc(size);
+    memset(source, 0x5a, size);
+    const int rounds = 20;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+      char *copy = (char *)malloc(size);
+      memcpy(copy, source, size);
+      // keep the copy from being optimized out
+      source[round] = copy[size - 1 - round];
+      free(copy);
+    }
+    double ms = Ms(std::chrono::steady_clock::now() - start) / rounds;
+    free(source);
+    out << (i > 0 ? "," : "") << "{\"bytes\":" << size << ",\"copy_ms\":" << ms
+        << ",\"copy_ms_per_mb\":" << ms / ((double)size / (1 << 20)) << "}";
+  }
+  out << "]";
+}
+
+static void BenchCommand(std::ostream &out, bool &first, const Options &options, const BenchCase &bench,
+                         const Fixture *input) {
+  string inputName = input != NULL ? input->name : "none";
+  std::cerr << bench.command << " / " << inputName << std::endl;
+  out << (first ? "" : ",") << "\n    {\"command\":\"" << bench.command << "\",\"input\":\"" << inputName << "\"";
+  first = false;
+
+  if (bench.skip != NULL) {
+    out << ",\"skipped\":\"" << JsonEscape(bench.skip) << "\"}";
+    return;
+  }
+
+  string args = CaseArgs(options, bench.args);
+  string type = input != NULL ? input->type : "png";
+  string data = input != NULL ? input->data : "";
+
+  RunResult cold = RunOnce(bench.command, args, type, data);
+  if (!cold.ok) {
+    out << ",\"error\":\"" << JsonEscape(cold.error) << "\"}";
+    return;
+  }
+
+  vector<double> times;
+  RunResult last = cold;
+  for (int i = 0; i < options.iterations; i++) {
+    last = RunOnce(bench.command, args, type, data);
+    if (!last.ok) {
+      out << ",\"error\":\"" << JsonEscape(last.error) << "\"}";
+      return;
+    }
+    times.push_back(last.ms);
+  }
+  std::sort(times.begin(), times.end());
+  double total = 0;
+  for (double ms : times) total += ms;
+  double mean = times.empty() ? cold.ms : total / times.size();
+
+  out << ",\"input_bytes\":" << data.length() << ",\"cold_ms\":" << cold.ms << ",\"p50_ms\":" << Percentile(times, 0.5)
+      << ",\"p95_ms\":" << Percentile(times, 0.95) << ",\"mean_ms\":" << mean
+      << ",\"throughput_mb_s\":" << (mean > 0 ? ((double)data.length() / (1 << 20)) / (mean / 1000) : 0)
+      << ",\"output_bytes\":" << last.outputBytes << ",\"output_type\":\"" << JsonEscape(last.outputType)
+      << "\",\"peak_rss_kb\":" << PeakRssKb() << "}";
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value for " << arg << std::endl;
+      return 1;
+    }
+    if (arg == "--assets") {
+      options.assets = argv[++i];
+      if (options.assets.back() != '/') options.assets += "/";
+    } else if (arg == "--fixtures") {
+      options.fixtures = argv[++i];
+    } else if (arg == "--iterations") {
+      options.iterations = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--commands") {
+      options.commands = SplitList(argv[++i]);
+    } else if (arg == "--inputs") {
+      options.inputs = SplitList(argv[++i]);
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  esmb_image_init();
+  vector<Fixture> fixtures = LoadFixtures(options);
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"iterations\": " << options.iterations << ",\n  \"fixtures\": [";
+  for (size_t i = 0; i < fixtures.size(); i++) {
+    out << (i > 0 ? "," : "") << "{\"name\":\"" << fixtures[i].name << "\",\"type\":\"" << fixtures[i].type
+        << "\",\"bytes\":" << fixtures[i].data.length() << "}";
+  }
+  out << "],\n  \"text\": ";
+  BenchText(out, options, fixtures);
+  out << ",\n  \"handoff\": ";
+  BenchHandoff(out);
+  out << ",\n  \"results\": [";
+
+  // Every registered command has to show up in the results, so a new command without a case is noticed
+  std::set<string> registered;
+  for (auto const &command : FunctionMap) registered.insert(command.first);
+  for (auto const &command : NoInputFunctionMap) registered.insert(command.first);
+
+  bool first = true;
+  for (const BenchCase &bench : benchCases) {
+    if (registered.erase(bench.command) == 0) continue;
+    if (!options.commands.empty() && options.commands.count(bench.command) == 0) continue;
+    if (bench.input == Input::None) {
+      BenchCommand(out, first, options, bench, NULL);
+      continue;
+    }
+    for (const Fixture &fixture : fixtures) {
+      if (fixture.kind == bench.input) BenchCommand(out, first, options, bench, &fixture);
+    }
+  }
+  for (const string &command : registered) {
+    out << (first ? "" : ",") << "\n    {\"command\":\"" << command << "\",\"skipped\":\"no benchmark case\"}";
+    first = false;
+  }
+
+  char *stats = esmb_image_stats(false);
+  out << "\n  ],\n  \"stats\": " << stats << "\n}\n";
+  esmb_image_free(stats, NULL);
+
+  std::cout << out.str();
+  return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vips/vips8>
+
+#include <algorithm>
+#include <mutex>
+
+/*
+  Splits the cores between the jobs in flight, so a few video jobs can't starve everything else. Every job holds a
+  Lease while it runs. vips concurrency is process-wide, so it follows the number of jobs and only applies to
+  pipelines built after it changes. Codecs, filter graphs and ParallelFor ask for their Share() when they start.
+*/
+class ThreadBudget {
+public:
+  struct Stats {
+    int cores;
+    int vipsMax;
+    int jobs;
+    // threads a job starting now gets
+    int share;
+    int vips;
+  };
+
+  class Lease {
+  public:
+    explicit Lease(ThreadBudget &budget) : budget(budget) { budget.Change(1); }
+    ~Lease() { budget.Change(-1); }
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+  private:
+    ThreadBudget &budget;
+  };
+
+  // vipsMax caps vips concurrency even when a job has the machine to itself, it bounds peak memory
+  void Configure(int cores, int vipsMax) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->cores = std::max(1, cores);
+    this->vipsMax = std::max(1, vipsMax);
+    Apply();
+  }
+
+  int Share() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ShareLocked();
+  }
+
+  Stats Get() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {cores, vipsMax, jobs, ShareLocked(), vips_concurrency_get()};
+  }
+
+private:
+  void Change(int delta) {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs += delta;
+    Apply();
+  }
+
+  int ShareLocked() const { return std::max(1, cores / std::max(1, jobs)); }
+  void Apply() { vips_concurrency_set(std::min(vipsMax, ShareLocked())); }
+
+  std::mutex mutex;
+  int cores = 1;
+  int vipsMax = 1;
+  int jobs = 0;
+};
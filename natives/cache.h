@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vips/vips8>
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe LRU of memory-backed images, bounded by the number of bytes the cached pixels take up.
+// Images put in here must already be fully decoded (e.g. via copy_memory()), since they get shared between jobs
+// running on different threads.
+class ImageCache {
+public:
+  struct Stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t limit;
+  };
+
+  explicit ImageCache(size_t limit) : limit(limit) {}
+
+  bool Get(const std::string &key, vips::VImage &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if (found == index.end()) {
+      misses++;
+      return false;
+    }
+    // move to the front of the list, marking it as the most recently used entry
+    entries.splice(entries.begin(), entries, found->second);
+    out = found->second->image;
+    hits++;
+    return true;
+  }
+
+  void Put(const std::string &key, const vips::VImage &image) {
+    size_t size = VIPS_IMAGE_SIZEOF_IMAGE(image.get_image());
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size > limit) return;
+
+    auto found = index.find(key);
+    if (found != index.end()) {
+      // another job got here first, keep its copy
+      entries.splice(entries.begin(), entries, found->second);
+      return;
+    }
+
+    entries.push_front({key, image, size});
+    index[key] = entries.begin();
+    bytes += size;
+    Shrink();
+  }
+
+  void SetLimit(size_t newLimit) {
+    std::lock_guard<std::mutex> lock(mutex);
+    limit = newLimit;
+    Shrink();
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+  }
+
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {hits, misses, evictions, entries.size(), bytes, limit};
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    vips::VImage image;
+    size_t size;
+  };
+
+  // must be called with the mutex held
+  void Shrink() {
+    while (bytes > limit && !entries.empty()) {
+      Entry &last = entries.back();
+      bytes -= last.size;
+      index.erase(last.key);
+      entries.pop_back();
+      evictions++;
+    }
+  }
+
+  std::mutex mutex;
+  std::list<Entry> entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+  size_t limit;
+  size_t bytes = 0;
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+};
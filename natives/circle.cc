@@ -29,52 +29,28 @@ VImage rectangularMap(int width, int height) {
   return index;
 }
 
-ArgumentMap Circle(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   [[maybe_unused]] ArgumentMap arguments, bool *shouldKill) {
-
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, false, false));
-
+VImage Circle(VImage in, ImageState &state, [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
-  try {
-    in = NormalizeVips(in, &width, &pageHeight, nPages);
-  } catch (int e) {
-    if (e == -1) {
-      ArgumentMap output;
-      output["buf"] = "";
-      outType = "frames";
-      return output;
-    }
-  }
+  in = NormalizeVips(in, &width, &pageHeight, nPages);
 
   VImage rectIndex = rectangularMap(width, pageHeight);
   VImage polarIndex = polarMap(width, pageHeight);
   VImage gaussmat = VImage::gaussmat(5, 0.2, VImage::option()->set("separable", true)).rot90();
 
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  for (int i = 0; i < nPages; i++) {
+  VImage out = JoinFrames(in, nPages, job, [&](int i) {
     VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
     VImage result = img_frame.mapim(rectIndex)
                       .replicate(1, 3)
                       .conv(gaussmat, VImage::option()->set("precision", VIPS_PRECISION_INTEGER))
                       .crop(0, pageHeight, width, pageHeight)
                       .mapim(polarIndex, VImage::option()->set("extend", VIPS_EXTEND_MIRROR));
-    img.push_back(result);
-  }
-
-  VImage out = VImage::arrayjoin(img, VImage::option()->set("across", 1));
+    return result;
+  });
 
-  SetupTimeoutCallback(out, shouldKill);
+  state.dither = 0;
 
-  char *buf;
-  size_t dataSize = 0;
-  out.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                      outType == "gif" ? VImage::option()->set("dither", 0) : 0);
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-  return output;
+  return out;
 }
@@ -9,13 +9,12 @@ using namespace vips;
 
 VImage sepia = VImage::new_matrixv(3, 3, 0.3588, 0.7044, 0.1368, 0.2990, 0.5870, 0.1140, 0.2392, 0.4696, 0.0912);
 
-ArgumentMap Colors(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   ArgumentMap arguments, bool *shouldKill) {
-  string color = GetArgument<string>(arguments, "color");
-  int shift = GetArgumentWithFallback<int>(arguments, "shift", 0);
+VImage Colors(VImage in, [[maybe_unused]] ImageState &state, const ColorsParams &arguments,
+              [[maybe_unused]] JobControl *job) {
+  const string &color = arguments.color;
+  int shift = arguments.shift;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
 
   VImage out;
 
@@ -29,15 +28,5 @@ ArgumentMap Colors(const string &type, string &outType, const char *bufferdata,
     out = in.colourspace(VIPS_INTERPRETATION_LCH) + shiftVec;
   }
 
-  SetupTimeoutCallback(out, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  out.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return out;
 }
@@ -1,77 +1,83 @@
 #pragma once
 
+#include "params.h"
+
 // Vultu: These are both bad, but I wanted to clean up code at least a little
 using std::string;
-#define declare_input_func(NAME)                                                                                       \
+#define declare_input_func(NAME, PARAMS)                                                                               \
   ArgumentMap NAME(const string &type, string &outType, const char *bufferData, size_t bufferLength,                   \
-                   ArgumentMap arguments, bool *shouldKill)
-#define declare_noinput_func(NAME)                                                                                     \
-  ArgumentMap NAME(const string &type, string &outType, ArgumentMap arguments, bool *shouldKill)
+                   const PARAMS &arguments, JobControl *job)
+#define declare_image_func(NAME, PARAMS)                                                                               \
+  vips::VImage NAME(vips::VImage in, ImageState &state, const PARAMS &arguments, JobControl *job)
+#define declare_noinput_func(NAME, PARAMS)                                                                             \
+  ArgumentMap NAME(const string &type, string &outType, const PARAMS &arguments, JobControl *job)
 
 // Declare our Input Functions
-declare_input_func(Blur);
-declare_input_func(Bounce);
-declare_input_func(Caption);
-declare_input_func(CaptionTwo);
-declare_input_func(Circle);
-declare_input_func(Colors);
-declare_input_func(Crop);
-declare_input_func(Deepfry);
-declare_input_func(Distort);
-declare_input_func(Fade);
-declare_input_func(Flag);
-declare_input_func(Flip);
-declare_input_func(Freeze);
-declare_input_func(Gamexplain);
-declare_input_func(Globe);
-declare_input_func(Invert);
-declare_input_func(Jpeg);
+declare_image_func(Blur, BlurParams);
+declare_image_func(Bounce, NoParams);
+declare_image_func(Caption, CaptionParams);
+declare_image_func(CaptionTwo, CaptionTwoParams);
+declare_image_func(Circle, NoParams);
+declare_image_func(Colors, ColorsParams);
+declare_image_func(Crop, NoParams);
+declare_image_func(Deepfry, NoParams);
+declare_image_func(Distort, DistortParams);
+declare_image_func(Fade, FadeParams);
+declare_image_func(Flag, FlagParams);
+declare_image_func(Flip, FlipParams);
+declare_input_func(Freeze, FreezeParams);
+declare_image_func(FreezeImage, FreezeParams);
+declare_image_func(Gamexplain, AssetParams);
+declare_image_func(Globe, AssetParams);
+declare_image_func(Invert, NoParams);
+declare_image_func(Jpeg, JpegParams);
 #if MAGICK_ENABLED
-declare_input_func(Magik);
+declare_input_func(Magik, NoParams);
 #endif
-declare_input_func(Meme);
-declare_input_func(Mirror);
-declare_input_func(Motivate);
-declare_input_func(Quote);
+declare_image_func(Meme, MemeParams);
+declare_image_func(Mirror, MirrorParams);
+declare_image_func(Motivate, MemeParams);
+declare_image_func(Quote, QuoteParams);
 #if ZXING_ENABLED
-declare_input_func(QrRead);
+declare_input_func(QrRead, NoParams);
 #endif
-declare_input_func(Reddit);
-declare_input_func(Resize);
-declare_input_func(Reverse);
-declare_input_func(Scott);
-declare_input_func(Snapchat);
-declare_input_func(Speed);
-declare_input_func(Spin);
-declare_input_func(Spotify);
-declare_input_func(Squish);
-declare_input_func(Swirl);
-declare_input_func(Tile);
-declare_input_func(ToGif);
-declare_input_func(Uncanny);
-declare_input_func(Uncaption);
+declare_image_func(Reddit, TextAssetParams);
+declare_image_func(Resize, ResizeParams);
+declare_image_func(Reverse, ReverseParams);
+declare_image_func(Scott, AssetParams);
+declare_image_func(Snapchat, SnapchatParams);
+declare_input_func(Speed, SpeedParams);
+declare_image_func(SpeedImage, SpeedParams);
+declare_image_func(Spin, NoParams);
+declare_image_func(Spotify, TextAssetParams);
+declare_image_func(Squish, NoParams);
+declare_image_func(Swirl, NoParams);
+declare_image_func(Tile, NoParams);
+declare_image_func(ToGif, NoParams);
+declare_image_func(Uncanny, UncannyParams);
+declare_image_func(Uncaption, UncaptionParams);
 #if MAGICK_ENABLED
-declare_input_func(Wall);
+declare_input_func(Wall, NoParams);
 #endif
-declare_input_func(Watermark);
-declare_input_func(Whisper);
+declare_image_func(Watermark, WatermarkParams);
+declare_image_func(Whisper, TextAssetParams);
 
 // Video processing functions (requires FFmpeg)
 #if FFMPEG_ENABLED
-declare_input_func(VideoSpeed);
-declare_input_func(VideoReverse);
-declare_input_func(VideoCaption);
-declare_input_func(VideoToGif);
-declare_input_func(VideoTrim);
-declare_input_func(VideoMeme);
-declare_input_func(VideoStitch);
-declare_input_func(VideoAudio);
+declare_input_func(VideoSpeed, VideoSpeedParams);
+declare_input_func(VideoReverse, NoParams);
+declare_input_func(VideoCaption, VideoCaptionParams);
+declare_input_func(VideoToGif, VideoToGifParams);
+declare_input_func(VideoTrim, VideoTrimParams);
+declare_input_func(VideoMeme, VideoMemeParams);
+declare_input_func(VideoStitch, VideoStitchParams);
+declare_input_func(VideoAudio, NoParams);
 #endif
 
 // Declare our No-Input Functions
 
-declare_noinput_func(Homebrew);
+declare_noinput_func(Homebrew, TextAssetParams);
 #if ZXING_ENABLED
-declare_noinput_func(QrCreate);
+declare_noinput_func(QrCreate, QrCreateParams);
 #endif
-declare_noinput_func(Sonic);
+declare_noinput_func(Sonic, SonicParams);
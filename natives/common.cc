@@ -1,8 +1,27 @@
 #include <vips/vips8>
 
 #include "common.h"
+#include "gifindex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+static ImageCache assetCache(ASSET_CACHE_MAX_MEM);
+static ImageCache textCache(TEXT_CACHE_MAX_MEM);
+
+static FontRegistry fontRegistry;
+static std::once_flag fontsLoaded;
+
+void FontRegistry::Load(const string &basePath) {
+  auto start = std::chrono::steady_clock::now();
 
-void LoadFonts(string basePath) {
   // manually loading fonts to workaround some font issues with libvips
   if (!FcConfigAppFontAddDir(NULL, (const FcChar8 *)(basePath + "assets/fonts/").c_str())) {
     std::cerr << "Unable to load local font files from directory, falling back to "
@@ -13,6 +32,36 @@ void LoadFonts(string basePath) {
                             true)) {
     std::cerr << "Unable to load local fontconfig, some fonts may be inaccurate!" << std::endl;
   }
+
+  for (auto const &font : fontPaths) Add(font.first, basePath + font.second);
+  for (auto const &font : commandFontPaths) Add(font.first, basePath + font.second);
+
+  loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void FontRegistry::Add(const string &name, const string &file) {
+  // the query only checks that FreeType can open the file, the pattern itself isn't needed afterwards
+  int count = 0;
+  FcPattern *pattern = FcFreeTypeQuery((const FcChar8 *)file.c_str(), 0, NULL, &count);
+  if (pattern == NULL) {
+    std::cerr << "Unable to load font file " << file << ", falling back to global fonts" << std::endl;
+    return;
+  }
+  FcPatternDestroy(pattern);
+  fonts[name] = {file};
+}
+
+// Returns the path of a known font file, or NULL if it isn't available so that fontconfig can pick a fallback
+const char *FontRegistry::File(const string &name) const {
+  auto found = fonts.find(name);
+  return found != fonts.end() ? found->second.file.c_str() : NULL;
+}
+
+// The registry is normally loaded when the module is initialized, but jobs can also trigger it in case the
+// caller didn't pass a base path at that point
+const FontRegistry &GetFonts(const string &basePath) {
+  std::call_once(fontsLoaded, [&basePath] { fontRegistry.Load(basePath); });
+  return fontRegistry;
 }
 
 string PangoEscape(const string &input) {
@@ -87,49 +136,324 @@ vips::VOption *GetInputOptions(string type, bool sequential, bool sequentialIfAn
   return options;
 }
 
-vips::VOption *GetOutputOptions(string type) {
-  vips::VOption *options = vips::VImage::option();
-  
-  // Memory-efficient output settings
-  if (type == "gif") {
-    // Optimize GIF encoding for memory
-    options->set("dither", 0);
-    options->set("reoptimise", 1);
-  } else if (type == "webp") {
-    // Use strip to remove metadata and save memory
-    options->set("strip", true);
-  } else if (type == "jpeg" || type == "jpg") {
-    // Strip metadata for JPEG
-    options->set("strip", true);
-  } else if (type == "png") {
-    // Optimize PNG compression
-    options->set("compression", 6);
-    options->set("strip", true);
-  }
-  
-  return options;
+// Decodes a file from the assets directory once and keeps it around in memory, so that templates and overlays
+// don't have to be read from disk on every job.
+vips::VImage LoadAsset(const string &path) {
+  vips::VImage cached;
+  if (assetCache.Get(path, cached)) return cached;
+
+  vips::VImage loaded = vips::VImage::new_from_file(path.c_str()).copy_memory();
+  assetCache.Put(path, loaded);
+  return loaded;
 }
 
-static void TimeoutCallback(VipsImage *image, [[maybe_unused]] VipsProgress *progress, CallbackData *data) {
-  time_t now = time(0);
-  bool *shouldKill = data->shouldKill;
+// Same as above, but for an asset that has been scaled to the given dimensions
+vips::VImage LoadAssetResized(const string &path, int width, int height, VipsKernel kernel) {
+  string key = path + "\x1f" + std::to_string(width) + "x" + std::to_string(height) + "\x1f" + std::to_string(kernel);
+  vips::VImage cached;
+  if (assetCache.Get(key, cached)) return cached;
 
-  if (now > data->expiration || (shouldKill != NULL && *shouldKill)) {
-    if (shouldKill != NULL) *shouldKill = true;
-    vips_image_set_kill(image, true);
-  }
+  vips::VImage base = LoadAsset(path);
+  vips::VImage resized = base
+                           .resize((double)width / (double)base.width(),
+                                   vips::VImage::option()
+                                     ->set("vscale", (double)height / (double)base.height())
+                                     ->set("kernel", kernel))
+                           .copy_memory();
+  assetCache.Put(key, resized);
+  return resized;
 }
 
-void SetupTimeoutCallback(vips::VImage image, bool *shouldKill) {
+ImageCache::Stats GetAssetCacheStats() { return assetCache.GetStats(); }
+
+// Rendered text layers only depend on the text itself and the width of the input, so repeated captions on images
+// of the same size can skip Pango layout and rasterization entirely. The render function should return the final
+// layer that the command composites onto the input.
+vips::VImage CachedText(const string &command, const string &markup, const string &font, const char *fontfile,
+                        int width, VipsAlign align, const std::function<vips::VImage()> &render) {
+  string key = command + "\x1f" + markup + "\x1f" + font + "\x1f" + (fontfile != NULL ? fontfile : "") + "\x1f" +
+               std::to_string(width) + "\x1f" + std::to_string(align);
+  vips::VImage cached;
+  if (textCache.Get(key, cached)) return cached;
+
+  vips::VImage rendered = render().copy_memory();
+  textCache.Put(key, rendered);
+  return rendered;
+}
+
+ImageCache::Stats GetTextCacheStats() { return textCache.GetStats(); }
+
+void SetCacheLimits(size_t assetLimit, size_t textLimit) {
+  assetCache.SetLimit(assetLimit);
+  textCache.SetLimit(textLimit);
+}
+
+static void TimeoutCallback(VipsImage *image, VipsProgress *progress, JobControl *job) {
+  if (job->Stopped()) vips_image_set_kill(image, true);
+  job->NoteMemory(vips_tracked_get_mem());
+  job->Progress("process", progress->percent, progress->npels, false);
+}
+
+static void PreEvalCallback([[maybe_unused]] VipsImage *image, VipsProgress *progress, JobControl *job) {
+  job->MarkProcess();
+  job->Progress("process", 0, progress->npels, true);
+}
+
+static void PostEvalCallback([[maybe_unused]] VipsImage *image, VipsProgress *progress, JobControl *job) {
+  job->MarkEncode();
+  job->NoteMemory(vips_tracked_get_mem());
+  job->Progress("encode", 100, progress->npels, true);
+}
+
+void SetupTimeoutCallback(vips::VImage image, JobControl *job) {
+  if (job == NULL) return;
   VipsImage *img = image.get_image();
-  CallbackData *cbData = VIPS_NEW(img, CallbackData);
-  cbData->expiration = time(0) + IMG_TIMEOUT;
-  cbData->shouldKill = shouldKill;
-  g_signal_connect(img, "eval", G_CALLBACK(TimeoutCallback), cbData);
+  job->NoteFrames(vips_image_get_n_pages(img));
+  job->NoteGraph(GraphSize(image));
+  g_signal_connect(img, "eval", G_CALLBACK(TimeoutCallback), job);
+  g_signal_connect(img, "preeval", G_CALLBACK(PreEvalCallback), job);
+  g_signal_connect(img, "posteval", G_CALLBACK(PostEvalCallback), job);
   vips_image_set_progress(img, true);
 }
 
+// Shards are only part of the job's work, the phases and progress come from the pipeline they end up in
+static void ShardCallback(VipsImage *image, [[maybe_unused]] VipsProgress *progress, JobControl *job) {
+  if (job->Stopped()) vips_image_set_kill(image, true);
+  job->NoteMemory(vips_tracked_get_mem());
+}
+
+static void SetupShardCallback(vips::VImage image, JobControl *job) {
+  if (job == NULL) return;
+  g_signal_connect(image.get_image(), "eval", G_CALLBACK(ShardCallback), job);
+  vips_image_set_progress(image.get_image(), true);
+}
+
+size_t GraphSize(vips::VImage image) {
+  // upstream links are set as the pipeline is built, a graph is only ever added to at the output end
+  std::unordered_set<VipsImage *> seen;
+  std::vector<VipsImage *> pending = {image.get_image()};
+  while (!pending.empty()) {
+    VipsImage *img = pending.back();
+    pending.pop_back();
+    if (!seen.insert(img).second) continue;
+    for (GSList *p = img->upstream; p != NULL; p = p->next) pending.push_back(static_cast<VipsImage *>(p->data));
+  }
+  return seen.size();
+}
+
+// Runs fn(0..count-1) on up to threads threads, rethrowing the first exception once they're all done
+void ParallelFor(int count, int threads, const std::function<void(int)> &fn) {
+  std::atomic<int> next{0};
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+  auto worker = [&]() {
+    for (int i = next++; i < count && !failed.load(std::memory_order_relaxed); i = next++) {
+      try {
+        fn(i);
+      } catch (...) {
+        if (!failed.exchange(true)) error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int i = 1; i < std::min(threads, count); i++) pool.emplace_back(worker);
+  worker();
+  for (std::thread &t : pool) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
+vips::VImage JoinFrames(vips::VImage &in, int nPages, JobControl *job,
+                        const std::function<vips::VImage(int)> &makeFrame) {
+  // vips already spreads a single pipeline over vips_concurrency threads, shards only help with what's left over
+  int threads = std::max(1, GetThreadBudget().Share() / std::max(1, vips_concurrency_get()));
+  size_t inputSize = (size_t)VIPS_IMAGE_SIZEOF_LINE(in.get_image()) * in.height();
+  if (nPages < FRAME_SHARD_MIN_PAGES || threads < 2 || inputSize > FRAME_SHARD_MAX_MEM) {
+    std::vector<vips::VImage> img;
+    img.reserve(nPages);  // Pre-allocate to avoid reallocations
+    for (int i = 0; i < nPages; i++) img.push_back(makeFrame(i));
+    return vips::VImage::arrayjoin(img, vips::VImage::option()->set("across", 1));
+  }
+
+  // Shards read their pages from several threads at once, which a sequential loader can't do
+  in = in.copy_memory();
+
+  int shardSize = std::max(FRAME_SHARD_MIN_SIZE, (nPages + threads * 2 - 1) / (threads * 2));
+  int nShards = (nPages + shardSize - 1) / shardSize;
+  std::vector<vips::VImage> shards(nShards);
+  ParallelFor(nShards, threads, [&](int s) {
+    CheckJob(job);
+    std::vector<vips::VImage> img;
+    for (int i = s * shardSize; i < std::min(nPages, (s + 1) * shardSize); i++) img.push_back(makeFrame(i));
+    vips::VImage shard = vips::VImage::arrayjoin(img, vips::VImage::option()->set("across", 1));
+    SetupShardCallback(shard, job);
+    shards[s] = shard.copy_memory();
+    vips_thread_shutdown();
+  });
+  return vips::VImage::arrayjoin(shards, vips::VImage::option()->set("across", 1));
+}
+
 uint32_t readUint32LE(unsigned char *buffer) {
   return static_cast<uint32_t>(buffer[0]) | (static_cast<uint32_t>(buffer[1]) << 8) |
          (static_cast<uint32_t>(buffer[2]) << 16) | (static_cast<uint32_t>(buffer[3]) << 24);
 }
+
+CommandArgs *NewCommandArgs(const string &command) {
+  auto input = FunctionMap.find(command);
+  if (input != FunctionMap.end()) return input->second.newArgs();
+  auto noInput = NoInputFunctionMap.find(command);
+  if (noInput != NoInputFunctionMap.end()) return noInput->second.newArgs();
+  return NULL;
+}
+
+// Filled in on first use, after which entries are never added or removed
+class StatsRegistry {
+public:
+  StatsRegistry() {
+    for (auto const &command : FunctionMap) stats.try_emplace(command.first);
+    for (auto const &command : NoInputFunctionMap) stats.try_emplace(command.first);
+    stats.try_emplace("pipeline");
+  }
+
+  std::map<string, CommandStats> stats;
+};
+
+static StatsRegistry &GetStatsRegistry() {
+  static StatsRegistry registry;
+  return registry;
+}
+
+CommandStats *GetCommandStats(const string &command) {
+  auto found = GetStatsRegistry().stats.find(command);
+  return found != GetStatsRegistry().stats.end() ? &found->second : NULL;
+}
+
+void ForEachCommandStats(const std::function<void(const string &, CommandStats &)> &fn) {
+  for (auto &entry : GetStatsRegistry().stats) fn(entry.first, entry.second);
+}
+
+static void RecordJob(CommandStats *stats, const JobControl &job, size_t inputBytes, size_t outputBytes,
+                      bool failed) {
+  if (stats == NULL) return;
+  JobControl::Times times = job.PhaseTimes();
+  stats->jobs.fetch_add(1, std::memory_order_relaxed);
+  if (failed) stats->failures.fetch_add(1, std::memory_order_relaxed);
+  if (job.TimedOut()) stats->timeouts.fetch_add(1, std::memory_order_relaxed);
+  stats->total.Record(times.total);
+  stats->decode.Record(times.decode);
+  stats->process.Record(times.process);
+  stats->encode.Record(times.encode);
+  stats->inputBytes.Record(inputBytes);
+  if (!failed) stats->outputBytes.Record(outputBytes);
+  stats->frames.Record(job.Frames());
+  stats->memPeak.Record(job.MemoryPeak());
+  stats->graphNodes.Record(job.GraphNodes());
+}
+
+ThreadBudget &GetThreadBudget() {
+  static ThreadBudget budget;
+  return budget;
+}
+
+static ArgumentMap RunRecorded(const string &name, size_t bufferLength, const string &outType, JobControl &job,
+                               const std::function<ArgumentMap()> &run) {
+  CommandStats *stats = GetCommandStats(name);
+  ThreadBudget::Lease lease(GetThreadBudget());
+  job.Begin();
+  ArgumentMap output;
+  try {
+    output = run();
+    if (!MapContainsKey(output, "error")) FitToBudget(output, outType, job);
+  } catch (...) {
+    RecordJob(stats, job, bufferLength, 0, true);
+    throw;
+  }
+  bool failed = MapContainsKey(output, "error");
+  RecordJob(stats, job, bufferLength, GetArgumentWithFallback<size_t>(output, "size", 0), failed);
+  return output;
+}
+
+ArgumentMap RunCommand(const string &command, const string &type, string &outType, const char *bufferData,
+                       size_t bufferLength, const CommandArgs &arguments, JobControl &job) {
+  return RunRecorded(command, bufferLength, outType, job, [&]() {
+    if (bufferLength != 0) {
+      return FunctionMap.at(command).run(type, outType, bufferData, bufferLength, arguments, &job);
+    }
+    return NoInputFunctionMap.at(command).run(type, outType, arguments, &job);
+  });
+}
+
+// Animations that are too long to process (see NormalizeVips) come back empty, with "frames" as the type
+static ArgumentMap TooManyFrames(string &outType) {
+  ArgumentMap output;
+  output["buf"] = (char *)NULL;
+  output["size"] = (size_t)0;
+  outType = "frames";
+  return output;
+}
+
+ArgumentMap RunImageCommand(ImageFunc run, Decode decode, Video video, const string &type, string &outType,
+                            const char *bufferData, size_t bufferLength, const CommandArgs &arguments,
+                            JobControl *job) {
+#ifdef FFMPEG_ENABLED
+  if (IsVideo(type)) {
+    if (video == Video::PerFrame) return RunVideoFrames(run, type, outType, bufferData, bufferLength, arguments, job);
+    ArgumentMap output;
+    output["error"] = string("This command doesn't work on videos");
+    return output;
+  }
+#endif
+  vips::VImage in;
+  if (decode == Decode::Indexed && type == "gif") in = LoadIndexedGif(bufferData, bufferLength, job);
+  bool indexed = in.get_image() != NULL;
+  if (!indexed) {
+    bool sequential = decode == Decode::Sequential || decode == Decode::SequentialIfAnimated;
+    vips::VOption *options = GetInputOptions(type, sequential, decode == Decode::SequentialIfAnimated);
+    in = vips::VImage::new_from_buffer(bufferData, bufferLength, "", options);
+  }
+
+  ImageState state{type, outType};
+  state.indexed = indexed;
+  vips::VImage out;
+  try {
+    out = run(in, state, arguments, job);
+  } catch (int e) {
+    if (e == -1) return TooManyFrames(outType);
+    throw;
+  }
+  outType = state.outType;
+
+  // commands that have nothing to do (e.g. reverse on a still image) give back the original bytes
+  if (out.get_image() == in.get_image() && outType == type) {
+    char *data = reinterpret_cast<char *>(malloc(bufferLength));
+    memcpy(data, bufferData, bufferLength);
+    ArgumentMap output;
+    output["buf"] = data;
+    output["free"] = free;
+    output["size"] = bufferLength;
+    return output;
+  }
+
+  return EncodeImage(out, state, job);
+}
+
+ArgumentMap RunPipeline(const std::vector<PipelineStep> &steps, const string &type, string &outType,
+                        const char *bufferData, size_t bufferLength, JobControl &job) {
+  return RunRecorded("pipeline", bufferLength, outType, job, [&]() {
+    vips::VImage image =
+      vips::VImage::new_from_buffer(bufferData, bufferLength, "", GetInputOptions(type, false, false));
+
+    ImageState state{type, type};
+    for (const PipelineStep &step : steps) {
+      CheckJob(&job);
+      if (step.arguments->togif) state.outType = "gif";
+      try {
+        image = FunctionMap.at(step.command).image(image, state, *step.arguments, &job);
+      } catch (int e) {
+        if (e == -1) return TooManyFrames(outType);
+        throw;
+      }
+    }
+    outType = state.outType;
+    return EncodeImage(image, state, &job);
+  });
+}
@@ -3,10 +3,16 @@
 #include <fontconfig/fontconfig.h>
 #include <vips/vips8>
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -15,39 +21,285 @@ using std::map;
 using std::string;
 using std::variant;
 
-typedef variant<char *, string, float, bool, int, size_t> ArgumentVariant;
+// Frees an output "buf". vips hands out g_malloc'd memory, while commands that patch the input bytes themselves
+// use malloc, so each command says which one the front end has to call.
+typedef void (*BufferFree)(void *);
+
+typedef variant<char *, string, float, bool, int, size_t, BufferFree> ArgumentVariant;
 typedef map<string, ArgumentVariant> ArgumentMap;
 
-void SetupTimeoutCallback(vips::VImage image, bool *shouldKill);
-typedef struct {
-  time_t expiration;
-  bool *shouldKill;
-} CallbackData;
 #define IMG_TIMEOUT 600
 
+// Snapshot of how far along a job is. The phase is "decode" until vips starts evaluating the output pipeline,
+// "process" while it does, and "encode" once every pixel has been computed and the saver is finishing up.
+struct JobProgress {
+  const char *phase;
+  int percent;
+  uint64_t pixels;
+  double elapsed;
+};
+
+#define PROGRESS_INTERVAL_MS 250
+
+// Lets a running job be stopped from another thread, either on request or once its deadline passes.
+// vips pipelines get interrupted through the eval signal (see SetupTimeoutCallback), other code paths have to poll
+// Stopped() themselves.
+class JobControl {
+public:
+  explicit JobControl(std::chrono::milliseconds timeout = std::chrono::seconds(IMG_TIMEOUT))
+      : start(std::chrono::steady_clock::now()), deadline(start + timeout) {}
+
+  void Kill() { killed.store(true, std::memory_order_relaxed); }
+  bool Stopped() {
+    if (killed.load(std::memory_order_relaxed)) return true;
+    if (std::chrono::steady_clock::now() < deadline) return false;
+    timedOut.store(true, std::memory_order_relaxed);
+    Kill();
+    return true;
+  }
+  // Whether the job was stopped because its deadline passed, rather than by Kill()
+  bool TimedOut() const { return timedOut.load(std::memory_order_relaxed); }
+  std::chrono::milliseconds Remaining() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+  }
+
+  // Reports progress to onProgress, at most once every PROGRESS_INTERVAL_MS unless force is set (e.g. on a phase
+  // change). Safe to call from any vips worker thread.
+  void Progress(const char *phase, int percent, uint64_t pixels, bool force) {
+    if (!onProgress) return;
+    auto now = std::chrono::steady_clock::now();
+    long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+    long long last = lastReport.load(std::memory_order_relaxed);
+    if (!force && nowMs - last < PROGRESS_INTERVAL_MS) return;
+    // only one thread gets to report each interval
+    if (!lastReport.compare_exchange_strong(last, nowMs) && !force) return;
+    onProgress({phase, percent, pixels, std::chrono::duration<double>(now - start).count()});
+  }
+
+  // Phase bookkeeping for the per-command stats, all times are microseconds since the job was created.
+  // Begin() is called once a thread actually starts on the job, the first vips evaluation ends the decode phase
+  // and the last one to finish starts the encode phase.
+  void Begin() {
+    runStart = ElapsedUs();
+    memBase = vips_tracked_get_mem();
+  }
+  void MarkProcess() {
+    long long unset = -1;
+    processStart.compare_exchange_strong(unset, ElapsedUs(), std::memory_order_relaxed);
+  }
+  void MarkEncode() { encodeStart.store(ElapsedUs(), std::memory_order_relaxed); }
+  void NoteFrames(int pages) { StoreMax(frames, pages); }
+  // bytes is vips' tracked total for the whole process, only the growth since Begin() is kept
+  void NoteMemory(long long bytes) { StoreMax(memPeak, bytes - memBase); }
+  void NoteGraph(long long nodes) { StoreMax(graphNodes, nodes); }
+
+  struct Times {
+    long long total;
+    long long decode;
+    long long process;
+    long long encode;
+  };
+  // Splits the time since Begin() into phases. Jobs that never ran a vips pipeline count entirely as "process".
+  Times PhaseTimes() const {
+    long long end = ElapsedUs();
+    long long process = processStart.load(std::memory_order_relaxed);
+    long long encode = encodeStart.load(std::memory_order_relaxed);
+    if (process < 0) return {end - runStart, 0, end - runStart, 0};
+    if (encode < process) encode = end;
+    return {end - runStart, process - runStart, encode - process, end - encode};
+  }
+  long long Frames() const { return frames.load(std::memory_order_relaxed); }
+  // vips can't tell jobs apart, so memory that other jobs allocate while this one runs is counted too
+  long long MemoryPeak() const { return memPeak.load(std::memory_order_relaxed); }
+  // Images in the largest vips pipeline the job evaluated, see GraphSize
+  long long GraphNodes() const { return graphNodes.load(std::memory_order_relaxed); }
+
+  // Set by the front end before the job starts, never changed while it runs
+  std::function<void(const JobProgress &)> onProgress;
+  // Largest result in bytes the front end can use, 0 for no limit. See FitToBudget.
+  size_t budget = 0;
+
+private:
+  long long ElapsedUs() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+  static void StoreMax(std::atomic<long long> &slot, long long value) {
+    long long prev = slot.load(std::memory_order_relaxed);
+    while (prev < value && !slot.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {}
+  }
+
+  std::atomic<bool> killed{false};
+  std::atomic<bool> timedOut{false};
+  long long runStart = 0;
+  long long memBase = 0;
+  std::atomic<long long> processStart{-1};
+  std::atomic<long long> encodeStart{-1};
+  std::atomic<long long> frames{0};
+  std::atomic<long long> memPeak{0};
+  std::atomic<long long> graphNodes{0};
+  std::atomic<long long> lastReport{-PROGRESS_INTERVAL_MS};
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+inline bool JobStopped(JobControl *job) { return job != NULL && job->Stopped(); }
+
+// Bails out of a job from code that vips can't interrupt for us
+inline void CheckJob(JobControl *job) {
+  if (JobStopped(job)) throw std::runtime_error("image_job_killed");
+}
+
+void SetupTimeoutCallback(vips::VImage image, JobControl *job);
+// Number of images image is built from, itself included. A command whose graph grows with the number of pages pays
+// for it in setup time and memory before vips computes a single pixel.
+size_t GraphSize(vips::VImage image);
+
+// Runs fn(0..count-1) on up to threads threads, rethrowing the first exception once they're all done
+void ParallelFor(int count, int threads, const std::function<void(int)> &fn);
+
+// Animations with at least this many pages get their frames rendered in shards of FRAME_SHARD_MIN_SIZE or more
+#define FRAME_SHARD_MIN_PAGES 32
+#define FRAME_SHARD_MIN_SIZE 8
+// Sharding needs the whole input in memory, bigger ones stay on a single streaming pipeline
+#define FRAME_SHARD_MAX_MEM (256 * 1024 * 1024)
+
+/*
+  Builds an animation out of makeFrame(0..nPages-1), joined top to bottom. Long animations are split into shards that
+  are rendered on their own threads, so makeFrame has to be safe to call concurrently and must only read its pages
+  through in (which is swapped for an in-memory copy when that happens). The caller still sets page-height.
+*/
+vips::VImage JoinFrames(vips::VImage &in, int nPages, JobControl *job,
+                        const std::function<vips::VImage(int)> &makeFrame);
+
+/*
+  Page-aware operations (see pages.cc). They do the same thing to every page of an animation with a fixed number of
+  vips operations, where JoinFrames needs a few per page, and set page-height on what they return. Prefer them when
+  every frame gets the same treatment.
+*/
+// Places every page at (x, y) of a width x height page filled with background, like embed does for one
+vips::VImage PageEmbed(vips::VImage in, int nPages, int x, int y, int width, int height,
+                       const std::vector<double> &background);
+// Joins band above or below every page, like join with expand does for one
+vips::VImage PageJoin(vips::VImage in, int nPages, vips::VImage band, bool above,
+                      const std::vector<double> &background);
+// Composites layer over every page at (x, y)
+vips::VImage PageLayer(vips::VImage in, int nPages, vips::VImage layer, int x, int y);
+// Resizes every page to width x height
+vips::VImage PageResize(vips::VImage in, int nPages, int width, int height);
+
+// How a command wants its input decoded when it runs on its own, see GetInputOptions. Pipelines always decode with
+// random access since later steps may read the pages in any order. Indexed is random access too, but animated GIFs
+// are decoded a few frames at a time from a frame index (see gifindex.cc) instead of all at once.
+enum class Decode { Random, Sequential, SequentialIfAnimated, Indexed };
+
+// Whether an image command can run on videos, which it only gets to see a batch of frames at a time (see
+// RunVideoFrames). That's only right for commands that treat every frame the same on its own, anything that looks at
+// the frames as a sequence (e.g. reverse or fade) would only see a batch of them. Other commands get an error.
+enum class Video { Unsupported, PerFrame };
+
+/*
+  What travels along with a decoded image from one command to the next. The page layout (page-height, delay, loop)
+  stays in the image's own metadata, the same way the vips loaders and savers handle it. Commands can change the
+  output format and the saver settings, in a pipeline the last step that sets something wins.
+*/
+struct ImageState {
+  // Format the input was decoded from
+  string type;
+  // Format the result gets encoded to
+  string outType;
+  // GIF saver settings, -1 keeps the libvips default
+  double dither = -1;
+  int reoptimise = -1;
+  // at most 2^bitdepth colours
+  int bitdepth = -1;
+  // largest per-channel difference from the frame before that's still left out of a frame
+  double maxError = -1;
+  // JPEG quality, -1 keeps the libvips default
+  int quality = -1;
+  bool strip = false;
+  // The input is decoded a few frames at a time from a frame index (see Decode::Indexed), so the encoder shouldn't
+  // hold every frame at once either
+  bool indexed = false;
+
+  // Bytes image is already encoded to as outType with the settings above. EncodeImage hands out a copy instead of
+  // encoding again when the result is still that image. The bytes have to live as long as image does.
+  void SetEncoded(vips::VImage image, const char *data, size_t length) {
+    encodedImage = image.get_image();
+    encodedType = outType;
+    encoded = data;
+    encodedLength = length;
+  }
+  bool IsEncoded(vips::VImage image) const {
+    return encoded != NULL && image.get_image() == encodedImage && outType == encodedType;
+  }
+  VipsImage *encodedImage = NULL;
+  string encodedType = "";
+  const char *encoded = NULL;
+  size_t encodedLength = 0;
+};
+
+#define ASSET_CACHE_MAX_MEM (64 * 1024 * 1024)
+#define TEXT_CACHE_MAX_MEM (32 * 1024 * 1024)
+// vips concurrency with the machine to itself, kept low to reduce peak memory usage
+#define VIPS_MAX_CONCURRENCY 2
+
 uint32_t readUint32LE(unsigned char *buffer);
+// Keeps every step-th frame of an animated WebP by copying chunks, see speed.cc. Returns NULL (a malloc'd buffer
+// otherwise) unless every kept frame is a keyframe.
+char *DecimateWebp(const char *data, size_t length, int step, size_t &dataSize, JobControl *job);
 
+#include "budget.h"
+#include "cache.h"
 #include "commands.h"
+#include "stats.h"
+
+struct FontHandle {
+  string file;
+};
+
+// Fonts from assets/fonts, resolved once per process. Lookups are read-only so it can be shared between jobs.
+class FontRegistry {
+public:
+  void Load(const string &basePath);
+  const char *File(const string &name) const;
+  double LoadTime() const { return loadTime; }
 
-void LoadFonts(string basePath);
+private:
+  void Add(const string &name, const string &file);
+
+  std::unordered_map<string, FontHandle> fonts;
+  double loadTime = 0;
+};
+
+const FontRegistry &GetFonts(const string &basePath);
 string PangoEscape(const string &input);
 vips::VImage NormalizeVips(vips::VImage in, int *width, int *pageHeight, int nPages);
 vips::VOption *GetInputOptions(string type, bool sequential, bool sequentialIfAnim);
-vips::VOption *GetOutputOptions(string type);
+vips::VImage LoadAsset(const string &path);
+vips::VImage LoadAssetResized(const string &path, int width, int height, VipsKernel kernel = VIPS_KERNEL_LANCZOS3);
+ImageCache::Stats GetAssetCacheStats();
+vips::VImage CachedText(const string &command, const string &markup, const string &font, const char *fontfile,
+                        int width, VipsAlign align, const std::function<vips::VImage()> &render);
+ImageCache::Stats GetTextCacheStats();
+vips::VImage genText(string text, string font, const char *fontfile, int width, vips::VImage mask, int radius);
+void SetCacheLimits(size_t assetLimit, size_t textLimit);
+// Shared by every job in the process, RunCommand and RunPipeline hold a lease on it while they run
+ThreadBudget &GetThreadBudget();
 #define MapContainsKey(MAP, KEY) (MAP.find(KEY) != MAP.end())
 
-template <typename T> T GetArgument(ArgumentMap map, string key) {
+template <typename T> T GetArgument(const ArgumentMap &map, const string &key) {
   if (!MapContainsKey(map, key)) throw "Invalid requested type from variant.";
   return std::get<T>(map.at(key));
 }
 
-template <typename T> T GetArgumentWithFallback(ArgumentMap map, string key, T fallback) {
+template <typename T> T GetArgumentWithFallback(const ArgumentMap &map, const string &key, T fallback) {
   if (!MapContainsKey(map, key)) return fallback;
   return std::get<T>(map.at(key));
 }
 
 const std::vector<double> zeroVec = {0, 0, 0, 0};
 const std::vector<double> zeroVecOneAlpha = {0, 0, 0, 1};
+const std::vector<double> whiteVec = {255, 255, 255, 255};
 
 const std::unordered_map<std::string, std::string> fontPaths{
   {"futura",    "assets/fonts/caption.otf" },
@@ -56,73 +308,208 @@ const std::unordered_map<std::string, std::string> fontPaths{
   {"ubuntu",    "assets/fonts/Ubuntu.ttf"  }
 };
 
-const std::map<std::string, ArgumentMap (*)(const string &type, string &outType, const char *bufferData,
-                                            size_t bufferLength, ArgumentMap arguments, bool *shouldKill)>
-  FunctionMap = {
-    {"blur",       &Blur      },
-    {"bounce",     &Bounce    },
-    {"caption",    &Caption   },
-    {"captionTwo", &CaptionTwo},
-    {"circle",     &Circle    },
-    {"colors",     &Colors    },
-    {"crop",       &Crop      },
-    {"deepfry",    &Deepfry   },
-    {"distort",    &Distort   },
-    {"fade",       &Fade      },
-    {"flag",       &Flag      },
-    {"flip",       &Flip      },
-    {"freeze",     &Freeze    },
-    {"gamexplain", &Gamexplain},
-    {"globe",      &Globe     },
-    {"invert",     &Invert    },
-    {"jpeg",       &Jpeg      },
+// Fonts that are only used by a single command and can't be picked by users
+const std::unordered_map<std::string, std::string> commandFontPaths{
+  {"circular", "assets/fonts/Circular.ttf"},
+  {"hbc",      "assets/fonts/hbc.ttf"     },
+  {"twemoji",  "assets/fonts/twemoji.otf" },
+  {"whisper",  "assets/fonts/whisper.otf" }
+};
+
+typedef vips::VImage (*ImageFunc)(vips::VImage in, ImageState &state, const CommandArgs &arguments, JobControl *job);
+typedef ArgumentMap (*InputFunc)(const string &type, string &outType, const char *bufferData, size_t bufferLength,
+                                 const CommandArgs &arguments, JobControl *job);
+typedef ArgumentMap (*NoInputFunc)(const string &type, string &outType, const CommandArgs &arguments,
+                                   JobControl *job);
+
+struct InputCommand {
+  InputFunc run;
+  CommandArgs *(*newArgs)();
+  // Runs the command on an already decoded image, NULL for commands that can't be part of a pipeline
+  ImageFunc image;
+};
+
+struct NoInputCommand {
+  NoInputFunc run;
+  CommandArgs *(*newArgs)();
+};
+
+// Bytes a pixel takes up in WriteGif on top of its frame: a palette index and about as much LZW data at most
+#define GIF_WORK_BYTES 2
+// Largest animation WriteGif encodes, counting the 8-bit frames and the above. Bigger ones are streamed through the
+// vips saver, which only needs a frame at a time.
+#define GIF_NATIVE_MAX_MEM (96 * 1024 * 1024)
+
+// Encodes the result of an image command (or the last step of a pipeline) with the saver settings in state
+ArgumentMap EncodeImage(vips::VImage image, const ImageState &state, JobControl *job);
+// Writes an animation as a GIF, with one palette shared by the frames that are close enough to it and the frames
+// quantised and compressed on all cores. Returns false without writing anything for images gifsave should handle,
+// e.g. still images. The buffer is allocated with g_malloc.
+bool WriteGif(vips::VImage image, const ImageState &state, JobControl *job, char **buf, size_t *size);
+/*
+  Makes a finished result fit in job.budget by encoding it again with cheaper settings: lower quality first, then
+  fewer frames and finally a smaller size. Each attempt refines a rough size model, so it usually only takes one or
+  two. The chosen settings are added to the output as "encode.*" keys. Results already under the budget and formats
+  libvips can't write (e.g. videos) are left alone. If nothing fits, the result is kept as it is and
+  "overBudget" is set on the output.
+*/
+void FitToBudget(ArgumentMap &output, const string &outType, JobControl &job);
+#ifdef FFMPEG_ENABLED
+inline bool IsVideo(const string &type) { return type == "mp4" || type == "webm" || type == "mov"; }
+// Runs an image command over a video's frames a batch at a time and encodes them back into the same container, see
+// video.cc
+ArgumentMap RunVideoFrames(ImageFunc run, const string &type, string &outType, const char *bufferData,
+                           size_t bufferLength, const CommandArgs &arguments, JobControl *job);
+#endif
+// Decodes the input, runs a command on the decoded image and encodes the result. Videos go through RunVideoFrames
+// if the command supports them.
+ArgumentMap RunImageCommand(ImageFunc run, Decode decode, Video video, const string &type, string &outType,
+                            const char *bufferData, size_t bufferLength, const CommandArgs &arguments,
+                            JobControl *job);
+
+// Works out a command's parameter struct from its signature, and wraps it so it can be called with the type-erased
+// arguments the front ends decode into
+template <typename F> struct CommandTraits;
+
+// Commands that work on a decoded image, these get decoded and encoded for them and can be chained in a pipeline
+template <typename P>
+struct CommandTraits<vips::VImage (*)(vips::VImage, ImageState &, const P &, JobControl *)> {
+  using Params = P;
+  template <auto F>
+  static vips::VImage Image(vips::VImage in, ImageState &state, const CommandArgs &arguments, JobControl *job) {
+    return F(in, state, static_cast<const Args<P> &>(arguments), job);
+  }
+  template <auto F, Decode D, Video V>
+  static ArgumentMap Run(const string &type, string &outType, const char *bufferData, size_t bufferLength,
+                         const CommandArgs &arguments, JobControl *job) {
+    return RunImageCommand(&Image<F>, D, V, type, outType, bufferData, bufferLength, arguments, job);
+  }
+  template <auto F, Decode D, Video V = Video::Unsupported> static constexpr InputCommand Entry() {
+    return {&Run<F, D, V>, &NewArgs<P>, &Image<F>};
+  }
+};
+
+// Commands that work on the encoded bytes, optionally with a separate function for when they're in a pipeline
+template <typename P>
+struct CommandTraits<ArgumentMap (*)(const string &, string &, const char *, size_t, const P &, JobControl *)> {
+  using Params = P;
+  template <auto F>
+  static ArgumentMap Run(const string &type, string &outType, const char *bufferData, size_t bufferLength,
+                         const CommandArgs &arguments, JobControl *job) {
+    return F(type, outType, bufferData, bufferLength, static_cast<const Args<P> &>(arguments), job);
+  }
+  template <auto F> static constexpr InputCommand Entry() { return {&Run<F>, &NewArgs<P>, NULL}; }
+  template <auto F, auto I> static constexpr InputCommand Entry() {
+    using ImageTraits = CommandTraits<decltype(I)>;
+    static_assert(std::is_same_v<typename ImageTraits::Params, P>, "Both versions of a command need the same params");
+    return {&Run<F>, &NewArgs<P>, &ImageTraits::template Image<I>};
+  }
+};
+
+template <typename P> struct CommandTraits<ArgumentMap (*)(const string &, string &, const P &, JobControl *)> {
+  using Params = P;
+  template <auto F>
+  static ArgumentMap Run(const string &type, string &outType, const CommandArgs &arguments, JobControl *job) {
+    return F(type, outType, static_cast<const Args<P> &>(arguments), job);
+  }
+  template <auto F> static constexpr NoInputCommand Entry() { return {&Run<F>, &NewArgs<P>}; }
+};
+
+template <auto F> constexpr auto Command() { return CommandTraits<decltype(F)>::template Entry<F>(); }
+// The second argument is either how an image command wants its input decoded, or the pipeline version of a command
+// that works on encoded bytes
+template <auto F, auto X> constexpr auto Command() { return CommandTraits<decltype(F)>::template Entry<F, X>(); }
+// An image command that also runs on videos, see Video
+template <auto F, Decode D, Video V> constexpr auto Command() {
+  return CommandTraits<decltype(F)>::template Entry<F, D, V>();
+}
+
+const std::map<std::string, InputCommand> FunctionMap = {
+  {"blur",         Command<&Blur, Decode::Sequential>()                    },
+  {"bounce",       Command<&Bounce, Decode::SequentialIfAnimated>()        },
+  {"caption",      Command<&Caption, Decode::Sequential, Video::PerFrame>()},
+  {"captionTwo",   Command<&CaptionTwo, Decode::Sequential>()              },
+  {"circle",       Command<&Circle, Decode::Random>()                      },
+  {"colors",       Command<&Colors, Decode::Sequential>()                  },
+  {"crop",         Command<&Crop, Decode::Sequential>()                    },
+  {"deepfry",      Command<&Deepfry, Decode::Sequential, Video::PerFrame>()},
+  {"distort",      Command<&Distort, Decode::SequentialIfAnimated>()       },
+  {"fade",         Command<&Fade, Decode::SequentialIfAnimated>()          },
+  {"flag",         Command<&Flag, Decode::Sequential, Video::PerFrame>()   },
+  {"flip",         Command<&Flip, Decode::SequentialIfAnimated>()          },
+  {"freeze",       Command<&Freeze, &FreezeImage>()                        },
+  {"gamexplain",   Command<&Gamexplain, Decode::Sequential>()              },
+  {"globe",        Command<&Globe, Decode::SequentialIfAnimated>()         },
+  {"invert",       Command<&Invert, Decode::Sequential, Video::PerFrame>() },
+  {"jpeg",         Command<&Jpeg, Decode::Sequential>()                    },
 #ifdef MAGICK_ENABLED
-    {"magik",      &Magik     },
+  {"magik",        Command<&Magik>()                                       },
 #endif
-    {"meme",       &Meme      },
-    {"mirror",     &Mirror    },
-    {"motivate",   &Motivate  },
-    {"quote",      &Quote     },
+  {"meme",         Command<&Meme, Decode::Sequential, Video::PerFrame>()   },
+  {"mirror",       Command<&Mirror, Decode::Random>()                      },
+  {"motivate",     Command<&Motivate, Decode::Sequential>()                },
+  {"quote",        Command<&Quote, Decode::Sequential>()                   },
 #ifdef ZXING_ENABLED
-    {"qrread",     &QrRead    },
+  {"qrread",       Command<&QrRead>()                                      },
 #endif
-    {"reddit",     &Reddit    },
-    {"resize",     &Resize    },
-    {"reverse",    &Reverse   },
-    {"scott",      &Scott     },
-    {"snapchat",   &Snapchat  },
-    {"speed",      &Speed     },
-    {"spin",       &Spin      },
-    {"spotify",    &Spotify   },
-    {"squish",     &Squish    },
-    {"swirl",      &Swirl     },
-    {"tile",       &Tile      },
-    {"togif",      &ToGif     },
-    {"uncanny",    &Uncanny   },
-    {"uncaption",  &Uncaption },
+  {"reddit",       Command<&Reddit, Decode::Sequential>()                  },
+  {"resize",       Command<&Resize, Decode::Sequential>()                  },
+  {"reverse",      Command<&Reverse, Decode::Indexed>()                    },
+  {"scott",        Command<&Scott, Decode::Sequential>()                   },
+  {"snapchat",     Command<&Snapchat, Decode::Sequential>()                },
+  {"speed",        Command<&Speed, &SpeedImage>()                          },
+  {"spin",         Command<&Spin, Decode::SequentialIfAnimated>()          },
+  {"spotify",      Command<&Spotify, Decode::Sequential>()                 },
+  {"squish",       Command<&Squish, Decode::SequentialIfAnimated>()        },
+  {"swirl",        Command<&Swirl, Decode::Random, Video::PerFrame>()      },
+  {"tile",         Command<&Tile, Decode::Random>()                        },
+  {"togif",        Command<&ToGif, Decode::Sequential>()                   },
+  {"uncanny",      Command<&Uncanny, Decode::Sequential>()                 },
+  {"uncaption",    Command<&Uncaption, Decode::SequentialIfAnimated>()     },
 #if MAGICK_ENABLED
-    {"wall",       &Wall      },
+  {"wall",         Command<&Wall>()                                        },
 #endif
-    {"watermark",  &Watermark },
-    {"whisper",    &Whisper   },
+  {"watermark",    Command<&Watermark, Decode::Sequential>()               },
+  {"whisper",      Command<&Whisper, Decode::Sequential>()                 },
 #ifdef FFMPEG_ENABLED
-    {"videospeed",   &VideoSpeed  },
-    {"videoreverse", &VideoReverse},
-    {"videocaption", &VideoCaption},
-    {"videotogif",   &VideoToGif  },
-    {"videotrim",    &VideoTrim   },
-    {"videomeme",    &VideoMeme   },
-    {"videostitch",  &VideoStitch },
-    {"videoaudio",   &VideoAudio  },
+  {"videospeed",   Command<&VideoSpeed>()                                  },
+  {"videoreverse", Command<&VideoReverse>()                                },
+  {"videocaption", Command<&VideoCaption>()                                },
+  {"videotogif",   Command<&VideoToGif>()                                  },
+  {"videotrim",    Command<&VideoTrim>()                                   },
+  {"videomeme",    Command<&VideoMeme>()                                   },
+  {"videostitch",  Command<&VideoStitch>()                                 },
+  {"videoaudio",   Command<&VideoAudio>()                                  },
 #endif
 };
 
-const std::map<std::string,
-               ArgumentMap (*)(const string &type, string &outType, ArgumentMap arguments, bool *shouldKill)>
-  NoInputFunctionMap = {
-    {"homebrew", &Homebrew},
+const std::map<std::string, NoInputCommand> NoInputFunctionMap = {
+  {"homebrew", Command<&Homebrew>()},
 #if ZXING_ENABLED
-    {"qrcreate", &QrCreate},
+  {"qrcreate", Command<&QrCreate>()},
 #endif
-    {"sonic",    &Sonic   }
+  {"sonic",    Command<&Sonic>()   }
 };
+
+// Parameter struct for the given command with its defaults filled in, or NULL if there's no such command
+CommandArgs *NewCommandArgs(const string &command);
+
+// Stats for every command in FunctionMap and NoInputFunctionMap. The set of commands is fixed when it's first
+// used, so reading and recording doesn't need a lock.
+CommandStats *GetCommandStats(const string &command);
+void ForEachCommandStats(const std::function<void(const string &, CommandStats &)> &fn);
+
+// Runs a command through FunctionMap or NoInputFunctionMap (depending on whether there's any input) and records
+// the job in that command's stats. The command has to exist in the map that gets picked.
+ArgumentMap RunCommand(const string &command, const string &type, string &outType, const char *bufferData,
+                       size_t bufferLength, const CommandArgs &arguments, JobControl &job);
+
+struct PipelineStep {
+  string command;
+  std::unique_ptr<CommandArgs> arguments;
+};
+
+// Runs several commands on a single decode of the input, only the result of the last one gets encoded. Every
+// command has to have an image function, and the job is recorded in the stats as "pipeline".
+ArgumentMap RunPipeline(const std::vector<PipelineStep> &steps, const string &type, string &outType,
+                        const char *bufferData, size_t bufferLength, JobControl &job);
@@ -7,13 +7,11 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Crop(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                 [[maybe_unused]] ArgumentMap arguments, bool *shouldKill) {
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false));
-
+VImage Crop(VImage in, ImageState &state, [[maybe_unused]] const NoParams &arguments,
+            [[maybe_unused]] JobControl *job) {
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   vector<VImage> img;
   img.reserve(nPages);  // Pre-allocate to avoid reallocations
@@ -33,16 +31,8 @@ ArgumentMap Crop(const string &type, string &outType, const char *bufferdata, si
   VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
   final.set(VIPS_META_PAGE_HEIGHT, finalHeight);
 
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  return output;
+  return final;
 }
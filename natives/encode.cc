@@ -0,0 +1,274 @@
+#include <vips/vips8>
+
+#include "common.h"
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace vips;
+
+#define BUDGET_MAX_ATTEMPTS 6
+// aim a bit under the budget since the size model is only a rough guess
+#define BUDGET_HEADROOM 0.92
+
+ArgumentMap EncodeImage(VImage image, const ImageState &state, JobControl *job) {
+  ArgumentMap output;
+  if (state.IsEncoded(image)) {
+    char *buf = reinterpret_cast<char *>(g_malloc(state.encodedLength));
+    memcpy(buf, state.encoded, state.encodedLength);
+    output["buf"] = buf;
+    output["free"] = g_free;
+    output["size"] = state.encodedLength;
+    return output;
+  }
+
+  if (state.outType == "gif") {
+    char *buf;
+    size_t dataSize = 0;
+    if (WriteGif(image, state, job, &buf, &dataSize)) {
+      output["buf"] = buf;
+      output["free"] = g_free;
+      output["size"] = dataSize;
+      return output;
+    }
+  }
+
+  SetupTimeoutCallback(image, job);
+
+  VOption *options = VImage::option();
+  if (state.outType == "gif") {
+    if (state.dither >= 0) options->set("dither", state.dither);
+    if (state.reoptimise >= 0) options->set("reoptimise", state.reoptimise);
+    if (state.bitdepth >= 0) options->set("bitdepth", state.bitdepth);
+    if (state.maxError >= 0) options->set("interframe-maxerror", state.maxError);
+  }
+  if ((state.outType == "jpg" || state.outType == "jpeg") && state.quality >= 0) options->set("Q", state.quality);
+  if (state.strip) options->set("strip", true);
+
+  char *buf;
+  size_t dataSize = 0;
+  image.write_to_buffer(("." + state.outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize, options);
+
+  output["buf"] = buf;
+  output["free"] = g_free;
+  output["size"] = dataSize;
+  return output;
+}
+
+/*
+  One rung of a format's quality ladder. factor is roughly how much smaller the output gets compared to the
+  command's own settings, it only has to be good enough to pick a starting point since every attempt corrects it.
+  Fields that don't apply to a format are -1.
+*/
+struct EncodeLevel {
+  double factor;
+  int quality;
+  int effort;
+  int bitdepth;
+  double maxError;
+  double dither;
+};
+
+// clang-format off
+static const vector<EncodeLevel> gifLadder = {
+  {0.80, -1, -1, 8, 8,  0.5 },
+  {0.65, -1, -1, 7, 16, 0.25},
+  {0.50, -1, -1, 6, 32, 0   },
+  {0.38, -1, -1, 5, 32, 0   },
+};
+static const vector<EncodeLevel> webpLadder = {
+  {0.80, 65, 6, -1, -1, -1},
+  {0.62, 50, 6, -1, -1, -1},
+  {0.48, 35, 6, -1, -1, -1},
+};
+static const vector<EncodeLevel> jpegLadder = {
+  {0.80, 60, -1, -1, -1, -1},
+  {0.65, 45, -1, -1, -1, -1},
+  {0.50, 30, -1, -1, -1, -1},
+};
+static const vector<EncodeLevel> pngLadder = {
+  {0.45, 90, -1, 8, -1, -1},
+  {0.30, 60, -1, 4, -1, -1},
+};
+// clang-format on
+
+static const vector<EncodeLevel> *GetLadder(const string &type) {
+  if (type == "gif") return &gifLadder;
+  if (type == "webp") return &webpLadder;
+  if (type == "jpg" || type == "jpeg") return &jpegLadder;
+  if (type == "png") return &pngLadder;
+  return NULL;
+}
+
+// Which rung of the ladder to use, how many frames to merge into one and how far to scale down
+struct EncodePlan {
+  int level;
+  int frameStep;
+  double scale;
+};
+
+static double PredictFactor(const vector<EncodeLevel> &ladder, const EncodePlan &plan) {
+  return ladder[plan.level].factor * plan.scale * plan.scale / plan.frameStep;
+}
+
+// Gentlest plan that is predicted to shrink the output to target (a fraction of its original size). Quality goes
+// first, then frame rate for animations, and the resolution last.
+static EncodePlan PlanEncode(const vector<EncodeLevel> &ladder, int nPages, double target) {
+  EncodePlan plan{(int)ladder.size() - 1, 1, 1.0};
+  for (size_t i = 0; i < ladder.size(); i++) {
+    if (ladder[i].factor <= target) {
+      plan.level = i;
+      break;
+    }
+  }
+
+  double remaining = target / ladder[plan.level].factor;
+  // dropping more than every other frame starts to look choppy, and keep at least a couple of frames
+  if (remaining < 0.75 && nPages >= 4) {
+    plan.frameStep = remaining < 0.4 && nPages >= 6 ? 3 : 2;
+    remaining *= plan.frameStep;
+  }
+  if (remaining < 1.0) plan.scale = sqrt(remaining);
+  return plan;
+}
+
+// Keeps every frameStep-th frame (adding up the delays of the ones in between) and scales it down, keeping the
+// page height a whole number of pixels
+static VImage ShrinkImage(VImage in, const EncodePlan &plan) {
+  int width = in.width();
+  int nPages = vips_image_get_n_pages(in.get_image());
+  int pageHeight = nPages > 1 ? vips_image_get_page_height(in.get_image()) : in.height();
+
+  VImage out = in;
+  if (plan.frameStep > 1 && nPages > 1) {
+    vector<int> delays;
+    if (vips_image_get_typeof(in.get_image(), "delay") != 0) delays = in.get_array_int("delay");
+
+    vector<VImage> frames;
+    vector<int> newDelays;
+    for (int i = 0; i < nPages; i += plan.frameStep) {
+      frames.push_back(in.crop(0, i * pageHeight, width, pageHeight));
+      int delay = 0;
+      for (int j = i; j < i + plan.frameStep && j < (int)delays.size(); j++) delay += delays[j];
+      newDelays.push_back(delay);
+    }
+    out = VImage::arrayjoin(frames, VImage::option()->set("across", 1));
+    nPages = frames.size();
+    out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
+    if (!delays.empty()) out.set("delay", newDelays);
+  }
+
+  if (plan.scale < 1.0) {
+    int newPageHeight = max(1, (int)round(pageHeight * plan.scale));
+    double vscale = (double)(newPageHeight * nPages) / (double)out.height();
+    out = out.resize(plan.scale, VImage::option()->set("vscale", vscale));
+    if (nPages > 1) out.set(VIPS_META_PAGE_HEIGHT, newPageHeight);
+  }
+  return out;
+}
+
+// GIFs go through EncodeImage instead, so they get the same encoder as the first result did
+static VOption *LevelOptions(const string &type, const EncodeLevel &settings) {
+  VOption *options = VImage::option()->set("strip", true);
+  if (type == "png") {
+    options->set("palette", true);
+    options->set("Q", settings.quality);
+    options->set("bitdepth", settings.bitdepth);
+  } else {
+    options->set("Q", settings.quality);
+    if (settings.effort >= 0) options->set("effort", settings.effort);
+  }
+  return options;
+}
+
+// Runs the search on a decoded copy of the result, returns NULL if nothing fit
+static char *ShrinkToBudget(VImage source, const vector<EncodeLevel> &ladder, const string &outType, size_t size,
+                            JobControl &job, size_t &dataSize, EncodePlan &plan, int &attempt) {
+  int nPages = vips_image_get_n_pages(source.get_image());
+
+  // how far off the size model was on the last attempt
+  double correction = 1.0;
+  double lastPredicted = 1.0;
+  for (attempt = 1; attempt <= BUDGET_MAX_ATTEMPTS; attempt++) {
+    CheckJob(&job);
+    double target = BUDGET_HEADROOM * (double)job.budget / ((double)size * correction);
+    // always ask for less than last time, even if the model thinks the last attempt should have been enough
+    if (target >= lastPredicted) target = lastPredicted * 0.8;
+    plan = PlanEncode(ladder, nPages, target);
+    if (source.width() * plan.scale < 1) break;
+
+    VImage shrunk = ShrinkImage(source, plan);
+    const EncodeLevel &level = ladder[plan.level];
+    char *buf;
+    if (outType == "gif") {
+      ImageState state;
+      state.outType = outType;
+      state.strip = true;
+      state.dither = level.dither;
+      state.bitdepth = level.bitdepth;
+      state.maxError = level.maxError;
+      ArgumentMap encoded = EncodeImage(shrunk, state, &job);
+      buf = GetArgument<char *>(encoded, "buf");
+      dataSize = GetArgument<size_t>(encoded, "size");
+    } else {
+      SetupTimeoutCallback(shrunk, &job);
+      shrunk.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
+                             LevelOptions(outType, level));
+    }
+    if (dataSize <= job.budget) return buf;
+    g_free(buf);
+
+    double predicted = PredictFactor(ladder, plan);
+    correction = (double)dataSize / ((double)size * predicted);
+    lastPredicted = predicted;
+  }
+  return NULL;
+}
+
+void FitToBudget(ArgumentMap &output, const string &outType, JobControl &job) {
+  size_t size = GetArgumentWithFallback<size_t>(output, "size", 0);
+  if (job.budget == 0 || size <= job.budget) return;
+  const vector<EncodeLevel> *ladder = GetLadder(outType);
+  // only formats we can decode and write again, e.g. videos are left alone
+  if (ladder == NULL) return;
+
+  char *original = GetArgument<char *>(output, "buf");
+  BufferFree originalFree = GetArgumentWithFallback<BufferFree>(output, "free", g_free);
+
+  // The first result is the best version we have of the pixels, so every attempt starts from it instead of running
+  // the command again. Decoding from memory also lets us go over it as many times as we need.
+  char *buf = NULL;
+  size_t dataSize = 0;
+  EncodePlan plan;
+  int attempts = 0;
+  try {
+    VOption *inputOptions = VImage::option()->set("fail-on", VIPS_FAIL_ON_NONE);
+    if (outType == "gif" || outType == "webp") inputOptions->set("n", -1);
+    VImage source = VImage::new_from_buffer(original, size, "", inputOptions);
+    buf = ShrinkToBudget(source, *ladder, outType, size, job, dataSize, plan, attempts);
+  } catch (...) {
+    originalFree(original);
+    throw;
+  }
+  // nothing fit, the caller gets the full result back rather than having to run the command again
+  if (buf == NULL) {
+    output["overBudget"] = true;
+    return;
+  }
+  originalFree(original);
+
+  const EncodeLevel &level = (*ladder)[plan.level];
+  output["buf"] = buf;
+  output["free"] = g_free;
+  output["size"] = dataSize;
+  output["encode.attempts"] = attempts;
+  output["encode.scale"] = (float)plan.scale;
+  output["encode.frameStep"] = plan.frameStep;
+  output["encode.quality"] = level.quality;
+  output["encode.effort"] = level.effort;
+  output["encode.bitdepth"] = level.bitdepth;
+  output["encode.maxError"] = (float)level.maxError;
+}
@@ -5,25 +5,20 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Flag(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                 ArgumentMap arguments, bool *shouldKill) {
-  string overlay = GetArgument<string>(arguments, "overlay");
-  string basePath = GetArgument<string>(arguments, "basePath");
+VImage Flag(VImage in, ImageState &state, const FlagParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &overlay = arguments.overlay;
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
 
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   string assetPath = basePath + overlay;
-  VImage overlayInput = VImage::new_from_file(assetPath.c_str());
-  VImage overlayImage =
-    overlayInput.resize((double)width / (double)overlayInput.width(),
-                        VImage::option()->set("vscale", (double)pageHeight / (double)overlayInput.height()));
+  VImage overlayImage = LoadAssetResized(assetPath, width, pageHeight);
   if (!overlayImage.has_alpha()) {
     overlayImage = overlayImage.bandjoin(127);
   } else {
@@ -33,16 +28,8 @@ ArgumentMap Flag(const string &type, string &outType, const char *bufferdata, si
   VImage replicated = overlayImage.replicate(1, nPages);
   VImage final = in.composite2(replicated, VIPS_BLEND_MODE_OVER);
 
-  SetupTimeoutCallback(final, shouldKill);
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return final;
 }
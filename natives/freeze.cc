@@ -3,12 +3,13 @@
 #include <vips/vips8>
 
 #include "common.h"
+#include "gifindex.h"
 
 using namespace std;
 using namespace vips;
 
 char *vipsTrim(const char *data, size_t length, size_t &dataSize, int frame, string suffix, string outType,
-               bool *shouldKill) {
+               JobControl *job) {
   VImage in = VImage::new_from_buffer(data, length, "", GetInputOptions(suffix, true, false));
 
   int pageHeight = vips_image_get_page_height(in.get_image());
@@ -18,7 +19,7 @@ char *vipsTrim(const char *data, size_t length, size_t &dataSize, int frame, str
   out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
   out.set("loop", 1);
 
-  SetupTimeoutCallback(out, shouldKill);
+  SetupTimeoutCallback(out, job);
 
   char *buf;
   out.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
@@ -26,69 +27,76 @@ char *vipsTrim(const char *data, size_t length, size_t &dataSize, int frame, str
   return buf;
 }
 
+char *TrimGif(const char *data, const GifIndex &index, size_t &dataSize, int frame) {
+  int framePos = clamp(frame, 1, (int)index.frames.size());
+
+  dataSize = index.headerEnd + 1;
+  for (int i = 0; i < framePos; i++) dataSize += index.frames[i].end - index.frames[i].start;
+  char *out = reinterpret_cast<char *>(malloc(dataSize));
+  memcpy(out, data, index.headerEnd);
+  size_t pos = index.headerEnd;
+  for (int i = 0; i < framePos; i++) {
+    const GifFrameInfo &info = index.frames[i];
+    memcpy(out + pos, data + info.start, info.end - info.start);
+    pos += info.end - info.start;
+  }
+  out[pos] = 0x3B;
+  return out;
+}
+
+char *SpliceGif(const char *data, size_t length, size_t offset, size_t size, const char *insert, size_t insertSize,
+                size_t &dataSize) {
+  dataSize = length - size + insertSize;
+  char *out = reinterpret_cast<char *>(malloc(dataSize));
+  memcpy(out, data, offset);
+  if (insertSize > 0) memcpy(out + offset, insert, insertSize);
+  memcpy(out + offset + insertSize, data + offset + size, length - offset - size);
+  return out;
+}
+
 ArgumentMap Freeze(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   ArgumentMap arguments, bool *shouldKill) {
-  bool loop = GetArgumentWithFallback<bool>(arguments, "loop", false);
-  int frame = GetArgumentWithFallback<int>(arguments, "frame", -1);
+                   const FreezeParams &arguments, JobControl *job) {
+  bool loop = arguments.loop;
+  int frame = arguments.frame;
 
   ArgumentMap output;
   size_t dataSize = 0;
 
   if (type == "gif") {
-    char *fileData = reinterpret_cast<char *>(malloc(bufferLength));
-    memcpy(fileData, bufferdata, bufferLength);
-
-    char *match = const_cast<char *>("\x21\xFF\x0BNETSCAPE2.0\x03\x01");
-    char *descriptor = const_cast<char *>("\x2C\x00\x00\x00\x00");
-    char *lastPos;
-
-    bool none = true;
-
-    if (loop) {
-      char *newData = reinterpret_cast<char *>(malloc(bufferLength + 19));
-      memcpy(newData, fileData, bufferLength);
-      lastPos = reinterpret_cast<char *>(memchr(newData, '\x2C', bufferLength));
-      while (lastPos != NULL) {
-        if (memcmp(lastPos, descriptor, 5) != 0) {
-          lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x2C', (bufferLength - (lastPos - newData)) - 1));
-          continue;
-        }
+    GifIndex index;
+    bool indexed = ParseGif(reinterpret_cast<const uint8_t *>(bufferdata), bufferLength, index, job);
 
-        memcpy(lastPos + 19, lastPos, (bufferLength - (lastPos - newData)));
-        memcpy(lastPos, match, 16);
-        memcpy(lastPos + 16, "\x00\x00\x00", 3);
-
-        none = false;
-        dataSize = bufferLength + 19;
-        break;
+    char *buf;
+    BufferFree bufFree = free;
+    if (frame >= 0 && !loop) {
+      if (indexed && outType == "gif") {
+        buf = TrimGif(bufferdata, index, dataSize, frame);
+      } else {
+        buf = vipsTrim(bufferdata, bufferLength, dataSize, frame, type, outType, job);
+        bufFree = g_free;
       }
-      if (none) dataSize = bufferLength;
-
-      output["buf"] = newData;
-    } else if (frame >= 0 && !loop) {
-      char *buf = vipsTrim(bufferdata, bufferLength, dataSize, frame, type, outType, shouldKill);
-      output["buf"] = buf;
-    } else {
-      lastPos = reinterpret_cast<char *>(memchr(fileData, '\x21', bufferLength));
-      while (lastPos != NULL) {
-        if (memcmp(lastPos, match, 16) != 0) {
-          lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x21', (bufferLength - (lastPos - fileData)) - 1));
-          continue;
-        }
-        memcpy(lastPos, lastPos + 19, (bufferLength - (lastPos - fileData)) - 19);
-        dataSize = bufferLength - 19;
-        none = false;
-        break;
+    } else if (indexed && loop) {
+      if (index.loopStart != 0) {
+        // only the loop count needs to change
+        buf = SpliceGif(bufferdata, bufferLength, index.loopStart + 16, 2, "\x00\x00", 2, dataSize);
+      } else {
+        buf = SpliceGif(bufferdata, bufferLength, index.headerEnd, 0, "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19,
+                        dataSize);
       }
-      if (none) dataSize = bufferLength;
-
-      output["buf"] = fileData;
+    } else if (indexed && !loop && index.loopStart != 0) {
+      buf = SpliceGif(bufferdata, bufferLength, index.loopStart, index.loopEnd - index.loopStart, NULL, 0, dataSize);
+    } else {
+      buf = SpliceGif(bufferdata, bufferLength, 0, 0, NULL, 0, dataSize);
     }
+
+    output["buf"] = buf;
+    output["free"] = bufFree;
     output["size"] = dataSize;
   } else if (type == "webp") {
     if (frame >= 0 && !loop) {
-      char *buf = vipsTrim(bufferdata, bufferLength, dataSize, frame, type, outType, shouldKill);
+      char *buf = vipsTrim(bufferdata, bufferLength, dataSize, frame, type, outType, job);
       output["buf"] = buf;
+      output["free"] = g_free;
       output["size"] = dataSize;
     } else {
       char *fileData = reinterpret_cast<char *>(malloc(bufferLength));
@@ -97,6 +105,10 @@ ArgumentMap Freeze(const string &type, string &outType, const char *bufferdata,
       size_t position = 12;
 
       while (position + 8 <= bufferLength) {
+        if (JobStopped(job)) {
+          free(fileData);
+          throw std::runtime_error("image_job_killed");
+        }
         const char *fourCC = &fileData[position];
         uint32_t chunkSize = readUint32LE(reinterpret_cast<unsigned char *>(fileData) + position + 4);
 
@@ -111,14 +123,37 @@ ArgumentMap Freeze(const string &type, string &outType, const char *bufferdata,
       }
 
       output["buf"] = fileData;
+
+      output["free"] = free;
       output["size"] = bufferLength;
     }
   } else {
     char *data = reinterpret_cast<char *>(malloc(bufferLength));
     memcpy(data, bufferdata, bufferLength);
     output["buf"] = data;
+    output["free"] = free;
     output["size"] = bufferLength;
   }
 
   return output;
 }
+
+// Pipeline version of Freeze, works on the loop count and frames vips decoded instead of patching the file
+VImage FreezeImage(VImage in, [[maybe_unused]] ImageState &state, const FreezeParams &arguments,
+                   [[maybe_unused]] JobControl *job) {
+  int nPages = vips_image_get_n_pages(in.get_image());
+  if (nPages < 2) return in;
+
+  VImage out;
+  if (!arguments.loop && arguments.frame >= 0) {
+    int pageHeight = vips_image_get_page_height(in.get_image());
+    int framePos = clamp(arguments.frame, 1, nPages);
+    out = in.crop(0, 0, in.width(), pageHeight * framePos);
+    out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
+  } else {
+    out = in.copy();
+  }
+  out.set("loop", arguments.loop ? 0 : 1);
+
+  return out;
+}
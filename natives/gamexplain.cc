@@ -5,44 +5,22 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Gamexplain(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                       ArgumentMap arguments, bool *shouldKill) {
-  string basePath = GetArgument<string>(arguments, "basePath");
+VImage Gamexplain(VImage in, ImageState &state, const AssetParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   string assetPath = basePath + "assets/images/gamexplain.png";
-  VImage tmpl = VImage::new_from_file(assetPath.c_str());
-
-  int width = in.width();
-  int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
-
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  for (int i = 0; i < nPages; i++) {
-    VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
-    VImage resized =
-      img_frame.resize(1181.0 / (double)width, VImage::option()->set("vscale", 571.0 / (double)pageHeight))
-        .embed(10, 92, 1200, 675, VImage::option()->set("extend", "white"));
-    VImage composited = resized.composite2(tmpl, VIPS_BLEND_MODE_OVER);
-    img.push_back(composited);
-  }
-  VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
-  final.set(VIPS_META_PAGE_HEIGHT, 675);
-
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  VImage tmpl = LoadAsset(assetPath);
+
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+
+  VImage resized = PageResize(in, nPages, 1181, 571);
+  VImage final = PageLayer(PageEmbed(resized, nPages, 10, 92, 1200, 675, whiteVec), nPages, tmpl, 0, 0);
+
+  state.dither = 0;
+  state.reoptimise = 1;
+
+  return final;
 }
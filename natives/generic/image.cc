@@ -5,10 +5,60 @@
 #include <Magick++.h>
 #endif
 #include <simdjson.h>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include <vips/vips8>
 
 using namespace simdjson;
 
+// Fills in a command's arguments from a JSON object
+static std::unique_ptr<CommandArgs> ParseArguments(const string &cmd, ondemand::object obj) {
+  std::unique_ptr<CommandArgs> arguments(NewCommandArgs(cmd));
+  if (!arguments) throw "Error: Unknown command \"" + cmd + "\".";
+
+  for (auto pair : obj) {
+    std::string key(pair.escaped_key().value());
+    auto val = pair.value();
+    bool valid;
+    switch (val.type()) {
+      case ondemand::json_type::boolean:
+        valid = arguments->SetBool(key, val.get_bool());
+        break;
+      case ondemand::json_type::string:
+        valid = arguments->SetString(key, std::string(val.get_string().value()));
+        break;
+      case ondemand::json_type::number:
+        valid = arguments->SetNumber(key, val.get_double());
+        break;
+      default:
+        throw "Unimplemented value type passed to image native.";
+    }
+    if (!valid) throw "Error: Type of property \"" + key + "\" is invalid.";
+  }
+
+  const char *missing = arguments->Missing();
+  if (missing != NULL) throw "Error: Missing required property \"" + string(missing) + "\".";
+
+  return arguments;
+}
+
+static image_result *MakeResult(ArgumentMap &outMap, const string &outType) {
+  vips_error_clear();
+  vips_thread_shutdown();
+
+  char *buf = GetArgument<char *>(outMap, "buf");
+
+  image_result *out = (image_result *)malloc(sizeof(image_result));
+  out->buf = buf;
+  snprintf(out->typeStorage, sizeof(out->typeStorage), "%s", outType.c_str());
+  out->type = out->typeStorage;
+  out->length = GetArgument<size_t>(outMap, "size");
+  out->free = GetArgumentWithFallback<BufferFree>(outMap, "free", g_free);
+  return out;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +69,7 @@ void esmb_image_init() {
 #endif
   if (VIPS_INIT("")) vips_error_exit(NULL);
   vips_cache_set_max(0);
+  GetThreadBudget().Configure(std::thread::hardware_concurrency(), VIPS_MAX_CONCURRENCY);
 #if VIPS_MAJOR_VERSION >= 8 && VIPS_MINOR_VERSION >= 13
   vips_block_untrusted_set(true);
   vips_operation_block_set("VipsForeignLoad", true);
@@ -35,66 +86,100 @@ image_result *esmb_image_process(const char *command, const char *args, size_t a
   ondemand::parser parser;
   padded_string padded(args, args_length);
   ondemand::document parsedArgs = parser.iterate(padded);
-  ondemand::object obj(parsedArgs);
-  ArgumentMap Arguments;
+  string cmd(command);
+  std::unique_ptr<CommandArgs> arguments = ParseArguments(cmd, ondemand::object(parsedArgs));
 
-  for (auto pair : obj) {
-    std::string key(pair.escaped_key().value());
-    auto val = pair.value();
-    switch (val.type()) {
-      case ondemand::json_type::boolean:
-        Arguments[key] = val.get_bool();
-        break;
-      case ondemand::json_type::string:
-        Arguments[key] = std::string(val.get_string().value());
-        break;
-      case ondemand::json_type::number:
-        if (val.is_integer()) {
-          Arguments[key] = static_cast<int>(val.get_int64());
-        } else {
-          Arguments[key] = static_cast<float>(val.get_double());
-        }
-        break;
-      default:
-        throw "Unimplemented value type passed to image native.";
-    }
+  string outType = arguments->togif ? "gif" : type;
+
+  if (length != 0 && !MapContainsKey(FunctionMap, command)) {
+    // Vultu: I don't think we will ever be here, but just in case we need a descriptive error
+    throw "Error: \"FunctionMap\" does not contain \"" + cmd +
+      "\", which was requested because \"length\" parameter was not 0.";
+  }
+  if (length == 0 && !MapContainsKey(NoInputFunctionMap, command)) {
+    throw "Error: \"NoInputFunctionMap\" does not contain \"" + cmd +
+      "\", which was requested because \"length\" parameter was 0.";
   }
 
-  string outType = GetArgumentWithFallback<bool>(Arguments, "togif", false) ? "gif" : type;
+  JobControl job;
+  ArgumentMap outMap = RunCommand(cmd, type, outType, data, length, *arguments, job);
+  return MakeResult(outMap, outType);
+}
 
-  ArgumentMap outMap;
-  if (length != 0) {
-    if (MapContainsKey(FunctionMap, command)) {
-      outMap = FunctionMap.at(command)(type, outType, data, length, Arguments, NULL);
-    } else { // Vultu: I don't think we will ever be here, but just in case we need a descriptive error
-      string cmd(command);
-      throw "Error: \"FunctionMap\" does not contain \"" + cmd +
-        "\", which was requested because \"length\" parameter was not 0.";
-    }
-  } else {
-    if (MapContainsKey(NoInputFunctionMap, command)) {
-      outMap = NoInputFunctionMap.at(command)(type, outType, Arguments, NULL);
-    } else {
-      string cmd(command);
-      throw "Error: \"NoInputFunctionMap\" does not contain \"" + cmd +
-        "\", which was requested because \"length\" parameter was 0.";
+image_result *esmb_image_pipeline(const char *steps, size_t steps_length, const char *type, const char *data, size_t length) {
+  ondemand::parser parser;
+  padded_string padded(steps, steps_length);
+  ondemand::document parsedSteps = parser.iterate(padded);
+
+  std::vector<PipelineStep> pipeline;
+  for (auto value : parsedSteps.get_array()) {
+    ondemand::object step = value.get_object().value();
+    string cmd(std::string_view(step["cmd"].get_string().value()));
+    auto found = FunctionMap.find(cmd);
+    if (found == FunctionMap.end() || found->second.image == NULL) {
+      throw "Error: Command \"" + cmd + "\" can't be used in a pipeline.";
     }
+    pipeline.push_back({cmd, ParseArguments(cmd, step["params"].get_object().value())});
   }
+  if (pipeline.empty()) throw "Error: Pipeline has no steps.";
+  if (length == 0) throw "Error: Pipelines need an input image.";
 
-  vips_error_clear();
-  vips_thread_shutdown();
+  JobControl job;
+  string outType = pipeline.size() == 1 && pipeline[0].arguments->togif ? "gif" : type;
+  ArgumentMap outMap = pipeline.size() == 1
+                         ? RunCommand(pipeline[0].command, type, outType, data, length, *pipeline[0].arguments, job)
+                         : RunPipeline(pipeline, type, outType, data, length, job);
+  return MakeResult(outMap, outType);
+}
 
-  char *buf = GetArgument<char *>(outMap, "buf");
+static void WriteHistogram(std::ostringstream &out, const char *name, const Histogram::Snapshot &histogram) {
+  out << ",\"" << name << "\":{\"count\":" << histogram.count << ",\"sum\":" << histogram.sum
+      << ",\"max\":" << histogram.max << ",\"p50\":" << histogram.Quantile(0.5)
+      << ",\"p95\":" << histogram.Quantile(0.95) << ",\"buckets\":[";
+  int used = STATS_BUCKETS;
+  while (used > 0 && histogram.buckets[used - 1] == 0) used--;
+  for (int i = 0; i < used; i++) out << (i > 0 ? "," : "") << histogram.buckets[i];
+  out << "]}";
+}
 
-  image_result *out = (image_result *)malloc(sizeof(image_result));
-  out->buf = buf;
-  out->type = outType.c_str();
-  out->length = GetArgument<size_t>(outMap, "size");
-  return out;
+char *esmb_image_stats(int reset) {
+  std::ostringstream out;
+  ThreadBudget::Stats budget = GetThreadBudget().Get();
+  out << "{\"memHighwater\":" << vips_tracked_get_mem_highwater() << ",\"threads\":{\"cores\":" << budget.cores
+      << ",\"vipsMax\":" << budget.vipsMax << ",\"jobs\":" << budget.jobs << ",\"share\":" << budget.share
+      << ",\"vips\":" << budget.vips << "},\"commands\":{";
+  bool first = true;
+  ForEachCommandStats([&](const string &name, CommandStats &stats) {
+    CommandStats::Snapshot snapshot = stats.Get();
+    if (reset) stats.Reset();
+    if (snapshot.jobs == 0) return;
+    // command names are plain identifiers, no escaping needed
+    out << (first ? "" : ",") << "\"" << name << "\":{\"jobs\":" << snapshot.jobs
+        << ",\"failures\":" << snapshot.failures << ",\"timeouts\":" << snapshot.timeouts;
+    WriteHistogram(out, "total", snapshot.total);
+    WriteHistogram(out, "decode", snapshot.decode);
+    WriteHistogram(out, "process", snapshot.process);
+    WriteHistogram(out, "encode", snapshot.encode);
+    WriteHistogram(out, "inputBytes", snapshot.inputBytes);
+    WriteHistogram(out, "outputBytes", snapshot.outputBytes);
+    WriteHistogram(out, "frames", snapshot.frames);
+    WriteHistogram(out, "memPeak", snapshot.memPeak);
+    WriteHistogram(out, "graphNodes", snapshot.graphNodes);
+    out << "}";
+    first = false;
+  });
+  out << "}}";
+  return g_strdup(out.str().c_str());
 }
 
 void esmb_image_free(void *ptr, [[maybe_unused]] void *ctx) { g_free(ptr); }
 
+void esmb_image_result_free(image_result *result) {
+  if (result == NULL) return;
+  result->free(result->buf);
+  free(result);
+}
+
 #ifdef __cplusplus
 }
 #endif
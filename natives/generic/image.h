@@ -9,11 +9,23 @@ struct image_result {
   const char *type;
   size_t length;
   void *buf;
+  // allocator-specific free for buf, esmb_image_result_free uses it
+  void (*free)(void *);
+  // backing storage for type
+  char typeStorage[16];
 };
 
 void esmb_image_init();
 image_result *esmb_image_process(const char *command, const char *args, size_t args_length, const char *type, const char *data, size_t length);
+// Runs a JSON array of {"cmd": ..., "params": {...}} steps on one decode of the input, only the last step is encoded.
+// Byte-level, video and no-input commands can't be part of a pipeline.
+image_result *esmb_image_pipeline(const char *steps, size_t steps_length, const char *type, const char *data, size_t length);
 void esmb_image_free(void *ptr, [[maybe_unused]] void *ctx);
+// Frees a result's buffer with the allocator it came from, then the result itself
+void esmb_image_result_free(image_result *result);
+// Per-command job stats as a JSON string, free it with esmb_image_free(ptr, NULL). A non-zero reset clears the
+// counters after they've been read.
+char *esmb_image_stats(int reset);
 
 inline const char *esmb_image_get_type(image_result *result) { return result->type; }
 inline void *esmb_image_get_data(image_result *result) { return result->buf; }
@@ -0,0 +1,446 @@
+#include <vips/vips8>
+
+#include "common.h"
+#include "gifindex.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+using namespace vips;
+
+// Frames the global palette is built from, spread evenly over the animation
+#define GIF_SAMPLE_FRAMES 8
+#define GIF_SAMPLE_PIXELS (1024 * 1024)
+// Mean squared error (summed over R, G and B) against the global palette that's always good enough for a frame
+#define GIF_LOCAL_PALETTE_MSE 300
+// Palette index reserved for transparent pixels, so frames never have more than 255 visible colours
+#define GIF_TRANSPARENT 255
+#define GIF_MAX_CODE 4095
+#define GIF_HASH_SIZE 5003
+// Same as GIF_NATIVE_MAX_MEM for inputs that were decoded from a frame index, which would lose the point of the
+// index well before that
+#define GIF_INDEXED_MAX_MEM (48 * 1024 * 1024)
+
+typedef array<uint8_t, 3> Colour;
+
+// Colours are looked up by their top 5 bits per channel
+static inline int ColourKey(int r, int g, int b) { return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3); }
+
+struct Palette {
+  vector<Colour> colours;
+  // nearest palette entry for each colour key, filled in on first use. Frames mapped on different threads may race
+  // on an entry, but they always compute the same value for it.
+  unique_ptr<atomic<int16_t>[]> lookup;
+
+  explicit Palette(vector<Colour> colours) : colours(std::move(colours)), lookup(new atomic<int16_t>[32768]) {
+    for (int i = 0; i < 32768; i++) lookup[i].store(-1, memory_order_relaxed);
+  }
+
+  int Nearest(int r, int g, int b) {
+    int key = ColourKey(r, g, b);
+    int found = lookup[key].load(memory_order_relaxed);
+    if (found >= 0) return found;
+
+    // search from the centre of the key's cell so every colour in it maps the same way
+    int cr = ((key >> 10) << 3) | 4, cg = (((key >> 5) & 31) << 3) | 4, cb = ((key & 31) << 3) | 4;
+    int best = 0, bestDistance = INT_MAX;
+    for (size_t i = 0; i < colours.size(); i++) {
+      int dr = cr - colours[i][0], dg = cg - colours[i][1], db = cb - colours[i][2];
+      int distance = dr * dr + dg * dg + db * db;
+      if (distance < bestDistance) {
+        bestDistance = distance;
+        best = i;
+      }
+    }
+    lookup[key].store(best, memory_order_relaxed);
+    return best;
+  }
+};
+
+// Colour histogram over the colour keys, with the sums needed to average the colours that fall into a box
+struct Histogram5 {
+  vector<uint32_t> counts = vector<uint32_t>(32768);
+  vector<array<uint64_t, 3>> sums = vector<array<uint64_t, 3>>(32768);
+
+  void Add(const uint8_t *pixel) {
+    int key = ColourKey(pixel[0], pixel[1], pixel[2]);
+    counts[key]++;
+    sums[key][0] += pixel[0];
+    sums[key][1] += pixel[1];
+    sums[key][2] += pixel[2];
+  }
+};
+
+// Median cut over the histogram, splitting the box with the widest channel range at its weighted median
+static vector<Colour> MedianCut(const Histogram5 &histogram, size_t maxColours) {
+  vector<vector<int>> boxes(1);
+  for (int key = 0; key < 32768; key++) {
+    if (histogram.counts[key] > 0) boxes[0].push_back(key);
+  }
+  if (boxes[0].empty()) return {Colour{0, 0, 0}};
+
+  auto channel = [](int key, int c) { return c == 0 ? key >> 10 : c == 1 ? (key >> 5) & 31 : key & 31; };
+  while (boxes.size() < maxColours) {
+    int bestBox = -1, bestChannel = 0, bestRange = 0;
+    for (size_t i = 0; i < boxes.size(); i++) {
+      if (boxes[i].size() < 2) continue;
+      for (int c = 0; c < 3; c++) {
+        int lo = 31, hi = 0;
+        for (int key : boxes[i]) {
+          lo = min(lo, channel(key, c));
+          hi = max(hi, channel(key, c));
+        }
+        if (hi - lo > bestRange) {
+          bestRange = hi - lo;
+          bestBox = i;
+          bestChannel = c;
+        }
+      }
+    }
+    if (bestBox < 0) break;
+
+    vector<int> &box = boxes[bestBox];
+    sort(box.begin(), box.end(), [&](int a, int b) { return channel(a, bestChannel) < channel(b, bestChannel); });
+    uint64_t total = 0;
+    for (int key : box) total += histogram.counts[key];
+    uint64_t seen = 0;
+    size_t split = 1;
+    for (; split < box.size() - 1; split++) {
+      seen += histogram.counts[box[split - 1]];
+      if (seen * 2 >= total) break;
+    }
+    vector<int> upper(box.begin() + split, box.end());
+    box.resize(split);
+    boxes.push_back(std::move(upper));
+  }
+
+  vector<Colour> colours;
+  for (const vector<int> &box : boxes) {
+    uint64_t count = 0, r = 0, g = 0, b = 0;
+    for (int key : box) {
+      count += histogram.counts[key];
+      r += histogram.sums[key][0];
+      g += histogram.sums[key][1];
+      b += histogram.sums[key][2];
+    }
+    colours.push_back({(uint8_t)(r / count), (uint8_t)(g / count), (uint8_t)(b / count)});
+  }
+  return colours;
+}
+
+struct GifFrame {
+  const uint8_t *pixels;
+  bool transparent = false;
+  double error = 0;
+  // frames whose colours are too far off the global palette get their own
+  unique_ptr<Palette> local;
+  vector<uint8_t> indices;
+  vector<uint8_t> lzw;
+  bool diffed = false;
+};
+
+static void MapFrame(GifFrame &frame, Palette &palette, int width, int height, int bands, float dither) {
+  frame.indices.resize((size_t)width * height);
+  // Floyd-Steinberg error for this row and the next one, with a pixel of padding on each side
+  vector<float> errors(dither > 0 ? (size_t)(width + 2) * 3 * 2 : 0);
+  for (int y = 0; y < height; y++) {
+    float *current = dither > 0 ? &errors[(y % 2) * (width + 2) * 3] : NULL;
+    float *below = dither > 0 ? &errors[((y + 1) % 2) * (width + 2) * 3] : NULL;
+    if (below != NULL) fill(below, below + (width + 2) * 3, 0.0f);
+    for (int x = 0; x < width; x++) {
+      size_t offset = (size_t)y * width + x;
+      const uint8_t *pixel = frame.pixels + offset * bands;
+      if (bands == 4 && pixel[3] < 128) {
+        frame.indices[offset] = GIF_TRANSPARENT;
+        continue;
+      }
+      int value[3];
+      for (int c = 0; c < 3; c++) {
+        float v = pixel[c] + (current != NULL ? current[(x + 1) * 3 + c] : 0);
+        value[c] = v < 0 ? 0 : v > 255 ? 255 : (int)(v + 0.5f);
+      }
+      int index = palette.Nearest(value[0], value[1], value[2]);
+      frame.indices[offset] = index;
+      if (current == NULL) continue;
+      for (int c = 0; c < 3; c++) {
+        float error = (value[c] - palette.colours[index][c]) * dither;
+        current[(x + 2) * 3 + c] += error * 7 / 16;
+        below[x * 3 + c] += error * 3 / 16;
+        below[(x + 1) * 3 + c] += error * 5 / 16;
+        below[(x + 2) * 3 + c] += error * 1 / 16;
+      }
+    }
+  }
+}
+
+// Mean squared error of the frame's opaque pixels against the palette, without dithering
+static double PaletteError(const GifFrame &frame, Palette &palette, size_t pixels, int bands) {
+  uint64_t total = 0, counted = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    const uint8_t *pixel = frame.pixels + i * bands;
+    if (bands == 4 && pixel[3] < 128) continue;
+    const Colour &colour = palette.colours[palette.Nearest(pixel[0], pixel[1], pixel[2])];
+    int dr = pixel[0] - colour[0], dg = pixel[1] - colour[1], db = pixel[2] - colour[2];
+    total += dr * dr + dg * dg + db * db;
+    counted++;
+  }
+  return counted > 0 ? (double)total / counted : 0;
+}
+
+// GIF flavoured LZW with a minimum code size of 8, packed into 255 byte sub-blocks
+void LzwEncode(const vector<uint8_t> &indices, vector<uint8_t> &out) {
+  const int minCodeSize = 8, clearCode = 1 << minCodeSize;
+  vector<int32_t> hashKeys(GIF_HASH_SIZE, -1);
+  vector<int16_t> hashCodes(GIF_HASH_SIZE);
+  int codeSize = minCodeSize + 1, maxCode = clearCode + 1;
+
+  vector<uint8_t> bytes;
+  uint32_t bitBuffer = 0;
+  int bitCount = 0;
+  auto write = [&](int code) {
+    bitBuffer |= (uint32_t)code << bitCount;
+    bitCount += codeSize;
+    while (bitCount >= 8) {
+      bytes.push_back(bitBuffer & 0xFF);
+      bitBuffer >>= 8;
+      bitCount -= 8;
+    }
+  };
+
+  write(clearCode);
+  int current = indices.empty() ? -1 : indices[0];
+  for (size_t i = 1; i < indices.size(); i++) {
+    int next = indices[i];
+    int32_t key = (current << 8) | next;
+    int slot = key % GIF_HASH_SIZE;
+    while (hashKeys[slot] != -1 && hashKeys[slot] != key) slot = (slot + 1) % GIF_HASH_SIZE;
+    if (hashKeys[slot] == key) {
+      current = hashCodes[slot];
+      continue;
+    }
+
+    write(current);
+    hashKeys[slot] = key;
+    hashCodes[slot] = ++maxCode;
+    if (maxCode >= (1 << codeSize)) codeSize++;
+    if (maxCode == GIF_MAX_CODE) {
+      write(clearCode);
+      fill(hashKeys.begin(), hashKeys.end(), -1);
+      codeSize = minCodeSize + 1;
+      maxCode = clearCode + 1;
+    }
+    current = next;
+  }
+  if (current >= 0) {
+    write(current);
+    // decoders add a table entry for this code too, so EOI goes out at the width that leaves them at
+    if (maxCode + 1 >= (1 << codeSize)) codeSize++;
+  }
+  write(clearCode + 1);
+  if (bitCount > 0) bytes.push_back(bitBuffer & 0xFF);
+
+  out.push_back(minCodeSize);
+  for (size_t i = 0; i < bytes.size(); i += 255) {
+    size_t length = min((size_t)255, bytes.size() - i);
+    out.push_back(length);
+    out.insert(out.end(), bytes.begin() + i, bytes.begin() + i + length);
+  }
+  out.push_back(0);
+}
+
+static void WriteShort(vector<uint8_t> &out, int value) {
+  out.push_back(value & 0xFF);
+  out.push_back((value >> 8) & 0xFF);
+}
+
+static void WriteColourTable(vector<uint8_t> &out, const vector<Colour> &colours) {
+  for (int i = 0; i < 256; i++) {
+    const Colour &colour = i < (int)colours.size() ? colours[i] : Colour{0, 0, 0};
+    out.insert(out.end(), colour.begin(), colour.end());
+  }
+}
+
+bool WriteGif(VImage image, const ImageState &state, JobControl *job, char **buf, size_t *size) {
+  int width = image.width();
+  int nPages = vips_image_get_n_pages(image.get_image());
+  int pageHeight = vips_image_get_page_height(image.get_image());
+  if (nPages < 2 || width > 65535 || pageHeight > 65535) return false;
+
+  vector<int> delays;
+  if (vips_image_get_typeof(image.get_image(), "delay") != 0) delays = image.get_array_int("delay");
+  int loop = vips_image_get_typeof(image.get_image(), "loop") != 0 ? image.get_int("loop") : 0;
+
+  // run the command's pipeline once from top to bottom, sequential inputs can't be read in any other order
+  if (image.interpretation() != VIPS_INTERPRETATION_sRGB) image = image.colourspace(VIPS_INTERPRETATION_sRGB);
+  if (image.format() != VIPS_FORMAT_UCHAR) image = image.cast(VIPS_FORMAT_UCHAR);
+  if (image.bands() < 3) {
+    VImage grey = image.extract_band(0);
+    VImage colour = grey.bandjoin({grey, grey});
+    image = image.bands() == 2 ? colour.bandjoin(image.extract_band(1)) : colour;
+  }
+  if (image.bands() > 4) image = image.extract_band(0, VImage::option()->set("n", 4));
+  int bands = image.bands();
+  // every frame is held decoded at once here, the vips saver only needs one frame at a time
+  size_t maxMemory = state.indexed ? GIF_INDEXED_MAX_MEM : GIF_NATIVE_MAX_MEM;
+  if ((size_t)width * pageHeight * nPages * (bands + GIF_WORK_BYTES) > maxMemory) return false;
+  // frames that are in memory as they are already (e.g. decoded video) are read in place, anything else is rendered
+  const uint8_t *pixels = image.get_image()->data;
+  unique_ptr<uint8_t, void (*)(gpointer)> rendered(NULL, g_free);
+  if (pixels == NULL) {
+    SetupTimeoutCallback(image, job);
+    size_t memorySize;
+    rendered.reset((uint8_t *)image.write_to_memory(&memorySize));
+    pixels = rendered.get();
+    CheckJob(job);
+  }
+
+  size_t framePixels = (size_t)width * pageHeight;
+  vector<GifFrame> frames(nPages);
+  for (int i = 0; i < nPages; i++) frames[i].pixels = pixels + framePixels * bands * i;
+
+  // build the shared palette from a sample of the frames
+  Histogram5 histogram;
+  int sampleFrames = min(nPages, GIF_SAMPLE_FRAMES);
+  size_t step = max((size_t)1, framePixels * sampleFrames / GIF_SAMPLE_PIXELS);
+  for (int s = 0; s < sampleFrames; s++) {
+    GifFrame &frame = frames[(size_t)s * nPages / sampleFrames];
+    for (size_t i = 0; i < framePixels; i += step) {
+      const uint8_t *pixel = frame.pixels + i * bands;
+      if (bands == 4 && pixel[3] < 128) continue;
+      histogram.Add(pixel);
+    }
+  }
+  // one entry is always kept back for transparency
+  size_t maxColours = GIF_TRANSPARENT;
+  if (state.bitdepth > 0 && state.bitdepth < 8) maxColours = (size_t)1 << state.bitdepth;
+  Palette global(MedianCut(histogram, maxColours));
+
+  float dither = state.dither < 0 ? 1.0f : (float)state.dither;
+  int threads = GetThreadBudget().Share();
+
+  ParallelFor(nPages, threads, [&](int i) {
+    CheckJob(job);
+    GifFrame &frame = frames[i];
+    if (bands == 4) {
+      for (size_t p = 0; p < framePixels && !frame.transparent; p++) frame.transparent = frame.pixels[p * 4 + 3] < 128;
+    }
+    frame.error = PaletteError(frame, global, framePixels, bands);
+  });
+
+  // Some content (noise, gradients) never quantises well, so only frames that are much worse off than the typical
+  // one get a palette of their own
+  vector<double> errors;
+  for (const GifFrame &frame : frames) errors.push_back(frame.error);
+  nth_element(errors.begin(), errors.begin() + nPages / 2, errors.end());
+  double maxError = max((double)GIF_LOCAL_PALETTE_MSE, errors[nPages / 2] * 2);
+
+  ParallelFor(nPages, threads, [&](int i) {
+    CheckJob(job);
+    GifFrame &frame = frames[i];
+    Palette *palette = &global;
+    if (frame.error > maxError) {
+      Histogram5 local;
+      for (size_t p = 0; p < framePixels; p++) {
+        const uint8_t *pixel = frame.pixels + p * bands;
+        if (bands != 4 || pixel[3] >= 128) local.Add(pixel);
+      }
+      frame.local.reset(new Palette(MedianCut(local, maxColours)));
+      palette = frame.local.get();
+    }
+    MapFrame(frame, *palette, width, pageHeight, bands, dither);
+  });
+
+  // Pixels that look the same as what's on screen already (or no further off than maxError in any channel) are left
+  // transparent so they compress to almost nothing. That only works if the frame before stays on screen (it does
+  // unless this frame has transparency, see the disposal below) and both frames' indices mean the same colours.
+  // What's on screen depends on every frame before, so this goes one frame at a time.
+  int closeEnough = state.maxError > 0 ? (int)state.maxError : 0;
+  auto unchanged = [&](uint8_t index, uint8_t shown) {
+    if (index == shown) return true;
+    if (closeEnough == 0 || index == GIF_TRANSPARENT || shown == GIF_TRANSPARENT) return false;
+    const Colour &a = global.colours[index], &b = global.colours[shown];
+    return abs(a[0] - b[0]) <= closeEnough && abs(a[1] - b[1]) <= closeEnough && abs(a[2] - b[2]) <= closeEnough;
+  };
+  vector<uint8_t> shown;
+  for (int i = 0; i < nPages; i++) {
+    CheckJob(job);
+    GifFrame &frame = frames[i];
+    if (i > 0 && !frame.transparent && !frame.local && !frames[i - 1].local) {
+      for (size_t p = 0; p < framePixels; p++) {
+        if (unchanged(frame.indices[p], shown[p])) {
+          frame.indices[p] = GIF_TRANSPARENT;
+        } else {
+          shown[p] = frame.indices[p];
+        }
+      }
+      frame.diffed = true;
+    } else {
+      shown.assign(frame.indices.begin(), frame.indices.end());
+    }
+  }
+
+  ParallelFor(nPages, threads, [&](int i) {
+    CheckJob(job);
+    LzwEncode(frames[i].indices, frames[i].lzw);
+    vector<uint8_t>().swap(frames[i].indices);
+  });
+
+  vector<uint8_t> out;
+  size_t total = 13 + 768 + 19 + 1;
+  for (const GifFrame &frame : frames) total += 8 + 10 + (frame.local ? 768 : 0) + frame.lzw.size();
+  out.reserve(total);
+
+  const char *header = "GIF89a";
+  out.insert(out.end(), header, header + 6);
+  WriteShort(out, width);
+  WriteShort(out, pageHeight);
+  // global colour table with 256 entries, 8 bits per channel
+  out.push_back(0xF7);
+  out.push_back(0);
+  out.push_back(0);
+  WriteColourTable(out, global.colours);
+
+  // a loop of 1 means play once, which is what leaving out the NETSCAPE block does
+  if (loop != 1) {
+    const char *netscape = "\x21\xFF\x0BNETSCAPE2.0\x03\x01";
+    out.insert(out.end(), netscape, netscape + 16);
+    WriteShort(out, loop > 0 ? loop - 1 : 0);
+    out.push_back(0);
+  }
+
+  for (int i = 0; i < nPages; i++) {
+    const GifFrame &frame = frames[i];
+    int delay = i < (int)delays.size() ? (delays[i] + 5) / 10 : 10;
+    // Disposal happens after a frame is shown, so it's up to the next frame: one with transparent pixels needs the
+    // canvas cleared, otherwise this frame would show through. The first frame follows the last one when looping.
+    int disposal = frames[(i + 1) % nPages].transparent ? 2 : 1;
+    out.push_back(0x21);
+    out.push_back(0xF9);
+    out.push_back(4);
+    out.push_back((disposal << 2) | (frame.transparent || frame.diffed ? 1 : 0));
+    WriteShort(out, delay);
+    out.push_back(GIF_TRANSPARENT);
+    out.push_back(0);
+
+    out.push_back(0x2C);
+    WriteShort(out, 0);
+    WriteShort(out, 0);
+    WriteShort(out, width);
+    WriteShort(out, pageHeight);
+    out.push_back(frame.local ? 0x87 : 0);
+    if (frame.local) WriteColourTable(out, frame.local->colours);
+    out.insert(out.end(), frame.lzw.begin(), frame.lzw.end());
+    vector<uint8_t>().swap(frames[i].lzw);
+  }
+  out.push_back(0x3B);
+
+  *buf = (char *)g_malloc(out.size());
+  memcpy(*buf, out.data(), out.size());
+  *size = out.size();
+  return true;
+}
@@ -0,0 +1,528 @@
+#include <vips/vips8>
+
+#include "common.h"
+#include "gifindex.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace vips;
+
+// Checkpoints are kept every sqrt(frames) frames (but no closer than this), so both the checkpoints and a decoded
+// run between two of them stay at around sqrt(frames) canvases
+#define GIF_CHECKPOINT_MIN_INTERVAL 8
+// Runs of decoded frames kept around, two so reads that straddle a run boundary (e.g. a resize) don't thrash
+#define GIF_CACHED_RUNS 2
+// Palette index the rebuilt frames of DecimateGif use for pixels that stay as they were
+#define GIF_TRANSPARENT 255
+
+typedef array<uint8_t, 3> Colour;
+
+// Returns the offset just past the terminator of a run of data sub-blocks, 0 if the data ends before it
+static size_t SkipSubBlocks(const uint8_t *data, size_t length, size_t pos) {
+  while (pos < length) {
+    uint8_t size = data[pos++];
+    if (size == 0) return pos;
+    pos += size;
+  }
+  return 0;
+}
+
+bool ParseGif(const uint8_t *data, size_t length, GifIndex &index, JobControl *job) {
+  if (length < 13 || (memcmp(data, "GIF87a", 6) != 0 && memcmp(data, "GIF89a", 6) != 0)) return false;
+  index.width = data[6] | (data[7] << 8);
+  index.height = data[8] | (data[9] << 8);
+  index.palette = 0;
+  index.paletteSize = 0;
+  index.loopCount = -1;
+  index.loopStart = 0;
+  index.loopEnd = 0;
+  index.trailer = 0;
+  index.frames.clear();
+
+  size_t pos = 13;
+  if (data[10] & 0x80) {
+    index.palette = pos;
+    index.paletteSize = 2 << (data[10] & 0x07);
+    pos += 3 * index.paletteSize;
+  }
+  if (pos > length) return false;
+  index.headerEnd = pos;
+
+  // graphic control extensions apply to the next image descriptor
+  GifFrameInfo frame{};
+  frame.transparent = -1;
+  while (pos < length && data[pos] != 0x3B) {
+    CheckJob(job);
+    size_t blockStart = pos;
+    if (data[pos] == 0x21) {
+      if (pos + 2 > length) break;
+      uint8_t label = data[pos + 1];
+      pos += 2;
+      if (label == 0xF9 && pos + 5 <= length && data[pos] == 4) {
+        frame.control = blockStart;
+        frame.disposal = (data[pos + 1] >> 2) & 0x07;
+        frame.transparent = data[pos + 1] & 0x01 ? data[pos + 4] : -1;
+        frame.delay = data[pos + 2] | (data[pos + 3] << 8);
+      } else if (label == 0xFF && pos + 16 <= length && data[pos] == 11 &&
+                 memcmp(data + pos + 1, "NETSCAPE2.0", 11) == 0 && data[pos + 12] >= 3 && data[pos + 13] == 1) {
+        index.loopCount = data[pos + 14] | (data[pos + 15] << 8);
+        index.loopStart = blockStart;
+      }
+      pos = SkipSubBlocks(data, length, pos);
+      if (pos == 0) break;
+      if (index.loopStart == blockStart) index.loopEnd = pos;
+    } else if (data[pos] == 0x2C) {
+      if (pos + 10 > length) break;
+      frame.start = frame.control != 0 ? frame.control : blockStart;
+      frame.left = data[pos + 1] | (data[pos + 2] << 8);
+      frame.top = data[pos + 3] | (data[pos + 4] << 8);
+      frame.width = data[pos + 5] | (data[pos + 6] << 8);
+      frame.height = data[pos + 7] | (data[pos + 8] << 8);
+      uint8_t flags = data[pos + 9];
+      frame.interlaced = flags & 0x40;
+      pos += 10;
+      if (flags & 0x80) {
+        frame.palette = pos;
+        frame.paletteSize = 2 << (flags & 0x07);
+        pos += 3 * frame.paletteSize;
+      }
+      if (pos >= length) break;
+      frame.data = pos;
+      pos = SkipSubBlocks(data, length, pos + 1);
+      if (pos == 0) break;
+      frame.end = pos;
+      index.frames.push_back(frame);
+
+      frame = GifFrameInfo{};
+      frame.transparent = -1;
+    } else {
+      // anything else is garbage, decoders stop here as well
+      break;
+    }
+  }
+
+  if (pos < length && data[pos] == 0x3B) index.trailer = pos;
+
+  return index.width > 0 && index.height > 0 && !index.frames.empty();
+}
+
+void LzwDecode(const uint8_t *data, const GifFrameInfo &frame, vector<uint16_t> &out) {
+  size_t total = (size_t)frame.width * frame.height;
+  out.assign(total, GIF_SKIP_PIXEL);
+  int minCodeSize = data[frame.data];
+  if (minCodeSize < 1 || minCodeSize > 11) return;
+
+  // rows come out in pass order for interlaced frames
+  vector<int> rows(frame.height);
+  if (frame.interlaced) {
+    static const int starts[] = {0, 4, 2, 1};
+    static const int steps[] = {8, 8, 4, 2};
+    int r = 0;
+    for (int pass = 0; pass < 4; pass++) {
+      for (int y = starts[pass]; y < frame.height; y += steps[pass]) rows[r++] = y;
+    }
+  } else {
+    for (int y = 0; y < frame.height; y++) rows[y] = y;
+  }
+
+  int clearCode = 1 << minCodeSize;
+  int codeSize = minCodeSize + 1;
+  int next = clearCode + 2;
+  uint16_t prefix[4096];
+  uint8_t suffix[4096];
+  uint8_t stack[4097];
+  for (int i = 0; i < clearCode; i++) suffix[i] = i;
+
+  size_t pos = frame.data + 1;
+  size_t blockLeft = 0;
+  uint32_t bitBuffer = 0;
+  int bitCount = 0;
+  int prev = -1;
+  uint8_t first = 0;
+  size_t written = 0;
+  while (written < total) {
+    while (bitCount < codeSize) {
+      if (blockLeft == 0) {
+        if (pos >= frame.end) return;
+        blockLeft = data[pos++];
+        if (blockLeft == 0 || pos + blockLeft > frame.end) return;
+      }
+      bitBuffer |= (uint32_t)data[pos++] << bitCount;
+      bitCount += 8;
+      blockLeft--;
+    }
+    int code = bitBuffer & ((1 << codeSize) - 1);
+    bitBuffer >>= codeSize;
+    bitCount -= codeSize;
+
+    if (code == clearCode) {
+      codeSize = minCodeSize + 1;
+      next = clearCode + 2;
+      prev = -1;
+      continue;
+    }
+    if (code == clearCode + 1) return;
+
+    int top = 0;
+    int current = code;
+    if (prev == -1) {
+      if (code > clearCode) return;
+      stack[top++] = code;
+    } else {
+      if (code > next) return;
+      if (code == next) {
+        stack[top++] = first;
+        current = prev;
+      }
+      while (current > clearCode) {
+        stack[top++] = suffix[current];
+        current = prefix[current];
+      }
+      stack[top++] = current;
+      if (next < 4096) {
+        prefix[next] = prev;
+        suffix[next] = current;
+        next++;
+        if (next == (1 << codeSize) && codeSize < 12) codeSize++;
+      }
+    }
+    first = stack[top - 1];
+    prev = code;
+
+    while (top > 0 && written < total) {
+      size_t y = written / frame.width;
+      size_t x = written % frame.width;
+      out[rows[y] * frame.width + x] = stack[--top];
+      written++;
+    }
+  }
+}
+
+typedef vector<uint8_t> GifCanvas;
+
+// Composites frames onto an RGBA canvas the size of the logical screen, following each frame's disposal method
+class GifRenderer {
+public:
+  GifRenderer(const uint8_t *data, const GifIndex &index) : data(data), index(index) {}
+
+  GifCanvas Blank() const { return GifCanvas((size_t)index.width * index.height * 4, 0); }
+
+  // Draws frame i onto the canvas
+  void Draw(int i, GifCanvas &canvas) {
+    const GifFrameInfo &frame = index.frames[i];
+    LzwDecode(data, frame, pixels);
+    const uint8_t *palette = data + (frame.paletteSize > 0 ? frame.palette : index.palette);
+    int paletteSize = frame.paletteSize > 0 ? frame.paletteSize : index.paletteSize;
+    for (int y = 0; y < frame.height && frame.top + y < index.height; y++) {
+      for (int x = 0; x < frame.width && frame.left + x < index.width; x++) {
+        int colour = pixels[(size_t)y * frame.width + x];
+        if (colour == GIF_SKIP_PIXEL || colour == frame.transparent) continue;
+        uint8_t *dest = &canvas[((size_t)(frame.top + y) * index.width + frame.left + x) * 4];
+        if (colour < paletteSize) {
+          memcpy(dest, palette + colour * 3, 3);
+        } else {
+          memset(dest, 0, 3);
+        }
+        dest[3] = 255;
+      }
+    }
+  }
+
+  // Draws frame i and leaves the canvas ready for the next one, the frame as shown is copied to shown if given
+  void Step(int i, GifCanvas &canvas, GifCanvas *shown) {
+    const GifFrameInfo &frame = index.frames[i];
+    if (frame.disposal == 3) previous = canvas;
+    Draw(i, canvas);
+    if (shown != NULL) *shown = canvas;
+    if (frame.disposal == 2) {
+      for (int y = frame.top; y < min(frame.top + frame.height, index.height); y++) {
+        int left = min(frame.left, index.width);
+        int right = min(frame.left + frame.width, index.width);
+        memset(&canvas[((size_t)y * index.width + left) * 4], 0, (size_t)(right - left) * 4);
+      }
+    } else if (frame.disposal == 3) {
+      canvas.swap(previous);
+    }
+  }
+
+private:
+  const uint8_t *data;
+  const GifIndex &index;
+  // scratch space
+  vector<uint16_t> pixels;
+  GifCanvas previous;
+};
+
+/*
+  Decodes frames on demand for a vips image. Going through the animation once up front leaves a checkpoint (the
+  canvas right before a frame is drawn) every interval frames, after that any frame is rebuilt by decoding forward
+  from the checkpoint before it. Frames are decoded a run at a time, so going through the animation backwards (e.g.
+  for reverse) only decodes each frame twice in total.
+*/
+class GifDecoder {
+public:
+  GifDecoder(const char *data, size_t length, JobControl *job)
+    : bytes(data, data + length), job(job), renderer(bytes.data(), index) {}
+
+  bool Open() {
+    if (!ParseGif(bytes.data(), bytes.size(), index, job)) return false;
+    int nPages = index.frames.size();
+    interval = max(GIF_CHECKPOINT_MIN_INTERVAL, (int)ceil(sqrt((double)nPages)));
+
+    // the alpha band can only be left out if nothing is ever see-through
+    const GifFrameInfo &firstFrame = index.frames[0];
+    bool opaque = firstFrame.left == 0 && firstFrame.top == 0 && firstFrame.width >= index.width &&
+                  firstFrame.height >= index.height;
+    for (const GifFrameInfo &frame : index.frames) {
+      if (frame.transparent >= 0 || frame.disposal == 2) opaque = false;
+    }
+    bands = opaque ? 3 : 4;
+    return true;
+  }
+
+  // Fills a region of the image, which is every frame stacked on top of each other
+  void Fill(VipsRegion *out) {
+    lock_guard<mutex> guard(lock);
+    if (checkpoints.empty()) MakeCheckpoints();
+    VipsRect *rect = &out->valid;
+    for (int y = rect->top; y < rect->top + rect->height; y++) {
+      const uint8_t *canvas = Frame(y / index.height);
+      const uint8_t *in = canvas + ((size_t)(y % index.height) * index.width + rect->left) * 4;
+      uint8_t *dest = VIPS_REGION_ADDR(out, rect->left, y);
+      if (bands == 4) {
+        memcpy(dest, in, (size_t)rect->width * 4);
+      } else {
+        for (int x = 0; x < rect->width; x++) memcpy(dest + x * 3, in + x * 4, 3);
+      }
+    }
+  }
+
+  GifIndex index;
+  int bands;
+
+private:
+  struct Run {
+    int first = -1;
+    vector<GifCanvas> frames;
+    unsigned long used = 0;
+  };
+
+  void MakeCheckpoints() {
+    GifCanvas canvas = renderer.Blank();
+    for (int i = 0; i < (int)index.frames.size(); i++) {
+      CheckJob(job);
+      if (i % interval == 0) checkpoints.push_back(canvas);
+      renderer.Step(i, canvas, NULL);
+    }
+  }
+
+  const uint8_t *Frame(int page) {
+    Run *oldest = &runs[0];
+    for (Run &run : runs) {
+      if (run.first >= 0 && page >= run.first && page < run.first + (int)run.frames.size()) {
+        run.used = ++clock;
+        return run.frames[page - run.first].data();
+      }
+      if (run.used < oldest->used) oldest = &run;
+    }
+
+    int first = page / interval * interval;
+    int last = min(first + interval, (int)index.frames.size());
+    GifCanvas canvas = checkpoints[first / interval];
+    oldest->frames.resize(last - first);
+    for (int i = first; i < last; i++) {
+      CheckJob(job);
+      renderer.Step(i, canvas, &oldest->frames[i - first]);
+    }
+    oldest->first = first;
+    oldest->used = ++clock;
+    return oldest->frames[page - first].data();
+  }
+
+  vector<uint8_t> bytes;
+  JobControl *job;
+  // only used with the lock held
+  GifRenderer renderer;
+  int interval;
+  vector<GifCanvas> checkpoints;
+  Run runs[GIF_CACHED_RUNS];
+  unsigned long clock = 0;
+  mutex lock;
+};
+
+static void PutShort(vector<uint8_t> &out, int value) {
+  out.push_back(value & 0xFF);
+  out.push_back((value >> 8) & 0xFF);
+}
+
+// Appends a frame that turns the canvas before into after, with every colour kept exact. Fails if that needs more
+// than 255 colours or would have to make something transparent again.
+static bool AppendRebuiltFrame(vector<uint8_t> &out, const GifIndex &index, const GifCanvas &before,
+                               const GifCanvas &after, int delay) {
+  int left = index.width, top = index.height, right = 0, bottom = 0;
+  for (int y = 0; y < index.height; y++) {
+    for (int x = 0; x < index.width; x++) {
+      size_t offset = ((size_t)y * index.width + x) * 4;
+      if (memcmp(&before[offset], &after[offset], 4) == 0) continue;
+      left = min(left, x);
+      top = min(top, y);
+      right = max(right, x + 1);
+      bottom = max(bottom, y + 1);
+    }
+  }
+  // nothing changed, but the frame still has to be there for its delay
+  if (right == 0) {
+    left = top = 0;
+    right = bottom = 1;
+  }
+
+  vector<Colour> colours;
+  unordered_map<uint32_t, uint8_t> lookup;
+  vector<uint8_t> indices;
+  indices.reserve((size_t)(right - left) * (bottom - top));
+  for (int y = top; y < bottom; y++) {
+    for (int x = left; x < right; x++) {
+      size_t offset = ((size_t)y * index.width + x) * 4;
+      const uint8_t *pixel = &after[offset];
+      if (memcmp(&before[offset], pixel, 4) == 0) {
+        indices.push_back(GIF_TRANSPARENT);
+        continue;
+      }
+      if (pixel[3] == 0) return false;
+      uint32_t key = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+      auto found = lookup.find(key);
+      if (found == lookup.end()) {
+        if (colours.size() == GIF_TRANSPARENT) return false;
+        found = lookup.emplace(key, colours.size()).first;
+        colours.push_back({pixel[0], pixel[1], pixel[2]});
+      }
+      indices.push_back(found->second);
+    }
+  }
+
+  // graphic control extension: leave the frame in place, transparent pixels keep what's underneath
+  out.insert(out.end(), {0x21, 0xF9, 0x04, (1 << 2) | 0x01});
+  PutShort(out, delay);
+  out.insert(out.end(), {GIF_TRANSPARENT, 0x00});
+  // image descriptor with a full size local colour table
+  out.push_back(0x2C);
+  PutShort(out, left);
+  PutShort(out, top);
+  PutShort(out, right - left);
+  PutShort(out, bottom - top);
+  out.push_back(0x87);
+  for (int i = 0; i < 256; i++) {
+    Colour colour = i < (int)colours.size() ? colours[i] : Colour{0, 0, 0};
+    out.insert(out.end(), colour.begin(), colour.end());
+  }
+  LzwEncode(indices, out);
+  return true;
+}
+
+char *DecimateGif(const char *data, const GifIndex &index, int step, size_t &dataSize, JobControl *job) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+  int nPages = index.frames.size();
+
+  // frames that cover the whole screen without any transparency don't depend on anything drawn before them, if every
+  // kept frame is like that there's nothing to decode
+  bool independent = true;
+  for (int i = step; i < nPages; i += step) {
+    const GifFrameInfo &frame = index.frames[i];
+    if (frame.transparent >= 0 || frame.left != 0 || frame.top != 0 || frame.width < index.width ||
+        frame.height < index.height)
+      independent = false;
+  }
+
+  vector<uint8_t> out(bytes, bytes + index.headerEnd);
+  if (index.loopStart != 0) out.insert(out.end(), bytes + index.loopStart, bytes + index.loopEnd);
+
+  // the original animation, and the one being written, are played side by side. A kept frame is copied as it is if
+  // it comes out the same on top of what's left of the new one, otherwise it's replaced with the difference.
+  GifRenderer original(bytes, index);
+  GifRenderer decimated(bytes, index);
+  GifCanvas canvas, newCanvas, shown, candidate, next;
+  if (!independent) {
+    canvas = original.Blank();
+    newCanvas = original.Blank();
+  }
+  bool rebuilt = false;
+  for (int i = 0; i < nPages; i++) {
+    CheckJob(job);
+    const GifFrameInfo &frame = index.frames[i];
+    if (i % step != 0) {
+      if (!independent) original.Step(i, canvas, NULL);
+      continue;
+    }
+    if (!independent) {
+      original.Step(i, canvas, &shown);
+      next = newCanvas;
+      decimated.Step(i, next, &candidate);
+      if (candidate != shown) {
+        if (!AppendRebuiltFrame(out, index, newCanvas, shown, frame.delay)) return NULL;
+        newCanvas = shown;
+        rebuilt = true;
+        continue;
+      }
+      newCanvas.swap(next);
+    }
+    out.insert(out.end(), bytes + frame.start, bytes + frame.end);
+  }
+  out.push_back(0x3B);
+  // graphic control extensions need the 89a header
+  if (rebuilt) memcpy(out.data() + 3, "89a", 3);
+
+  dataSize = out.size();
+  char *buf = reinterpret_cast<char *>(malloc(dataSize));
+  memcpy(buf, out.data(), dataSize);
+  return buf;
+}
+
+static int GenerateFrames(VipsRegion *out, [[maybe_unused]] void *seq, void *a, [[maybe_unused]] void *b,
+                          [[maybe_unused]] gboolean *stop) {
+  try {
+    static_cast<GifDecoder *>(a)->Fill(out);
+  } catch (const std::exception &e) {
+    vips_error("gifindex", "%s", e.what());
+    return -1;
+  }
+  return 0;
+}
+
+static void CloseDecoder([[maybe_unused]] VipsImage *image, GifDecoder *decoder) { delete decoder; }
+
+VImage LoadIndexedGif(const char *data, size_t length, JobControl *job) {
+  GifDecoder *decoder = new GifDecoder(data, length, job);
+  if (!decoder->Open() || decoder->index.frames.size() < 2) {
+    delete decoder;
+    return VImage();
+  }
+  const GifIndex &index = decoder->index;
+  int nPages = index.frames.size();
+
+  VipsImage *image = vips_image_new();
+  g_signal_connect(image, "close", G_CALLBACK(CloseDecoder), decoder);
+  vips_image_init_fields(image, index.width, index.height * nPages, decoder->bands, VIPS_FORMAT_UCHAR,
+                         VIPS_CODING_NONE, VIPS_INTERPRETATION_sRGB, 1.0, 1.0);
+  if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_THINSTRIP, NULL) != 0 ||
+      vips_image_generate(image, NULL, GenerateFrames, NULL, decoder, NULL) != 0) {
+    g_object_unref(image);
+    throw VError();
+  }
+
+  VImage out(image);
+  vector<int> delays;
+  for (const GifFrameInfo &frame : index.frames) delays.push_back(frame.delay * 10);
+  out.set(VIPS_META_PAGE_HEIGHT, index.height);
+  out.set(VIPS_META_N_PAGES, nPages);
+  out.set("delay", delays);
+  // same as the vips loader: the number of times to play, 0 for forever
+  out.set("loop", index.loopCount < 0 ? 1 : index.loopCount == 0 ? 0 : index.loopCount + 1);
+  return out;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vips/vips8>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class JobControl;
+
+// Palette index LzwDecode gives pixels the data doesn't reach
+#define GIF_SKIP_PIXEL 0xFFFF
+
+// Where one frame lives in a GIF file, and what a decoder needs to know to draw it
+struct GifFrameInfo {
+  // Bytes that make up the frame, from its graphic control extension (if it has one) to the end of its image data
+  size_t start;
+  size_t end;
+  // Offset of the graphic control extension, 0 if the frame doesn't have one
+  size_t control;
+  // Offset of the LZW minimum code size byte, the image data sub-blocks follow it
+  size_t data;
+  // Offset and number of entries of the local colour table, 0 entries if the frame uses the global one
+  size_t palette;
+  int paletteSize;
+  int left;
+  int top;
+  int width;
+  int height;
+  bool interlaced;
+  int disposal;
+  // Palette index of transparent pixels, -1 if there aren't any
+  int transparent;
+  // In centiseconds, as stored in the file
+  int delay;
+};
+
+struct GifIndex {
+  // Logical screen size
+  int width;
+  int height;
+  // Offset of the first block after the logical screen descriptor and global colour table
+  size_t headerEnd;
+  size_t palette;
+  int paletteSize;
+  // NETSCAPE2.0 loop count as stored (0 loops forever), -1 if the file doesn't have the extension
+  int loopCount;
+  // Bytes of the NETSCAPE2.0 application extension, both 0 if there isn't one
+  size_t loopStart;
+  size_t loopEnd;
+  // Offset of the trailer byte, 0 if the file ends without one
+  size_t trailer;
+  std::vector<GifFrameInfo> frames;
+};
+
+// Walks the block structure of a GIF once, without copying or decoding anything. Returns false if it isn't a GIF we
+// can make sense of, a truncated frame at the end of the file is left out.
+bool ParseGif(const uint8_t *data, size_t length, GifIndex &index, JobControl *job);
+
+// Decodes a frame's LZW data into palette indices in display order. Pixels the data doesn't reach (truncated or
+// corrupt files) are left as GIF_SKIP_PIXEL.
+void LzwDecode(const uint8_t *data, const GifFrameInfo &frame, std::vector<uint16_t> &out);
+
+// Random access to the frames of an animated GIF without keeping all of them decoded, see gifindex.cc. Returns an
+// empty image if the data isn't an animation the index can handle, so callers can fall back to the vips loader.
+vips::VImage LoadIndexedGif(const char *data, size_t length, JobControl *job);
+
+// Keeps every step-th frame of a GIF. Frames are copied as they are wherever that still looks right without the
+// dropped ones, others are replaced by a frame with exactly the pixels they need. Returns NULL (a malloc'd buffer
+// otherwise) if a replacement frame can't be made exact.
+char *DecimateGif(const char *data, const GifIndex &index, int step, size_t &dataSize, JobControl *job);
+
+// GIF flavoured LZW with a minimum code size of 8, packed into 255 byte sub-blocks (see gif.cc)
+void LzwEncode(const std::vector<uint8_t> &indices, std::vector<uint8_t> &out);
+
+// Block level edits used by freeze (see freeze.cc), both return a malloc'd buffer. TrimGif cuts a GIF down to its
+// first frames by copying their blocks, without the loop extension so it plays once. SpliceGif copies the file with
+// size bytes at offset replaced by insert.
+char *TrimGif(const char *data, const GifIndex &index, size_t &dataSize, int frame);
+char *SpliceGif(const char *data, size_t length, size_t offset, size_t size, const char *insert, size_t insertSize,
+                size_t &dataSize);
@@ -5,27 +5,28 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Homebrew([[maybe_unused]] const string &type, string &outType, ArgumentMap arguments, bool *shouldKill) {
-  string caption = GetArgument<string>(arguments, "caption");
-  string basePath = GetArgument<string>(arguments, "basePath");
+ArgumentMap Homebrew([[maybe_unused]] const string &type, string &outType, const TextAssetParams &arguments,
+                     JobControl *job) {
+  const string &caption = arguments.caption;
+  const string &basePath = arguments.basePath;
 
   string assetPath = basePath + "assets/images/hbc.png";
-  VImage bg = VImage::new_from_file(assetPath.c_str());
+  VImage bg = LoadAsset(assetPath);
 
-  LoadFonts(basePath);
+  const FontRegistry &fonts = GetFonts(basePath);
   string escapedCaption = PangoEscape(caption);
   VImage text = VImage::text(("<span letter_spacing=\"-5120\" color=\"white\">" + escapedCaption + "</span>").c_str(),
                              VImage::option()
                                ->set("rgba", true)
                                ->set("align", VIPS_ALIGN_CENTRE)
                                ->set("font", "PF Square Sans Pro 96")
-                               ->set("fontfile", (basePath + "assets/fonts/hbc.ttf").c_str()));
+                               ->set("fontfile", fonts.File("hbc")));
 
   VImage out =
     bg.composite2(text, VIPS_BLEND_MODE_OVER,
                   VImage::option()->set("x", 400 - (text.width() / 2))->set("y", 300 - (text.height() / 2) - 8));
 
-  SetupTimeoutCallback(out, shouldKill);
+  SetupTimeoutCallback(out, job);
 
   char *buf;
   size_t dataSize = 0;
@@ -33,6 +34,7 @@ ArgumentMap Homebrew([[maybe_unused]] const string &type, string &outType, Argum
 
   ArgumentMap output;
   output["buf"] = buf;
+  output["free"] = g_free;
   output["size"] = dataSize;
 
   return output;
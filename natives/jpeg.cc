@@ -5,16 +5,26 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Jpeg(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                 ArgumentMap arguments, bool *shouldKill) {
-  int quality = GetArgumentWithFallback<int>(arguments, "quality", 1);
+static void FreeJpeg([[maybe_unused]] VipsImage *image, void *buf) { g_free(buf); }
 
-  char *buf;
-  size_t dataSize = 0;
+// Encodes in as a JPEG and decodes it again, the encoded bytes stay around for as long as the decoded image does
+static VImage RoundTrip(VImage in, int quality, void **buf, size_t *length) {
+  in.write_to_buffer(".jpg", buf, length, VImage::option()->set("Q", quality)->set("strip", true));
+  VImage out;
+  try {
+    out = VImage::new_from_buffer(*buf, *length, "");
+  } catch (...) {
+    g_free(*buf);
+    throw;
+  }
+  g_signal_connect(out.get_image(), "postclose", G_CALLBACK(FreeJpeg), *buf);
+  return out;
+}
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false));
+VImage Jpeg(VImage in, ImageState &state, const JpegParams &arguments, JobControl *job) {
+  int quality = arguments.quality;
 
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   if (nPages > 1) {
     int width = in.width();
@@ -24,46 +34,41 @@ ArgumentMap Jpeg(const string &type, string &outType, const char *bufferdata, si
     VImage final;
 
     if (totalHeight > 65500) {
-      vector<VImage> img;
-      img.reserve(nPages);  // Pre-allocate to avoid reallocations
-      for (int i = 0; i < nPages; i++) {
+      final = JoinFrames(in, nPages, job, [&](int i) {
         VImage img_frame = in.crop(0, i * pageHeight, width, pageHeight);
         void *jpgBuf;
         size_t jpgLength;
-        img_frame.write_to_buffer(".jpg", &jpgBuf, &jpgLength, VImage::option()->set("Q", quality)->set("strip", true));
-        VImage jpeged = VImage::new_from_buffer(jpgBuf, jpgLength, "");
+        VImage jpeged = RoundTrip(img_frame, quality, &jpgBuf, &jpgLength);
         jpeged.set(VIPS_META_PAGE_HEIGHT, pageHeight);
         jpeged.set("delay", in.get_array_int("delay"));
-        img.push_back(jpeged);
-      }
-      final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
+        return jpeged;
+      });
       final.set(VIPS_META_PAGE_HEIGHT, pageHeight);
     } else {
       void *jpgBuf;
       size_t jpgLength;
-      in.write_to_buffer(".jpg", &jpgBuf, &jpgLength, VImage::option()->set("Q", quality)->set("strip", true));
-      final = VImage::new_from_buffer(jpgBuf, jpgLength, "");
+      final = RoundTrip(in, quality, &jpgBuf, &jpgLength);
       final.set(VIPS_META_PAGE_HEIGHT, pageHeight);
       final.set("delay", in.get_array_int("delay"));
     }
 
-    final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                          outType == "gif" ? VImage::option()->set("dither", 0) : 0);
-  } else {
-    void *jpgBuf;
-    in.write_to_buffer(".jpg", &jpgBuf, &dataSize, VImage::option()->set("Q", quality)->set("strip", true));
-    if (outType == "gif") {
-      VImage gifIn = VImage::new_from_buffer(reinterpret_cast<char *>(jpgBuf), dataSize, "");
-      gifIn.write_to_buffer(".gif", reinterpret_cast<void **>(&buf), &dataSize, VImage::option()->set("strip", true));
-    } else {
-      outType = "jpg";
-      buf = reinterpret_cast<char *>(jpgBuf);
-    }
+    state.dither = 0;
+
+    return final;
   }
 
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  // The artifacts have to be baked in here in case another command runs after this one. If nothing does, the
+  // bytes are the result as they are, encoding them again would only lose more.
+  void *jpgBuf;
+  size_t jpgLength;
+  VImage final = RoundTrip(in, quality, &jpgBuf, &jpgLength);
+
+  if (state.outType != "gif") {
+    state.outType = "jpg";
+    state.quality = quality;
+    state.SetEncoded(final, (const char *)jpgBuf, jpgLength);
+  }
+  state.strip = true;
 
-  return output;
+  return final;
 }
@@ -11,7 +11,7 @@ using namespace std;
 using namespace Magick;
 
 ArgumentMap Magik([[maybe_unused]] const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                  [[maybe_unused]] ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
+                  [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   Blob blob;
 
   list<Image> frames;
@@ -27,6 +27,7 @@ ArgumentMap Magik([[maybe_unused]] const string &type, string &outType, const ch
   coalesceImages(&coalesced, frames.begin(), frames.end());
 
   for (Image &image : coalesced) {
+    CheckJob(job);
     image.scale(Geometry("350x350"));
     image.liquidRescale(Geometry("175x175"));
     image.liquidRescale(Geometry("350x350"));
@@ -38,6 +39,7 @@ ArgumentMap Magik([[maybe_unused]] const string &type, string &outType, const ch
 
   if (outType == "gif") {
     for (Image &image : blurred) {
+      CheckJob(job);
       image.quantizeDitherMethod(FloydSteinbergDitherMethod);
       image.quantize();
     }
@@ -52,6 +54,7 @@ ArgumentMap Magik([[maybe_unused]] const string &type, string &outType, const ch
 
   ArgumentMap output;
   output["buf"] = data;
+  output["free"] = free;
   output["size"] = dataSize;
 
   return output;
@@ -0,0 +1,1407 @@
+#include "media.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/display.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+using namespace std;
+
+#define MEDIA_IO_BUFFER 65536
+// Hard limits for a single job, a file that would go past them fails instead of taking the worker down
+#define MEDIA_MAX_OUTPUT (512 * 1024 * 1024)
+#define MEDIA_MAX_PIXELS (4096 * 4096)
+// How much of libav's log is kept to go with an error, in bytes
+#define MEDIA_LOG_TAIL 512
+
+// the write callback takes a const buffer from libavformat 61 on
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+typedef const uint8_t *WriteBuffer;
+#else
+typedef uint8_t *WriteBuffer;
+#endif
+
+static void Check(int ret, const char *what) {
+  if (ret >= 0) return;
+  char error[AV_ERROR_MAX_STRING_SIZE];
+  av_strerror(ret, error, sizeof(error));
+  throw MediaError(string(what) + ": " + error);
+}
+
+template <typename T> static T *Allocated(T *value) {
+  if (value == NULL) throw MediaError("Out of memory");
+  return value;
+}
+
+static int Interrupted(void *opaque) { return JobStopped(static_cast<JobControl *>(opaque)); }
+
+// The end of what libav logged on this thread while a job runs, the same thing the CLI used to leave on stderr
+static thread_local string *logTail = NULL;
+
+static void LogToTail(void *context, int level, const char *format, va_list args) {
+  if (level > av_log_get_level()) return;
+  // codec threads log too, those messages go to stderr as usual
+  if (logTail == NULL) return av_log_default_callback(context, level, format, args);
+  char line[1024];
+  int printPrefix = 1;
+  av_log_format_line2(context, level, format, args, line, sizeof(line), &printPrefix);
+  logTail->append(line);
+  if (logTail->size() > MEDIA_LOG_TAIL) logTail->erase(0, logTail->size() - MEDIA_LOG_TAIL);
+}
+
+// Collects the log tail for the job running on this thread, for as long as it's in scope
+class LogCapture {
+public:
+  LogCapture() {
+    static once_flag installed;
+    call_once(installed, []() {
+      // the CLI only showed its output when something went wrong
+      av_log_set_level(AV_LOG_ERROR);
+      av_log_set_callback(LogToTail);
+    });
+    logTail = &tail;
+  }
+  ~LogCapture() { logTail = NULL; }
+
+  // the error with the last thing libav said about it, if that says more
+  MediaError Annotate(const MediaError &error) const {
+    string detail = tail;
+    while (!detail.empty() && isspace((unsigned char)detail.back())) detail.pop_back();
+    size_t lastLine = detail.rfind('\n');
+    if (lastLine != string::npos) detail.erase(0, lastLine + 1);
+    if (detail.empty() || string(error.what()).find(detail) != string::npos) return error;
+    return MediaError(string(error.what()) + " (" + detail + ")");
+  }
+
+private:
+  string tail;
+};
+
+struct MemoryReader {
+  const uint8_t *data;
+  size_t length;
+  size_t pos;
+};
+
+static int ReadMemory(void *opaque, uint8_t *buf, int size) {
+  MemoryReader *reader = static_cast<MemoryReader *>(opaque);
+  size_t count = min(reader->length - reader->pos, (size_t)size);
+  if (count == 0) return AVERROR_EOF;
+  memcpy(buf, reader->data + reader->pos, count);
+  reader->pos += count;
+  return count;
+}
+
+static int64_t SeekMemory(void *opaque, int64_t offset, int whence) {
+  MemoryReader *reader = static_cast<MemoryReader *>(opaque);
+  if (whence & AVSEEK_SIZE) return reader->length;
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+      target = offset;
+      break;
+    case SEEK_CUR:
+      target = reader->pos + offset;
+      break;
+    case SEEK_END:
+      target = reader->length + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (target < 0 || target > (int64_t)reader->length) return AVERROR(EINVAL);
+  reader->pos = target;
+  return target;
+}
+
+// A growable malloc'd buffer, so the result can be handed on without another copy. Muxers seek back to patch
+// headers, so writes can land anywhere in it.
+struct MemoryWriter {
+  char *data = NULL;
+  size_t size = 0;
+  size_t capacity = 0;
+  size_t pos = 0;
+
+  ~MemoryWriter() { free(data); }
+};
+
+static int WriteMemory(void *opaque, WriteBuffer buf, int size) {
+  MemoryWriter *writer = static_cast<MemoryWriter *>(opaque);
+  size_t end = writer->pos + size;
+  if (end > MEDIA_MAX_OUTPUT) return AVERROR(EFBIG);
+  if (end > writer->capacity) {
+    size_t capacity = max(end, writer->capacity * 2 + MEDIA_IO_BUFFER);
+    char *data = static_cast<char *>(realloc(writer->data, capacity));
+    if (data == NULL) return AVERROR(ENOMEM);
+    writer->data = data;
+    writer->capacity = capacity;
+  }
+  if (writer->pos > writer->size) memset(writer->data + writer->size, 0, writer->pos - writer->size);
+  memcpy(writer->data + writer->pos, buf, size);
+  writer->pos = end;
+  writer->size = max(writer->size, end);
+  return size;
+}
+
+static int64_t SeekWriter(void *opaque, int64_t offset, int whence) {
+  MemoryWriter *writer = static_cast<MemoryWriter *>(opaque);
+  if (whence & AVSEEK_SIZE) return writer->size;
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+      target = offset;
+      break;
+    case SEEK_CUR:
+      target = writer->pos + offset;
+      break;
+    case SEEK_END:
+      target = writer->size + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (target < 0) return AVERROR(EINVAL);
+  writer->pos = target;
+  return target;
+}
+
+static AVIOContext *OpenMemoryIO(void *opaque, bool write) {
+  unsigned char *buffer = Allocated(static_cast<unsigned char *>(av_malloc(MEDIA_IO_BUFFER)));
+  AVIOContext *io = avio_alloc_context(buffer, MEDIA_IO_BUFFER, write, opaque, write ? NULL : ReadMemory,
+                                       write ? WriteMemory : NULL, write ? SeekWriter : SeekMemory);
+  if (io == NULL) {
+    av_free(buffer);
+    throw MediaError("Out of memory");
+  }
+  return io;
+}
+
+static void CloseMemoryIO(AVIOContext *&io) {
+  if (io == NULL) return;
+  av_freep(&io->buffer);
+  avio_context_free(&io);
+}
+
+// A demuxer over the input buffer, with decoders for its main video and audio streams
+class MediaInput {
+public:
+  ~MediaInput() {
+    avcodec_free_context(&video);
+    avcodec_free_context(&audio);
+    avformat_close_input(&format);
+    CloseMemoryIO(io);
+  }
+
+  void Open(const char *data, size_t length, JobControl *job) {
+    reader = {reinterpret_cast<const uint8_t *>(data), length, 0};
+    io = OpenMemoryIO(&reader, false);
+    format = Allocated(avformat_alloc_context());
+    format->pb = io;
+    format->flags |= AVFMT_FLAG_CUSTOM_IO;
+    format->interrupt_callback.callback = Interrupted;
+    format->interrupt_callback.opaque = job;
+    // frees the context if it fails
+    Check(avformat_open_input(&format, NULL, NULL, NULL), "Couldn't open input");
+    Check(avformat_find_stream_info(format, NULL), "Couldn't read stream info");
+
+    videoIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    // cover art of audio files isn't a video
+    if (videoIndex >= 0 && format->streams[videoIndex]->disposition & AV_DISPOSITION_ATTACHED_PIC) videoIndex = -1;
+    audioIndex = av_find_best_stream(format, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (videoIndex < 0) videoIndex = -1;
+    if (audioIndex < 0) audioIndex = -1;
+  }
+
+  AVCodecContext *OpenDecoder(int index) {
+    AVStream *stream = format->streams[index];
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (codec == NULL) throw MediaError(string("No decoder for ") + avcodec_get_name(stream->codecpar->codec_id));
+    AVCodecContext *&decoder = index == videoIndex ? video : audio;
+    decoder = Allocated(avcodec_alloc_context3(codec));
+    Check(avcodec_parameters_to_context(decoder, stream->codecpar), "Couldn't set up decoder");
+    decoder->pkt_timebase = stream->time_base;
+    // also stops frames from growing past it halfway through
+    decoder->max_pixels = MEDIA_MAX_PIXELS;
+    if (index == videoIndex && (int64_t)decoder->width * decoder->height > MEDIA_MAX_PIXELS) {
+      throw MediaError("Video is too large");
+    }
+    decoder->thread_count = GetThreadBudget().Share();
+    Check(avcodec_open2(decoder, codec, NULL), "Couldn't open decoder");
+    return decoder;
+  }
+
+  // Lands on the keyframe before, a file that can't seek just plays from the start
+  void Seek(double seconds) {
+    int64_t target = seconds * AV_TIME_BASE;
+    if (format->start_time != AV_NOPTS_VALUE) target += format->start_time;
+    avformat_seek_file(format, -1, INT64_MIN, target, target, 0);
+  }
+
+  // Timestamps are moved so the file starts at 0, like the CLI does. This is by how much in a stream's time base.
+  int64_t Offset(int index) {
+    if (format->start_time == AV_NOPTS_VALUE) return 0;
+    return av_rescale_q(format->start_time, AVRational{1, AV_TIME_BASE}, format->streams[index]->time_base);
+  }
+
+  AVFormatContext *format = NULL;
+  int videoIndex = -1;
+  int audioIndex = -1;
+  AVCodecContext *video = NULL;
+  AVCodecContext *audio = NULL;
+
+private:
+  MemoryReader reader;
+  AVIOContext *io = NULL;
+};
+
+// The matrix a video stream's frames should be turned by to show them (phones film sideways and say so here), NULL
+// if there isn't one. Side data moved from the stream to its codec parameters in libavcodec 60.30.
+static const int32_t *DisplayMatrix(const AVStream *stream) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 30, 100)
+  const AVPacketSideData *side = av_packet_side_data_get(
+    stream->codecpar->coded_side_data, stream->codecpar->nb_coded_side_data, AV_PKT_DATA_DISPLAYMATRIX);
+  if (side == NULL || side->size < 9 * sizeof(int32_t)) return NULL;
+  return reinterpret_cast<const int32_t *>(side->data);
+#else
+  size_t size = 0;
+  const uint8_t *data = av_stream_get_side_data(stream, AV_PKT_DATA_DISPLAYMATRIX, &size);
+  if (data == NULL || size < 9 * sizeof(int32_t)) return NULL;
+  return reinterpret_cast<const int32_t *>(data);
+#endif
+}
+
+// Clockwise rotation of a display matrix in degrees from 0 up to 360, worked out the same way as the CLI
+static double DisplayRotation(const int32_t *matrix) {
+  double theta = -round(av_display_rotation_get(matrix));
+  return theta - 360 * floor(theta / 360 + 0.9 / 360);
+}
+
+// Filters that show a video stream's frames the right way up, the same ones the CLI's autorotate inserts
+static vector<MediaFilter> DisplayFilters(const AVStream *stream) {
+  const int32_t *matrix = DisplayMatrix(stream);
+  if (matrix == NULL) return {};
+  double theta = DisplayRotation(matrix);
+  if (fabs(theta - 90) < 1) return {{"transpose", {{"dir", matrix[3] > 0 ? "cclock_flip" : "clock"}}}};
+  if (fabs(theta - 270) < 1) return {{"transpose", {{"dir", matrix[3] < 0 ? "clock_flip" : "cclock"}}}};
+  vector<MediaFilter> filters;
+  if (fabs(theta - 180) < 1) {
+    if (matrix[0] < 0) filters.push_back({"hflip", {}});
+    if (matrix[4] < 0) filters.push_back({"vflip", {}});
+  } else if (fabs(theta) > 1) {
+    filters.push_back({"rotate", {{"angle", to_string(theta * M_PI / 180)}}});
+  } else if (matrix[4] < 0) {
+    filters.push_back({"vflip", {}});
+  }
+  return filters;
+}
+
+// Whether DisplayFilters swaps the stream's width and height
+static bool DisplayTransposed(const AVStream *stream) {
+  const int32_t *matrix = DisplayMatrix(stream);
+  if (matrix == NULL) return false;
+  double theta = DisplayRotation(matrix);
+  return fabs(theta - 90) < 1 || fabs(theta - 270) < 1;
+}
+
+static MediaStreamInfo DescribeStream(AVFormatContext *format, int index) {
+  MediaStreamInfo info;
+  if (index < 0) return info;
+  AVStream *stream = format->streams[index];
+  AVCodecParameters *codecpar = stream->codecpar;
+  info.present = true;
+  info.codec = avcodec_get_name(codecpar->codec_id);
+  info.bitRate = codecpar->bit_rate;
+  // the size it's shown at
+  bool transposed = DisplayTransposed(stream);
+  info.width = transposed ? codecpar->height : codecpar->width;
+  info.height = transposed ? codecpar->width : codecpar->height;
+  if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) info.frameRate = av_q2d(stream->avg_frame_rate);
+  info.sampleRate = codecpar->sample_rate;
+  info.channels = codecpar->ch_layout.nb_channels;
+  return info;
+}
+
+bool ProbeMedia(const char *data, size_t length, MediaProbe &probe, JobControl *job) {
+  LogCapture log;
+  MediaInput input;
+  try {
+    input.Open(data, length, job);
+  } catch (const MediaError &) {
+    CheckJob(job);
+    return false;
+  }
+  AVFormatContext *format = input.format;
+  probe.container = format->iformat->name;
+  probe.duration = format->duration != AV_NOPTS_VALUE ? (double)format->duration / AV_TIME_BASE : 0;
+  probe.bitRate = format->bit_rate;
+  probe.video = DescribeStream(format, input.videoIndex);
+  probe.audio = DescribeStream(format, input.audioIndex);
+  if (input.videoIndex >= 0) {
+    AVStream *stream = format->streams[input.videoIndex];
+    int64_t offset = input.Offset(input.videoIndex);
+    int count = avformat_index_get_entries_count(stream);
+    for (int i = 0; i < count; i++) {
+      const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+      if (entry->flags & AVINDEX_KEYFRAME)
+        probe.keyframes.push_back((entry->timestamp - offset) * av_q2d(stream->time_base));
+    }
+  }
+  return true;
+}
+
+class MediaOutput {
+public:
+  ~MediaOutput() {
+    avformat_free_context(format);
+    CloseMemoryIO(io);
+  }
+
+  void Open(const string &extension) {
+    const AVOutputFormat *container = av_guess_format(NULL, ("output." + extension).c_str(), NULL);
+    if (container == NULL) throw MediaError("Unsupported output format " + extension);
+    Check(avformat_alloc_output_context2(&format, container, NULL, NULL), "Couldn't set up output");
+    io = OpenMemoryIO(&writer, true);
+    format->pb = io;
+    format->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  // The finished file, the caller frees it
+  char *Release(size_t &size) {
+    avio_flush(io);
+    char *data = writer.data;
+    size = writer.size;
+    writer.data = NULL;
+    return data;
+  }
+
+  AVFormatContext *format = NULL;
+
+private:
+  MemoryWriter writer;
+  AVIOContext *io = NULL;
+};
+
+static uint64_t ReadAtom(const uint8_t *data, size_t length, size_t pos, uint32_t &type, size_t &header) {
+  if (length - pos < 8) return 0;
+  uint64_t size = AV_RB32(data + pos);
+  type = AV_RB32(data + pos + 4);
+  header = 8;
+  if (size == 1) {
+    if (length - pos < 16) return 0;
+    size = AV_RB64(data + pos + 8);
+    header = 16;
+  } else if (size == 0) {
+    size = length - pos;
+  }
+  if (size < header || size > length - pos) return 0;
+  return size;
+}
+
+// Adds shift to every chunk offset in the sample tables below a moov atom's body
+bool ShiftChunkOffsets(uint8_t *data, size_t length, uint64_t shift) {
+  size_t pos = 0;
+  while (pos < length) {
+    uint32_t type;
+    size_t header;
+    uint64_t size = ReadAtom(data, length, pos, type, header);
+    if (size == 0) return false;
+    uint8_t *body = data + pos + header;
+    size_t bodySize = size - header;
+    if (type == MKBETAG('t', 'r', 'a', 'k') || type == MKBETAG('m', 'd', 'i', 'a') ||
+        type == MKBETAG('m', 'i', 'n', 'f') || type == MKBETAG('s', 't', 'b', 'l')) {
+      if (!ShiftChunkOffsets(body, bodySize, shift)) return false;
+    } else if (type == MKBETAG('s', 't', 'c', 'o') || type == MKBETAG('c', 'o', '6', '4')) {
+      size_t width = type == MKBETAG('s', 't', 'c', 'o') ? 4 : 8;
+      if (bodySize < 8) return false;
+      uint32_t count = AV_RB32(body + 4);
+      if ((bodySize - 8) / width < count) return false;
+      for (uint32_t i = 0; i < count; i++) {
+        uint8_t *entry = body + 8 + i * width;
+        if (width == 4) {
+          uint64_t offset = AV_RB32(entry) + shift;
+          if (offset > UINT32_MAX) return false;
+          AV_WB32(entry, offset);
+        } else {
+          AV_WB64(entry, AV_RB64(entry) + shift);
+        }
+      }
+    }
+    pos += size;
+  }
+  return true;
+}
+
+/*
+  Moves the moov atom in front of the media data so players can start before they have the whole file. The mov
+  muxer's faststart flag would do this, but it reopens the output by name to do it, which a memory buffer doesn't
+  have. Every chunk offset moves up by the size of moov. Leaves the file as it is if anything looks off.
+*/
+char *MoveMoovToFront(char *file, size_t length) {
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(file);
+  size_t mdat = SIZE_MAX;
+  size_t moov = SIZE_MAX;
+  uint64_t moovSize = 0;
+  for (size_t pos = 0; pos < length;) {
+    uint32_t type;
+    size_t header;
+    uint64_t size = ReadAtom(data, length, pos, type, header);
+    if (size == 0) return file;
+    if (type == MKBETAG('m', 'd', 'a', 't') && mdat == SIZE_MAX) mdat = pos;
+    if (type == MKBETAG('m', 'o', 'o', 'v')) {
+      moov = pos;
+      moovSize = size;
+    }
+    pos += size;
+  }
+  if (moov == SIZE_MAX || mdat == SIZE_MAX || moov < mdat) return file;
+
+  char *moved = static_cast<char *>(malloc(length));
+  if (moved == NULL) return file;
+  memcpy(moved, file, mdat);
+  memcpy(moved + mdat, file + moov, moovSize);
+  memcpy(moved + mdat + moovSize, file + mdat, moov - mdat);
+  memcpy(moved + mdat + moovSize + (moov - mdat), file + moov + moovSize, length - moov - moovSize);
+
+  uint32_t type;
+  size_t header;
+  ReadAtom(data, length, moov, type, header);
+  if (!ShiftChunkOffsets(reinterpret_cast<uint8_t *>(moved + mdat + header), moovSize - header, moovSize)) {
+    free(moved);
+    return file;
+  }
+  free(file);
+  return moved;
+}
+
+// H.264 and AAC wherever the container takes them, its own defaults otherwise (e.g. GIF or MP3)
+static const AVCodec *FindEncoder(const AVOutputFormat *container, AVMediaType type) {
+  bool video = type == AVMEDIA_TYPE_VIDEO;
+  AVCodecID preferred = video ? AV_CODEC_ID_H264 : AV_CODEC_ID_AAC;
+  AVCodecID id = preferred;
+  if (avformat_query_codec(container, preferred, FF_COMPLIANCE_NORMAL) != 1)
+    id = video ? container->video_codec : container->audio_codec;
+  const AVCodec *codec = id == AV_CODEC_ID_H264 ? avcodec_find_encoder_by_name("libx264") : NULL;
+  if (codec == NULL) codec = avcodec_find_encoder(id);
+  if (codec == NULL) throw MediaError(string("No encoder for ") + avcodec_get_name(id));
+  return codec;
+}
+
+// What an encoder accepts, NULL if anything goes. The lists moved behind avcodec_get_supported_config in 61.13.
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+static const void *Supported(const AVCodec *codec, AVCodecConfig config) {
+  const void *values = NULL;
+  if (avcodec_get_supported_config(NULL, codec, config, 0, &values, NULL) < 0) return NULL;
+  return values;
+}
+#define SUPPORTED(codec, config, field) Supported(codec, config)
+#else
+#define SUPPORTED(codec, config, field) (codec)->field
+#endif
+
+static string PixelFormats(const AVCodec *codec) {
+  const AVPixelFormat *formats =
+      static_cast<const AVPixelFormat *>(SUPPORTED(codec, AV_CODEC_CONFIG_PIX_FORMAT, pix_fmts));
+  if (formats == NULL) return "";
+  string list;
+  for (int i = 0; formats[i] != AV_PIX_FMT_NONE; i++) {
+    // what every player can show
+    if (formats[i] == AV_PIX_FMT_YUV420P) return "yuv420p";
+    list += (list.empty() ? "" : "|") + string(av_get_pix_fmt_name(formats[i]));
+  }
+  return list;
+}
+
+static string SampleFormats(const AVCodec *codec) {
+  const AVSampleFormat *formats =
+      static_cast<const AVSampleFormat *>(SUPPORTED(codec, AV_CODEC_CONFIG_SAMPLE_FORMAT, sample_fmts));
+  if (formats == NULL) return "";
+  string list;
+  for (int i = 0; formats[i] != AV_SAMPLE_FMT_NONE; i++)
+    list += (list.empty() ? "" : "|") + string(av_get_sample_fmt_name(formats[i]));
+  return list;
+}
+
+static string SampleRates(const AVCodec *codec) {
+  const int *rates =
+      static_cast<const int *>(SUPPORTED(codec, AV_CODEC_CONFIG_SAMPLE_RATE, supported_samplerates));
+  if (rates == NULL) return "";
+  string list;
+  for (int i = 0; rates[i] != 0; i++) list += (list.empty() ? "" : "|") + to_string(rates[i]);
+  return list;
+}
+
+static string Rational(AVRational value) { return to_string(value.num) + "/" + to_string(value.den); }
+
+struct FilterPad {
+  AVFilterContext *filter;
+  int pad;
+};
+
+class FilterGraph {
+public:
+  FilterGraph() : graph(Allocated(avfilter_graph_alloc())) { graph->nb_threads = GetThreadBudget().Share(); }
+  ~FilterGraph() { avfilter_graph_free(&graph); }
+
+  AVFilterContext *Add(const MediaFilter &filter) {
+    const AVFilter *type = avfilter_get_by_name(filter.name.c_str());
+    if (type == NULL) throw MediaError("Missing filter " + filter.name);
+    string name = filter.name + "@" + to_string(count++);
+    AVFilterContext *context = Allocated(avfilter_graph_alloc_filter(graph, type, name.c_str()));
+    for (const auto &option : filter.options) {
+      string what = "Invalid " + filter.name + " option " + option.first;
+      Check(av_opt_set(context, option.first.c_str(), option.second.c_str(), AV_OPT_SEARCH_CHILDREN), what.c_str());
+    }
+    Check(avfilter_init_str(context, NULL), ("Couldn't set up " + filter.name).c_str());
+    return context;
+  }
+
+  void Link(FilterPad from, AVFilterContext *to, int pad) {
+    Check(avfilter_link(from.filter, from.pad, to, pad), "Couldn't link filters");
+  }
+
+  FilterPad Chain(FilterPad from, const vector<MediaFilter> &filters) {
+    for (const MediaFilter &filter : filters) {
+      AVFilterContext *next = Add(filter);
+      Link(from, next, 0);
+      from = {next, 0};
+    }
+    return from;
+  }
+
+  void Configure() { Check(avfilter_graph_config(graph, NULL), "Couldn't set up filters"); }
+
+private:
+  AVFilterGraph *graph;
+  int count = 0;
+};
+
+// What a decoded frame's pixels or samples take up
+static size_t FrameBytes(const AVFrame *frame) {
+  if (frame->nb_samples > 0) {
+    return (size_t)frame->nb_samples * frame->ch_layout.nb_channels *
+           av_get_bytes_per_sample(static_cast<AVSampleFormat>(frame->format));
+  }
+  int size = av_image_get_buffer_size(static_cast<AVPixelFormat>(frame->format), frame->width, frame->height, 1);
+  return max(size, 0);
+}
+
+// buffer source for the decoded frames of an input's video stream
+static MediaFilter VideoSource(MediaInput &input) {
+  AVCodecContext *decoder = input.video;
+  if (decoder->pix_fmt == AV_PIX_FMT_NONE) throw MediaError("Unknown pixel format");
+  AVStream *stream = input.format->streams[input.videoIndex];
+  MediaFilter source = {"buffer",
+                        {{"video_size", to_string(decoder->width) + "x" + to_string(decoder->height)},
+                         {"pix_fmt", av_get_pix_fmt_name(decoder->pix_fmt)},
+                         {"time_base", Rational(stream->time_base)},
+                         {"pixel_aspect", Rational(decoder->sample_aspect_ratio)}}};
+  if (stream->avg_frame_rate.num > 0) source.options.push_back({"frame_rate", Rational(stream->avg_frame_rate)});
+  return source;
+}
+
+// A filter graph sink and the encoder it feeds
+struct MediaTrack {
+  AVFilterContext *sink = NULL;
+  AVCodecContext *encoder = NULL;
+  AVStream *stream = NULL;
+  bool finished = false;
+};
+
+// Packets of one stream copied from every input in turn
+struct CopiedTrack {
+  AVStream *stream = NULL;
+  // per input, video can only start on a keyframe and a cut ends the stream early
+  bool started = false;
+  bool finished = false;
+};
+
+class Transcoder {
+public:
+  ~Transcoder() {
+    av_packet_free(&packet);
+    av_packet_free(&encoded);
+    av_frame_free(&decoded);
+    av_frame_free(&filtered);
+    av_frame_free(&processed);
+    av_frame_free(&palette);
+    avcodec_free_context(&video.encoder);
+    avcodec_free_context(&audio.encoder);
+  }
+
+  void Run(const MediaJob &media, JobControl *job);
+  char *Release(size_t &size);
+
+private:
+  void BuildGraph(const MediaJob &media, const AVCodec *videoCodec, const AVCodec *audioCodec);
+  void OpenEncoder(MediaTrack &track, const AVCodec *codec);
+  void Decode(AVCodecContext *decoder, AVPacket *input, AVFilterContext *source, int64_t offset);
+  vector<MediaFilter> CutFilters(const char *trim, const char *setpts);
+  void Drain();
+  void Encode(MediaTrack &track, AVFrame *frame);
+  bool CanCopy(int MediaInput::*index);
+  void OpenCopy(CopiedTrack &track, int MediaInput::*index);
+  void Copy(CopiedTrack &track, MediaInput &input, int index);
+  void PushOverlay(AVFilterContext *source, const MediaOverlay &overlay);
+  void PushPalette();
+  void EncoderChain(FilterGraph &target, FilterPad end, const AVCodec *videoCodec);
+  void BuildProcessedGraph(const MediaJob &media, const AVCodec *videoCodec);
+  void PullBatch();
+  void ProcessBatch();
+  void ReadInputs(JobControl *job);
+
+  vector<unique_ptr<MediaInput>> inputs;
+  MediaOutput output;
+  unique_ptr<FilterGraph> graph;
+  vector<AVFilterContext *> videoSources;
+  vector<AVFilterContext *> audioSources;
+  vector<AVFilterContext *> overlaySources;
+  // With a frame processor, video leaves the graph at batchSink and comes back in at processedSource
+  AVFilterContext *batchSink = NULL;
+  unique_ptr<FilterGraph> processedGraph;
+  AVFilterContext *processedSource = NULL;
+  FrameProcessor process;
+  size_t batchFrames = 1;
+  VideoFrames batch;
+  vector<int64_t> batchPts;
+  AVRational batchTimeBase = {1, AV_TIME_BASE};
+  int defaultDelay = 100;
+  int processedWidth = 0;
+  int processedHeight = 0;
+  bool batchFinished = false;
+  MediaTrack video;
+  MediaTrack audio;
+  CopiedTrack copiedVideo;
+  CopiedTrack copiedAudio;
+  // The cut in AV_TIME_BASE units, 0 and INT64_MAX for all of it
+  int64_t cutStart = 0;
+  int64_t cutDuration = INT64_MAX;
+  // Where the current input starts in the copied output and where it ends so far, also in AV_TIME_BASE units
+  int64_t inputStart = 0;
+  int64_t inputEnd = 0;
+  // decoded bytes so far, against the job's maxBuffered
+  size_t maxBuffered = 0;
+  size_t buffered = 0;
+  AVPacket *packet = NULL;
+  AVPacket *encoded = NULL;
+  AVFrame *decoded = NULL;
+  AVFrame *filtered = NULL;
+  AVFrame *processed = NULL;
+  // GIFs are encoded in two passes like the CLI does it. The first only runs palettegen and keeps its one frame here,
+  // the second maps the frames to it as they come, so neither has to hold on to the whole clip.
+  bool palettePass = false;
+  AVFrame *palette = NULL;
+  AVFilterContext *paletteSource = NULL;
+};
+
+// trim (or atrim) for the job's cut, with timestamps starting at 0 again after it
+vector<MediaFilter> Transcoder::CutFilters(const char *trim, const char *setpts) {
+  MediaFilter cut = {trim, {{"start", to_string(cutStart) + "us"}}};
+  if (cutDuration != INT64_MAX) cut.options.push_back({"duration", to_string(cutDuration) + "us"});
+  return {cut, {setpts, {{"expr", "PTS-STARTPTS"}}}};
+}
+
+void Transcoder::BuildGraph(const MediaJob &media, const AVCodec *videoCodec, const AVCodec *audioCodec) {
+  graph.reset(new FilterGraph());
+  size_t count = inputs.size();
+  videoSources.assign(count, NULL);
+  audioSources.assign(count, NULL);
+  vector<FilterPad> videoEnds;
+  vector<FilterPad> audioEnds;
+  // the first input's size once it's the right way up
+  int width = 0, height = 0;
+  for (size_t i = 0; i < count; i++) {
+    MediaInput &input = *inputs[i];
+    if (videoCodec) {
+      input.OpenDecoder(input.videoIndex);
+      AVStream *stream = input.format->streams[input.videoIndex];
+      videoSources[i] = graph->Add(VideoSource(input));
+      FilterPad end = graph->Chain({videoSources[i], 0}, DisplayFilters(stream));
+      if (i == 0) {
+        bool transposed = DisplayTransposed(stream);
+        width = transposed ? input.video->height : input.video->width;
+        height = transposed ? input.video->width : input.video->height;
+      }
+      // concat needs every part at the same size
+      if (count > 1) {
+        end = graph->Chain(
+          end, {{"scale", {{"w", to_string(width)}, {"h", to_string(height)}}}, {"setsar", {{"sar", "1"}}}});
+      }
+      videoEnds.push_back(end);
+    }
+    if (audioCodec) {
+      AVCodecContext *decoder = input.OpenDecoder(input.audioIndex);
+      if (decoder->sample_fmt == AV_SAMPLE_FMT_NONE) throw MediaError("Unknown sample format");
+      AVChannelLayout layout = {};
+      if (decoder->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_default(&layout, decoder->ch_layout.nb_channels);
+      } else {
+        Check(av_channel_layout_copy(&layout, &decoder->ch_layout), "Couldn't read channel layout");
+      }
+      char description[128];
+      int described = av_channel_layout_describe(&layout, description, sizeof(description));
+      av_channel_layout_uninit(&layout);
+      Check(described, "Couldn't read channel layout");
+      // frames keep the stream's timestamps, which aren't in samples for most containers (WebM and MKV count ms)
+      audioSources[i] = graph->Add({"abuffer",
+                                    {{"time_base", Rational(input.format->streams[input.audioIndex]->time_base)},
+                                     {"sample_rate", to_string(decoder->sample_rate)},
+                                     {"sample_fmt", av_get_sample_fmt_name(decoder->sample_fmt)},
+                                     {"channel_layout", description}}});
+      FilterPad end = {audioSources[i], 0};
+      if (count > 1) {
+        end = graph->Chain(end, {{"aformat",
+                                  {{"sample_fmts", "fltp"},
+                                   {"sample_rates", to_string(inputs[0]->audio->sample_rate)},
+                                   {"channel_layouts", "stereo"}}}});
+      }
+      audioEnds.push_back(end);
+    }
+  }
+
+  FilterPad videoOut = {NULL, 0};
+  FilterPad audioOut = {NULL, 0};
+  if (count == 1) {
+    if (videoCodec) videoOut = videoEnds[0];
+    if (audioCodec) audioOut = audioEnds[0];
+  } else {
+    // parts go in as video then audio for each input, and come out in the same order
+    int perInput = (videoCodec ? 1 : 0) + (audioCodec ? 1 : 0);
+    AVFilterContext *concat = graph->Add({"concat",
+                                          {{"n", to_string(count)},
+                                           {"v", videoCodec ? "1" : "0"},
+                                           {"a", audioCodec ? "1" : "0"}}});
+    for (size_t i = 0; i < count; i++) {
+      if (videoCodec) graph->Link(videoEnds[i], concat, i * perInput);
+      if (audioCodec) graph->Link(audioEnds[i], concat, i * perInput + (videoCodec ? 1 : 0));
+    }
+    if (videoCodec) videoOut = {concat, 0};
+    if (audioCodec) audioOut = {concat, videoCodec ? 1 : 0};
+  }
+
+  if (videoCodec) {
+    if (cutStart > 0 || cutDuration != INT64_MAX) videoOut = graph->Chain(videoOut, CutFilters("trim", "setpts"));
+    FilterPad end = graph->Chain(videoOut, media.videoFilters);
+    for (const MediaOverlay &overlay : media.overlays) {
+      overlaySources.push_back(graph->Add({"buffer",
+                                           {{"video_size", to_string(overlay.width) + "x" + to_string(overlay.height)},
+                                            {"pix_fmt", "rgba"},
+                                            {"time_base", "1/" + to_string(AV_TIME_BASE)}}}));
+      // the one frame stays up for the whole clip, the position is worked out once
+      AVFilterContext *blend = graph->Add({"overlay",
+                                           {{"x", overlay.x},
+                                            {"y", overlay.y},
+                                            {"eval", "init"},
+                                            {"eof_action", "repeat"},
+                                            {"format", "auto"}}});
+      graph->Link(end, blend, 0);
+      graph->Link({overlaySources.back(), 0}, blend, 1);
+      end = {blend, 0};
+    }
+    if (media.frames) {
+      end = graph->Chain(end, {{"format", {{"pix_fmts", "rgb24"}}}});
+      batchSink = graph->Add({"buffersink", {}});
+      graph->Link(end, batchSink, 0);
+    } else {
+      EncoderChain(*graph, end, videoCodec);
+    }
+  }
+
+  if (audioCodec) {
+    if (cutStart > 0 || cutDuration != INT64_MAX) audioOut = graph->Chain(audioOut, CutFilters("atrim", "asetpts"));
+    FilterPad end = graph->Chain(audioOut, media.audioFilters);
+    MediaFilter format = {"aformat", {{"channel_layouts", "mono|stereo"}}};
+    string formats = SampleFormats(audioCodec);
+    if (!formats.empty()) format.options.push_back({"sample_fmts", formats});
+    string rates = SampleRates(audioCodec);
+    if (!rates.empty()) format.options.push_back({"sample_rates", rates});
+    end = graph->Chain(end, {format});
+    audio.sink = graph->Add({"abuffersink", {}});
+    graph->Link(end, audio.sink, 0);
+  }
+
+  graph->Configure();
+  for (size_t i = 0; i < overlaySources.size(); i++) PushOverlay(overlaySources[i], media.overlays[i]);
+  if (batchSink) BuildProcessedGraph(media, videoCodec);
+  if (paletteSource) PushPalette();
+}
+
+// The end of the video graph, from filtered frames to what the encoder takes
+void Transcoder::EncoderChain(FilterGraph &target, FilterPad end, const AVCodec *videoCodec) {
+  if (videoCodec->id == AV_CODEC_ID_GIF && palettePass) {
+    // one palette for the whole clip, palettegen only outputs once it has seen every frame
+    end = target.Chain(end, {{"palettegen", {}}});
+  } else if (videoCodec->id == AV_CODEC_ID_GIF) {
+    paletteSource = target.Add({"buffer",
+                                {{"video_size", to_string(palette->width) + "x" + to_string(palette->height)},
+                                 {"pix_fmt", av_get_pix_fmt_name(static_cast<AVPixelFormat>(palette->format))},
+                                 {"time_base", "1/" + to_string(AV_TIME_BASE)}}});
+    AVFilterContext *paletteuse = target.Add({"paletteuse", {}});
+    target.Link(end, paletteuse, 0);
+    target.Link({paletteSource, 0}, paletteuse, 1);
+    end = {paletteuse, 0};
+  } else {
+    // 4:2:0 needs even sizes
+    end = target.Chain(end, {{"scale", {{"w", "trunc(iw/2)*2"}, {"h", "trunc(ih/2)*2"}}}});
+    string formats = PixelFormats(videoCodec);
+    if (!formats.empty()) end = target.Chain(end, {{"format", {{"pix_fmts", formats}}}});
+  }
+  video.sink = target.Add({"buffersink", {}});
+  target.Link(end, video.sink, 0);
+}
+
+// Processed batches go into a graph of their own on the way to the encoder. The encoder has to be opened before
+// anything is decoded, so the size they come out at is found with a dry run on a black frame.
+void Transcoder::BuildProcessedGraph(const MediaJob &media, const AVCodec *videoCodec) {
+  process = media.frames;
+  batchFrames = max<size_t>(1, media.batchFrames);
+  batchTimeBase = av_buffersink_get_time_base(batchSink);
+  AVRational rate = av_buffersink_get_frame_rate(batchSink);
+  defaultDelay = rate.num > 0 ? (int)av_rescale(1000, rate.den, rate.num) : 100;
+
+  VideoFrames dryRun;
+  dryRun.width = av_buffersink_get_w(batchSink);
+  dryRun.height = av_buffersink_get_h(batchSink);
+  dryRun.pixels.assign((size_t)dryRun.width * dryRun.height * 3, 0);
+  dryRun.delays = {defaultDelay};
+  process(dryRun);
+  if (dryRun.pixels.size() != (size_t)dryRun.width * dryRun.height * 3) {
+    throw MediaError("Processed frame doesn't match its size");
+  }
+  processedWidth = dryRun.width;
+  processedHeight = dryRun.height;
+
+  processedGraph.reset(new FilterGraph());
+  MediaFilter source = {"buffer",
+                        {{"video_size", to_string(processedWidth) + "x" + to_string(processedHeight)},
+                         {"pix_fmt", "rgb24"},
+                         {"time_base", Rational(batchTimeBase)},
+                         {"pixel_aspect", Rational(av_buffersink_get_sample_aspect_ratio(batchSink))}}};
+  if (rate.num > 0) source.options.push_back({"frame_rate", Rational(rate)});
+  processedSource = processedGraph->Add(source);
+  EncoderChain(*processedGraph, {processedSource, 0}, videoCodec);
+  processedGraph->Configure();
+}
+
+// Moves frames out of the first graph into the batch, which goes through the processor once it's full
+void Transcoder::PullBatch() {
+  while (true) {
+    int ret = av_buffersink_get_frame(batchSink, filtered);
+    if (ret == AVERROR(EAGAIN)) return;
+    if (ret == AVERROR_EOF) {
+      ProcessBatch();
+      Check(av_buffersrc_add_frame(processedSource, NULL), "Couldn't filter frame");
+      batchFinished = true;
+      return;
+    }
+    Check(ret, "Couldn't filter frame");
+    if (batchPts.empty()) {
+      batch.width = filtered->width;
+      batch.height = filtered->height;
+    } else if (filtered->width != batch.width || filtered->height != batch.height) {
+      av_frame_unref(filtered);
+      throw MediaError("Frame size changed partway through the video");
+    }
+    size_t rowSize = (size_t)batch.width * 3;
+    size_t offset = batch.pixels.size();
+    batch.pixels.resize(offset + rowSize * batch.height);
+    for (int y = 0; y < batch.height; y++)
+      memcpy(batch.pixels.data() + offset + y * rowSize, filtered->data[0] + y * filtered->linesize[0], rowSize);
+    batchPts.push_back(filtered->pts);
+    av_frame_unref(filtered);
+    if (batchPts.size() >= batchFrames) ProcessBatch();
+  }
+}
+
+void Transcoder::ProcessBatch() {
+  size_t count = batchPts.size();
+  if (count == 0) return;
+  // a frame lasts until the next one starts, the last one as long as the frame rate says
+  batch.delays.assign(count, defaultDelay);
+  for (size_t i = 0; i + 1 < count; i++) {
+    if (batchPts[i] != AV_NOPTS_VALUE && batchPts[i + 1] != AV_NOPTS_VALUE)
+      batch.delays[i] = max(1, (int)av_rescale_q(batchPts[i + 1] - batchPts[i], batchTimeBase, AVRational{1, 1000}));
+  }
+  process(batch);
+  size_t rowSize = (size_t)processedWidth * 3;
+  if (batch.width != processedWidth || batch.height != processedHeight ||
+      batch.pixels.size() != rowSize * processedHeight * count)
+    throw MediaError("Processed frames don't match the first batch");
+
+  for (size_t i = 0; i < count; i++) {
+    processed->width = processedWidth;
+    processed->height = processedHeight;
+    processed->format = AV_PIX_FMT_RGB24;
+    Check(av_frame_get_buffer(processed, 0), "Couldn't filter frame");
+    const uint8_t *frame = batch.pixels.data() + i * rowSize * processedHeight;
+    for (int y = 0; y < processedHeight; y++)
+      memcpy(processed->data[0] + y * processed->linesize[0], frame + y * rowSize, rowSize);
+    processed->pts = batchPts[i];
+    // takes the frame's buffer, which leaves it ready for the next one
+    Check(av_buffersrc_add_frame(processedSource, processed), "Couldn't filter frame");
+  }
+  batch.pixels.clear();
+  batchPts.clear();
+}
+
+// an overlay's only frame at the start of the clip, then the end of its input
+void Transcoder::PushOverlay(AVFilterContext *source, const MediaOverlay &overlay) {
+  if (overlay.pixels.size() < (size_t)overlay.width * overlay.height * 4) throw MediaError("Overlay is too small");
+  AVFrame *frame = Allocated(av_frame_alloc());
+  frame->width = overlay.width;
+  frame->height = overlay.height;
+  frame->format = AV_PIX_FMT_RGBA;
+  frame->pts = 0;
+  int ret = av_frame_get_buffer(frame, 0);
+  if (ret >= 0) {
+    for (int row = 0; row < overlay.height; row++) {
+      memcpy(frame->data[0] + (size_t)row * frame->linesize[0], overlay.pixels.data() + (size_t)row * overlay.width * 4,
+             overlay.width * 4);
+    }
+    ret = av_buffersrc_add_frame(source, frame);
+  }
+  av_frame_free(&frame);
+  Check(ret, "Couldn't filter overlay");
+  Check(av_buffersrc_add_frame(source, NULL), "Couldn't filter overlay");
+}
+
+// the first pass's palette at the start of the clip, paletteuse keeps using it after the end of its input
+void Transcoder::PushPalette() {
+  palette->pts = 0;
+  Check(av_buffersrc_add_frame(paletteSource, palette), "Couldn't filter palette");
+  Check(av_buffersrc_add_frame(paletteSource, NULL), "Couldn't filter palette");
+}
+
+void Transcoder::OpenEncoder(MediaTrack &track, const AVCodec *codec) {
+  track.encoder = Allocated(avcodec_alloc_context3(codec));
+  AVCodecContext *encoder = track.encoder;
+  AVDictionary *options = NULL;
+  if (codec->type == AVMEDIA_TYPE_VIDEO) {
+    encoder->width = av_buffersink_get_w(track.sink);
+    encoder->height = av_buffersink_get_h(track.sink);
+    encoder->pix_fmt = static_cast<AVPixelFormat>(av_buffersink_get_format(track.sink));
+    encoder->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(track.sink);
+    encoder->time_base = av_buffersink_get_time_base(track.sink);
+    AVRational rate = av_buffersink_get_frame_rate(track.sink);
+    if (rate.num > 0) encoder->framerate = rate;
+    // same as the ffmpeg CLI was run with, libx264 ignores anything it doesn't know and other encoders ignore these
+    av_dict_set(&options, "preset", "fast", 0);
+    av_dict_set(&options, "crf", "23", 0);
+  } else {
+    encoder->sample_rate = av_buffersink_get_sample_rate(track.sink);
+    encoder->sample_fmt = static_cast<AVSampleFormat>(av_buffersink_get_format(track.sink));
+    Check(av_buffersink_get_ch_layout(track.sink, &encoder->ch_layout), "Couldn't read channel layout");
+    encoder->time_base = {1, encoder->sample_rate};
+    if (codec->id == AV_CODEC_ID_MP3) {
+      // VBR quality 2
+      encoder->flags |= AV_CODEC_FLAG_QSCALE;
+      encoder->global_quality = FF_QP2LAMBDA * 2;
+    } else {
+      encoder->bit_rate = 128000;
+    }
+  }
+  encoder->thread_count = GetThreadBudget().Share();
+  if (output.format->oformat->flags & AVFMT_GLOBALHEADER) encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  int ret = avcodec_open2(encoder, codec, &options);
+  av_dict_free(&options);
+  Check(ret, "Couldn't open encoder");
+
+  track.stream = Allocated(avformat_new_stream(output.format, NULL));
+  Check(avcodec_parameters_from_context(track.stream->codecpar, encoder), "Couldn't set up output stream");
+  track.stream->time_base = encoder->time_base;
+  if (codec->type == AVMEDIA_TYPE_AUDIO && !(codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) &&
+      encoder->frame_size > 0)
+    av_buffersink_set_frame_size(track.sink, encoder->frame_size);
+}
+
+void Transcoder::Encode(MediaTrack &track, AVFrame *frame) {
+  Check(avcodec_send_frame(track.encoder, frame), "Couldn't encode frame");
+  while (true) {
+    int ret = avcodec_receive_packet(track.encoder, encoded);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return;
+    Check(ret, "Couldn't encode frame");
+    av_packet_rescale_ts(encoded, track.encoder->time_base, track.stream->time_base);
+    encoded->stream_index = track.stream->index;
+    Check(av_interleaved_write_frame(output.format, encoded), "Couldn't write output");
+  }
+}
+
+// Encodes whatever the filters have ready, and flushes an encoder once its sink has seen the end of every input
+void Transcoder::Drain() {
+  if (batchSink && !batchFinished) PullBatch();
+  for (MediaTrack *track : {&video, &audio}) {
+    if (track->sink == NULL || track->finished) continue;
+    while (true) {
+      int ret = av_buffersink_get_frame(track->sink, filtered);
+      if (ret == AVERROR(EAGAIN)) break;
+      if (ret == AVERROR_EOF) {
+        if (!palettePass) Encode(*track, NULL);
+        track->finished = true;
+        break;
+      }
+      Check(ret, "Couldn't filter frame");
+      if (palettePass) {
+        av_frame_unref(palette);
+        av_frame_move_ref(palette, filtered);
+        continue;
+      }
+      AVRational timeBase = av_buffersink_get_time_base(track->sink);
+      if (filtered->pts != AV_NOPTS_VALUE)
+        filtered->pts = av_rescale_q(filtered->pts, timeBase, track->encoder->time_base);
+      // let the encoder pick its own keyframes
+      filtered->pict_type = AV_PICTURE_TYPE_NONE;
+      Encode(*track, filtered);
+      av_frame_unref(filtered);
+    }
+  }
+}
+
+void Transcoder::Decode(AVCodecContext *decoder, AVPacket *input, AVFilterContext *source, int64_t offset) {
+  // a damaged packet is skipped, the same as the CLI does
+  if (avcodec_send_packet(decoder, input) < 0) return;
+  while (avcodec_receive_frame(decoder, decoded) >= 0) {
+    decoded->pts = decoded->best_effort_timestamp;
+    if (decoded->pts != AV_NOPTS_VALUE) decoded->pts -= offset;
+    buffered += FrameBytes(decoded);
+    if (maxBuffered > 0 && buffered > maxBuffered) {
+      av_frame_unref(decoded);
+      throw MediaError("Too long to hold in memory");
+    }
+    Check(av_buffersrc_add_frame(source, decoded), "Couldn't filter frame");
+    Drain();
+  }
+}
+
+// Copied packets need a single set of codec parameters (e.g. H.264's SPS and PPS) to describe every input, and a
+// container that takes the codec
+bool Transcoder::CanCopy(int MediaInput::*index) {
+  const AVCodecParameters *first = inputs[0]->format->streams[(*inputs[0]).*index]->codecpar;
+  if (avformat_query_codec(output.format->oformat, first->codec_id, FF_COMPLIANCE_NORMAL) != 1) return false;
+  for (size_t i = 1; i < inputs.size(); i++) {
+    const AVCodecParameters *other = inputs[i]->format->streams[(*inputs[i]).*index]->codecpar;
+    if (other->codec_id != first->codec_id || other->format != first->format || other->width != first->width ||
+        other->height != first->height || other->sample_rate != first->sample_rate ||
+        other->ch_layout.nb_channels != first->ch_layout.nb_channels ||
+        other->extradata_size != first->extradata_size ||
+        (first->extradata_size > 0 && memcmp(other->extradata, first->extradata, first->extradata_size) != 0))
+      return false;
+    // copied packets can only be shown one way
+    const int32_t *firstMatrix = DisplayMatrix(inputs[0]->format->streams[(*inputs[0]).*index]);
+    const int32_t *otherMatrix = DisplayMatrix(inputs[i]->format->streams[(*inputs[i]).*index]);
+    if ((firstMatrix == NULL) != (otherMatrix == NULL) ||
+        (firstMatrix != NULL && memcmp(firstMatrix, otherMatrix, 9 * sizeof(int32_t)) != 0))
+      return false;
+  }
+  return true;
+}
+
+void Transcoder::OpenCopy(CopiedTrack &track, int MediaInput::*index) {
+  AVStream *source = inputs[0]->format->streams[(*inputs[0]).*index];
+  track.stream = Allocated(avformat_new_stream(output.format, NULL));
+  Check(avcodec_parameters_copy(track.stream->codecpar, source->codecpar), "Couldn't copy stream");
+  // the input container's tag might not mean anything in the output one
+  track.stream->codecpar->codec_tag = 0;
+  track.stream->time_base = source->time_base;
+  track.stream->avg_frame_rate = source->avg_frame_rate;
+  // Copied frames are still stored the way they were filmed, so players need the display matrix to turn them. The
+  // codec parameters carry it along from libavcodec 60.30, before that it's on the stream.
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(60, 30, 100)
+  size_t size = 0;
+  const uint8_t *matrix = av_stream_get_side_data(source, AV_PKT_DATA_DISPLAYMATRIX, &size);
+  if (matrix != NULL) {
+    uint8_t *copy = Allocated(av_stream_new_side_data(track.stream, AV_PKT_DATA_DISPLAYMATRIX, size));
+    memcpy(copy, matrix, size);
+  }
+#endif
+}
+
+void Transcoder::Copy(CopiedTrack &track, MediaInput &input, int index) {
+  if (track.finished) return;
+  AVRational timeBase = input.format->streams[index]->time_base;
+  AVRational microseconds = {1, AV_TIME_BASE};
+  bool isVideo = index == input.videoIndex;
+  if (isVideo && !track.started && !(packet->flags & AV_PKT_FLAG_KEY)) return;
+  int64_t time = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  if (time == AV_NOPTS_VALUE) return;
+
+  // relative to the start of the cut
+  int64_t offset = input.Offset(index) + av_rescale_q(cutStart, microseconds, timeBase);
+  time -= offset;
+  // audio before the cut (but not the encoder priming at the very start of a file)
+  if (!isVideo && cutStart > 0 && time + packet->duration <= 0) return;
+  if (cutDuration != INT64_MAX && time >= av_rescale_q(cutDuration, microseconds, timeBase)) {
+    track.finished = true;
+    return;
+  }
+  track.started = true;
+
+  int64_t shift = av_rescale_q(inputStart, microseconds, timeBase) - offset;
+  if (packet->pts != AV_NOPTS_VALUE) packet->pts += shift;
+  if (packet->dts != AV_NOPTS_VALUE) packet->dts += shift;
+  int64_t end = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  inputEnd = max(inputEnd, av_rescale_q(end + packet->duration, timeBase, microseconds));
+  av_packet_rescale_ts(packet, timeBase, track.stream->time_base);
+  packet->stream_index = track.stream->index;
+  packet->pos = -1;
+  Check(av_interleaved_write_frame(output.format, packet), "Couldn't write output");
+}
+
+void Transcoder::Run(const MediaJob &media, JobControl *job) {
+  for (const auto &data : media.inputs) {
+    inputs.emplace_back(new MediaInput());
+    inputs.back()->Open(data.first, data.second, job);
+  }
+  output.Open(media.format);
+  const AVOutputFormat *container = output.format->oformat;
+
+  bool hasVideo = media.format != "mp3" && media.video != StreamMode::Drop &&
+                  container->video_codec != AV_CODEC_ID_NONE;
+  bool hasAudio = media.audio != StreamMode::Drop && container->audio_codec != AV_CODEC_ID_NONE;
+  for (const auto &input : inputs) {
+    hasVideo = hasVideo && input->videoIndex >= 0;
+    hasAudio = hasAudio && input->audioIndex >= 0;
+  }
+  if (!hasVideo && !hasAudio) throw MediaError("No video or audio to write");
+  bool copyVideo = hasVideo && media.video == StreamMode::Copy && media.overlays.empty() && !media.frames &&
+                   CanCopy(&MediaInput::videoIndex);
+  bool copyAudio = hasAudio && media.audio == StreamMode::Copy && CanCopy(&MediaInput::audioIndex);
+  // the concat filter keeps its own time, so it can't line up with copied packets
+  if (inputs.size() > 1 && (copyVideo != hasVideo || copyAudio != hasAudio)) copyVideo = copyAudio = false;
+  if (inputs.size() == 1) {
+    cutStart = media.start * AV_TIME_BASE;
+    if (media.duration > 0) cutDuration = media.duration * AV_TIME_BASE;
+  }
+  maxBuffered = media.maxBuffered;
+
+  const AVCodec *videoCodec = hasVideo && !copyVideo ? FindEncoder(container, AVMEDIA_TYPE_VIDEO) : NULL;
+  const AVCodec *audioCodec = hasAudio && !copyAudio ? FindEncoder(container, AVMEDIA_TYPE_AUDIO) : NULL;
+  packet = Allocated(av_packet_alloc());
+  encoded = Allocated(av_packet_alloc());
+  decoded = Allocated(av_frame_alloc());
+  filtered = Allocated(av_frame_alloc());
+  processed = Allocated(av_frame_alloc());
+
+  if (palettePass) {
+    palette = Allocated(av_frame_alloc());
+    BuildGraph(media, videoCodec, NULL);
+    ReadInputs(job);
+    if (palette->data[0] == NULL) throw MediaError("No frames to make a palette from");
+    return;
+  }
+  if (videoCodec && videoCodec->id == AV_CODEC_ID_GIF) {
+    Transcoder first;
+    first.palettePass = true;
+    first.Run(media, job);
+    swap(palette, first.palette);
+  }
+
+  if (videoCodec || audioCodec) BuildGraph(media, videoCodec, audioCodec);
+  if (videoCodec) OpenEncoder(video, videoCodec);
+  if (copyVideo) OpenCopy(copiedVideo, &MediaInput::videoIndex);
+  if (audioCodec) OpenEncoder(audio, audioCodec);
+  if (copyAudio) OpenCopy(copiedAudio, &MediaInput::audioIndex);
+  Check(avformat_write_header(output.format, NULL), "Couldn't write header");
+  ReadInputs(job);
+  Check(av_write_trailer(output.format), "Couldn't finish output");
+}
+
+// Decodes and copies every input in turn, inputs play one after the other and concat takes the next one once the
+// last has ended
+void Transcoder::ReadInputs(JobControl *job) {
+  for (size_t i = 0; i < inputs.size(); i++) {
+    MediaInput &input = *inputs[i];
+    if (cutStart > 0) input.Seek((double)cutStart / AV_TIME_BASE);
+    while (true) {
+      CheckJob(job);
+      // the end of the input, or a damaged file that plays up to here
+      if (av_read_frame(input.format, packet) < 0) break;
+      if (packet->stream_index == input.videoIndex) {
+        if (videoSources.size() > i && videoSources[i]) {
+          Decode(input.video, packet, videoSources[i], input.Offset(input.videoIndex));
+        } else if (copiedVideo.stream) {
+          Copy(copiedVideo, input, input.videoIndex);
+        }
+      } else if (packet->stream_index == input.audioIndex) {
+        if (audioSources.size() > i && audioSources[i]) {
+          Decode(input.audio, packet, audioSources[i], input.Offset(input.audioIndex));
+        } else if (copiedAudio.stream) {
+          Copy(copiedAudio, input, input.audioIndex);
+        }
+      }
+      av_packet_unref(packet);
+    }
+    // reading stops early when the job gets interrupted
+    CheckJob(job);
+    if (videoSources.size() > i && videoSources[i]) {
+      Decode(input.video, NULL, videoSources[i], input.Offset(input.videoIndex));
+      Check(av_buffersrc_add_frame(videoSources[i], NULL), "Couldn't filter frame");
+    }
+    if (audioSources.size() > i && audioSources[i]) {
+      Decode(input.audio, NULL, audioSources[i], input.Offset(input.audioIndex));
+      Check(av_buffersrc_add_frame(audioSources[i], NULL), "Couldn't filter frame");
+    }
+    Drain();
+    inputStart = inputEnd;
+    copiedVideo.started = copiedVideo.finished = false;
+    copiedAudio.started = copiedAudio.finished = false;
+  }
+}
+
+char *Transcoder::Release(size_t &size) {
+  char *data = output.Release(size);
+  string name = output.format->oformat->name;
+  if (name == "mp4" || name == "mov" || name == "ipod") data = MoveMoovToFront(data, size);
+  return data;
+}
+
+char *RunMedia(const MediaJob &media, size_t &size, JobControl *job) {
+  LogCapture log;
+  Transcoder transcoder;
+  try {
+    transcoder.Run(media, job);
+  } catch (const MediaError &e) {
+    // an interrupted read or write shows up as a libav error
+    CheckJob(job);
+    throw log.Annotate(e);
+  }
+  return transcoder.Release(size);
+}
+
+// Frames pulled out of a filter graph, instead of going to an encoder
+class FrameCollector {
+public:
+  ~FrameCollector() {
+    av_packet_free(&packet);
+    av_frame_free(&decoded);
+    av_frame_free(&filtered);
+  }
+
+  bool Run(const char *data, size_t length, const vector<MediaFilter> &filters, size_t maxMemory,
+           VideoFrames &frames, JobControl *job);
+
+private:
+  bool Decode(AVPacket *compressed, VideoFrames &frames, size_t maxMemory);
+  bool Pull(VideoFrames &frames, size_t maxMemory);
+
+  MediaInput input;
+  FilterGraph graph;
+  AVFilterContext *source = NULL;
+  AVFilterContext *sink = NULL;
+  AVPacket *packet = NULL;
+  AVFrame *decoded = NULL;
+  AVFrame *filtered = NULL;
+  int64_t lastPts = AV_NOPTS_VALUE;
+};
+
+// Moves whatever the filters have ready into frames, returns false once they're over the memory limit
+bool FrameCollector::Pull(VideoFrames &frames, size_t maxMemory) {
+  AVRational timeBase = av_buffersink_get_time_base(sink);
+  AVRational rate = av_buffersink_get_frame_rate(sink);
+  int defaultDelay = rate.num > 0 ? (int)av_rescale(1000, rate.den, rate.num) : 100;
+  while (true) {
+    int ret = av_buffersink_get_frame(sink, filtered);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return true;
+    Check(ret, "Couldn't filter frame");
+    if (frames.pixels.empty()) {
+      frames.width = filtered->width;
+      frames.height = filtered->height;
+    } else if (filtered->width != frames.width || filtered->height != frames.height) {
+      av_frame_unref(filtered);
+      throw MediaError("Frame size changed partway through the video");
+    }
+    size_t rowSize = (size_t)frames.width * 3;
+    size_t frameSize = rowSize * frames.height;
+    if (frames.pixels.size() + frameSize > maxMemory) {
+      av_frame_unref(filtered);
+      return false;
+    }
+    size_t offset = frames.pixels.size();
+    frames.pixels.resize(offset + frameSize);
+    for (int y = 0; y < frames.height; y++)
+      memcpy(frames.pixels.data() + offset + y * rowSize, filtered->data[0] + y * filtered->linesize[0], rowSize);
+
+    // a frame lasts until the next one starts
+    if (lastPts != AV_NOPTS_VALUE && filtered->pts != AV_NOPTS_VALUE && !frames.delays.empty())
+      frames.delays.back() = max(1, (int)av_rescale_q(filtered->pts - lastPts, timeBase, AVRational{1, 1000}));
+    frames.delays.push_back(defaultDelay);
+    lastPts = filtered->pts;
+    av_frame_unref(filtered);
+  }
+}
+
+bool FrameCollector::Decode(AVPacket *compressed, VideoFrames &frames, size_t maxMemory) {
+  // a damaged packet is skipped, the same as the CLI does
+  if (avcodec_send_packet(input.video, compressed) < 0) return true;
+  int64_t offset = input.Offset(input.videoIndex);
+  while (avcodec_receive_frame(input.video, decoded) >= 0) {
+    decoded->pts = decoded->best_effort_timestamp;
+    if (decoded->pts != AV_NOPTS_VALUE) decoded->pts -= offset;
+    Check(av_buffersrc_add_frame(source, decoded), "Couldn't filter frame");
+    if (!Pull(frames, maxMemory)) return false;
+  }
+  return true;
+}
+
+bool FrameCollector::Run(const char *data, size_t length, const vector<MediaFilter> &filters, size_t maxMemory,
+                         VideoFrames &frames, JobControl *job) {
+  input.Open(data, length, job);
+  if (input.videoIndex < 0) throw MediaError("No video stream");
+  input.OpenDecoder(input.videoIndex);
+  source = graph.Add(VideoSource(input));
+  FilterPad end = graph.Chain({source, 0}, DisplayFilters(input.format->streams[input.videoIndex]));
+  end = graph.Chain(end, filters);
+  end = graph.Chain(end, {{"format", {{"pix_fmts", "rgb24"}}}});
+  sink = graph.Add({"buffersink", {}});
+  graph.Link(end, sink, 0);
+  graph.Configure();
+
+  packet = Allocated(av_packet_alloc());
+  decoded = Allocated(av_frame_alloc());
+  filtered = Allocated(av_frame_alloc());
+  while (true) {
+    CheckJob(job);
+    if (av_read_frame(input.format, packet) < 0) break;
+    bool fits = packet->stream_index != input.videoIndex || Decode(packet, frames, maxMemory);
+    av_packet_unref(packet);
+    if (!fits) return false;
+  }
+  CheckJob(job);
+  if (!Decode(NULL, frames, maxMemory)) return false;
+  Check(av_buffersrc_add_frame(source, NULL), "Couldn't filter frame");
+  return Pull(frames, maxMemory);
+}
+
+bool DecodeVideo(const char *data, size_t length, const vector<MediaFilter> &filters, size_t maxMemory,
+                 VideoFrames &frames, JobControl *job) {
+  LogCapture log;
+  FrameCollector collector;
+  try {
+    return collector.Run(data, length, filters, maxMemory, frames, job);
+  } catch (const MediaError &e) {
+    CheckJob(job);
+    throw log.Annotate(e);
+  }
+}
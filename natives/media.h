@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+class JobControl;
+
+// Something libav couldn't do with the input, as opposed to the job being stopped
+class MediaError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// One filter in a chain. The options are set on the filter one by one, so values never need any escaping.
+struct MediaFilter {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> options;
+};
+
+struct MediaStreamInfo {
+  bool present = false;
+  std::string codec;
+  // bits per second, 0 if the container doesn't say
+  int64_t bitRate = 0;
+  int width = 0;
+  int height = 0;
+  double frameRate = 0;
+  int sampleRate = 0;
+  int channels = 0;
+};
+
+// What's in a file, for commands to decide on a single transcode before running it
+struct MediaProbe {
+  // libavformat's name for the demuxer, e.g. "mov,mp4,m4a,3gp,3g2,mj2"
+  std::string container;
+  // in seconds, 0 if unknown
+  double duration = 0;
+  int64_t bitRate = 0;
+  // the streams a transcode would use, cover art doesn't count as video
+  MediaStreamInfo video;
+  MediaStreamInfo audio;
+  // Video keyframe times in seconds, as far as the demuxer's index knows them. Empty for containers that don't
+  // index the whole file on opening (MP4 and Matroska do).
+  std::vector<double> keyframes;
+};
+
+// Reads the headers (and a few packets if it has to) from memory, returns false if libav can't make sense of it
+bool ProbeMedia(const char *data, size_t length, MediaProbe &probe, JobControl *job);
+
+/*
+  Copy keeps a stream's packets as they are, so its filters don't apply. It only happens when the output container
+  takes the codec and every input encodes the stream the same way, otherwise the stream is encoded after all. With
+  several inputs, copying is all or nothing.
+*/
+enum class StreamMode { Encode, Copy, Drop };
+
+// A still image blended over every frame, such as text rendered once up front
+struct MediaOverlay {
+  // packed 8-bit RGBA, straight alpha
+  std::vector<uint8_t> pixels;
+  int width = 0;
+  int height = 0;
+  // position as overlay filter expressions, e.g. "main_h-overlay_h" for the bottom edge
+  std::string x = "0";
+  std::string y = "0";
+};
+
+// A video's frames after its filters as packed 8-bit RGB, one frame after the other
+struct VideoFrames {
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> pixels;
+  // how long each frame is shown, in milliseconds
+  std::vector<int> delays;
+};
+
+/*
+  Changes a batch of frames in place. It can change their size, but every batch has to come out at the size the first
+  one did and with as many frames as it went in with. It's also run once on a single black frame before anything
+  gets decoded, to find that size for the encoder.
+*/
+typedef std::function<void(VideoFrames &batch)> FrameProcessor;
+
+/*
+  A transcode that runs entirely in-process: inputs are demuxed straight from memory, filtered through a libavfilter
+  graph and muxed into a growable buffer. Several inputs are scaled to the first one's size and concatenated before
+  the filters run. Encoders follow from the format: GIFs get a palette built over the whole clip in a first pass,
+  "mp3" is audio only, anything else is H.264/AAC.
+*/
+struct MediaJob {
+  std::vector<std::pair<const char *, size_t>> inputs;
+  // Output container, as a file extension
+  std::string format;
+  std::vector<MediaFilter> videoFilters;
+  std::vector<MediaFilter> audioFilters;
+  // blended in order after the video filters, they need the video encoded
+  std::vector<MediaOverlay> overlays;
+  // Runs after the filters and overlays on up to batchFrames frames at a time, so only that many are ever held in
+  // memory. It needs the video encoded.
+  FrameProcessor frames;
+  size_t batchFrames = 0;
+  StreamMode video = StreamMode::Encode;
+  StreamMode audio = StreamMode::Encode;
+  // Cut of a single input in seconds, a duration of 0 goes to the end. Encoded streams are cut exactly before their
+  // filters run. Copied video starts at the keyframe before start, so callers should only copy when one is close.
+  double start = 0;
+  double duration = 0;
+  // For filters that hold every frame until the input ends (reverse, areverse): the job fails once the decoded
+  // frames add up to more than this many bytes. 0 for no limit.
+  size_t maxBuffered = 0;
+};
+
+// Runs the job and returns the output in a malloc'd buffer, throws MediaError if it can't be done. The error ends
+// with the last line libav logged. Oversized frames or output fail the job rather than using up memory, as does
+// going past maxBuffered; filters that hold the clip aren't limited otherwise.
+char *RunMedia(const MediaJob &media, size_t &size, JobControl *job);
+
+// Decodes the main video stream once, through the filters. Returns false as soon as the frames would take up more
+// than maxMemory bytes, throws MediaError if it can't be done.
+bool DecodeVideo(const char *data, size_t length, const std::vector<MediaFilter> &filters, size_t maxMemory,
+                 VideoFrames &frames, JobControl *job);
+
+// Moves an MP4's moov atom in front of its media data (see media.cc). Takes the malloc'd file and returns the moved
+// copy, or the file itself if it's left as it is.
+char *MoveMoovToFront(char *file, size_t length);
+// Adds shift to every chunk offset (stco and co64) in the sample tables below a moov atom's body, returns false if
+// the atoms don't add up or an offset would overflow
+bool ShiftChunkOffsets(uint8_t *data, size_t length, uint64_t shift);
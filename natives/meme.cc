@@ -12,7 +12,7 @@ VImage genText(string text, string font, const char *fontfile, int width, VImage
                        ->set("font", font.c_str())
                        ->set("width", width);
   VImage in = VImage::text(("<span foreground=\"white\">" + text + "</span>").c_str(),
-                           strncmp(fontfile, "\0", 1) != 0 ? options->set("fontfile", fontfile) : options);
+                           fontfile != NULL ? options->set("fontfile", fontfile) : options);
 
   in = in.embed(radius, radius * 2, in.width() + 2 * radius, (in.height() + 2 * radius) + (radius * 2));
 
@@ -21,20 +21,18 @@ VImage genText(string text, string font, const char *fontfile, int width, VImage
   return outline.composite2(in, VIPS_BLEND_MODE_OVER);
 }
 
-ArgumentMap Meme(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                 ArgumentMap arguments, bool *shouldKill) {
-  string top = GetArgument<string>(arguments, "topText");
-  string bottom = GetArgument<string>(arguments, "bottomText");
-  string font = GetArgument<string>(arguments, "font");
-  string basePath = GetArgument<string>(arguments, "basePath");
+VImage Meme(VImage in, ImageState &state, const MemeParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &top = arguments.topText;
+  const string &bottom = arguments.bottomText;
+  const string &font = arguments.font;
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
   double size = (double)width / 9;
   double radius = size / 18;
 
@@ -43,21 +41,21 @@ ArgumentMap Meme(const string &type, string &outType, const char *bufferdata, si
 
   VImage mask = VImage::gaussmat(radius / 2, 0.1, VImage::option()->set("separable", true)) * 8;
 
-  auto findResult = fontPaths.find(font);
-  string fontResult = findResult != fontPaths.end() ? basePath + findResult->second : "";
+  const char *fontFile = GetFonts(basePath).File(font);
 
-  LoadFonts(basePath);
   VImage combinedText = VImage::black(width, pageHeight, VImage::option()->set("bands", 3))
                           .bandjoin(0)
                           .copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB));
   if (top != "") {
-    VImage topText = genText(top, font_string, fontResult.c_str(), width, mask, radius);
+    VImage topText = CachedText("meme", top, font_string, fontFile, width, VIPS_ALIGN_CENTRE,
+                                [&]() { return genText(top, font_string, fontFile, width, mask, radius); });
     combinedText = combinedText.composite(topText, VIPS_BLEND_MODE_OVER,
                                           VImage::option()->set("x", (width / 2) - (topText.width() / 2))->set("y", 0));
   }
 
   if (bottom != "") {
-    VImage bottomText = genText(bottom, font_string, fontResult.c_str(), width, mask, radius);
+    VImage bottomText = CachedText("meme", bottom, font_string, fontFile, width, VIPS_ALIGN_CENTRE,
+                                   [&]() { return genText(bottom, font_string, fontFile, width, mask, radius); });
     combinedText = combinedText.composite(
       bottomText, VIPS_BLEND_MODE_OVER,
       VImage::option()->set("x", (width / 2) - (bottomText.width() / 2))->set("y", pageHeight - bottomText.height()));
@@ -67,16 +65,8 @@ ArgumentMap Meme(const string &type, string &outType, const char *bufferdata, si
     combinedText.copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB)).replicate(1, nPages);
   VImage final = in.composite(replicated, VIPS_BLEND_MODE_OVER);
 
-  SetupTimeoutCallback(final, shouldKill);
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return final;
 }
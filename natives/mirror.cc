@@ -5,14 +5,11 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Mirror(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   ArgumentMap arguments, bool *shouldKill) {
-  bool vertical = GetArgumentWithFallback<bool>(arguments, "vertical", false);
-  bool first = GetArgumentWithFallback<bool>(arguments, "first", false);
+VImage Mirror(VImage in, ImageState &state, const MirrorParams &arguments, [[maybe_unused]] JobControl *job) {
+  bool vertical = arguments.vertical;
+  bool first = arguments.first;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, false, false));
-
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   VImage out;
 
@@ -58,15 +55,5 @@ ArgumentMap Mirror(const string &type, string &outType, const char *bufferdata,
     }
   }
 
-  SetupTimeoutCallback(out, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  out.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return out;
 }
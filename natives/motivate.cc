@@ -5,28 +5,24 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Motivate(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                     ArgumentMap arguments, bool *shouldKill) {
-  string top_text = GetArgument<string>(arguments, "topText");
-  string bottom_text = GetArgument<string>(arguments, "bottomText");
-  string font = GetArgument<string>(arguments, "font");
-  string basePath = GetArgument<string>(arguments, "basePath");
+VImage Motivate(VImage in, ImageState &state, const MemeParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &top_text = arguments.topText;
+  const string &bottom_text = arguments.bottomText;
+  const string &font = arguments.font;
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   int width = in.width();
   int size = width / 5;
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
   int textWidth = width - ((width / 25) * 2);
 
   string font_string = font == "roboto" ? "Roboto Condensed" : font;
-  auto findResult = fontPaths.find(font);
-  string fontResult = findResult != fontPaths.end() ? basePath + findResult->second : "";
+  const char *fontFile = GetFonts(basePath).File(font);
 
-  LoadFonts(basePath);
   VImage topImage;
   if (top_text != "") {
     string topText = "<span foreground=\"white\" background=\"black\">" + top_text + "</span>";
@@ -36,8 +32,8 @@ ArgumentMap Motivate(const string &type, string &outType, const char *bufferdata
                                 ->set("align", VIPS_ALIGN_CENTRE)
                                 ->set("width", textWidth)
                                 ->set("font", (font_string + " " + to_string(size)).c_str());
-    if (fontResult != "") {
-      topTextOptions = topTextOptions->set("fontfile", (basePath + findResult->second).c_str());
+    if (fontFile != NULL) {
+      topTextOptions = topTextOptions->set("fontfile", fontFile);
     }
     topImage = VImage::text(topText.c_str(), topTextOptions);
   }
@@ -51,61 +47,49 @@ ArgumentMap Motivate(const string &type, string &outType, const char *bufferdata
                                    ->set("align", VIPS_ALIGN_CENTRE)
                                    ->set("width", textWidth)
                                    ->set("font", (font_string + " " + to_string(size * 0.4)).c_str());
-    if (fontResult != "") {
-      bottomTextOptions = bottomTextOptions->set("fontfile", (basePath + findResult->second).c_str());
+    if (fontFile != NULL) {
+      bottomTextOptions = bottomTextOptions->set("fontfile", fontFile);
     }
     bottomImage = VImage::text(bottomText.c_str(), bottomTextOptions);
   }
 
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  int height = 0;
-  for (int i = 0; i < nPages; i++) {
-    VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
-
-    int borderSize = max(2, width / 66);
-    int borderSize2 = borderSize * 0.5;
-    VImage bordered = img_frame.embed(borderSize, borderSize, width + (borderSize * 2), pageHeight + (borderSize * 2),
-                                      VImage::option()->set("extend", "black"));
-    VImage bordered2 = bordered.embed(borderSize2, borderSize2, bordered.width() + (borderSize2 * 2),
-                                      bordered.height() + (borderSize2 * 2), VImage::option()->set("extend", "white"));
-
-    int addition = width / 8;
-    int sideAddition = pageHeight * 0.4;
-
-    VImage bordered3 = bordered2.embed(sideAddition / 2, addition / 2, bordered2.width() + sideAddition,
-                                       bordered2.height() + addition, VImage::option()->set("extend", "black"));
-    VImage frame;
-    if (top_text != "") {
-      frame =
-        bordered3.join(topImage.gravity(VIPS_COMPASS_DIRECTION_NORTH, bordered3.width(), topImage.height() + (size / 4),
+  int borderSize = max(2, width / 66);
+  int borderSize2 = borderSize * 0.5;
+  int addition = width / 8;
+  int sideAddition = pageHeight * 0.4;
+
+  // The border and text are the same for every page, so they're laid out once around an empty page and the pages
+  // only get copied into the hole
+  VImage empty = VImage::black(width, pageHeight, VImage::option()->set("bands", 4));
+  VImage bordered = empty.embed(borderSize, borderSize, width + (borderSize * 2), pageHeight + (borderSize * 2),
+                                VImage::option()->set("extend", "black"));
+  VImage bordered2 = bordered.embed(borderSize2, borderSize2, bordered.width() + (borderSize2 * 2),
+                                    bordered.height() + (borderSize2 * 2), VImage::option()->set("extend", "white"));
+  VImage frame = bordered2.embed(sideAddition / 2, addition / 2, bordered2.width() + sideAddition,
+                                 bordered2.height() + addition, VImage::option()->set("extend", "black"));
+  int frameWidth = frame.width();
+  if (top_text != "") {
+    frame = frame.join(topImage.gravity(VIPS_COMPASS_DIRECTION_NORTH, frameWidth, topImage.height() + (size / 4),
                                         VImage::option()->set("extend", "black")),
                        VIPS_DIRECTION_VERTICAL, VImage::option()->set("background", 0x000000)->set("expand", true));
-    }
-    if (bottom_text != "") {
-      if (top_text == "") frame = bordered3;
-      frame =
-        frame.join(bottomImage.gravity(VIPS_COMPASS_DIRECTION_NORTH, bordered3.width(),
-                                       bottomImage.height() + (size / 4), VImage::option()->set("extend", "black")),
-                   VIPS_DIRECTION_VERTICAL, VImage::option()->set("background", 0x000000)->set("expand", true));
-    }
-    height = frame.height();
-    img.push_back(frame);
   }
-  VImage final =
-    VImage::arrayjoin(img, VImage::option()->set("across", 1)).extract_band(0, VImage::option()->set("n", 3));
-  final.set(VIPS_META_PAGE_HEIGHT, height);
-
-  SetupTimeoutCallback(final, shouldKill);
+  if (bottom_text != "") {
+    frame = frame.join(bottomImage.gravity(VIPS_COMPASS_DIRECTION_NORTH, frameWidth, bottomImage.height() + (size / 4),
+                                           VImage::option()->set("extend", "black")),
+                       VIPS_DIRECTION_VERTICAL, VImage::option()->set("background", 0x000000)->set("expand", true));
+  }
 
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 1) : 0);
+  int x = (sideAddition / 2) + borderSize2 + borderSize;
+  int y = (addition / 2) + borderSize2 + borderSize;
+  VImage rgb = in.extract_band(0, VImage::option()->set("n", 3));
+  VImage pages = PageEmbed(rgb, nPages, x, y, frame.width(), frame.height(), {0, 0, 0});
+  VImage hole =
+    (empty[0] + 255).cast(VIPS_FORMAT_UCHAR).embed(x, y, frame.width(), frame.height()).replicate(1, nPages);
+  VImage final =
+    hole.ifthenelse(pages, frame.extract_band(0, VImage::option()->set("n", 3)).replicate(1, nPages));
+  final.set(VIPS_META_PAGE_HEIGHT, frame.height());
 
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.dither = 1;
 
-  return output;
+  return final;
 }
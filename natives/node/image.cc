@@ -1,7 +1,10 @@
 #include <napi.h>
 
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #ifdef __GLIBC__
 #include <malloc.h>
@@ -25,56 +28,173 @@ namespace backward {
 
 using namespace std;
 
-bool isNapiValueInt(Napi::Env &env, Napi::Value &num) {
-  return env.Global().Get("Number").ToObject().Get("isInteger").As<Napi::Function>().Call({num}).ToBoolean().Value();
+// Runs on the main thread for each progress update queued from a vips worker thread
+static void SendProgress(Napi::Env env, Napi::Function callback, JobProgress *update) {
+  if (env != nullptr && callback != nullptr) {
+    Napi::Object obj = Napi::Object::New(env);
+    obj.Set("phase", Napi::String::New(env, update->phase));
+    obj.Set("percent", Napi::Number::From(env, update->percent));
+    obj.Set("pixels", Napi::Number::From(env, (double)update->pixels));
+    obj.Set("elapsed", Napi::Number::From(env, update->elapsed));
+    callback.Call({obj});
+  }
+  delete update;
 }
 
-Napi::Value ProcessImage(const Napi::CallbackInfo &info) {
-  Napi::Env env = info.Env();
-
-  string command = info[0].As<Napi::String>().Utf8Value();
-  Napi::Object obj = info[1].As<Napi::Object>();
-  Napi::Object input = info[2].As<Napi::Object>();
-  string type = input.Has("type") ? input.Get("type").As<Napi::String>().Utf8Value() : "png";
-  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+// Fills in a command's arguments from a JS object, returns NULL and sets error if something doesn't fit
+static std::unique_ptr<CommandArgs> DecodeArguments(const string &command, Napi::Object obj, string &error) {
+  std::unique_ptr<CommandArgs> arguments(NewCommandArgs(command));
+  if (!arguments) {
+    error = "Unknown command \"" + command + "\"";
+    return nullptr;
+  }
 
   Napi::Array properties = obj.GetPropertyNames();
 
-  ArgumentMap Arguments;
-
   for (unsigned int i = 0; i < properties.Length(); i++) {
     string property = properties.Get(uint32_t(i)).As<Napi::String>().Utf8Value();
 
     auto val = obj.Get(property);
+    bool valid;
     if (val.IsBoolean()) {
-      Arguments[property] = val.ToBoolean().Value();
+      valid = arguments->SetBool(property, val.ToBoolean().Value());
     } else if (val.IsString()) {
-      Arguments[property] = val.ToString().As<Napi::String>().Utf8Value();
+      valid = arguments->SetString(property, val.As<Napi::String>().Utf8Value());
     } else if (val.IsNumber()) {
-      auto num = val.ToNumber();
-      if (isNapiValueInt(env, num) && property != "yscale" && property != "tolerance" &&
-          property != "pos") { // dumb hack
-        Arguments[property] = num.Int32Value();
-      } else {
-        Arguments[property] = num.FloatValue();
-      }
+      valid = arguments->SetNumber(property, val.As<Napi::Number>().DoubleValue());
+    } else if (val.IsArrayBuffer()) {
+      Napi::ArrayBuffer buf = val.As<Napi::ArrayBuffer>();
+      valid = arguments->SetBuffer(property, (const char *)buf.Data(), buf.ByteLength());
+    } else if (val.IsTypedArray()) {
+      Napi::TypedArray arr = val.As<Napi::TypedArray>();
+      valid = arguments->SetBuffer(property, (const char *)arr.ArrayBuffer().Data() + arr.ByteOffset(),
+                                   arr.ByteLength());
     } else {
-      deferred.Reject(Napi::Error::New(env, "Type of property \"" + property + "\" is unknown").Value());
-      return deferred.Promise();
+      error = "Type of property \"" + property + "\" is unknown";
+      return nullptr;
+    }
+    if (!valid) {
+      error = "Type of property \"" + property + "\" is invalid";
+      return nullptr;
     }
   }
 
+  const char *missing = arguments->Missing();
+  if (missing != NULL) {
+    error = "Missing required property \"" + string(missing) + "\"";
+    return nullptr;
+  }
+
+  return arguments;
+}
+
+// Queues the steps on the input and options objects, shared by image() and pipeline()
+static Napi::Value QueueJob(Napi::Env env, Napi::Promise::Deferred deferred, std::vector<PipelineStep> steps,
+                            Napi::Object input, Napi::Object options) {
+  string type = input.Has("type") ? input.Get("type").As<Napi::String>().Utf8Value() : "png";
+
   char *bufData = NULL;
   size_t bufSize = 0;
+  Napi::ArrayBuffer data;
   if (input.Has("data")) {
-    Napi::ArrayBuffer data = input.Get("data").As<Napi::ArrayBuffer>();
+    data = input.Get("data").As<Napi::ArrayBuffer>();
     bufData = (char *)data.Data();
     bufSize = data.ByteLength();
   }
 
-  ImageAsyncWorker *asyncWorker = new ImageAsyncWorker(env, deferred, command, Arguments, type, bufData, bufSize);
+  std::shared_ptr<JobControl> job = std::make_shared<JobControl>();
+  Napi::Value timeout = options.Get("timeout");
+  if (timeout.IsNumber()) {
+    job = std::make_shared<JobControl>(std::chrono::milliseconds(timeout.As<Napi::Number>().Int64Value()));
+  }
+  Napi::Value budget = options.Get("budget");
+  if (budget.IsNumber() && budget.As<Napi::Number>().Int64Value() > 0) {
+    job->budget = budget.As<Napi::Number>().Int64Value();
+  }
+
+  ImageAsyncWorker *asyncWorker = new ImageAsyncWorker(env, deferred, std::move(steps), type, bufData, bufSize, job);
+  if (bufData != NULL) asyncWorker->PinInput(data);
+
+  Napi::Value onProgress = options.Get("progress");
+  if (onProgress.IsFunction()) {
+    Napi::ThreadSafeFunction progress =
+      Napi::ThreadSafeFunction::New(env, onProgress.As<Napi::Function>(), "image progress", 0, 1);
+    job->onProgress = [progress](const JobProgress &update) {
+      JobProgress *data = new JobProgress(update);
+      if (progress.NonBlockingCall(data, SendProgress) != napi_ok) delete data;
+    };
+    asyncWorker->SetProgress(progress);
+  }
+
   asyncWorker->Queue();
-  return deferred.Promise();
+
+  // The returned promise doubles as the job handle, cancel() stops it at the next check and rejects the promise
+  // with "image_job_killed"
+  Napi::Promise promise = deferred.Promise();
+  promise.Set("cancel", Napi::Function::New(env, [job](const Napi::CallbackInfo &info) {
+                job->Kill();
+                return info.Env().Undefined();
+              }));
+  return promise;
+}
+
+Napi::Value ProcessImage(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  string command = info[0].As<Napi::String>().Utf8Value();
+  Napi::Object obj = info[1].As<Napi::Object>();
+  Napi::Object input = info[2].As<Napi::Object>();
+  Napi::Object options = info.Length() > 3 && info[3].IsObject() ? info[3].As<Napi::Object>() : Napi::Object::New(env);
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+
+  string error;
+  std::unique_ptr<CommandArgs> arguments = DecodeArguments(command, obj, error);
+  if (!arguments) {
+    deferred.Reject(Napi::Error::New(env, error).Value());
+    return deferred.Promise();
+  }
+
+  std::vector<PipelineStep> steps;
+  steps.push_back({command, std::move(arguments)});
+  return QueueJob(env, deferred, std::move(steps), input, options);
+}
+
+// Runs a list of {cmd, params} steps on one decode of the input, see RunPipeline
+Napi::Value Pipeline(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+
+  Napi::Array list = info[0].As<Napi::Array>();
+  Napi::Object input = info[1].As<Napi::Object>();
+  Napi::Object options = info.Length() > 2 && info[2].IsObject() ? info[2].As<Napi::Object>() : Napi::Object::New(env);
+  Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+
+  if (list.Length() == 0) {
+    deferred.Reject(Napi::Error::New(env, "Pipeline has no steps").Value());
+    return deferred.Promise();
+  }
+
+  std::vector<PipelineStep> steps;
+  for (unsigned int i = 0; i < list.Length(); i++) {
+    Napi::Object step = list.Get(uint32_t(i)).As<Napi::Object>();
+    string command = step.Get("cmd").As<Napi::String>().Utf8Value();
+    auto found = FunctionMap.find(command);
+    if (found == FunctionMap.end() || found->second.image == NULL) {
+      deferred.Reject(Napi::Error::New(env, "Command \"" + command + "\" can't be used in a pipeline").Value());
+      return deferred.Promise();
+    }
+
+    string error;
+    Napi::Value params = step.Get("params");
+    std::unique_ptr<CommandArgs> arguments =
+      DecodeArguments(command, params.IsObject() ? params.As<Napi::Object>() : Napi::Object::New(env), error);
+    if (!arguments) {
+      deferred.Reject(Napi::Error::New(env, error).Value());
+      return deferred.Promise();
+    }
+    steps.push_back({command, std::move(arguments)});
+  }
+
+  return QueueJob(env, deferred, std::move(steps), input, options);
 }
 
 /*
@@ -97,6 +217,110 @@ Napi::Value Trim(const Napi::CallbackInfo &info) {
 #endif
 }
 
+Napi::Object CacheStatsObject(Napi::Env env, const ImageCache::Stats &stats) {
+  Napi::Object obj = Napi::Object::New(env);
+  obj.Set("hits", Napi::Number::From(env, stats.hits));
+  obj.Set("misses", Napi::Number::From(env, stats.misses));
+  obj.Set("evictions", Napi::Number::From(env, stats.evictions));
+  obj.Set("entries", Napi::Number::From(env, stats.entries));
+  obj.Set("bytes", Napi::Number::From(env, stats.bytes));
+  obj.Set("limit", Napi::Number::From(env, stats.limit));
+  size_t lookups = stats.hits + stats.misses;
+  obj.Set("hitRate", Napi::Number::From(env, lookups > 0 ? (double)stats.hits / (double)lookups : 0.0));
+  return obj;
+}
+
+Napi::Value CacheStats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  Napi::Object stats = Napi::Object::New(env);
+  stats.Set("assets", CacheStatsObject(env, GetAssetCacheStats()));
+  stats.Set("text", CacheStatsObject(env, GetTextCacheStats()));
+  return stats;
+}
+
+Napi::Value CacheLimits(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  Napi::Object limits = info[0].As<Napi::Object>();
+
+  size_t assetLimit = GetAssetCacheStats().limit;
+  size_t textLimit = GetTextCacheStats().limit;
+  if (limits.Get("assets").IsNumber()) assetLimit = limits.Get("assets").As<Napi::Number>().Int64Value();
+  if (limits.Get("text").IsNumber()) textLimit = limits.Get("text").As<Napi::Number>().Int64Value();
+  SetCacheLimits(assetLimit, textLimit);
+
+  return env.Undefined();
+}
+
+// Sets how many cores jobs get to share, and the most vips concurrency a single job gets
+Napi::Value ThreadLimits(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  Napi::Object limits = info[0].As<Napi::Object>();
+
+  ThreadBudget::Stats current = GetThreadBudget().Get();
+  int cores = current.cores;
+  int vips = current.vipsMax;
+  if (limits.Get("cores").IsNumber()) cores = limits.Get("cores").As<Napi::Number>().Int32Value();
+  if (limits.Get("vips").IsNumber()) vips = limits.Get("vips").As<Napi::Number>().Int32Value();
+  GetThreadBudget().Configure(cores, vips);
+
+  return env.Undefined();
+}
+
+Napi::Object HistogramObject(Napi::Env env, const Histogram::Snapshot &histogram) {
+  Napi::Object obj = Napi::Object::New(env);
+  obj.Set("count", Napi::Number::From(env, (double)histogram.count));
+  obj.Set("sum", Napi::Number::From(env, (double)histogram.sum));
+  obj.Set("max", Napi::Number::From(env, (double)histogram.max));
+  obj.Set("p50", Napi::Number::From(env, (double)histogram.Quantile(0.5)));
+  obj.Set("p95", Napi::Number::From(env, (double)histogram.Quantile(0.95)));
+  // trailing empty buckets are left out
+  int used = STATS_BUCKETS;
+  while (used > 0 && histogram.buckets[used - 1] == 0) used--;
+  Napi::Array buckets = Napi::Array::New(env, used);
+  for (int i = 0; i < used; i++) buckets[i] = Napi::Number::From(env, (double)histogram.buckets[i]);
+  obj.Set("buckets", buckets);
+  return obj;
+}
+
+Napi::Value Stats(const Napi::CallbackInfo &info) {
+  Napi::Env env = info.Env();
+  bool reset = info.Length() > 0 && info[0].IsBoolean() && info[0].As<Napi::Boolean>().Value();
+
+  Napi::Object commands = Napi::Object::New(env);
+  ForEachCommandStats([&](const string &name, CommandStats &stats) {
+    CommandStats::Snapshot snapshot = stats.Get();
+    if (reset) stats.Reset();
+    if (snapshot.jobs == 0) return;
+    Napi::Object obj = Napi::Object::New(env);
+    obj.Set("jobs", Napi::Number::From(env, (double)snapshot.jobs));
+    obj.Set("failures", Napi::Number::From(env, (double)snapshot.failures));
+    obj.Set("timeouts", Napi::Number::From(env, (double)snapshot.timeouts));
+    obj.Set("total", HistogramObject(env, snapshot.total));
+    obj.Set("decode", HistogramObject(env, snapshot.decode));
+    obj.Set("process", HistogramObject(env, snapshot.process));
+    obj.Set("encode", HistogramObject(env, snapshot.encode));
+    obj.Set("inputBytes", HistogramObject(env, snapshot.inputBytes));
+    obj.Set("outputBytes", HistogramObject(env, snapshot.outputBytes));
+    obj.Set("frames", HistogramObject(env, snapshot.frames));
+    obj.Set("memPeak", HistogramObject(env, snapshot.memPeak));
+    obj.Set("graphNodes", HistogramObject(env, snapshot.graphNodes));
+    commands.Set(name, obj);
+  });
+
+  Napi::Object stats = Napi::Object::New(env);
+  stats.Set("memHighwater", Napi::Number::From(env, (double)vips_tracked_get_mem_highwater()));
+  ThreadBudget::Stats budget = GetThreadBudget().Get();
+  Napi::Object threads = Napi::Object::New(env);
+  threads.Set("cores", Napi::Number::From(env, budget.cores));
+  threads.Set("vipsMax", Napi::Number::From(env, budget.vipsMax));
+  threads.Set("jobs", Napi::Number::From(env, budget.jobs));
+  threads.Set("share", Napi::Number::From(env, budget.share));
+  threads.Set("vips", Napi::Number::From(env, budget.vips));
+  stats.Set("threads", threads);
+  stats.Set("commands", commands);
+  return stats;
+}
+
 void *checkTypes(GType type, Napi::Object *formats) {
   VipsObjectClass *c = VIPS_OBJECT_CLASS(g_type_class_ref(type));
 
@@ -128,8 +352,8 @@ Napi::Value ImgInit(const Napi::CallbackInfo &info) {
   // Disable caching to minimize memory footprint
   vips_cache_set_max(0);
   vips_cache_set_max_mem(0);
-  // Limit concurrency to reduce peak memory usage
-  vips_concurrency_set(2);
+  // Limit concurrency to reduce peak memory usage, the cores are shared out between jobs from here on
+  GetThreadBudget().Configure(std::thread::hardware_concurrency(), VIPS_MAX_CONCURRENCY);
 #if VIPS_MAJOR_VERSION >= 8 && VIPS_MINOR_VERSION >= 13
   vips_block_untrusted_set(true);
   vips_operation_block_set("VipsForeignLoad", true);
@@ -139,6 +363,10 @@ Napi::Value ImgInit(const Napi::CallbackInfo &info) {
   vips_operation_block_set("VipsForeignLoadWebp", false);
   vips_operation_block_set("VipsForeignLoadHeif", false);
 #endif
+  // Fonts only need to be registered once, jobs will do it themselves if we don't know where the assets are yet
+  if (info.Length() > 0 && info[0].IsString()) {
+    GetFonts(info[0].As<Napi::String>().Utf8Value());
+  }
   Napi::Object formats = Napi::Object::New(info.Env());
   vips_type_map_all(g_type_from_name("VipsForeignLoad"), (VipsTypeMapFn)checkTypes, &formats);
   return formats;
@@ -146,8 +374,13 @@ Napi::Value ImgInit(const Napi::CallbackInfo &info) {
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
   exports.Set(Napi::String::New(env, "image"), Napi::Function::New(env, ProcessImage));
+  exports.Set(Napi::String::New(env, "pipeline"), Napi::Function::New(env, Pipeline));
   exports.Set(Napi::String::New(env, "imageInit"), Napi::Function::New(env, ImgInit));
   exports.Set(Napi::String::New(env, "trim"), Napi::Function::New(env, Trim));
+  exports.Set(Napi::String::New(env, "cacheStats"), Napi::Function::New(env, CacheStats));
+  exports.Set(Napi::String::New(env, "cacheLimits"), Napi::Function::New(env, CacheLimits));
+  exports.Set(Napi::String::New(env, "threadLimits"), Napi::Function::New(env, ThreadLimits));
+  exports.Set(Napi::String::New(env, "stats"), Napi::Function::New(env, Stats));
 
   Napi::Array arr = Napi::Array::New(env);
   size_t i = 0;
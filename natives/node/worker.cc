@@ -3,27 +3,38 @@
 
 using namespace std;
 
-ImageAsyncWorker::ImageAsyncWorker(Napi::Env &env, Promise::Deferred deferred, string command, ArgumentMap inArgs,
-                                   string type, const char *bufData, size_t bufSize)
-    : AsyncWorker(env), deferred(deferred), command(command), inArgs(inArgs), type(type), bufData(bufData),
-      bufSize(bufSize) {}
+ImageAsyncWorker::ImageAsyncWorker(Napi::Env &env, Promise::Deferred deferred, std::vector<PipelineStep> steps,
+                                   string type, const char *bufData, size_t bufSize, std::shared_ptr<JobControl> job)
+    : AsyncWorker(env), deferred(deferred), steps(std::move(steps)), type(type), bufData(bufData), bufSize(bufSize),
+      job(std::move(job)) {}
 
 void ImageAsyncWorker::Execute() {
-  outType = GetArgumentWithFallback<bool>(inArgs, "togif", false) ? "gif" : type;
-  shouldKill = false;
+  outType = steps.size() == 1 && steps[0].arguments->togif ? "gif" : type;
+  // cancelled before a thread was free to pick it up
+  CheckJob(job.get());
+  job->Progress("decode", 0, 0, true);
 
-  if (bufSize != 0) {
-    outArgs = FunctionMap.at(command)(type, outType, bufData, bufSize, inArgs, &shouldKill);
+  if (steps.size() == 1) {
+    outArgs = RunCommand(steps[0].command, type, outType, bufData, bufSize, *steps[0].arguments, *job);
   } else {
-    outArgs = NoInputFunctionMap.at(command)(type, outType, inArgs, &shouldKill);
+    outArgs = RunPipeline(steps, type, outType, bufData, bufSize, *job);
   }
 }
 
+void ImageAsyncWorker::PinInput(Napi::Object data) { input = ObjectReference::New(data, 1); }
+
+void ImageAsyncWorker::Finish() {
+  input.Reset();
+  job->onProgress = nullptr;
+  if (progress) progress.Release();
+}
+
 void ImageAsyncWorker::OnError(const Error &e) {
+  Finish();
   std::string detail = vips_error_buffer();
   vips_error_clear();
   vips_thread_shutdown();
-  if (shouldKill) {
+  if (job->Stopped()) {
     deferred.Reject(Napi::Error::New(Env(), "image_job_killed").Value());
   } else {
     Napi::Error err = Napi::Error::New(Env(), e.Message());
@@ -36,11 +47,13 @@ void ImageAsyncWorker::OnError(const Error &e) {
 }
 
 void ImageAsyncWorker::OnOK() {
+  Finish();
   vips_error_clear();
   vips_thread_shutdown();
   // Check if an error occurred during processing
   if (MapContainsKey(outArgs, "error")) {
-    string errorMsg = GetArgument<string>(outArgs, "error");
+    // commands that run external tools report a killed job as a plain failure
+    string errorMsg = job->Stopped() ? "image_job_killed" : GetArgument<string>(outArgs, "error");
     deferred.Reject(Napi::Error::New(Env(), errorMsg).Value());
     return;
   }
@@ -48,12 +61,27 @@ void ImageAsyncWorker::OnOK() {
   size_t outSize = GetArgumentWithFallback<size_t>(outArgs, "size", 0);
   if (outSize > 0) {
     char *buf = GetArgument<char *>(outArgs, "buf");
-    nodeBuf = Buffer<char>::Copy(Env(), buf, outSize);
-    g_free(buf);
+    BufferFree freeBuf = GetArgumentWithFallback<BufferFree>(outArgs, "free", g_free);
+    // Hand the native buffer straight to V8 instead of copying it on the main thread, it gets freed with the
+    // command's own allocator once JS is done with it. Runtimes that don't allow external buffers get a copy.
+    nodeBuf = Buffer<char>::NewOrCopy(Env(), buf, outSize, [freeBuf](Napi::Env, char *data) { freeBuf(data); });
   }
 
   Napi::Object returned = Napi::Object::New(Env());
   returned.Set("data", nodeBuf);
   returned.Set("type", Napi::String::New(Env(), outType));
+  // only there when the result had to be re-encoded to fit the budget
+  if (MapContainsKey(outArgs, "encode.attempts")) {
+    Napi::Object encode = Napi::Object::New(Env());
+    encode.Set("attempts", Napi::Number::From(Env(), GetArgument<int>(outArgs, "encode.attempts")));
+    encode.Set("scale", Napi::Number::From(Env(), GetArgument<float>(outArgs, "encode.scale")));
+    encode.Set("frameStep", Napi::Number::From(Env(), GetArgument<int>(outArgs, "encode.frameStep")));
+    encode.Set("quality", Napi::Number::From(Env(), GetArgument<int>(outArgs, "encode.quality")));
+    encode.Set("effort", Napi::Number::From(Env(), GetArgument<int>(outArgs, "encode.effort")));
+    encode.Set("bitdepth", Napi::Number::From(Env(), GetArgument<int>(outArgs, "encode.bitdepth")));
+    encode.Set("maxError", Napi::Number::From(Env(), GetArgument<float>(outArgs, "encode.maxError")));
+    returned.Set("encode", encode);
+  }
+  if (GetArgumentWithFallback<bool>(outArgs, "overBudget", false)) returned.Set("overBudget", true);
   deferred.Resolve(returned);
 }
@@ -2,32 +2,44 @@
 #include "../common.h"
 #include <napi.h>
 
+#include <memory>
+#include <vector>
+
 using namespace Napi;
 
 class ImageAsyncWorker : public AsyncWorker {
 public:
-  ImageAsyncWorker(Napi::Env &env, Promise::Deferred deferred, string command, ArgumentMap inArgs, string type,
-                   const char *bufData, size_t bufSize);
+  // A single step runs as a plain command, more than one goes through RunPipeline
+  ImageAsyncWorker(Napi::Env &env, Promise::Deferred deferred, std::vector<PipelineStep> steps, string type,
+                   const char *bufData, size_t bufSize, std::shared_ptr<JobControl> job);
   virtual ~ImageAsyncWorker() {};
 
   void Execute();
   void OnError(const Error &e);
   void OnOK();
 
-  void SetKill() { shouldKill = true; }
+  // Keeps the input ArrayBuffer alive while the job reads from it on another thread
+  void PinInput(Napi::Object data);
+  // Progress updates are delivered through this until the job settles
+  void SetProgress(ThreadSafeFunction tsfn) { progress = tsfn; }
 
 private:
+  // Drops everything that has to be released on the main thread once the job is done
+  void Finish();
+
   Promise::Deferred deferred;
 
-  string command;
-  ArgumentMap inArgs;
+  std::vector<PipelineStep> steps;
   string type;
 
   const char *bufData;
   size_t bufSize;
+  ObjectReference input;
+  ThreadSafeFunction progress;
 
   ArgumentMap outArgs;
   string outType;
 
-  bool shouldKill;
+  // shared with the cancel() function handed to JS, which can outlive the worker
+  std::shared_ptr<JobControl> job;
 };
@@ -0,0 +1,117 @@
+#include <vips/vips8>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "common.h"
+
+using namespace std;
+using namespace vips;
+
+// Clamps every pixel of a coordinate image to [low, high]
+static VImage Clamp(VImage coords, double low, double high) {
+  return (coords < low).ifthenelse(low, (coords > high).ifthenelse(high, coords));
+}
+
+// Which page each row of a strip of pages that are pageHeight tall belongs to, and where it is in that page
+static void PageRows(VImage rows, int pageHeight, VImage &page, VImage &row) {
+  page = (rows / pageHeight).floor();
+  row = rows - page * pageHeight;
+}
+
+VImage PageEmbed(VImage in, int nPages, int x, int y, int width, int height, const vector<double> &background) {
+  if (nPages <= 1) {
+    return in.embed(x, y, width, height,
+                    VImage::option()->set("extend", VIPS_EXTEND_BACKGROUND)->set("background", background));
+  }
+
+  int inWidth = in.width();
+  int inPageHeight = in.height() / nPages;
+  VImage xy = VImage::xyz(width, height * nPages);
+  VImage page, row;
+  PageRows(xy[1], height, page, row);
+  VImage srcX = xy[0] - x;
+  VImage srcY = row - y;
+  VImage inside = (srcX >= 0) & (srcX < inWidth) & (srcY >= 0) & (srcY < inPageHeight);
+  // pixels outside the page are replaced with the background, but still read from their own page so mapim never
+  // asks for rows that a sequential loader has already passed
+  VImage index = Clamp(srcX, 0, inWidth - 1).bandjoin(Clamp(srcY, 0, inPageHeight - 1) + page * inPageHeight);
+  VImage mapped = in.mapim(index, VImage::option()->set("interpolate", VInterpolate::new_from_name("nearest")));
+
+  VImage out = inside.ifthenelse(mapped, background);
+  out.set(VIPS_META_PAGE_HEIGHT, height);
+  return out;
+}
+
+VImage PageJoin(VImage in, int nPages, VImage band, bool above, const vector<double> &background) {
+  int pageHeight = in.height() / max(1, nPages);
+  int width = max(in.width(), band.width());
+  int height = pageHeight + band.height();
+  int bandY = above ? 0 : pageHeight;
+
+  VImage pages = PageEmbed(in, nPages, 0, above ? band.height() : 0, width, height, background);
+  VImage layer =
+    band
+      .embed(0, bandY, width, height,
+             VImage::option()->set("extend", VIPS_EXTEND_BACKGROUND)->set("background", background))
+      .replicate(1, nPages);
+  // the band's pixels are copied as they are like join does, not composited
+  VImage mask = (VImage::black(band.width(), band.height()) + 255)
+                  .cast(VIPS_FORMAT_UCHAR)
+                  .embed(0, bandY, width, height)
+                  .replicate(1, nPages);
+
+  VImage out = mask.ifthenelse(layer, pages);
+  out.set(VIPS_META_PAGE_HEIGHT, height);
+  return out;
+}
+
+VImage PageLayer(VImage in, int nPages, VImage layer, int x, int y) {
+  int pageHeight = in.height() / max(1, nPages);
+  VImage replicated = layer.embed(x, y, in.width(), pageHeight)
+                        .copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB))
+                        .replicate(1, nPages);
+  VImage out = in.composite2(replicated, VIPS_BLEND_MODE_OVER);
+  out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
+  return out;
+}
+
+VImage PageResize(VImage in, int nPages, int width, int height) {
+  double hscale = (double)width / (double)in.width();
+  int inPageHeight = in.height() / max(1, nPages);
+  double vscale = (double)height / (double)inPageHeight;
+  if (nPages <= 1) return in.resize(hscale, VImage::option()->set("vscale", vscale));
+
+  // resizing across only mixes pixels from the same row, so it can't mix pages up
+  VImage across = in.resize(hscale, VImage::option()->set("vscale", 1.0));
+  // Down the strip, resize's kernel would blend each page's edges with its neighbours. Every row is interpolated from
+  // two rows of its own page instead. That skips rows when shrinking more than 2x, so like resize does, runs of
+  // shrink rows are averaged into one first. Pages are padded with their last row to a multiple of shrink so no run
+  // reaches into the next page.
+  int rows = inPageHeight;
+  double rowScale = vscale;
+  int shrink = (int)floor(1.0 / vscale);
+  if (shrink >= 2) {
+    int padded = (inPageHeight + shrink - 1) / shrink * shrink;
+    if (padded != inPageHeight) {
+      VImage xy = VImage::xyz(width, padded * nPages);
+      VImage page, row;
+      PageRows(xy[1], padded, page, row);
+      VImage index = xy[0].bandjoin(Clamp(row, 0, inPageHeight - 1) + page * inPageHeight);
+      across = across.mapim(index, VImage::option()->set("interpolate", VInterpolate::new_from_name("nearest")));
+    }
+    across = across.shrinkv(shrink);
+    rows = padded / shrink;
+    rowScale = vscale * shrink;
+  }
+
+  VImage xy = VImage::xyz(width, height * nPages);
+  VImage page, row;
+  PageRows(xy[1], height, page, row);
+  VImage srcY = Clamp((row + 0.5) / rowScale - 0.5, 0, rows - 1) + page * rows;
+  VImage out =
+    across.mapim(xy[0].bandjoin(srcY), VImage::option()->set("interpolate", VInterpolate::new_from_name("bilinear")));
+  out.set(VIPS_META_PAGE_HEIGHT, height);
+  return out;
+}
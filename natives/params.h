@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <string>
+
+#include "args.h"
+
+using std::string;
+
+// Parameter structs for each command, along with the schema the front ends use to fill them in.
+// Field names match the keys sent from the JS side.
+
+struct NoParams {
+  static constexpr std::array<ArgField<NoParams>, 0> fields{};
+};
+
+// Commands that only need to know where the assets are
+struct AssetParams {
+  string basePath;
+  static constexpr auto fields = std::array{RequiredArg("basePath", &AssetParams::basePath)};
+};
+
+// Commands that put a single caption on top of an asset
+struct TextAssetParams {
+  string caption;
+  string basePath;
+  static constexpr auto fields = std::array{RequiredArg("caption", &TextAssetParams::caption),
+                                            RequiredArg("basePath", &TextAssetParams::basePath)};
+};
+
+struct BlurParams {
+  bool sharp;
+  static constexpr auto fields = std::array{Arg("sharp", &BlurParams::sharp, false)};
+};
+
+struct CaptionParams {
+  string caption;
+  string font;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("caption", &CaptionParams::caption), RequiredArg("font", &CaptionParams::font),
+               RequiredArg("basePath", &CaptionParams::basePath)};
+};
+
+struct CaptionTwoParams {
+  bool top;
+  string caption;
+  string font;
+  string basePath;
+  static constexpr auto fields =
+    std::array{Arg("top", &CaptionTwoParams::top, false), RequiredArg("caption", &CaptionTwoParams::caption),
+               RequiredArg("font", &CaptionTwoParams::font), RequiredArg("basePath", &CaptionTwoParams::basePath)};
+};
+
+struct ColorsParams {
+  string color;
+  int shift;
+  static constexpr auto fields =
+    std::array{RequiredArg("color", &ColorsParams::color), Arg("shift", &ColorsParams::shift, 0)};
+};
+
+struct DistortParams {
+  string mapName;
+  string basePath;
+  static constexpr auto fields = std::array{RequiredArg("mapName", &DistortParams::mapName),
+                                            RequiredArg("basePath", &DistortParams::basePath)};
+};
+
+struct FadeParams {
+  bool alpha;
+  static constexpr auto fields = std::array{Arg("alpha", &FadeParams::alpha, false)};
+};
+
+struct FlagParams {
+  string overlay;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("overlay", &FlagParams::overlay), RequiredArg("basePath", &FlagParams::basePath)};
+};
+
+struct FlipParams {
+  bool flop;
+  static constexpr auto fields = std::array{Arg("flop", &FlipParams::flop, false)};
+};
+
+struct FreezeParams {
+  bool loop;
+  int frame;
+  static constexpr auto fields =
+    std::array{Arg("loop", &FreezeParams::loop, false), Arg("frame", &FreezeParams::frame, -1, -1)};
+};
+
+struct JpegParams {
+  int quality;
+  static constexpr auto fields = std::array{Arg("quality", &JpegParams::quality, 1, 1, 100)};
+};
+
+struct MemeParams {
+  string topText;
+  string bottomText;
+  string font;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("topText", &MemeParams::topText), RequiredArg("bottomText", &MemeParams::bottomText),
+               RequiredArg("font", &MemeParams::font), RequiredArg("basePath", &MemeParams::basePath)};
+};
+
+struct MirrorParams {
+  bool vertical;
+  bool first;
+  static constexpr auto fields =
+    std::array{Arg("vertical", &MirrorParams::vertical, false), Arg("first", &MirrorParams::first, false)};
+};
+
+struct QuoteParams {
+  string text;
+  string username;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("text", &QuoteParams::text), RequiredArg("username", &QuoteParams::username),
+               RequiredArg("basePath", &QuoteParams::basePath)};
+};
+
+struct QrCreateParams {
+  string text;
+  static constexpr auto fields = std::array{RequiredArg("text", &QrCreateParams::text)};
+};
+
+struct ResizeParams {
+  bool stretch;
+  bool wide;
+  int amount;
+  static constexpr auto fields =
+    std::array{Arg("stretch", &ResizeParams::stretch, false), Arg("wide", &ResizeParams::wide, false),
+               Arg("amount", &ResizeParams::amount, 19, 1)};
+};
+
+struct ReverseParams {
+  bool soos;
+  static constexpr auto fields = std::array{Arg("soos", &ReverseParams::soos, false)};
+};
+
+struct SnapchatParams {
+  string caption;
+  float pos;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("caption", &SnapchatParams::caption), Arg("pos", &SnapchatParams::pos, 0.565f, 0.0f, 1.0f),
+               RequiredArg("basePath", &SnapchatParams::basePath)};
+};
+
+struct SonicParams {
+  string text;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("text", &SonicParams::text), RequiredArg("basePath", &SonicParams::basePath)};
+};
+
+struct SpeedParams {
+  bool slow;
+  int speed;
+  static constexpr auto fields =
+    std::array{Arg("slow", &SpeedParams::slow, false), Arg("speed", &SpeedParams::speed, 2, 1)};
+};
+
+struct UncannyParams {
+  string caption;
+  string caption2;
+  string font;
+  string path;
+  string basePath;
+  static constexpr auto fields =
+    std::array{RequiredArg("caption", &UncannyParams::caption), RequiredArg("caption2", &UncannyParams::caption2),
+               RequiredArg("font", &UncannyParams::font), RequiredArg("path", &UncannyParams::path),
+               RequiredArg("basePath", &UncannyParams::basePath)};
+};
+
+struct UncaptionParams {
+  float tolerance;
+  static constexpr auto fields = std::array{Arg("tolerance", &UncaptionParams::tolerance, 0.5f, 0.0f, 1.0f)};
+};
+
+struct WatermarkParams {
+  string water;
+  int gravity;
+  bool resize;
+  float yscale;
+  bool append;
+  bool alpha;
+  bool flipX;
+  bool flipY;
+  bool mc;
+  string basePath;
+  static constexpr auto fields = std::array{
+    RequiredArg("water", &WatermarkParams::water), Arg("gravity", &WatermarkParams::gravity, 1, 1, 9),
+    Arg("resize", &WatermarkParams::resize, false),  Arg("yscale", &WatermarkParams::yscale, 0.0f),
+    Arg("append", &WatermarkParams::append, false),  Arg("alpha", &WatermarkParams::alpha, false),
+    Arg("flipX", &WatermarkParams::flipX, false),    Arg("flipY", &WatermarkParams::flipY, false),
+    Arg("mc", &WatermarkParams::mc, false),          RequiredArg("basePath", &WatermarkParams::basePath)};
+};
+
+struct VideoSpeedParams {
+  float speed;
+  bool slow;
+  static constexpr auto fields = std::array{Arg("speed", &VideoSpeedParams::speed, 2.0f, 0.25f, 4.0f),
+                                            Arg("slow", &VideoSpeedParams::slow, false)};
+};
+
+struct VideoCaptionParams {
+  string caption;
+  string position;
+  int fontSize;
+  string font;
+  string basePath;
+  static constexpr auto fields =
+    std::array{Arg("caption", &VideoCaptionParams::caption, ""), Arg("position", &VideoCaptionParams::position, "top"),
+               Arg("font_size", &VideoCaptionParams::fontSize, 32, 12, 72),
+               Arg("font", &VideoCaptionParams::font, "futura"),
+               RequiredArg("basePath", &VideoCaptionParams::basePath)};
+};
+
+struct VideoToGifParams {
+  int fps;
+  int width;
+  static constexpr auto fields = std::array{Arg("fps", &VideoToGifParams::fps, 15, 5, 30),
+                                            Arg("width", &VideoToGifParams::width, 480, 120, 720)};
+};
+
+struct VideoTrimParams {
+  float start;
+  float duration;
+  static constexpr auto fields = std::array{Arg("start", &VideoTrimParams::start, 0.0f, 0.0f),
+                                            Arg("duration", &VideoTrimParams::duration, 10.0f, 0.5f, 60.0f)};
+};
+
+struct VideoMemeParams {
+  string top;
+  string bottom;
+  int fontSize;
+  string font;
+  string basePath;
+  static constexpr auto fields =
+    std::array{Arg("top", &VideoMemeParams::top, ""), Arg("bottom", &VideoMemeParams::bottom, ""),
+               Arg("font_size", &VideoMemeParams::fontSize, 48, 16, 96), Arg("font", &VideoMemeParams::font, "impact"),
+               RequiredArg("basePath", &VideoMemeParams::basePath)};
+};
+
+struct VideoStitchParams {
+  string buffer2;
+  static constexpr auto fields = std::array{BufferArg("buffer2", &VideoStitchParams::buffer2)};
+};
@@ -10,9 +10,9 @@
 
 #include "common.h"
 
-ArgumentMap QrCreate([[maybe_unused]] const string &type, string &outType, ArgumentMap arguments,
-                     [[maybe_unused]] bool *shouldKill) {
-  string text = GetArgument<string>(arguments, "text");
+ArgumentMap QrCreate([[maybe_unused]] const string &type, string &outType, const QrCreateParams &arguments,
+                     [[maybe_unused]] JobControl *job) {
+  const string &text = arguments.text;
 
   auto writer =
     ZXing::MultiFormatWriter(ZXing::BarcodeFormat::QRCode).setMargin(1).setEncoding(ZXing::CharacterSet::UTF8);
@@ -34,13 +34,14 @@ ArgumentMap QrCreate([[maybe_unused]] const string &type, string &outType, Argum
 
   ArgumentMap output;
   output["buf"] = buf;
+  output["free"] = g_free;
   output["size"] = dataSize;
 
   return output;
 }
 
 ArgumentMap QrRead([[maybe_unused]] const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   [[maybe_unused]] ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
+                   [[maybe_unused]] const NoParams &arguments, [[maybe_unused]] JobControl *job) {
   vips::VOption *options = vips::VImage::option()->set("access", "sequential");
 
   vips::VImage in = vips::VImage::new_from_buffer(bufferdata, bufferLength, "", options)
@@ -83,6 +84,8 @@ ArgumentMap QrRead([[maybe_unused]] const string &type, string &outType, const c
   memcpy(data, resultText.c_str(), dataSize);
 
   output["buf"] = data;
+
+  output["free"] = free;
   output["size"] = dataSize;
   outType = "text";
   return output;
@@ -7,14 +7,12 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Quote(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                  ArgumentMap arguments, bool *shouldKill) {
-  string text = GetArgument<string>(arguments, "text");
-  string username = GetArgument<string>(arguments, "username");
-  string basePath = GetArgument<string>(arguments, "basePath");
-
-  VImage avatar = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                    .colourspace(VIPS_INTERPRETATION_sRGB);
+VImage Quote(VImage in, ImageState &state, const QuoteParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &text = arguments.text;
+  const string &username = arguments.username;
+  const string &basePath = arguments.basePath;
+
+  VImage avatar = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!avatar.has_alpha()) avatar = avatar.bandjoin(255);
 
   VImage alpha = avatar.extract_band(avatar.bands() - 1);
@@ -54,9 +52,7 @@ ArgumentMap Quote(const string &type, string &outType, const char *bufferdata, s
     avatarCanvas, VIPS_BLEND_MODE_OVER,
     VImage::option()->set("x", framePadding)->set("y", framePadding));
 
-  LoadFonts(basePath);
-
-  string fontPath = basePath + "assets/fonts/Ubuntu.ttf";
+  const char *fontFile = GetFonts(basePath).File("ubuntu");
 
   const int textWidth = 720;
   VImage nameImage = VImage::text(
@@ -64,7 +60,7 @@ ArgumentMap Quote(const string &type, string &outType, const char *bufferdata, s
     VImage::option()
       ->set("rgba", true)
       ->set("font", "Ubuntu 58")
-      ->set("fontfile", fontPath.c_str())
+      ->set("fontfile", fontFile)
   ->set("align", VIPS_ALIGN_LOW)
       ->set("width", textWidth));
 
@@ -73,7 +69,7 @@ ArgumentMap Quote(const string &type, string &outType, const char *bufferdata, s
     VImage::option()
       ->set("rgba", true)
       ->set("font", "Ubuntu 46")
-      ->set("fontfile", fontPath.c_str())
+      ->set("fontfile", fontFile)
   ->set("align", VIPS_ALIGN_LOW)
       ->set("wrap", VIPS_TEXT_WRAP_WORD)
       ->set("width", textWidth));
@@ -121,17 +117,7 @@ ArgumentMap Quote(const string &type, string &outType, const char *bufferdata, s
     textBlock, VIPS_BLEND_MODE_OVER,
     VImage::option()->set("x", textX)->set("y", textY));
 
-  SetupTimeoutCallback(composed, shouldKill);
-
-  outType = "png";
-
-  char *buf;
-  size_t dataSize = 0;
-  composed.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.outType = "png";
 
-  return output;
+  return composed;
 }
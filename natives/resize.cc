@@ -5,30 +5,18 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Resize(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                   ArgumentMap arguments, bool *shouldKill) {
-  bool stretch = GetArgumentWithFallback<bool>(arguments, "stretch", false);
-  bool wide = GetArgumentWithFallback<bool>(arguments, "wide", false);
-  int wideAmount = GetArgumentWithFallback<int>(arguments, "amount", 19);
-
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false));
+VImage Resize(VImage in, ImageState &state, const ResizeParams &arguments, [[maybe_unused]] JobControl *job) {
+  bool stretch = arguments.stretch;
+  bool wide = arguments.wide;
+  int wideAmount = arguments.amount;
 
   VImage out;
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
-  try {
-    in = NormalizeVips(in, &width, &pageHeight, nPages);
-  } catch (int e) {
-    if (e == -1) {
-      ArgumentMap output;
-      output["buf"] = "";
-      outType = "frames";
-      return output;
-    }
-  }
+  in = NormalizeVips(in, &width, &pageHeight, nPages);
 
   int finalHeight = 0;
   if (stretch) {
@@ -51,15 +39,5 @@ ArgumentMap Resize(const string &type, string &outType, const char *bufferdata,
   }
   out.set(VIPS_META_PAGE_HEIGHT, finalHeight);
 
-  SetupTimeoutCallback(out, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  out.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return out;
 }
@@ -5,39 +5,17 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Reverse([[maybe_unused]] const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                    ArgumentMap arguments, bool *shouldKill) {
-  bool soos = GetArgumentWithFallback<bool>(arguments, "soos", false);
-
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, false, false));
+VImage Reverse(VImage in, ImageState &state, const ReverseParams &arguments, [[maybe_unused]] JobControl *job) {
+  bool soos = arguments.soos;
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
-
-  try {
-    in = NormalizeVips(in, &width, &pageHeight, nPages);
-  } catch (int e) {
-    if (e == -1) {
-      ArgumentMap output;
-      output["buf"] = "";
-      outType = "frames";
-      return output;
-    }
-  }
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   // this command is useless with single-page images
-  if (nPages < 2) {
-    size_t dataSize = bufferLength;
-    char *data = reinterpret_cast<char *>(malloc(bufferLength));
-    memcpy(data, bufferdata, bufferLength);
+  if (nPages < 2) return in;
 
-    ArgumentMap output;
-    output["buf"] = data;
-    output["size"] = dataSize;
-
-    return output;
-  }
+  in = NormalizeVips(in, &width, &pageHeight, nPages);
 
   vector<VImage> out;
   vector<int> delaysOut;
@@ -67,18 +45,9 @@ ArgumentMap Reverse([[maybe_unused]] const string &type, string &outType, const
   final.set(VIPS_META_PAGE_HEIGHT, pageHeight);
   final.set("delay", delaysOut);
 
-  if (outType != "webp") outType = "gif";
-
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(outType == "webp" ? ".webp" : ".gif", reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0) : 0);
+  if (state.outType != "webp") state.outType = "gif";
 
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.dither = 0;
 
-  return output;
+  return final;
 }
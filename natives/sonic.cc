@@ -5,14 +5,15 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Sonic([[maybe_unused]] const string &type, string &outType, ArgumentMap arguments, bool *shouldKill) {
-  string text = GetArgument<string>(arguments, "text");
-  string basePath = GetArgument<string>(arguments, "basePath");
+ArgumentMap Sonic([[maybe_unused]] const string &type, string &outType, const SonicParams &arguments,
+                  JobControl *job) {
+  const string &text = arguments.text;
+  const string &basePath = arguments.basePath;
 
   string assetPath = basePath + "assets/images/sonic.jpg";
-  VImage bg = VImage::new_from_file(assetPath.c_str());
+  VImage bg = LoadAsset(assetPath);
 
-  LoadFonts(basePath);
+  GetFonts(basePath);
   VImage textImage =
     VImage::text(("<span foreground=\"white\">" + text + "</span>").c_str(), VImage::option()
                                                                                ->set("rgba", true)
@@ -24,7 +25,7 @@ ArgumentMap Sonic([[maybe_unused]] const string &type, string &outType, Argument
 
   VImage out = bg.composite2(textImage, VIPS_BLEND_MODE_OVER, VImage::option()->set("x", 391)->set("y", 84));
 
-  SetupTimeoutCallback(out, shouldKill);
+  SetupTimeoutCallback(out, job);
 
   char *buf;
   size_t dataSize = 0;
@@ -32,6 +33,7 @@ ArgumentMap Sonic([[maybe_unused]] const string &type, string &outType, Argument
 
   ArgumentMap output;
   output["buf"] = buf;
+  output["free"] = g_free;
   output["size"] = dataSize;
 
   return output;
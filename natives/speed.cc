@@ -3,18 +3,12 @@
 #include <vips/vips8>
 
 #include "common.h"
+#include "gifindex.h"
 
 using namespace std;
 using namespace vips;
 
-void *memset16(void *m, uint16_t val, size_t count) {
-  uint16_t *buf = (uint16_t *)m;
-
-  while (count--) *buf++ = val;
-  return m;
-}
-
-char *vipsRemove(const char *data, size_t length, size_t &dataSize, int speed, string suffix, bool *shouldKill) {
+char *vipsRemove(const char *data, size_t length, size_t &dataSize, int speed, string suffix, JobControl *job) {
   VOption *options = VImage::option()->set("access", "sequential");
 
   VImage in = VImage::new_from_buffer(data, length, "", options->set("n", -1));
@@ -32,7 +26,7 @@ char *vipsRemove(const char *data, size_t length, size_t &dataSize, int speed, s
   VImage out = VImage::arrayjoin(img, VImage::option()->set("across", 1));
   out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
 
-  SetupTimeoutCallback(out, shouldKill);
+  SetupTimeoutCallback(out, job);
 
   char *buf;
   out.write_to_buffer(suffix.c_str(), reinterpret_cast<void **>(&buf), &dataSize);
@@ -40,57 +34,116 @@ char *vipsRemove(const char *data, size_t length, size_t &dataSize, int speed, s
   return buf;
 }
 
+static uint32_t ReadUint24LE(const unsigned char *buffer) { return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16); }
+
+// Whether an ANMF frame comes out the same no matter what was on the canvas before it: it has to cover the whole
+// canvas, and either replace what's there or have nothing see-through to blend with
+static bool WebpKeyframe(unsigned char *frame, size_t size, uint32_t canvasWidth, uint32_t canvasHeight) {
+  if (size < 16) return false;
+  if (ReadUint24LE(frame) != 0 || ReadUint24LE(frame + 3) != 0 || ReadUint24LE(frame + 6) + 1 != canvasWidth ||
+      ReadUint24LE(frame + 9) + 1 != canvasHeight)
+    return false;
+  if (frame[15] & 0x02) return true;
+
+  size_t position = 16;
+  while (position + 8 <= size) {
+    const unsigned char *fourCC = frame + position;
+    uint32_t chunkSize = readUint32LE(frame + position + 4);
+    if (memcmp(fourCC, "ALPH", 4) == 0) return false;
+    // lossless frames carry an alpha_is_used bit in their header
+    if (memcmp(fourCC, "VP8L", 4) == 0) {
+      return chunkSize >= 5 && position + 13 <= size &&
+             !(readUint32LE(frame + position + 9) & (1 << 28));
+    }
+    if (memcmp(fourCC, "VP8 ", 4) == 0) return true;
+    position += 8 + chunkSize + (chunkSize % 2);
+  }
+  return false;
+}
+
+// Keeps every step-th ANMF chunk and fixes up the RIFF size, everything else in the file is copied as it is. Only
+// possible if each kept frame is a keyframe (see above), returns NULL otherwise.
+char *DecimateWebp(const char *data, size_t length, int step, size_t &dataSize, JobControl *job) {
+  unsigned char *bytes = reinterpret_cast<unsigned char *>(const_cast<char *>(data));
+  uint32_t canvasWidth = 0;
+  uint32_t canvasHeight = 0;
+  vector<pair<size_t, size_t>> kept;
+  size_t position = 12;
+  int frame = 0;
+  while (position + 8 <= length) {
+    CheckJob(job);
+    const char *fourCC = &data[position];
+    uint32_t chunkSize = readUint32LE(bytes + position + 4);
+    size_t next = position + 8 + chunkSize + (chunkSize % 2);
+    if (next > length) return NULL;
+
+    if (memcmp(fourCC, "VP8X", 4) == 0 && chunkSize >= 10) {
+      canvasWidth = ReadUint24LE(bytes + position + 12) + 1;
+      canvasHeight = ReadUint24LE(bytes + position + 15) + 1;
+    }
+    if (memcmp(fourCC, "ANMF", 4) != 0) {
+      kept.emplace_back(position, next);
+    } else if (frame++ % step == 0) {
+      if (frame > 1 && !WebpKeyframe(bytes + position + 8, chunkSize, canvasWidth, canvasHeight)) return NULL;
+      kept.emplace_back(position, next);
+    }
+    position = next;
+  }
+
+  dataSize = 12;
+  for (const auto &chunk : kept) dataSize += chunk.second - chunk.first;
+  char *out = reinterpret_cast<char *>(malloc(dataSize));
+  memcpy(out, data, 12);
+  size_t written = 12;
+  for (const auto &chunk : kept) {
+    memcpy(out + written, data + chunk.first, chunk.second - chunk.first);
+    written += chunk.second - chunk.first;
+  }
+  uint32_t riffSize = dataSize - 8;
+  for (int i = 0; i < 4; i++) out[4 + i] = static_cast<char>((riffSize >> (i * 8)) & 0xFF);
+  return out;
+}
+
 ArgumentMap Speed([[maybe_unused]] const string &type, [[maybe_unused]] string &outType, const char *bufferdata,
-                  size_t bufferLength, ArgumentMap arguments, bool *shouldKill) {
-  bool slow = GetArgumentWithFallback<bool>(arguments, "slow", false);
-  int speed = GetArgumentWithFallback<int>(arguments, "speed", 2);
+                  size_t bufferLength, const SpeedParams &arguments, JobControl *job) {
+  bool slow = arguments.slow;
+  int speed = arguments.speed;
 
   ArgumentMap output;
   size_t dataSize = 0;
 
   char *fileData = reinterpret_cast<char *>(malloc(bufferLength));
   memcpy(fileData, bufferdata, bufferLength);
+  BufferFree fileDataFree = free;
 
   if (type == "gif") {
-    char *match = const_cast<char *>("\x00\x21\xF9\x04");
-
-    vector<uint16_t> old_delays;
+    GifIndex index;
     bool removeFrames = false;
-    char *lastPos;
-
-    lastPos = reinterpret_cast<char *>(memchr(fileData, '\x00', bufferLength));
-    while (lastPos != NULL) {
-      if (memcmp(lastPos, match, 4) != 0) {
-        lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x00', (bufferLength - (lastPos - fileData)) - 1));
-        continue;
-      }
-      uint16_t old_delay;
-      memcpy(&old_delay, lastPos + 5, 2);
-      old_delays.push_back(old_delay);
-      lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x00', (bufferLength - (lastPos - fileData)) - 1));
-    }
-
-    int currentFrame = 0;
-    lastPos = reinterpret_cast<char *>(memchr(fileData, '\x00', bufferLength));
-    while (lastPos != NULL) {
-      if (memcmp(lastPos, match, 4) != 0) {
-        lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x00', (bufferLength - (lastPos - fileData)) - 1));
-        continue;
+    if (ParseGif(reinterpret_cast<const uint8_t *>(fileData), bufferLength, index, job)) {
+      // decide before patching anything, frames without a graphic control extension keep the default delay
+      for (const GifFrameInfo &frame : index.frames) {
+        if (frame.control != 0 && !slow && frame.delay / speed <= 1) {
+          removeFrames = true;
+          break;
+        }
       }
-      uint16_t new_delay = slow ? old_delays[currentFrame] * speed : old_delays[currentFrame] / speed;
-      if (!slow && new_delay <= 1) {
-        removeFrames = true;
-        break;
+      if (!removeFrames) {
+        for (const GifFrameInfo &frame : index.frames) {
+          if (frame.control == 0) continue;
+          int newDelay = slow ? min(frame.delay * speed, 65535) : frame.delay / speed;
+          fileData[frame.control + 4] = static_cast<uint8_t>(newDelay & 0xFF);
+          fileData[frame.control + 5] = static_cast<uint8_t>((newDelay >> 8) & 0xFF);
+        }
       }
-
-      memset16(lastPos + 5, new_delay, 1);
-
-      lastPos = reinterpret_cast<char *>(memchr(lastPos + 1, '\x00', (bufferLength - (lastPos - fileData)) - 1));
-      ++currentFrame;
     }
 
     if (removeFrames) {
-      fileData = vipsRemove(bufferdata, bufferLength, dataSize, speed, ".gif", shouldKill);
+      free(fileData);
+      fileData = DecimateGif(bufferdata, index, speed, dataSize, job);
+      if (fileData == NULL) {
+        fileData = vipsRemove(bufferdata, bufferLength, dataSize, speed, ".gif", job);
+        fileDataFree = g_free;
+      }
     } else {
       dataSize = bufferLength;
     }
@@ -99,6 +152,10 @@ ArgumentMap Speed([[maybe_unused]] const string &type, [[maybe_unused]] string &
     bool removeFrames = false;
 
     while (position + 8 <= bufferLength) {
+      if (JobStopped(job)) {
+        free(fileData);
+        throw std::runtime_error("image_job_killed");
+      }
       const char *fourCC = &fileData[position];
       uint32_t chunkSize = readUint32LE(reinterpret_cast<unsigned char *>(fileData) + position + 4);
 
@@ -120,7 +177,12 @@ ArgumentMap Speed([[maybe_unused]] const string &type, [[maybe_unused]] string &
     }
 
     if (removeFrames) {
-      fileData = vipsRemove(bufferdata, bufferLength, dataSize, speed, ".webp", shouldKill);
+      free(fileData);
+      fileData = DecimateWebp(bufferdata, bufferLength, speed, dataSize, job);
+      if (fileData == NULL) {
+        fileData = vipsRemove(bufferdata, bufferLength, dataSize, speed, ".webp", job);
+        fileDataFree = g_free;
+      }
     } else {
       dataSize = bufferLength;
     }
@@ -129,7 +191,53 @@ ArgumentMap Speed([[maybe_unused]] const string &type, [[maybe_unused]] string &
   }
 
   output["buf"] = fileData;
+  output["free"] = fileDataFree;
   output["size"] = dataSize;
 
   return output;
 }
+
+// Pipeline version of Speed. The delays vips decoded are in milliseconds, so the same cutoff works for GIF and WebP.
+VImage SpeedImage(VImage in, [[maybe_unused]] ImageState &state, const SpeedParams &arguments, JobControl *job) {
+  bool slow = arguments.slow;
+  int speed = arguments.speed;
+
+  int nPages = vips_image_get_n_pages(in.get_image());
+  if (nPages < 2 || vips_image_get_typeof(in.get_image(), "delay") == 0) return in;
+
+  vector<int> delays = in.get_array_int("delay");
+  vector<int> newDelays;
+  newDelays.reserve(delays.size());
+  bool removeFrames = false;
+  for (int delay : delays) {
+    int newDelay = slow ? delay * speed : delay / speed;
+    if (!slow && newDelay <= 10) {
+      removeFrames = true;
+      break;
+    }
+    newDelays.push_back(newDelay);
+  }
+
+  if (!removeFrames) {
+    VImage out = in.copy();
+    out.set("delay", newDelays);
+    return out;
+  }
+
+  // delays would be too short for anything to play them back properly, so drop frames instead like vipsRemove does
+  int width = in.width();
+  int pageHeight = vips_image_get_page_height(in.get_image());
+
+  vector<VImage> img;
+  vector<int> keptDelays;
+  for (int i = 0; i < nPages; i += speed) {
+    CheckJob(job);
+    img.push_back(in.crop(0, i * pageHeight, width, pageHeight));
+    if (i < (int)delays.size()) keptDelays.push_back(delays[i]);
+  }
+  VImage out = VImage::arrayjoin(img, VImage::option()->set("across", 1));
+  out.set(VIPS_META_PAGE_HEIGHT, pageHeight);
+  if (!keptDelays.empty()) out.set("delay", keptDelays);
+
+  return out;
+}
@@ -5,30 +5,27 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Spotify(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                    ArgumentMap arguments, bool *shouldKill) {
-  string text = GetArgument<string>(arguments, "caption");
-  string basePath = GetArgument<string>(arguments, "basePath");
+VImage Spotify(VImage in, ImageState &state, const TextAssetParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &text = arguments.caption;
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   string assetPath = basePath + "assets/images/spotify.png";
-  VImage tmpl = VImage::new_from_file(assetPath.c_str());
+  VImage tmpl = LoadAsset(assetPath);
 
   int width = in.width();
-  int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   string captionText = "<span foreground=\"black\">" + text + "</span>";
 
-  LoadFonts(basePath);
+  const FontRegistry &fonts = GetFonts(basePath);
   VImage textImage =
     VImage::text(captionText.c_str(), VImage::option()
                                         ->set("rgba", true)
                                         ->set("font", "Circular Bold 78")
-                                        ->set("fontfile", (basePath + "assets/fonts/Circular.ttf").c_str())
+                                        ->set("fontfile", fonts.File("circular"))
                                         ->set("align", VIPS_ALIGN_CENTRE));
 
   VImage composited =
@@ -36,26 +33,10 @@ ArgumentMap Spotify(const string &type, string &outType, const char *bufferdata,
                     VImage::option()->set("x", (tmpl.width() / 2) - (textImage.width() / 2))->set("y", 195));
   VImage watermark = composited.resize((double)width / (double)composited.width());
 
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  for (int i = 0; i < nPages; i++) {
-    VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
-    VImage frame = watermark.join(img_frame, VIPS_DIRECTION_VERTICAL, VImage::option()->set("expand", true));
-    img.push_back(frame);
-  }
-  VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
-  final.set(VIPS_META_PAGE_HEIGHT, pageHeight + watermark.height());
+  VImage final = PageJoin(in, nPages, watermark, true, zeroVec);
 
-  SetupTimeoutCallback(final, shouldKill);
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return final;
 }
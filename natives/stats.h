@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define STATS_BUCKETS 32
+
+// Lock-free histogram with power-of-two buckets. Bucket 0 counts zeroes, bucket i counts values in [2^(i-1), 2^i),
+// and the last bucket also takes everything above that. Samples from different threads may interleave while a
+// snapshot is taken, so the fields of a snapshot are only consistent with each other once the jobs are done.
+class Histogram {
+public:
+  struct Snapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+
+    // Upper bound of the bucket the q-th quantile falls into (capped at the largest sample), 0 if nothing was recorded
+    uint64_t Quantile(double q) const {
+      uint64_t rank = (uint64_t)(q * (double)count);
+      uint64_t seen = 0;
+      for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return i == STATS_BUCKETS - 1 || UpperBound(i) > max ? max : UpperBound(i);
+      }
+      return max;
+    }
+  };
+
+  void Record(uint64_t value) {
+    int bucket = 0;
+    for (uint64_t v = value; v != 0 && bucket < STATS_BUCKETS - 1; v >>= 1) bucket++;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t prev = max.load(std::memory_order_relaxed);
+    while (prev < value && !max.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {}
+  }
+
+  Snapshot Get() const {
+    Snapshot out;
+    out.count = count.load(std::memory_order_relaxed);
+    out.sum = sum.load(std::memory_order_relaxed);
+    out.max = max.load(std::memory_order_relaxed);
+    for (int i = 0; i < STATS_BUCKETS; i++) out.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    return out;
+  }
+
+  void Reset() {
+    for (int i = 0; i < STATS_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+  }
+
+  // Largest value that lands in the given bucket
+  static uint64_t UpperBound(int bucket) { return bucket == 0 ? 0 : (UINT64_C(1) << bucket) - 1; }
+
+private:
+  std::atomic<uint64_t> buckets[STATS_BUCKETS] = {};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+};
+
+// Everything we keep track of for a single command. Times are in microseconds, memory in bytes,
+// graphNodes counts the images in the largest vips pipeline a job evaluated.
+struct CommandStats {
+  struct Snapshot {
+    uint64_t jobs;
+    uint64_t failures;
+    uint64_t timeouts;
+    Histogram::Snapshot total;
+    Histogram::Snapshot decode;
+    Histogram::Snapshot process;
+    Histogram::Snapshot encode;
+    Histogram::Snapshot inputBytes;
+    Histogram::Snapshot outputBytes;
+    Histogram::Snapshot frames;
+    Histogram::Snapshot memPeak;
+    Histogram::Snapshot graphNodes;
+  };
+
+  std::atomic<uint64_t> jobs{0};
+  std::atomic<uint64_t> failures{0};
+  std::atomic<uint64_t> timeouts{0};
+  Histogram total;
+  Histogram decode;
+  Histogram process;
+  Histogram encode;
+  Histogram inputBytes;
+  Histogram outputBytes;
+  Histogram frames;
+  Histogram memPeak;
+  Histogram graphNodes;
+
+  Snapshot Get() const {
+    return {jobs.load(std::memory_order_relaxed),
+            failures.load(std::memory_order_relaxed),
+            timeouts.load(std::memory_order_relaxed),
+            total.Get(),
+            decode.Get(),
+            process.Get(),
+            encode.Get(),
+            inputBytes.Get(),
+            outputBytes.Get(),
+            frames.Get(),
+            memPeak.Get(),
+            graphNodes.Get()};
+  }
+
+  void Reset() {
+    jobs.store(0, std::memory_order_relaxed);
+    failures.store(0, std::memory_order_relaxed);
+    timeouts.store(0, std::memory_order_relaxed);
+    total.Reset();
+    decode.Reset();
+    process.Reset();
+    encode.Reset();
+    inputBytes.Reset();
+    outputBytes.Reset();
+    frames.Reset();
+    memPeak.Reset();
+    graphNodes.Reset();
+  }
+};
@@ -5,12 +5,9 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Swirl(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                  [[maybe_unused]] ArgumentMap arguments, bool *shouldKill) {
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, false, false));
-
+VImage Swirl(VImage in, ImageState &state, [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
   int width = in.width();
   double newWidth = width * 3;
   double newHeight = pageHeight * 3;
@@ -36,9 +33,7 @@ ArgumentMap Swirl(const string &type, string &outType, const char *bufferdata, s
                         .copy(VImage::option()->set("format", VIPS_FORMAT_FLOAT)->set("bands", 2)) +
                       divSize;
 
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  for (int i = 0; i < nPages; i++) {
+  VImage final = JoinFrames(in, nPages, job, [&](int i) {
     VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
 
     VImage distort =
@@ -46,20 +41,9 @@ ArgumentMap Swirl(const string &type, string &outType, const char *bufferdata, s
         .gravity(VIPS_COMPASS_DIRECTION_CENTRE, newWidth, newHeight, VImage::option()->set("extend", VIPS_EXTEND_COPY))
         .mapim(distortion, VImage::option()->set("interpolate", VInterpolate::new_from_name("bicubic")));
     VImage frame = distort.crop(width, pageHeight, width, pageHeight);
-    img.push_back(frame);
-  }
-  VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
+    return frame;
+  });
   final.set(VIPS_META_PAGE_HEIGHT, pageHeight);
 
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
-
-  return output;
+  return final;
 }
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../gifindex.h"
+
+/*
+  Small files built byte by byte, so the tests know exactly where every block is. Entry i of the global palette is
+  (i, 255 - i, i / 2), of a local one (255 - i, i, 128).
+*/
+
+struct GifFixtureFrame {
+  // Palette indices of the whole canvas, row by row
+  std::vector<uint8_t> indices;
+  // In centiseconds
+  int delay = 10;
+  int disposal = 1;
+  int transparent = -1;
+  // Entries of the frame's own colour table (a power of 2), 0 uses the global one
+  int localPalette = 0;
+};
+
+struct GifFixture {
+  int width;
+  int height;
+  // Stored loop count of the NETSCAPE2.0 extension, -1 leaves it out
+  int loopCount = 0;
+  std::vector<GifFixtureFrame> frames;
+};
+
+inline void PushShort(std::vector<uint8_t> &out, int value) {
+  out.push_back(value & 0xFF);
+  out.push_back(value >> 8);
+}
+
+inline void PushPalette(std::vector<uint8_t> &out, int entries, bool local) {
+  for (int i = 0; i < entries; i++) {
+    out.push_back(local ? 255 - i : i);
+    out.push_back(local ? i : 255 - i);
+    out.push_back(local ? 128 : i / 2);
+  }
+}
+
+inline std::vector<uint8_t> BuildGif(const GifFixture &gif) {
+  std::vector<uint8_t> out = {'G', 'I', 'F', '8', '9', 'a'};
+  PushShort(out, gif.width);
+  PushShort(out, gif.height);
+  out.push_back(0xF7);
+  out.push_back(0);
+  out.push_back(0);
+  PushPalette(out, 256, false);
+
+  if (gif.loopCount >= 0) {
+    const char *netscape = "\x21\xFF\x0BNETSCAPE2.0\x03\x01";
+    out.insert(out.end(), netscape, netscape + 16);
+    PushShort(out, gif.loopCount);
+    out.push_back(0);
+  }
+
+  for (const GifFixtureFrame &frame : gif.frames) {
+    out.push_back(0x21);
+    out.push_back(0xF9);
+    out.push_back(4);
+    out.push_back((frame.disposal << 2) | (frame.transparent >= 0 ? 1 : 0));
+    PushShort(out, frame.delay);
+    out.push_back(frame.transparent >= 0 ? frame.transparent : 0);
+    out.push_back(0);
+
+    out.push_back(0x2C);
+    PushShort(out, 0);
+    PushShort(out, 0);
+    PushShort(out, gif.width);
+    PushShort(out, gif.height);
+    int bits = 0;
+    while (frame.localPalette > (2 << bits)) bits++;
+    out.push_back(frame.localPalette > 0 ? 0x80 | bits : 0);
+    PushPalette(out, frame.localPalette > 0 ? 2 << bits : 0, true);
+    std::vector<uint8_t> lzw;
+    LzwEncode(frame.indices, lzw);
+    out.insert(out.end(), lzw.begin(), lzw.end());
+  }
+  out.push_back(0x3B);
+  return out;
+}
+
+// A width x height frame of one palette index
+inline GifFixtureFrame FlatFrame(int width, int height, uint8_t index, int delay = 10) {
+  GifFixtureFrame frame;
+  frame.indices.assign((size_t)width * height, index);
+  frame.delay = delay;
+  return frame;
+}
+
+// The first count symbols of a de Bruijn sequence, where no two neighbouring symbols come up twice. Every symbol but
+// the first then gets an LZW code of its own.
+inline std::vector<uint8_t> DistinctPairs(size_t count) {
+  std::vector<uint8_t> out;
+  for (int a = 0; a < 256; a++) {
+    out.push_back(a);
+    for (int b = a + 1; b < 256; b++) {
+      out.push_back(a);
+      out.push_back(b);
+    }
+  }
+  out.resize(count);
+  return out;
+}
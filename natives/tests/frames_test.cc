@@ -0,0 +1,36 @@
+#include <vips/vips8>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../common.h"
+#include "test.h"
+
+using namespace std;
+using namespace vips;
+
+TEST(JoinFramesShardsLeaveThePhasesAlone) {
+  // enough threads left over from vips for the frames to be rendered in shards
+  GetThreadBudget().Configure(4, 1);
+  const int width = 4, height = 4, nPages = FRAME_SHARD_MIN_PAGES;
+  VImage in = VImage::black(width, height * nPages).cast(VIPS_FORMAT_UCHAR);
+  in.set(VIPS_META_PAGE_HEIGHT, height);
+
+  JobControl job;
+  mutex lock;
+  vector<string> phases;
+  job.onProgress = [&](const JobProgress &progress) {
+    lock_guard<mutex> guard(lock);
+    phases.push_back(progress.phase);
+  };
+  job.Begin();
+  VImage out = JoinFrames(in, nPages, &job, [&](int i) { return in.crop(0, i * height, width, height) + i; });
+  GetThreadBudget().Configure(1, 1);
+
+  // nothing has been encoded yet, or even started on the output pipeline
+  for (const string &phase : phases) CHECK(phase != "encode");
+  CHECK_EQ(job.PhaseTimes().encode, 0LL);
+  CHECK_EQ(out.height(), height * nPages);
+  CHECK_EQ(out.getpoint(0, height * (nPages - 1))[0], (double)(nPages - 1));
+}
@@ -0,0 +1,85 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../gifindex.h"
+#include "fixtures.h"
+#include "test.h"
+
+using namespace std;
+
+static GifFixture Frames(int count, int loopCount) {
+  GifFixture gif{4, 4, loopCount, {}};
+  for (int i = 0; i < count; i++) gif.frames.push_back(FlatFrame(4, 4, i * 10, i + 1));
+  return gif;
+}
+
+// Parses a malloc'd result into data and frees it
+static GifIndex ParseResult(char *buf, size_t size, vector<uint8_t> &data) {
+  data.assign(buf, buf + size);
+  free(buf);
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  return index;
+}
+
+TEST(TrimGifCopiesTheFirstFrames) {
+  vector<uint8_t> data = BuildGif(Frames(3, 0)), out;
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+
+  size_t size;
+  char *buf = TrimGif((const char *)data.data(), index, size, 2);
+  GifIndex trimmed = ParseResult(buf, size, out);
+  CHECK_EQ(trimmed.frames.size(), (size_t)2);
+  // plays once, and ends with a trailer
+  CHECK_EQ(trimmed.loopCount, -1);
+  CHECK_EQ(trimmed.trailer, out.size() - 1);
+  CHECK(memcmp(out.data(), data.data(), index.headerEnd) == 0);
+  for (size_t i = 0; i < trimmed.frames.size(); i++) {
+    const GifFrameInfo &from = index.frames[i], &to = trimmed.frames[i];
+    CHECK_EQ(to.end - to.start, from.end - from.start);
+    CHECK(memcmp(out.data() + to.start, data.data() + from.start, from.end - from.start) == 0);
+    CHECK_EQ(to.delay, (int)i + 1);
+  }
+
+  // out of range frame numbers are clamped
+  buf = TrimGif((const char *)data.data(), index, size, 0);
+  CHECK_EQ(ParseResult(buf, size, out).frames.size(), (size_t)1);
+  buf = TrimGif((const char *)data.data(), index, size, 9);
+  CHECK_EQ(ParseResult(buf, size, out).frames.size(), (size_t)3);
+}
+
+TEST(SpliceGifEditsTheLoopExtension) {
+  vector<uint8_t> data = BuildGif(Frames(3, 4)), out;
+  const char *file = (const char *)data.data();
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  CHECK_EQ(index.loopCount, 4);
+
+  // the loop count, in place
+  size_t size;
+  char *buf = SpliceGif(file, data.size(), index.loopStart + 16, 2, "\x00\x00", 2, size);
+  GifIndex spliced = ParseResult(buf, size, out);
+  CHECK_EQ(out.size(), data.size());
+  CHECK_EQ(spliced.loopCount, 0);
+  CHECK_EQ(spliced.frames.size(), (size_t)3);
+
+  // the whole extension
+  buf = SpliceGif(file, data.size(), index.loopStart, index.loopEnd - index.loopStart, NULL, 0, size);
+  spliced = ParseResult(buf, size, out);
+  CHECK_EQ(out.size(), data.size() - 19);
+  CHECK_EQ(spliced.loopCount, -1);
+  CHECK_EQ(spliced.frames.size(), (size_t)3);
+  CHECK_EQ(spliced.trailer, out.size() - 1);
+
+  // and back again, right after the header like freeze does
+  vector<uint8_t> without = out;
+  buf = SpliceGif((const char *)without.data(), without.size(), index.headerEnd, 0,
+                  "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19, size);
+  spliced = ParseResult(buf, size, out);
+  CHECK_EQ(spliced.loopCount, 0);
+  CHECK_EQ(spliced.loopStart, index.headerEnd);
+  CHECK_EQ(spliced.frames.size(), (size_t)3);
+  if (!spliced.frames.empty()) CHECK_EQ(spliced.frames[0].start, spliced.loopEnd);
+}
@@ -0,0 +1,170 @@
+#include <vips/vips8>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../common.h"
+#include "../gifindex.h"
+#include "fixtures.h"
+#include "test.h"
+
+using namespace std;
+using namespace vips;
+
+// An animation of RGBA frames that are width x height each, with a 100ms delay on every one
+static VImage Animation(const vector<vector<uint8_t>> &frames, int width, int height) {
+  vector<uint8_t> pixels;
+  for (const vector<uint8_t> &frame : frames) pixels.insert(pixels.end(), frame.begin(), frame.end());
+  int nPages = frames.size();
+  VImage image =
+    VImage::new_from_memory(pixels.data(), pixels.size(), width, height * nPages, 4, VIPS_FORMAT_UCHAR).copy_memory();
+  image = image.copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB));
+  image.set(VIPS_META_PAGE_HEIGHT, height);
+  image.set(VIPS_META_N_PAGES, nPages);
+  image.set("delay", vector<int>(nPages, 100));
+  return image;
+}
+
+// A width x height frame of one colour, with the columns left of hole fully transparent
+static vector<uint8_t> Frame(int width, int height, vector<uint8_t> rgba, int hole = 0) {
+  vector<uint8_t> pixels;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      pixels.insert(pixels.end(), rgba.begin(), rgba.end());
+      if (x < hole) pixels.back() = 0;
+    }
+  }
+  return pixels;
+}
+
+static vector<int> Disposals(const char *buf, size_t size) {
+  GifIndex index;
+  vector<int> disposals;
+  if (!ParseGif((const uint8_t *)buf, size, index, NULL)) return disposals;
+  for (const GifFrameInfo &frame : index.frames) disposals.push_back(frame.disposal);
+  return disposals;
+}
+
+TEST(WriteGifClearsBeforeATransparentFrame) {
+  const int width = 8, height = 8;
+  VImage image = Animation(
+    {Frame(width, height, {255, 0, 0, 255}), Frame(width, height, {0, 0, 255, 255}, width / 2),
+     Frame(width, height, {0, 255, 0, 255})},
+    width, height);
+  char *buf;
+  size_t size;
+  CHECK(WriteGif(image, ImageState{"gif", "gif"}, NULL, &buf, &size));
+
+  // the red frame has to go before the one with the hole is drawn, the others can stay
+  CHECK(Disposals(buf, size) == vector<int>({2, 1, 1}));
+
+  VImage decoded = VImage::new_from_buffer(buf, size, "", VImage::option()->set("n", -1));
+  CHECK_EQ(decoded.bands(), 4);
+  vector<double> hole = decoded.getpoint(0, height);
+  CHECK_EQ(hole[3], 0.0);
+  vector<double> blue = decoded.getpoint(width - 1, height);
+  CHECK(blue[0] < 16 && blue[2] > 240 && blue[3] == 255);
+  // the last frame is drawn over the second one, which it doesn't cover up with transparent pixels
+  vector<double> green = decoded.getpoint(0, height * 2);
+  CHECK(green[0] < 16 && green[1] > 240 && green[3] == 255);
+  g_free(buf);
+}
+
+TEST(WriteGifClearsTheLastFrameForATransparentFirstOne) {
+  const int width = 8, height = 8;
+  VImage image =
+    Animation({Frame(width, height, {0, 0, 255, 255}, width / 2), Frame(width, height, {255, 0, 0, 255})}, width,
+              height);
+  char *buf;
+  size_t size;
+  CHECK(WriteGif(image, ImageState{"gif", "gif"}, NULL, &buf, &size));
+  CHECK(Disposals(buf, size) == vector<int>({1, 2}));
+  g_free(buf);
+}
+
+TEST(WriteGifLeavesCloseColoursOnScreen) {
+  const int width = 8, height = 8;
+  VImage image =
+    Animation({Frame(width, height, {200, 0, 0, 255}), Frame(width, height, {212, 0, 0, 255})}, width, height);
+  char *buf;
+  size_t size;
+  CHECK(WriteGif(image, ImageState{"gif", "gif"}, NULL, &buf, &size));
+  VImage decoded = VImage::new_from_buffer(buf, size, "", VImage::option()->set("n", -1));
+  CHECK(decoded.getpoint(0, height)[0] > 206);
+  g_free(buf);
+
+  ImageState state{"gif", "gif"};
+  state.maxError = 16;
+  state.bitdepth = 4;
+  CHECK(WriteGif(image, state, NULL, &buf, &size));
+  decoded = VImage::new_from_buffer(buf, size, "", VImage::option()->set("n", -1));
+  CHECK(decoded.getpoint(0, height)[0] < 206);
+  g_free(buf);
+}
+
+// Decodes LZW the way stb_image does, which (unlike giflib) reads every code at the width the table is at and fails
+// if the data runs out before the end of information code
+static bool StrictLzwDecode(const vector<uint8_t> &lzw, vector<uint8_t> &out) {
+  if (lzw.empty()) return false;
+  vector<uint8_t> bytes;
+  size_t pos = 1;
+  while (pos < lzw.size() && lzw[pos] != 0) {
+    size_t length = lzw[pos++];
+    if (pos + length > lzw.size()) return false;
+    bytes.insert(bytes.end(), lzw.begin() + pos, lzw.begin() + pos + length);
+    pos += length;
+  }
+
+  const int minCodeSize = lzw[0], clearCode = 1 << minCodeSize;
+  vector<int> prefix(4096, -1);
+  vector<uint8_t> suffix(4096);
+  for (int i = 0; i < clearCode; i++) suffix[i] = i;
+  int codeSize = minCodeSize + 1, next = clearCode + 2, previous = -1;
+  size_t bit = 0;
+  vector<uint8_t> entry;
+  while (bit + codeSize <= bytes.size() * 8) {
+    int code = 0;
+    for (int b = 0; b < codeSize; b++, bit++) code |= ((bytes[bit / 8] >> (bit % 8)) & 1) << b;
+    if (code == clearCode) {
+      codeSize = minCodeSize + 1;
+      next = clearCode + 2;
+      previous = -1;
+      continue;
+    }
+    if (code == clearCode + 1) return true;
+    if (code > next || (previous < 0 && code >= clearCode)) return false;
+
+    entry.clear();
+    for (int c = code == next ? previous : code; c >= 0; c = prefix[c]) entry.push_back(suffix[c]);
+    reverse(entry.begin(), entry.end());
+    if (code == next) entry.push_back(entry[0]);
+    out.insert(out.end(), entry.begin(), entry.end());
+
+    if (previous >= 0 && next < 4096) {
+      prefix[next] = previous;
+      suffix[next] = entry[0];
+      next++;
+    }
+    if (next == (1 << codeSize) && codeSize < 12) codeSize++;
+    previous = code;
+  }
+  return false;
+}
+
+TEST(LzwEncodeEndsAtTheDecodersWidth) {
+  // 4093 symbols fill the table up to the clear and leave 255 codes after it, so the last one moves the decoder to 10
+  // bits. An EOI written with 9 of them ends exactly on a byte boundary and the decoder runs out of data.
+  for (size_t count : {(size_t)255, (size_t)256, (size_t)4093, (size_t)4094, (size_t)10000}) {
+    vector<uint8_t> indices = DistinctPairs(count), lzw, decoded;
+    LzwEncode(indices, lzw);
+    CHECK(StrictLzwDecode(lzw, decoded));
+    CHECK(decoded == indices);
+  }
+
+  // runs of one colour, which go through the code that is about to be added
+  vector<uint8_t> flat(20000, 7), lzw, decoded;
+  LzwEncode(flat, lzw);
+  CHECK(StrictLzwDecode(lzw, decoded));
+  CHECK(decoded == flat);
+}
@@ -0,0 +1,233 @@
+#include <vips/vips8>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "../gifindex.h"
+#include "fixtures.h"
+#include "test.h"
+
+using namespace std;
+using namespace vips;
+
+// Three 4x3 frames: one on the global palette, one with a local palette of 4 colours and a transparent one
+static GifFixture ThreeFrames(int loopCount) {
+  GifFixture gif{4, 3, loopCount, {FlatFrame(4, 3, 10), FlatFrame(4, 3, 3), FlatFrame(4, 3, 5, 7)}};
+  gif.frames[1].localPalette = 4;
+  gif.frames[2].transparent = 5;
+  gif.frames[2].disposal = 2;
+  return gif;
+}
+
+static vector<uint16_t> Decode(const vector<uint8_t> &data, const GifFrameInfo &frame) {
+  vector<uint16_t> out;
+  LzwDecode(data.data(), frame, out);
+  return out;
+}
+
+// Where LzwDecode finds the data of a frame that is just the LZW stream
+static GifFrameInfo StreamFrame(const vector<uint8_t> &lzw, int width, int height) {
+  GifFrameInfo frame{};
+  frame.data = 0;
+  frame.end = lzw.size();
+  frame.width = width;
+  frame.height = height;
+  return frame;
+}
+
+TEST(ParseGifFindsEveryBlock) {
+  vector<uint8_t> data = BuildGif(ThreeFrames(0));
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  CHECK_EQ(index.width, 4);
+  CHECK_EQ(index.height, 3);
+  CHECK_EQ(index.palette, (size_t)13);
+  CHECK_EQ(index.paletteSize, 256);
+  CHECK_EQ(index.headerEnd, (size_t)13 + 768);
+  CHECK_EQ(index.loopCount, 0);
+  CHECK_EQ(index.loopStart, index.headerEnd);
+  CHECK_EQ(index.loopEnd, index.headerEnd + 19);
+  CHECK_EQ(index.trailer, data.size() - 1);
+  CHECK_EQ(index.frames.size(), (size_t)3);
+  if (index.frames.size() != 3) return;
+
+  // frames are contiguous, from their graphic control extension to the end of their image data
+  CHECK_EQ(index.frames[0].start, index.loopEnd);
+  for (int i = 0; i < 3; i++) CHECK_EQ(index.frames[i].control, index.frames[i].start);
+  CHECK_EQ(index.frames[0].end, index.frames[1].start);
+  CHECK_EQ(index.frames[1].end, index.frames[2].start);
+  CHECK_EQ(index.frames[2].end, index.trailer);
+
+  CHECK_EQ(index.frames[0].paletteSize, 0);
+  CHECK_EQ(index.frames[1].paletteSize, 4);
+  CHECK_EQ(index.frames[1].palette, index.frames[1].start + 8 + 10);
+  CHECK_EQ(index.frames[1].data, index.frames[1].palette + 12);
+  CHECK_EQ(data[index.frames[1].palette], 255);
+  CHECK_EQ(index.frames[0].transparent, -1);
+  CHECK_EQ(index.frames[2].transparent, 5);
+  CHECK_EQ(index.frames[2].disposal, 2);
+  CHECK_EQ(index.frames[2].delay, 7);
+  CHECK(Decode(data, index.frames[1]) == vector<uint16_t>(12, 3));
+}
+
+TEST(ParseGifWithoutLoopExtension) {
+  vector<uint8_t> data = BuildGif(ThreeFrames(-1));
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  CHECK_EQ(index.loopCount, -1);
+  CHECK_EQ(index.loopStart, (size_t)0);
+  CHECK_EQ(index.loopEnd, (size_t)0);
+  CHECK_EQ(index.frames.size(), (size_t)3);
+  if (!index.frames.empty()) CHECK_EQ(index.frames[0].start, index.headerEnd);
+}
+
+TEST(ParseGifLeavesOutTruncatedFrames) {
+  vector<uint8_t> data = BuildGif(ThreeFrames(0));
+  GifIndex full;
+  CHECK(ParseGif(data.data(), data.size(), full, NULL));
+
+  // cut the file short at every byte, only frames that are there in full count
+  for (size_t length = 0; length < data.size(); length++) {
+    size_t complete = 0;
+    for (const GifFrameInfo &frame : full.frames) complete += frame.end <= length;
+    // a copy, so reading past length is caught by the sanitizers
+    vector<uint8_t> cut(data.begin(), data.begin() + length);
+    GifIndex index;
+    bool parsed = ParseGif(cut.data(), cut.size(), index, NULL);
+    CHECK_EQ(parsed, complete > 0);
+    if (!parsed) continue;
+    CHECK_EQ(index.frames.size(), complete);
+    CHECK_EQ(index.trailer, (size_t)0);
+  }
+}
+
+TEST(ParseGifRejectsOtherFiles) {
+  vector<uint8_t> data = BuildGif(ThreeFrames(0));
+  GifIndex index;
+  data[4] = '8';
+  CHECK(!ParseGif(data.data(), data.size(), index, NULL));
+  data[4] = '7';
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  if (index.frames.size() != 3) return;
+  // garbage where a block should start ends the file
+  data[index.frames[1].start] = 0x00;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  CHECK_EQ(index.frames.size(), (size_t)1);
+}
+
+TEST(LzwDecodeRoundTrip) {
+  // one run per table size, up to the clear LzwEncode writes when the table is full
+  for (size_t count : {(size_t)1, (size_t)300, (size_t)4093, (size_t)4094, (size_t)12000}) {
+    vector<uint8_t> indices = DistinctPairs(count), lzw;
+    LzwEncode(indices, lzw);
+    CHECK(Decode(lzw, StreamFrame(lzw, count, 1)) == vector<uint16_t>(indices.begin(), indices.end()));
+  }
+  vector<uint8_t> flat(30000, 200), lzw;
+  LzwEncode(flat, lzw);
+  CHECK(Decode(lzw, StreamFrame(lzw, 300, 100)) == vector<uint16_t>(flat.size(), 200));
+}
+
+// LZW like encoders that wait for the data to stop compressing before they clear the table: once it holds 4095
+// codes, the rest are written at 12 bits without adding anything
+static vector<uint8_t> LzwEncodeWithoutClear(const vector<uint8_t> &indices) {
+  vector<int> table(4096 * 256, -1);
+  int codeSize = 9, maxCode = 257;
+  vector<uint8_t> bytes;
+  uint32_t bitBuffer = 0;
+  int bitCount = 0;
+  auto write = [&](int code) {
+    bitBuffer |= (uint32_t)code << bitCount;
+    for (bitCount += codeSize; bitCount >= 8; bitCount -= 8, bitBuffer >>= 8) bytes.push_back(bitBuffer & 0xFF);
+  };
+
+  write(256);
+  int current = indices[0];
+  for (size_t i = 1; i < indices.size(); i++) {
+    int &entry = table[current * 256 + indices[i]];
+    if (entry >= 0) {
+      current = entry;
+      continue;
+    }
+    write(current);
+    if (maxCode < 4095) {
+      entry = ++maxCode;
+      if (maxCode >= (1 << codeSize) && codeSize < 12) codeSize++;
+    }
+    current = indices[i];
+  }
+  write(current);
+  if (maxCode < 4095 && maxCode + 1 >= (1 << codeSize)) codeSize++;
+  write(257);
+  if (bitCount > 0) bytes.push_back(bitBuffer & 0xFF);
+
+  vector<uint8_t> out = {8};
+  for (size_t i = 0; i < bytes.size(); i += 255) {
+    size_t length = min((size_t)255, bytes.size() - i);
+    out.push_back(length);
+    out.insert(out.end(), bytes.begin() + i, bytes.begin() + i + length);
+  }
+  out.push_back(0);
+  return out;
+}
+
+TEST(LzwDecodeKeepsAFullTable) {
+  for (size_t count : {(size_t)4094, (size_t)4095, (size_t)4096, (size_t)9000}) {
+    vector<uint8_t> indices = DistinctPairs(count);
+    vector<uint8_t> lzw = LzwEncodeWithoutClear(indices);
+    CHECK(Decode(lzw, StreamFrame(lzw, count, 1)) == vector<uint16_t>(indices.begin(), indices.end()));
+  }
+}
+
+TEST(LzwDecodeStopsAtTheEndOfTheData) {
+  vector<uint8_t> indices = DistinctPairs(4000), lzw;
+  LzwEncode(indices, lzw);
+
+  // only the first sub-block
+  GifFrameInfo frame = StreamFrame(lzw, 100, 40);
+  frame.end = 2 + 255;
+  vector<uint16_t> out = Decode(lzw, frame);
+  size_t decoded = 0;
+  while (decoded < out.size() && out[decoded] != GIF_SKIP_PIXEL) decoded++;
+  // 255 bytes hold 226 codes of 9 bits, one of them the clear
+  CHECK_EQ(decoded, (size_t)225);
+  CHECK(equal(out.begin(), out.begin() + decoded, indices.begin()));
+  for (size_t i = decoded; i < out.size(); i++) CHECK_EQ(out[i], GIF_SKIP_PIXEL);
+
+  // a sub-block that says it goes on past the end of the frame isn't read at all
+  frame.end = 2 + 255 + 100;
+  CHECK(Decode(lzw, frame) == out);
+}
+
+TEST(LzwDecodeInterlaced) {
+  // rows are stored as every 8th from 0, every 8th from 4, every 4th from 2 and then the odd ones
+  const int rows[] = {0, 8, 4, 2, 6, 1, 3, 5, 7, 9};
+  vector<uint8_t> indices, lzw;
+  for (int row : rows) indices.insert(indices.end(), 3, row);
+  LzwEncode(indices, lzw);
+  GifFrameInfo frame = StreamFrame(lzw, 3, 10);
+  frame.interlaced = true;
+  vector<uint16_t> out = Decode(lzw, frame);
+  for (int y = 0; y < 10; y++) CHECK_EQ(out[y * 3], y);
+}
+
+TEST(LoadIndexedGifUsesLocalPalettes) {
+  vector<uint8_t> data = BuildGif(ThreeFrames(0));
+  VImage image = LoadIndexedGif((const char *)data.data(), data.size(), NULL);
+  CHECK(image.get_image() != NULL);
+  if (image.get_image() == NULL) return;
+  CHECK_EQ(vips_image_get_n_pages(image.get_image()), 3);
+  CHECK_EQ(vips_image_get_page_height(image.get_image()), 3);
+  CHECK(image.get_array_int("delay") == vector<int>({100, 100, 70}));
+
+  vector<double> global = image.getpoint(0, 0);
+  CHECK_EQ(global[0], 10.0);
+  CHECK_EQ(global[1], 245.0);
+  vector<double> local = image.getpoint(0, 3);
+  CHECK_EQ(local[0], 252.0);
+  CHECK_EQ(local[1], 3.0);
+  CHECK_EQ(local[2], 128.0);
+  // the last frame is all transparent, and the one before it is left on screen
+  vector<double> transparent = image.getpoint(3, 8);
+  CHECK_EQ(transparent[0], 252.0);
+}
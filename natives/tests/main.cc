@@ -0,0 +1,56 @@
+/*
+  Unit tests for the native code, built with the plain CMake build (-DWITH_TESTS=ON) and run through ctest. Fixtures
+  are generated by the tests themselves, so nothing has to be downloaded.
+
+  Usage: image_tests [name...]
+
+  Runs every test, or only the ones named. Exits with 1 if any check failed.
+*/
+
+#include "test.h"
+
+#include <vips/vips8>
+
+#include <exception>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+std::vector<TestCase> &TestCases() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+void TestFailed(const char *file, int line, const std::string &message) {
+  std::cerr << "  " << file << ":" << line << ": " << message << std::endl;
+  failures++;
+}
+
+int main(int argc, char **argv) {
+  if (VIPS_INIT(argv[0])) vips_error_exit(NULL);
+
+  std::set<std::string> selected(argv + 1, argv + argc);
+  int failedTests = 0, ran = 0;
+  for (const TestCase &test : TestCases()) {
+    if (!selected.empty() && selected.count(test.name) == 0) continue;
+    int before = failures;
+    try {
+      test.run();
+    } catch (std::exception &e) {
+      TestFailed(__FILE__, __LINE__, std::string("threw ") + e.what());
+    } catch (...) {
+      TestFailed(__FILE__, __LINE__, "threw an unknown exception");
+    }
+    bool ok = failures == before;
+    std::cerr << (ok ? "ok   " : "FAIL ") << test.name << std::endl;
+    if (!ok) failedTests++;
+    ran++;
+  }
+  std::cerr << ran - failedTests << "/" << ran << " tests passed" << std::endl;
+
+  vips_shutdown();
+  return failedTests > 0 ? 1 : 0;
+}
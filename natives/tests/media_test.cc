@@ -0,0 +1,233 @@
+#include <vips/vips8>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../common.h"
+#include "../media.h"
+#include "test.h"
+
+using namespace std;
+using namespace vips;
+
+static void PushUint32BE(vector<uint8_t> &out, uint64_t value) {
+  for (int i = 3; i >= 0; i--) out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static void PushUint64BE(vector<uint8_t> &out, uint64_t value) {
+  for (int i = 7; i >= 0; i--) out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static uint64_t ReadBE(const uint8_t *data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) value = (value << 8) | data[i];
+  return value;
+}
+
+static vector<uint8_t> Atom(const string &type, const vector<uint8_t> &body, bool largeSize = false) {
+  vector<uint8_t> out;
+  PushUint32BE(out, largeSize ? 1 : 8 + body.size());
+  out.insert(out.end(), type.begin(), type.end());
+  if (largeSize) PushUint64BE(out, 16 + body.size());
+  out.insert(out.end(), body.begin(), body.end());
+  return out;
+}
+
+// A chunk offset table, stco with 32-bit entries or co64 with 64-bit ones
+static vector<uint8_t> ChunkOffsets(const string &type, const vector<uint64_t> &offsets) {
+  vector<uint8_t> body = {0, 0, 0, 0};
+  PushUint32BE(body, offsets.size());
+  for (uint64_t offset : offsets) {
+    if (type == "stco") {
+      PushUint32BE(body, offset);
+    } else {
+      PushUint64BE(body, offset);
+    }
+  }
+  return Atom(type, body);
+}
+
+static vector<uint8_t> Track(const vector<uint8_t> &offsets) {
+  return Atom("trak", Atom("mdia", Atom("minf", Atom("stbl", offsets))));
+}
+
+static vector<uint8_t> Concat(const vector<vector<uint8_t>> &parts) {
+  vector<uint8_t> out;
+  for (const vector<uint8_t> &part : parts) out.insert(out.end(), part.begin(), part.end());
+  return out;
+}
+
+// Media data of 64 distinct bytes, with chunks at 0, 16 and 40 of it
+struct Mp4Fixture {
+  vector<uint8_t> file;
+  // where the media data starts in file
+  size_t mdat;
+};
+
+static Mp4Fixture BuildMp4(bool largeMdat, uint64_t extraShift = 0) {
+  vector<uint8_t> ftyp = Atom("ftyp", {'i', 's', 'o', 'm', 0, 0, 2, 0});
+  vector<uint8_t> media;
+  for (int i = 0; i < 64; i++) media.push_back(i * 3 + 1);
+  size_t mdat = ftyp.size() + (largeMdat ? 16 : 8);
+  vector<uint8_t> moov =
+    Atom("moov", Concat({Atom("mvhd", vector<uint8_t>(100, 0)),
+                         Track(ChunkOffsets("stco", {mdat + extraShift, mdat + 40 + extraShift})),
+                         Track(ChunkOffsets("co64", {mdat + 16}))}));
+  return {Concat({ftyp, Atom("mdat", media, largeMdat), moov, Atom("free", {1, 2, 3})}), mdat};
+}
+
+// Every chunk offset in the file, in the order the tables list them
+static vector<uint64_t> FindChunkOffsets(const vector<uint8_t> &file) {
+  vector<uint64_t> offsets;
+  for (size_t pos = 4; pos + 12 <= file.size(); pos++) {
+    bool stco = memcmp(&file[pos], "stco", 4) == 0;
+    if (!stco && memcmp(&file[pos], "co64", 4) != 0) continue;
+    int width = stco ? 4 : 8;
+    uint32_t count = ReadBE(&file[pos + 8], 4);
+    for (uint32_t i = 0; i < count; i++) offsets.push_back(ReadBE(&file[pos + 12 + i * width], width));
+  }
+  return offsets;
+}
+
+// Runs MoveMoovToFront on a malloc'd copy, returns whether it moved anything
+static bool MoveMoov(const vector<uint8_t> &file, vector<uint8_t> &out) {
+  char *copy = static_cast<char *>(malloc(file.size()));
+  memcpy(copy, file.data(), file.size());
+  char *moved = MoveMoovToFront(copy, file.size());
+  out.assign(moved, moved + file.size());
+  free(moved);
+  return moved != copy;
+}
+
+static vector<string> TopLevelAtoms(const vector<uint8_t> &file) {
+  vector<string> types;
+  for (size_t pos = 0; pos + 8 <= file.size();) {
+    uint64_t size = ReadBE(&file[pos], 4);
+    if (size == 1) size = ReadBE(&file[pos + 8], 8);
+    types.emplace_back(file.begin() + pos + 4, file.begin() + pos + 8);
+    if (size < 8) break;
+    pos += size;
+  }
+  return types;
+}
+
+TEST(MoveMoovToFrontShiftsChunkOffsets) {
+  for (bool largeMdat : {false, true}) {
+    Mp4Fixture mp4 = BuildMp4(largeMdat);
+    vector<uint8_t> out;
+    CHECK(MoveMoov(mp4.file, out));
+    CHECK(TopLevelAtoms(out) == vector<string>({"ftyp", "moov", "mdat", "free"}));
+
+    // every offset still points at the same media bytes, in stco and co64 alike
+    vector<uint64_t> before = FindChunkOffsets(mp4.file), after = FindChunkOffsets(out);
+    CHECK_EQ(after.size(), (size_t)3);
+    if (after.size() != before.size()) continue;
+    for (size_t i = 0; i < after.size(); i++) {
+      CHECK(after[i] > before[i]);
+      CHECK(after[i] + 8 <= out.size());
+      if (after[i] + 8 <= out.size()) CHECK(memcmp(&out[after[i]], &mp4.file[before[i]], 8) == 0);
+    }
+    // the atoms after moov are kept
+    CHECK(memcmp(&out[out.size() - 3], "\x01\x02\x03", 3) == 0);
+  }
+}
+
+TEST(MoveMoovToFrontLeavesOddFilesAlone) {
+  vector<uint8_t> out;
+
+  // moov is at the front already
+  Mp4Fixture mp4 = BuildMp4(false);
+  vector<uint8_t> once;
+  CHECK(MoveMoov(mp4.file, once));
+  CHECK(!MoveMoov(once, out));
+  CHECK(out == once);
+
+  // a 32-bit offset that would overflow once shifted
+  mp4 = BuildMp4(false, UINT32_MAX - 200);
+  CHECK(!MoveMoov(mp4.file, out));
+  CHECK(out == mp4.file);
+
+  // atoms that run past the end of the file
+  mp4 = BuildMp4(false);
+  mp4.file[mp4.file.size() - 8] = 0xFF;
+  CHECK(!MoveMoov(mp4.file, out));
+  CHECK(out == mp4.file);
+}
+
+TEST(ShiftChunkOffsetsChecksTableSizes) {
+  vector<uint8_t> stbl = Atom("stbl", ChunkOffsets("co64", {10, 20}));
+  CHECK(ShiftChunkOffsets(stbl.data(), stbl.size(), 5));
+  CHECK(FindChunkOffsets(stbl) == vector<uint64_t>({15, 25}));
+
+  // a count with more entries than the atom holds
+  stbl[8 + 8 + 7] = 3;
+  CHECK(!ShiftChunkOffsets(stbl.data(), stbl.size(), 5));
+}
+
+// red, green and blue frames of size x size, a tenth of a second each
+static vector<uint8_t> ColourGif(int size) {
+  vector<uint8_t> pixels;
+  for (int i = 0; i < 3; i++) {
+    for (int p = 0; p < size * size; p++) {
+      for (int c = 0; c < 3; c++) pixels.push_back(c == i ? 255 : 0);
+    }
+  }
+  VImage image =
+    VImage::new_from_memory(pixels.data(), pixels.size(), size, size * 3, 3, VIPS_FORMAT_UCHAR).copy_memory();
+  image.set(VIPS_META_PAGE_HEIGHT, size);
+  image.set("delay", vector<int>(3, 100));
+  char *buf;
+  size_t length;
+  if (!WriteGif(image, ImageState{"gif", "gif"}, NULL, &buf, &length)) return {};
+  vector<uint8_t> gif(buf, buf + length);
+  g_free(buf);
+  return gif;
+}
+
+TEST(RunMediaMapsGifsToAPaletteFromItsOwnPass) {
+  const int size = 16;
+  vector<uint8_t> gif = ColourGif(size);
+  CHECK(!gif.empty());
+
+  MediaJob media;
+  media.inputs = {{reinterpret_cast<const char *>(gif.data()), gif.size()}};
+  media.format = "gif";
+  size_t length = 0;
+  char *out = RunMedia(media, length, NULL);
+
+  VImage decoded = VImage::new_from_buffer(out, length, "", VImage::option()->set("n", -1));
+  CHECK_EQ(vips_image_get_n_pages(decoded.get_image()), 3);
+  for (int i = 0; i < 3; i++) {
+    vector<double> pixel = decoded.getpoint(size / 2, size * i + size / 2);
+    for (int c = 0; c < 3; c++) CHECK(c == i ? pixel[c] > 240 : pixel[c] < 16);
+  }
+  free(out);
+}
+
+TEST(RunMediaStopsPastMaxBuffered) {
+  const int size = 16;
+  vector<uint8_t> gif = ColourGif(size);
+  MediaJob media;
+  media.inputs = {{reinterpret_cast<const char *>(gif.data()), gif.size()}};
+  media.format = "gif";
+  media.videoFilters = {{"reverse", {}}};
+  // libav decodes GIFs to BGRA, this has room for two of the three frames
+  media.maxBuffered = size * size * 4 * 2;
+  size_t length = 0;
+  bool failed = false;
+  try {
+    free(RunMedia(media, length, NULL));
+  } catch (const MediaError &) {
+    failed = true;
+  }
+  CHECK(failed);
+
+  media.maxBuffered = size * size * 4 * 3;
+  char *out = RunMedia(media, length, NULL);
+  VImage decoded = VImage::new_from_buffer(out, length, "", VImage::option()->set("n", -1));
+  // played backwards, so blue comes first
+  CHECK(decoded.getpoint(size / 2, size / 2)[2] > 240);
+  free(out);
+}
@@ -0,0 +1,113 @@
+#include <vips/vips8>
+
+#include <functional>
+#include <vector>
+
+#include "../common.h"
+#include "test.h"
+
+using namespace std;
+using namespace vips;
+
+// Three width x height pages of an sRGB gradient that's different on every page
+static VImage Strip(int width, int height) {
+  VImage xy = VImage::xyz(width, height * 3);
+  VImage page = (xy[1] / height).floor();
+  VImage row = xy[1] - page * height;
+  VImage strip = (xy[0] * 10).bandjoin(row * 8).bandjoin(page * 100).cast(VIPS_FORMAT_UCHAR);
+  strip = strip.copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB)).copy_memory();
+  strip.set(VIPS_META_PAGE_HEIGHT, height);
+  return strip;
+}
+
+// What the page helpers replace: fn run on every page on its own, and the pages joined back up
+static VImage EachPage(VImage in, int nPages, const function<VImage(VImage)> &fn) {
+  int pageHeight = in.height() / nPages;
+  vector<VImage> pages;
+  for (int i = 0; i < nPages; i++) pages.push_back(fn(in.crop(0, i * pageHeight, in.width(), pageHeight)));
+  return VImage::arrayjoin(pages, VImage::option()->set("across", 1));
+}
+
+static double MaxDifference(VImage a, VImage b) {
+  if (a.width() != b.width() || a.height() != b.height() || a.bands() != b.bands()) return 1e9;
+  return (a.cast(VIPS_FORMAT_DOUBLE) - b.cast(VIPS_FORMAT_DOUBLE)).abs().max();
+}
+
+TEST(PageEmbedMatchesEmbeddingEachPage) {
+  VImage strip = Strip(20, 16);
+  const vector<double> background = {10, 20, 30};
+  for (vector<int> box : vector<vector<int>>{{4, 3, 30, 24}, {-2, -3, 12, 10}}) {
+    VImage expected = EachPage(strip, 3, [&](VImage page) {
+      return page.embed(box[0], box[1], box[2], box[3],
+                        VImage::option()->set("extend", VIPS_EXTEND_BACKGROUND)->set("background", background));
+    });
+    VImage out = PageEmbed(strip, 3, box[0], box[1], box[2], box[3], background);
+    CHECK_EQ(MaxDifference(out, expected), 0.0);
+    CHECK_EQ(vips_image_get_page_height(out.get_image()), box[3]);
+  }
+}
+
+TEST(PageJoinMatchesJoiningEachPage) {
+  VImage strip = Strip(20, 16);
+  VImage band = (VImage::black(24, 5) + vector<double>{200, 100, 50}).cast(VIPS_FORMAT_UCHAR);
+  const vector<double> background = {255, 255, 255};
+  for (bool above : {true, false}) {
+    VImage expected = EachPage(strip, 3, [&](VImage page) {
+      VImage first = above ? band : page, second = above ? page : band;
+      return first.join(second, VIPS_DIRECTION_VERTICAL,
+                        VImage::option()->set("expand", true)->set("background", background));
+    });
+    VImage out = PageJoin(strip, 3, band, above, background);
+    CHECK_EQ(MaxDifference(out, expected), 0.0);
+    CHECK_EQ(vips_image_get_page_height(out.get_image()), 21);
+  }
+}
+
+TEST(PageLayerMatchesCompositingEachPage) {
+  VImage strip = Strip(20, 16).bandjoin(255);
+  VImage layer = (VImage::black(8, 8) + vector<double>{0, 255, 0, 128}).cast(VIPS_FORMAT_UCHAR);
+  layer = layer.copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB));
+  VImage expected = EachPage(strip, 3, [&](VImage page) {
+    return page.composite2(layer.embed(5, 6, 20, 16), VIPS_BLEND_MODE_OVER);
+  });
+  VImage out = PageLayer(strip, 3, layer, 5, 6);
+  CHECK(MaxDifference(out, expected) <= 1);
+}
+
+TEST(PageResizeKeepsPagesApart) {
+  // flat pages, anything from a neighbour would show
+  vector<VImage> flat;
+  for (int i = 0; i < 3; i++) {
+    flat.push_back((VImage::black(20, 30) + vector<double>{i * 120.0}).cast(VIPS_FORMAT_UCHAR));
+  }
+  VImage strip = VImage::arrayjoin(flat, VImage::option()->set("across", 1));
+  // enlarging, shrinking less than 2x, and more than 2x onto a page height that the shrink doesn't divide
+  for (vector<int> size : vector<vector<int>>{{40, 50}, {15, 20}, {6, 7}}) {
+    VImage out = PageResize(strip, 3, size[0], size[1]);
+    CHECK_EQ(out.height(), size[1] * 3);
+    for (int i = 0; i < 3; i++) {
+      VImage page = out.crop(0, i * size[1], size[0], size[1]);
+      CHECK(page.min() >= i * 120.0 - 1 && page.max() <= i * 120.0 + 1);
+    }
+  }
+}
+
+TEST(PageResizeMatchesResizingEachPage) {
+  VImage strip = Strip(20, 30);
+  for (vector<int> size : vector<vector<int>>{{30, 45}, {12, 18}, {8, 10}}) {
+    VImage expected = EachPage(strip, 3, [&](VImage page) {
+      return page.resize(size[0] / 20.0, VImage::option()->set("vscale", size[1] / 30.0));
+    });
+    VImage out = PageResize(strip, 3, size[0], size[1]);
+    // bilinear down the pages instead of resize's lanczos, which only differs by much at the edges
+    VImage inner = out.crop(1, 0, size[0] - 2, out.height());
+    CHECK(MaxDifference(inner, expected.crop(1, 0, size[0] - 2, expected.height())) <= 16);
+  }
+}
+
+TEST(PageResizeAveragesRowsWhenShrinkingALot) {
+  // black and white rows, which point sampling every third row would turn into stripes again
+  VImage rows = (VImage::xyz(8, 90)[1] % 2 * 255).cast(VIPS_FORMAT_UCHAR);
+  VImage out = PageResize(rows, 3, 8, 10);
+  CHECK(out.min() >= 64 && out.max() <= 192);
+}
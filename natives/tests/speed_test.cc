@@ -0,0 +1,194 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../common.h"
+#include "../gifindex.h"
+#include "fixtures.h"
+#include "test.h"
+
+using namespace std;
+
+static void PushUint24(vector<uint8_t> &out, uint32_t value) {
+  for (int i = 0; i < 3; i++) out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static void PushUint32(vector<uint8_t> &out, uint32_t value) {
+  for (int i = 0; i < 4; i++) out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static vector<uint8_t> Chunk(const string &fourCC, const vector<uint8_t> &payload) {
+  vector<uint8_t> out(fourCC.begin(), fourCC.end());
+  PushUint32(out, payload.size());
+  out.insert(out.end(), payload.begin(), payload.end());
+  if (payload.size() % 2) out.push_back(0);
+  return out;
+}
+
+// Bitstreams aren't decoded, only their headers are looked at
+static vector<uint8_t> Lossy() { return Chunk("VP8 ", vector<uint8_t>(10, 0x9D)); }
+static vector<uint8_t> Lossless(bool alpha) { return Chunk("VP8L", {0x2F, 0, 0, 0, (uint8_t)(alpha ? 0x10 : 0)}); }
+
+struct WebpFixtureFrame {
+  int duration;
+  vector<uint8_t> chunks;
+  // ANMF flags, 0x02 draws the frame without blending
+  uint8_t flags = 0;
+  int width = 0;
+};
+
+// An animated WebP on a 16x16 canvas, frames cover all of it unless they say otherwise
+static vector<uint8_t> BuildWebp(const vector<WebpFixtureFrame> &frames) {
+  const int size = 16;
+  vector<uint8_t> vp8x = {0x12, 0, 0, 0};
+  PushUint24(vp8x, size - 1);
+  PushUint24(vp8x, size - 1);
+  vector<uint8_t> body = {'W', 'E', 'B', 'P'};
+  vector<uint8_t> chunk = Chunk("VP8X", vp8x);
+  body.insert(body.end(), chunk.begin(), chunk.end());
+  chunk = Chunk("ANIM", {0, 0, 0, 0, 0, 0});
+  body.insert(body.end(), chunk.begin(), chunk.end());
+
+  for (const WebpFixtureFrame &frame : frames) {
+    vector<uint8_t> anmf;
+    PushUint24(anmf, 0);
+    PushUint24(anmf, 0);
+    PushUint24(anmf, (frame.width > 0 ? frame.width : size) - 1);
+    PushUint24(anmf, size - 1);
+    PushUint24(anmf, frame.duration);
+    anmf.push_back(frame.flags);
+    anmf.insert(anmf.end(), frame.chunks.begin(), frame.chunks.end());
+    chunk = Chunk("ANMF", anmf);
+    body.insert(body.end(), chunk.begin(), chunk.end());
+  }
+
+  vector<uint8_t> out = {'R', 'I', 'F', 'F'};
+  PushUint32(out, body.size());
+  out.insert(out.end(), body.begin(), body.end());
+  return out;
+}
+
+// The chunks of a WebP file with their payloads, empty if the sizes don't add up to the RIFF size
+static vector<pair<string, vector<uint8_t>>> WebpChunks(const vector<uint8_t> &data) {
+  vector<pair<string, vector<uint8_t>>> chunks;
+  if (data.size() < 12 || readUint32LE(const_cast<uint8_t *>(data.data()) + 4) != data.size() - 8) return chunks;
+  size_t position = 12;
+  while (position + 8 <= data.size()) {
+    uint32_t size = readUint32LE(const_cast<uint8_t *>(data.data()) + position + 4);
+    if (position + 8 + size > data.size()) return {};
+    chunks.emplace_back(string(data.begin() + position, data.begin() + position + 4),
+                        vector<uint8_t>(data.begin() + position + 8, data.begin() + position + 8 + size));
+    position += 8 + size + size % 2;
+  }
+  if (position != data.size()) return {};
+  return chunks;
+}
+
+static bool Decimate(const vector<uint8_t> &data, int step, vector<uint8_t> &out) {
+  size_t size;
+  char *buf = DecimateWebp((const char *)data.data(), data.size(), step, size, NULL);
+  if (buf == NULL) return false;
+  out.assign(buf, buf + size);
+  free(buf);
+  return true;
+}
+
+TEST(DecimateWebpKeepsEveryStepthFrame) {
+  vector<WebpFixtureFrame> frames;
+  for (int i = 0; i < 7; i++) frames.push_back({(i + 1) * 10, i % 2 ? Lossless(false) : Lossy()});
+  vector<uint8_t> data = BuildWebp(frames), out;
+  CHECK(Decimate(data, 3, out));
+
+  vector<pair<string, vector<uint8_t>>> before = WebpChunks(data), after = WebpChunks(out);
+  CHECK_EQ(after.size(), (size_t)5);
+  if (after.size() != 5) return;
+  CHECK(after[0] == before[0]);
+  CHECK(after[1] == before[1]);
+  // frames 0, 3 and 6 as they were, durations included
+  CHECK(after[2] == before[2]);
+  CHECK(after[3] == before[5]);
+  CHECK(after[4] == before[8]);
+  CHECK_EQ(readUint32LE(after[3].second.data() + 12) & 0xFFFFFF, (uint32_t)40);
+}
+
+TEST(DecimateWebpOnlyKeepsKeyframes) {
+  vector<uint8_t> alpha = Chunk("ALPH", {0, 1, 2}), lossy = Lossy();
+  alpha.insert(alpha.end(), lossy.begin(), lossy.end());
+  vector<uint8_t> out;
+
+  // what the dropped frames are like doesn't matter
+  CHECK(Decimate(BuildWebp({{10, Lossy()}, {10, alpha}, {10, Lossy()}, {10, Lossless(true)}}), 2, out));
+  // the first frame is drawn on a blank canvas anyway
+  CHECK(Decimate(BuildWebp({{10, alpha}, {10, Lossy()}, {10, Lossy()}}), 2, out));
+
+  // kept frames that blend with what's under them
+  CHECK(!Decimate(BuildWebp({{10, Lossy()}, {10, Lossy()}, {10, alpha}}), 2, out));
+  CHECK(!Decimate(BuildWebp({{10, Lossy()}, {10, Lossy()}, {10, Lossless(true)}}), 2, out));
+  // unless they're drawn without blending
+  WebpFixtureFrame replace{10, alpha, 0x02};
+  CHECK(Decimate(BuildWebp({{10, Lossy()}, {10, Lossy()}, replace}), 2, out));
+  // or ones that don't cover the canvas
+  WebpFixtureFrame partial{10, Lossy(), 0x02, 8};
+  CHECK(!Decimate(BuildWebp({{10, Lossy()}, {10, Lossy()}, partial}), 2, out));
+}
+
+static GifIndex DecimateAndParse(const vector<uint8_t> &data, int step, vector<uint8_t> &out) {
+  GifIndex index, result;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+  size_t size;
+  char *buf = DecimateGif((const char *)data.data(), index, step, size, NULL);
+  CHECK(buf != NULL);
+  if (buf == NULL) return result;
+  out.assign(buf, buf + size);
+  free(buf);
+  CHECK(ParseGif(out.data(), out.size(), result, NULL));
+  return result;
+}
+
+static vector<int> Delays(const GifIndex &index) {
+  vector<int> delays;
+  for (const GifFrameInfo &frame : index.frames) delays.push_back(frame.delay);
+  return delays;
+}
+
+TEST(DecimateGifKeepsDelays) {
+  GifFixture gif{4, 4, 3, {}};
+  for (int i = 0; i < 5; i++) gif.frames.push_back(FlatFrame(4, 4, i * 10, i + 1));
+  vector<uint8_t> data = BuildGif(gif), out;
+  GifIndex index;
+  CHECK(ParseGif(data.data(), data.size(), index, NULL));
+
+  GifIndex result = DecimateAndParse(data, 2, out);
+  CHECK(Delays(result) == vector<int>({1, 3, 5}));
+  CHECK_EQ(result.loopCount, 3);
+  // opaque frames are copied as they are
+  for (size_t i = 0; i < result.frames.size(); i++) {
+    const GifFrameInfo &from = index.frames[i * 2], &to = result.frames[i];
+    CHECK_EQ(to.end - to.start, from.end - from.start);
+    CHECK(memcmp(out.data() + to.start, data.data() + from.start, from.end - from.start) == 0);
+  }
+}
+
+TEST(DecimateGifRebuildsFramesThatShowDroppedOnes) {
+  // the last frame is see-through, so what it shows is the dropped one before it
+  GifFixture gif{4, 4, 0, {FlatFrame(4, 4, 10, 4), FlatFrame(4, 4, 20, 5), FlatFrame(4, 4, 5, 6)}};
+  gif.frames[2].transparent = 5;
+  vector<uint8_t> data = BuildGif(gif), out;
+
+  GifIndex result = DecimateAndParse(data, 2, out);
+  CHECK(Delays(result) == vector<int>({4, 6}));
+  if (result.frames.size() != 2) return;
+  const GifFrameInfo &rebuilt = result.frames[1];
+  CHECK_EQ(rebuilt.paletteSize, 256);
+  vector<uint16_t> pixels;
+  LzwDecode(out.data(), rebuilt, pixels);
+  CHECK_EQ(pixels.size(), (size_t)16);
+  for (uint16_t pixel : pixels) {
+    // not left transparent, and the colour of global palette entry 20
+    CHECK(pixel != GIF_SKIP_PIXEL && (int)pixel != rebuilt.transparent);
+    if (pixel >= rebuilt.paletteSize) break;
+    const uint8_t *colour = out.data() + rebuilt.palette + pixel * 3;
+    CHECK(colour[0] == 20 && colour[1] == 235 && colour[2] == 10);
+  }
+}
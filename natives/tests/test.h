@@ -0,0 +1,34 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+  Just enough of a test harness for the native code, see main.cc. A TEST is a function that registers itself before
+  main runs. Failed CHECKs are reported and counted, and the test carries on so a single run shows every broken check.
+*/
+
+struct TestCase {
+  const char *name;
+  void (*run)();
+};
+
+std::vector<TestCase> &TestCases();
+void TestFailed(const char *file, int line, const std::string &message);
+
+struct TestRegistrar {
+  TestRegistrar(const char *name, void (*run)()) { TestCases().push_back({name, run}); }
+};
+
+template <typename A, typename B> void CheckEqual(const A &a, const B &b, const char *expression, const char *file,
+                                                  int line) {
+  if (a == b) return;
+  std::ostringstream message;
+  message << expression << " (" << a << " vs " << b << ")";
+  TestFailed(file, line, message.str());
+}
+
+#define TEST(NAME) static void NAME(); static TestRegistrar NAME##Registrar(#NAME, NAME); static void NAME()
+#define CHECK(EXPR) ((EXPR) ? (void)0 : TestFailed(__FILE__, __LINE__, #EXPR))
+#define CHECK_EQ(A, B) CheckEqual((A), (B), #A " == " #B, __FILE__, __LINE__)
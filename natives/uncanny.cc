@@ -5,17 +5,14 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Uncanny(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                    ArgumentMap arguments, bool *shouldKill) {
-  string caption = GetArgument<string>(arguments, "caption");
-  string caption2 = GetArgument<string>(arguments, "caption2");
-  string font = GetArgument<string>(arguments, "font");
-  string path = GetArgument<string>(arguments, "path");
-  string basePath = GetArgument<string>(arguments, "basePath");
-
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB)
-                .extract_band(0, VImage::option()->set("n", 3));
+VImage Uncanny(VImage in, ImageState &state, const UncannyParams &arguments, JobControl *job) {
+  const string &caption = arguments.caption;
+  const string &caption2 = arguments.caption2;
+  const string &font = arguments.font;
+  const string &path = arguments.path;
+  const string &basePath = arguments.basePath;
+
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB).extract_band(0, VImage::option()->set("n", 3));
 
   VImage base = VImage::black(1280, 720, VImage::option()->set("bands", 3));
 
@@ -25,18 +22,16 @@ ArgumentMap Uncanny(const string &type, string &outType, const char *bufferdata,
   string captionText = "<span background=\"black\" foreground=\"white\">" + caption + "</span>";
   string caption2Text = "<span background=\"black\" foreground=\"red\">" + caption2 + "</span>";
 
-  auto findResult = fontPaths.find(font);
-  string fontResult = findResult != fontPaths.end() ? basePath + findResult->second : "";
+  const char *fontFile = GetFonts(basePath).File(font);
 
-  LoadFonts(basePath);
   VOption *textOptions = VImage::option()
                            ->set("rgba", true)
                            ->set("align", VIPS_ALIGN_CENTRE)
                            ->set("font", font_string.c_str())
                            ->set("width", 588)
                            ->set("height", 90);
-  if (fontResult != "") {
-    textOptions = textOptions->set("fontfile", fontResult.c_str());
+  if (fontFile != NULL) {
+    textOptions = textOptions->set("fontfile", fontFile);
   }
   VImage text = VImage::text(captionText.c_str(), textOptions);
   VImage captionImage =
@@ -49,8 +44,8 @@ ArgumentMap Uncanny(const string &type, string &outType, const char *bufferdata,
                             ->set("font", font_string.c_str())
                             ->set("width", 588)
                             ->set("height", 90);
-  if (fontResult != "") {
-    textOptions2 = textOptions2->set("fontfile", fontResult.c_str());
+  if (fontFile != NULL) {
+    textOptions2 = textOptions2->set("fontfile", fontFile);
   }
   VImage text2 = VImage::text(caption2Text.c_str(), textOptions2);
   VImage caption2Image =
@@ -61,15 +56,13 @@ ArgumentMap Uncanny(const string &type, string &outType, const char *bufferdata,
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
-  VImage uncanny = VImage::new_from_file((basePath + path).c_str());
+  VImage uncanny = LoadAsset(basePath + path);
 
   base = base.insert(uncanny, 0, 130);
 
-  vector<VImage> img;
-  img.reserve(nPages);  // Pre-allocate to avoid reallocations
-  for (int i = 0; i < nPages; i++) {
+  VImage final = JoinFrames(in, nPages, job, [&](int i) {
     VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
     VImage resized = img_frame.resize(690.0 / (double)width);
     if (resized.height() > 590) {
@@ -77,21 +70,11 @@ ArgumentMap Uncanny(const string &type, string &outType, const char *bufferdata,
       resized = resized.resize(vscale, VImage::option()->set("vscale", vscale));
     }
     VImage composited = base.insert(resized, 935 - (resized.width() / 2), 425 - (resized.height() / 2));
-    img.push_back(composited);
-  }
-  VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
+    return composited;
+  });
   final.set(VIPS_META_PAGE_HEIGHT, 720);
 
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.reoptimise = 1;
 
-  return output;
+  return final;
 }
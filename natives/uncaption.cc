@@ -6,15 +6,12 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Uncaption(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                      ArgumentMap arguments, bool *shouldKill) {
-  float tolerance = GetArgumentWithFallback<float>(arguments, "tolerance", 0.5);
-
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, true));
+VImage Uncaption(VImage in, ImageState &state, const UncaptionParams &arguments, [[maybe_unused]] JobControl *job) {
+  float tolerance = arguments.tolerance;
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
 
   VImage first = in.crop(0, 0, 3, pageHeight).colourspace(VIPS_INTERPRETATION_B_W) > (255 * tolerance);
   int top, captionWidth, captionHeight;
@@ -34,16 +31,8 @@ ArgumentMap Uncaption(const string &type, string &outType, const char *bufferdat
   VImage final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
   final.set(VIPS_META_PAGE_HEIGHT, newHeight);
 
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  return output;
+  return final;
 }
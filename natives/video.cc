@@ -1,103 +1,37 @@
 /**
  * FFmpeg Video Processing Module for Gabe Discord Bot
  *
- * This module provides video manipulation capabilities using FFmpeg CLI.
- * All operations write to temporary files, process with ffmpeg, and return buffers.
+ * This module provides video manipulation capabilities using the FFmpeg libraries.
+ * Everything runs in-process from the input buffer to an output buffer, see media.cc.
  *
  * Operations: speed, reverse, caption, togif, trim, meme, stitch, audio extraction
  */
 
-#include <chrono>
+#include <cmath>
 #include <cstdlib>
-#include <filesystem>
-#include <fstream>
-#include <random>
-#include <sstream>
 #include <string>
+#include <vector>
 
 #include "common.h"
+#include "media.h"
 
 using namespace std;
-namespace fs = std::filesystem;
-
-// Helper: Generate unique temporary filename
-static string makeTempPath(const string &ext) {
-  auto now = chrono::high_resolution_clock::now();
-  auto ns = chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count();
-  random_device rd;
-  mt19937 gen(rd());
-  uniform_int_distribution<> dist(100000, 999999);
-
-  ostringstream oss;
-  oss << "/tmp/gabe_" << ns << "_" << dist(gen) << ext;
-  return oss.str();
-}
-
-// Helper: Write buffer to file
-static bool writeFile(const string &path, const char *data, size_t len) {
-  ofstream out(path, ios::binary);
-  if (!out) return false;
-  out.write(data, static_cast<streamsize>(len));
-  return out.good();
-}
-
-// Helper: Read file into malloc'd buffer, returns nullptr on failure
-static char *readFile(const string &path, size_t &outSize) {
-  ifstream in(path, ios::binary | ios::ate);
-  if (!in) return nullptr;
-
-  auto size = in.tellg();
-  if (size <= 0) return nullptr;
-
-  in.seekg(0, ios::beg);
-  char *buf = static_cast<char *>(malloc(static_cast<size_t>(size)));
-  if (!buf) return nullptr;
+using namespace vips;
 
-  in.read(buf, size);
-  if (!in) {
-    free(buf);
-    return nullptr;
-  }
-
-  outSize = static_cast<size_t>(size);
-  return buf;
-}
-
-// Helper: Remove temp file if it exists
-static void removeTempFile(const string &path) {
-  try {
-    fs::remove(path);
-  } catch (...) {
-  }
-}
-
-// Helper: Escape text for FFmpeg drawtext filter
-static string escapeDrawtext(const string &text) {
-  string out;
-  out.reserve(text.size() * 2);
-  for (char c : text) {
-    // Escape characters that have special meaning in drawtext
-    if (c == '\'' || c == '\\' || c == ':' || c == '%') {
-      out += '\\';
-    }
-    out += c;
-  }
-  return out;
-}
-
-// Helper: Run ffmpeg command and return success status
-static bool runFfmpeg(const string &cmd) {
-  string finalCmd = cmd;
-  if (finalCmd.find("ffmpeg ") == 0) {
-    finalCmd.replace(0, 7, "ffmpeg -nostdin ");
-  }
-  return system(finalCmd.c_str()) == 0;
-}
+// Most decoded RGB frames VideoToGif holds for the native GIF encoder, which reads them in place
+#define VIDEO_GIF_MAX_FRAMES_MEM (GIF_NATIVE_MAX_MEM / (3 + GIF_WORK_BYTES) * 3)
+// Most the decoded clip may take up for filters that hold all of it until the end, such as reverse
+#define VIDEO_BUFFERED_MAX_MEM (256 * 1024 * 1024)
+// Image commands on videos get at most this frame rate and size, and see this many frames at a time
+#define VIDEO_FRAMES_MAX_FPS 30
+#define VIDEO_FRAMES_MAX_SIZE 720
+#define VIDEO_FRAMES_BATCH 32
 
 // Helper: Build output map with buffer
 static ArgumentMap makeOutput(char *buf, size_t size) {
   ArgumentMap out;
   out["buf"] = buf;
+  out["free"] = free;
   out["size"] = size;
   return out;
 }
@@ -109,251 +43,191 @@ static ArgumentMap makeError(const string &msg) {
   return out;
 }
 
-// Helper: Get float from arguments (handling int/float mismatch)
-static float GetFloat(const ArgumentMap& arguments, const string& key, float fallback) {
-  if (arguments.find(key) == arguments.end()) return fallback;
-  const auto& val = arguments.at(key);
-  if (std::holds_alternative<int>(val)) return static_cast<float>(std::get<int>(val));
-  if (std::holds_alternative<float>(val)) return std::get<float>(val);
-  return fallback;
+// Helper: Run a job, a failure is reported as the given message with libav's reason after it
+static ArgumentMap runMedia(const MediaJob &media, const string &failure, JobControl *job) {
+  try {
+    size_t size = 0;
+    char *buf = RunMedia(media, size, job);
+    return makeOutput(buf, size);
+  } catch (const MediaError &e) {
+    return makeError(failure + ": " + e.what());
+  }
+}
+
+// Helper: Roughly what the decoded clip takes up, as YUV 4:2:0 frames (1.5 bytes a pixel) and 32-bit samples. 0 for
+// what the probe can't tell.
+static double decodedSize(const MediaProbe &probe) {
+  double bytes = 0;
+  if (probe.video.present) {
+    bytes += probe.duration * probe.video.frameRate * probe.video.width * probe.video.height * 1.5;
+  }
+  if (probe.audio.present) bytes += probe.duration * probe.audio.sampleRate * probe.audio.channels * 4;
+  return bytes;
 }
 
+// Helper: Outlined text as the image meme command draws it, rendered once by vips and centred over every frame.
+// The text is Pango markup, so it's escaped on the JS side.
+static MediaOverlay textOverlay(const string &command, const string &text, const string &font, int fontSize,
+                                const string &basePath, int width, const string &y) {
+  double radius = (double)fontSize / 18;
+  int textWidth = width - (int)ceil(radius) * 2;
+  string fontString = (font == "roboto" ? "Roboto Condensed" : font) + " " + (font != "impact" ? "bold" : "normal") +
+                      " " + to_string(fontSize);
+  const char *fontFile = GetFonts(basePath).File(font);
+  VImage mask = VImage::gaussmat(radius / 2, 0.1, VImage::option()->set("separable", true)) * 8;
+  VImage rendered = CachedText(command, text, fontString, fontFile, textWidth, VIPS_ALIGN_CENTRE, [&]() {
+    return genText(text, fontString, fontFile, textWidth, mask, radius);
+  });
+  rendered = rendered.cast(VIPS_FORMAT_UCHAR);
+
+  size_t size = 0;
+  uint8_t *data = static_cast<uint8_t *>(rendered.write_to_memory(&size));
+  MediaOverlay overlay;
+  overlay.pixels.assign(data, data + size);
+  g_free(data);
+  overlay.width = rendered.width();
+  overlay.height = rendered.height();
+  overlay.x = "(main_w-overlay_w)/2";
+  overlay.y = y;
+  return overlay;
+}
 
 /**
  * VideoSpeed - Adjust playback speed of video
  * Parameters: speed (float), slow (bool)
  */
 ArgumentMap VideoSpeed(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                       ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  float speed = GetFloat(arguments, "speed", 2.0f);
-  bool slow = GetArgumentWithFallback<bool>(arguments, "slow", false);
-
-  // Clamp speed
-  if (speed < 0.25f) speed = 0.25f;
-  if (speed > 4.0f) speed = 4.0f;
+                       const VideoSpeedParams &arguments, JobControl *job) {
+  float speed = arguments.speed;
+  bool slow = arguments.slow;
 
   float factor = slow ? (1.0f / speed) : speed;
   outType = type;
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath("." + type);
-
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
-  }
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job)) return makeError("FFmpeg speed adjustment failed");
 
-  // First attempt: Try with both video and audio speed adjustment
-  ostringstream cmd;
-  cmd << "ffmpeg -y -i \"" << inPath << "\" -filter_complex \"";
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
 
   // Video speed: setpts=PTS/factor
-  cmd << "[0:v]setpts=" << (1.0f / factor) << "*PTS[v];";
+  media.videoFilters = {{"setpts", {{"expr", to_string(1.0f / factor) + "*PTS"}}}};
 
   // Audio speed: atempo (limited to 0.5-2.0, chain for extremes)
-  cmd << "[0:a]";
-  float audioFactor = factor;
-  while (audioFactor > 2.0f) {
-    cmd << "atempo=2.0,";
-    audioFactor /= 2.0f;
-  }
-  while (audioFactor < 0.5f) {
-    cmd << "atempo=0.5,";
-    audioFactor *= 2.0f;
-  }
-  cmd << "atempo=" << audioFactor << "[a]\" ";
-
-  cmd << "-map \"[v]\" -map \"[a]\" ";
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a aac -b:a 128k ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  // If that failed, try without audio (video might not have audio stream)
-  if (!ok || !fs::exists(outPath)) {
-    removeTempFile(outPath);
-    ostringstream cmdNoAudio;
-    cmdNoAudio << "ffmpeg -y -i \"" << inPath << "\" ";
-    cmdNoAudio << "-vf \"setpts=" << (1.0f / factor) << "*PTS\" ";
-    cmdNoAudio << "-an ";  // Disable audio
-    cmdNoAudio << "-c:v libx264 -preset fast -crf 23 ";
-    cmdNoAudio << "-movflags +faststart \"" << outPath << "\"";
-    
-    ok = runFfmpeg(cmdNoAudio.str());
-  }
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
+  if (probe.audio.present) {
+    float audioFactor = factor;
+    while (audioFactor > 2.0f) {
+      media.audioFilters.push_back({"atempo", {{"tempo", "2.0"}}});
+      audioFactor /= 2.0f;
+    }
+    while (audioFactor < 0.5f) {
+      media.audioFilters.push_back({"atempo", {{"tempo", "0.5"}}});
+      audioFactor *= 2.0f;
     }
+    media.audioFilters.push_back({"atempo", {{"tempo", to_string(audioFactor)}}});
   } else {
-    result = makeError("FFmpeg speed adjustment failed");
+    media.audio = StreamMode::Drop;
   }
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg speed adjustment failed", job);
 }
 
 /**
  * VideoReverse - Reverse video and audio playback
  */
 ArgumentMap VideoReverse(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                         [[maybe_unused]] ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
+                         [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   outType = type;
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath("." + type);
+  // reverse and areverse hold the whole clip until it ends, so anything too long is turned down before it's decoded
+  // and whatever the probe couldn't tell about is caught on the way
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job)) return makeError("FFmpeg reverse failed");
+  if (decodedSize(probe) > VIDEO_BUFFERED_MAX_MEM) return makeError("Video is too long to reverse");
 
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
-  }
-
-  ostringstream cmd;
-  cmd << "ffmpeg -y -i \"" << inPath << "\" ";
-  cmd << "-vf reverse -af areverse ";
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a aac -b:a 128k ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg reverse failed");
-  }
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
+  media.videoFilters = {{"reverse", {}}};
+  media.audioFilters = {{"areverse", {}}};
+  media.maxBuffered = VIDEO_BUFFERED_MAX_MEM;
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg reverse failed", job);
 }
 
 /**
  * VideoCaption - Add text caption to video
- * Parameters: caption (string), position (string: "top"/"bottom"), font_size (int)
+ * Parameters: caption (string), position (string: "top"/"bottom"), font_size (int), font (string)
  */
 ArgumentMap VideoCaption(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                         ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  string caption = GetArgumentWithFallback<string>(arguments, "caption", string(""));
-  string position = GetArgumentWithFallback<string>(arguments, "position", string("top"));
-  int fontSize = GetArgumentWithFallback<int>(arguments, "font_size", 32);
-
-  if (fontSize < 12) fontSize = 12;
-  if (fontSize > 72) fontSize = 72;
+                         const VideoCaptionParams &arguments, JobControl *job) {
+  const string &caption = arguments.caption;
+  const string &position = arguments.position;
+  int fontSize = arguments.fontSize;
 
   outType = type;
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath("." + type);
-
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job) || !probe.video.present) {
+    return makeError("FFmpeg caption failed");
   }
 
-  string escaped = escapeDrawtext(caption);
-  string yPos = (position == "bottom") ? "(h-th-20)" : "20";
-
-  ostringstream cmd;
-  cmd << "ffmpeg -y -i \"" << inPath << "\" ";
-  cmd << "-vf \"drawtext=text='" << escaped << "'";
-  cmd << ":fontsize=" << fontSize;
-  cmd << ":fontcolor=white:borderw=3:bordercolor=black";
-  cmd << ":x=(w-tw)/2:y=" << yPos << "\" ";
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a copy ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg caption failed");
-  }
+  string yPos = (position == "bottom") ? "main_h-overlay_h-20" : "20";
+
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
+  media.overlays = {textOverlay("videocaption", caption, arguments.font, fontSize, arguments.basePath,
+                                probe.video.width, yPos)};
+  media.audio = StreamMode::Copy;
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg caption failed", job);
 }
 
 /**
  * VideoToGif - Convert video to animated GIF
  * Parameters: fps (int), width (int)
  */
-ArgumentMap VideoToGif(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                       ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  int fps = GetArgumentWithFallback<int>(arguments, "fps", 15);
-  int width = GetArgumentWithFallback<int>(arguments, "width", 480);
-
-  if (fps < 5) fps = 5;
-  if (fps > 30) fps = 30;
-  if (width < 120) width = 120;
-  if (width > 720) width = 720;
+ArgumentMap VideoToGif(const string &type, string &outType, const char *bufferData,
+                       size_t bufferLength, const VideoToGifParams &arguments, JobControl *job) {
+  int fps = arguments.fps;
+  int width = arguments.width;
 
   outType = "gif";
 
-  string inPath = makeTempPath("." + type);
-  string palettePath = makeTempPath(".png");
-  string outPath = makeTempPath(".gif");
-
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
-  }
-
-  // Pass 1: Generate palette
-  ostringstream paletteCmd;
-  paletteCmd << "ffmpeg -y -i \"" << inPath << "\" ";
-  paletteCmd << "-vf \"fps=" << fps << ",scale=" << width << ":-1:flags=lanczos,palettegen\" ";
-  paletteCmd << "\"" << palettePath << "\"";
-
-  if (!runFfmpeg(paletteCmd.str())) {
-    removeTempFile(inPath);
-    removeTempFile(palettePath);
-    return makeError("FFmpeg palette generation failed");
-  }
-
-  // Pass 2: Generate GIF with palette
-  ostringstream gifCmd;
-  gifCmd << "ffmpeg -y -i \"" << inPath << "\" -i \"" << palettePath << "\" ";
-  gifCmd << "-lavfi \"fps=" << fps << ",scale=" << width << ":-1:flags=lanczos[x];[x][1:v]paletteuse\" ";
-  gifCmd << "\"" << outPath << "\"";
-
-  bool ok = runFfmpeg(gifCmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg GIF conversion failed");
-  }
+  vector<MediaFilter> filters = {{"fps", {{"fps", to_string(fps)}}},
+                                 {"scale", {{"w", to_string(width)}, {"h", "-1"}, {"flags", "lanczos"}}}};
 
-  removeTempFile(inPath);
-  removeTempFile(palettePath);
-  removeTempFile(outPath);
-  return result;
+  // The video is decoded and scaled once, and the frames go through the same GIF encoder as image commands
+  VideoFrames frames;
+  bool fits;
+  try {
+    fits = DecodeVideo(bufferData, bufferLength, filters, VIDEO_GIF_MAX_FRAMES_MEM, frames, job);
+  } catch (const MediaError &e) {
+    return makeError(string("FFmpeg GIF conversion failed: ") + e.what());
+  }
+  if (fits && !frames.delays.empty()) {
+    int nPages = frames.delays.size();
+    VImage image = VImage::new_from_memory(frames.pixels.data(), frames.pixels.size(), frames.width,
+                                           frames.height * nPages, 3, VIPS_FORMAT_UCHAR);
+    image.set(VIPS_META_PAGE_HEIGHT, frames.height);
+    image.set("delay", frames.delays);
+    image.set("loop", 0);
+    ImageState state;
+    state.type = type;
+    state.outType = "gif";
+    return EncodeImage(image, state, job);
+  }
+
+  // Too long to hold every frame at this size. libav finds the palette in a pass of its own and maps the frames to
+  // it in a second one, so it only ever has a few frames at a time.
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = "gif";
+  media.videoFilters = filters;
+
+  return runMedia(media, "FFmpeg GIF conversion failed", job);
 }
 
 /**
@@ -361,251 +235,164 @@ ArgumentMap VideoToGif(const string &type, string &outType, const char *bufferDa
  * Parameters: start (float), duration (float)
  */
 ArgumentMap VideoTrim(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                      ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  float start = GetFloat(arguments, "start", 0.0f);
-  float duration = GetFloat(arguments, "duration", 10.0f);
-
-  if (start < 0.0f) start = 0.0f;
-  if (duration < 0.5f) duration = 0.5f;
-  if (duration > 60.0f) duration = 60.0f;
+                      const VideoTrimParams &arguments, JobControl *job) {
+  float start = arguments.start;
+  float duration = arguments.duration;
 
   outType = type;
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath("." + type);
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job)) return makeError("FFmpeg trim failed");
+  if (probe.duration > 0 && start >= probe.duration) return makeError("Trim start is past the end of the video");
 
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
-  }
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
+  media.start = start;
+  media.duration = duration;
 
-  ostringstream cmd;
-  cmd << "ffmpeg -y -ss " << start << " -i \"" << inPath << "\" ";
-  cmd << "-t " << duration << " ";
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a aac -b:a 128k ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg trim failed");
+  // A cut that starts on a keyframe (within half a frame) doesn't need anything decoded, the packets are copied
+  double tolerance = probe.video.frameRate > 0 ? 0.5 / probe.video.frameRate : 0.001;
+  bool aligned = start <= 0;
+  for (double keyframe : probe.keyframes) aligned = aligned || abs(keyframe - start) <= tolerance;
+  if (aligned) {
+    media.video = StreamMode::Copy;
+    media.audio = StreamMode::Copy;
   }
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg trim failed", job);
 }
 
 /**
  * VideoMeme - Add top/bottom meme text to video
- * Parameters: top (string), bottom (string), font_size (int)
+ * Parameters: top (string), bottom (string), font_size (int), font (string)
  */
 ArgumentMap VideoMeme(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                      ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  string topText = GetArgumentWithFallback<string>(arguments, "top", string(""));
-  string bottomText = GetArgumentWithFallback<string>(arguments, "bottom", string(""));
-  int fontSize = GetArgumentWithFallback<int>(arguments, "font_size", 48);
-
-  if (fontSize < 16) fontSize = 16;
-  if (fontSize > 96) fontSize = 96;
+                      const VideoMemeParams &arguments, JobControl *job) {
+  const string &topText = arguments.top;
+  const string &bottomText = arguments.bottom;
+  int fontSize = arguments.fontSize;
+  const string &font = arguments.font;
+  const string &basePath = arguments.basePath;
 
   outType = type;
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath("." + type);
-
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job) || !probe.video.present) {
+    return makeError("FFmpeg meme failed");
   }
+  int width = probe.video.width;
 
-  string escapedTop = escapeDrawtext(topText);
-  string escapedBottom = escapeDrawtext(bottomText);
-
-  // Build filter chain
-  ostringstream filter;
-  bool hasFilter = false;
-
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
   if (!topText.empty()) {
-    filter << "drawtext=text='" << escapedTop << "'";
-    filter << ":fontsize=" << fontSize;
-    filter << ":fontcolor=white:borderw=4:bordercolor=black";
-    filter << ":x=(w-tw)/2:y=20";
-    hasFilter = true;
+    media.overlays.push_back(textOverlay("videomeme", topText, font, fontSize, basePath, width, "0"));
   }
-
   if (!bottomText.empty()) {
-    if (hasFilter) filter << ",";
-    filter << "drawtext=text='" << escapedBottom << "'";
-    filter << ":fontsize=" << fontSize;
-    filter << ":fontcolor=white:borderw=4:bordercolor=black";
-    filter << ":x=(w-tw)/2:y=(h-th-20)";
-    hasFilter = true;
-  }
-
-  ostringstream cmd;
-  cmd << "ffmpeg -y -i \"" << inPath << "\" ";
-  if (hasFilter) {
-    cmd << "-vf \"" << filter.str() << "\" ";
-  }
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a copy ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg meme failed");
+    media.overlays.push_back(
+      textOverlay("videomeme", bottomText, font, fontSize, basePath, width, "main_h-overlay_h"));
   }
+  media.audio = StreamMode::Copy;
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg meme failed", job);
 }
 
 /**
  * VideoStitch - Concatenate two videos
- * Parameters: buffer2 (char*), buffer2_len (size_t)
+ * Parameters: buffer2 (buffer)
  */
 ArgumentMap VideoStitch(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                        ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
-  char *buffer2 = GetArgumentWithFallback<char *>(arguments, "buffer2", nullptr);
-  size_t buffer2Len = GetArgumentWithFallback<size_t>(arguments, "buffer2_len", static_cast<size_t>(0));
+                        const VideoStitchParams &arguments, JobControl *job) {
+  const string &buffer2 = arguments.buffer2;
 
-  if (!buffer2 || buffer2Len == 0) {
+  if (buffer2.empty()) {
     return makeError("Second video required for stitching");
   }
 
   outType = type;
 
-  string inPath1 = makeTempPath("." + type);
-  string inPath2 = makeTempPath("." + type);
-  string listPath = makeTempPath(".txt");
-  string outPath = makeTempPath("." + type);
-
-  if (!writeFile(inPath1, bufferData, bufferLength) || !writeFile(inPath2, buffer2, buffer2Len)) {
-    removeTempFile(inPath1);
-    removeTempFile(inPath2);
-    return makeError("Failed to write input files");
-  }
-
-  // Write concat list
-  {
-    ofstream listFile(listPath);
-    listFile << "file '" << inPath1 << "'\n";
-    listFile << "file '" << inPath2 << "'\n";
-  }
-
-  ostringstream cmd;
-  cmd << "ffmpeg -y -f concat -safe 0 -i \"" << listPath << "\" ";
-  cmd << "-c:v libx264 -preset fast -crf 23 -c:a aac -b:a 128k ";
-  cmd << "-movflags +faststart \"" << outPath << "\"";
-
-  bool ok = runFfmpeg(cmd.str());
-
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg stitch failed");
-  }
+  // Clips encoded the same way are joined packet by packet, otherwise the second one gets scaled to the size of the
+  // first one and both are encoded
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}, {buffer2.data(), buffer2.size()}};
+  media.format = type;
+  media.video = StreamMode::Copy;
+  media.audio = StreamMode::Copy;
 
-  removeTempFile(inPath1);
-  removeTempFile(inPath2);
-  removeTempFile(listPath);
-  removeTempFile(outPath);
-  return result;
+  return runMedia(media, "FFmpeg stitch failed", job);
 }
 
 /**
  * VideoAudio - Extract audio from video as MP3
  */
-ArgumentMap VideoAudio(const string &type, string &outType, const char *bufferData, size_t bufferLength,
-                       [[maybe_unused]] ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
+ArgumentMap VideoAudio([[maybe_unused]] const string &type, string &outType, const char *bufferData,
+                       size_t bufferLength, [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   outType = "mp3";
 
-  string inPath = makeTempPath("." + type);
-  string outPath = makeTempPath(".mp3");
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job)) return makeError("FFmpeg audio extraction failed");
+  if (!probe.audio.present) return makeError("No audio stream to extract");
 
-  if (!writeFile(inPath, bufferData, bufferLength)) {
-    return makeError("Failed to write input file");
-  }
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = "mp3";
+  // Audio that already is MP3 comes out as it is, without decoding it
+  media.audio = StreamMode::Copy;
 
-  // Try multiple approaches to extract audio
-  bool ok = false;
-  
-  // First attempt: Use libmp3lame with explicit audio stream mapping
-  ostringstream cmd1;
-  cmd1 << "ffmpeg -y -i \"" << inPath << "\" ";
-  cmd1 << "-vn -map 0:a:0 -acodec libmp3lame -q:a 2 ";
-  cmd1 << "\"" << outPath << "\"";
-  ok = runFfmpeg(cmd1.str());
-
-  // Second attempt: Use built-in MP3 encoder if libmp3lame isn't available
-  if (!ok || !fs::exists(outPath)) {
-    removeTempFile(outPath);
-    ostringstream cmd2;
-    cmd2 << "ffmpeg -y -i \"" << inPath << "\" ";
-    cmd2 << "-vn -map 0:a? -acodec mp3 -q:a 2 ";
-    cmd2 << "\"" << outPath << "\"";
-    ok = runFfmpeg(cmd2.str());
-  }
-
-  // Third attempt: Convert to AAC first, then to MP3 (for problematic codecs)
-  if (!ok || !fs::exists(outPath)) {
-    removeTempFile(outPath);
-    ostringstream cmd3;
-    cmd3 << "ffmpeg -y -i \"" << inPath << "\" ";
-    cmd3 << "-vn -acodec libmp3lame -ar 44100 -ac 2 -b:a 192k ";
-    cmd3 << "\"" << outPath << "\"";
-    ok = runFfmpeg(cmd3.str());
-  }
-
-  // Fourth attempt: Simple copy if input already has MP3 audio
-  if (!ok || !fs::exists(outPath)) {
-    removeTempFile(outPath);
-    ostringstream cmd4;
-    cmd4 << "ffmpeg -y -i \"" << inPath << "\" ";
-    cmd4 << "-vn -acodec copy ";
-    cmd4 << "\"" << outPath << "\"";
-    ok = runFfmpeg(cmd4.str());
-  }
+  return runMedia(media, "FFmpeg audio extraction failed", job);
+}
 
-  ArgumentMap result;
-  if (ok && fs::exists(outPath)) {
-    size_t outSize = 0;
-    char *outBuf = readFile(outPath, outSize);
-    if (outBuf) {
-      result = makeOutput(outBuf, outSize);
-    } else {
-      result = makeError("Failed to read output file");
-    }
-  } else {
-    result = makeError("FFmpeg audio extraction failed");
-  }
+/**
+ * RunVideoFrames - Apply an image command to every frame of a video
+ * Frames are decoded in batches, and each batch goes through the command as one animation with page-height set.
+ * Audio is copied as it is. Only used for commands marked Video::PerFrame.
+ */
+ArgumentMap RunVideoFrames(ImageFunc run, const string &type, string &outType, const char *bufferData,
+                           size_t bufferLength, const CommandArgs &arguments, JobControl *job) {
+  outType = type;
 
-  removeTempFile(inPath);
-  removeTempFile(outPath);
-  return result;
+  MediaProbe probe;
+  if (!ProbeMedia(bufferData, bufferLength, probe, job) || !probe.video.present) {
+    return makeError("FFmpeg frame processing failed");
+  }
+
+  MediaJob media;
+  media.inputs = {{bufferData, bufferLength}};
+  media.format = type;
+  if (probe.video.frameRate > VIDEO_FRAMES_MAX_FPS) {
+    media.videoFilters.push_back({"fps", {{"fps", to_string(VIDEO_FRAMES_MAX_FPS)}}});
+  }
+  string maxSize = to_string(VIDEO_FRAMES_MAX_SIZE);
+  media.videoFilters.push_back({"scale",
+                                {{"w", "min(iw," + maxSize + ")"},
+                                 {"h", "min(ih," + maxSize + ")"},
+                                 {"force_original_aspect_ratio", "decrease"}}});
+  media.audio = StreamMode::Copy;
+  media.batchFrames = VIDEO_FRAMES_BATCH;
+  media.frames = [&](VideoFrames &batch) {
+    int nPages = batch.delays.size();
+    VImage in = VImage::new_from_memory(batch.pixels.data(), batch.pixels.size(), batch.width,
+                                        batch.height * nPages, 3, VIPS_FORMAT_UCHAR);
+    in.set(VIPS_META_PAGE_HEIGHT, batch.height);
+    in.set("delay", batch.delays);
+    in.set("loop", 0);
+    ImageState state{type, type};
+    VImage out = run(in, state, arguments, job);
+
+    out = out.colourspace(VIPS_INTERPRETATION_sRGB);
+    if (out.has_alpha()) out = out.flatten();
+    out = out.cast(VIPS_FORMAT_UCHAR);
+    int pageHeight = vips_image_get_page_height(out.get_image());
+    if (out.height() != pageHeight * nPages) throw MediaError("This command can't be used on videos");
+
+    size_t size = 0;
+    uint8_t *data = static_cast<uint8_t *>(out.write_to_memory(&size));
+    batch.pixels.assign(data, data + size);
+    g_free(data);
+    batch.width = out.width();
+    batch.height = pageHeight;
+  };
+
+  return runMedia(media, "FFmpeg frame processing failed", job);
 }
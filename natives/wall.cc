@@ -11,7 +11,7 @@ using namespace std;
 using namespace Magick;
 
 ArgumentMap Wall([[maybe_unused]] const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                 [[maybe_unused]] ArgumentMap arguments, [[maybe_unused]] bool *shouldKill) {
+                 [[maybe_unused]] const NoParams &arguments, JobControl *job) {
   Blob blob;
 
   list<Image> frames;
@@ -27,6 +27,7 @@ ArgumentMap Wall([[maybe_unused]] const string &type, string &outType, const cha
   coalesceImages(&coalesced, frames.begin(), frames.end());
 
   for (Image &image : coalesced) {
+    CheckJob(job);
     image.resize(Geometry("128x128"));
     image.virtualPixelMethod(Magick::TileVirtualPixelMethod);
     image.matteColor("none");
@@ -43,6 +44,7 @@ ArgumentMap Wall([[maybe_unused]] const string &type, string &outType, const cha
 
   if (outType == "gif") {
     for (Image &image : mid) {
+      CheckJob(job);
       image.quantizeDitherMethod(FloydSteinbergDitherMethod);
       image.quantize();
     }
@@ -57,6 +59,7 @@ ArgumentMap Wall([[maybe_unused]] const string &type, string &outType, const cha
 
   ArgumentMap output;
   output["buf"] = data;
+  output["free"] = free;
   output["size"] = dataSize;
 
   return output;
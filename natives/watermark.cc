@@ -1,3 +1,4 @@
+#include <cmath>
 #include <map>
 #include <vips/vips8>
 
@@ -6,34 +7,48 @@
 using namespace std;
 using namespace vips;
 
-ArgumentMap Watermark(const string &type, string &outType, const char *bufferdata, size_t bufferLength,
-                      ArgumentMap arguments, bool *shouldKill) {
-  string water = GetArgument<string>(arguments, "water");
-  int gravity = GetArgument<int>(arguments, "gravity");
+VImage Watermark(VImage in, ImageState &state, const WatermarkParams &arguments, [[maybe_unused]] JobControl *job) {
+  const string &water = arguments.water;
+  int gravity = arguments.gravity;
 
-  bool resize = GetArgumentWithFallback<bool>(arguments, "resize", false);
-  float yscale = GetArgumentWithFallback<float>(arguments, "yscale", false);
+  bool resize = arguments.resize;
+  float yscale = arguments.yscale;
 
-  bool append = GetArgumentWithFallback<bool>(arguments, "append", false);
+  bool append = arguments.append;
 
-  bool alpha = GetArgumentWithFallback<bool>(arguments, "alpha", false);
-  bool flipX = GetArgumentWithFallback<bool>(arguments, "flipX", false);
-  bool flipY = GetArgumentWithFallback<bool>(arguments, "flipY", false);
+  bool alpha = arguments.alpha;
+  bool flipX = arguments.flipX;
+  bool flipY = arguments.flipY;
 
-  bool mc = MapContainsKey(arguments, "mc");
+  bool mc = arguments.mc;
 
-  string basePath = GetArgument<string>(arguments, "basePath");
+  const string &basePath = arguments.basePath;
 
-  VImage in = VImage::new_from_buffer(bufferdata, bufferLength, "", GetInputOptions(type, true, false))
-                .colourspace(VIPS_INTERPRETATION_sRGB);
+  in = in.colourspace(VIPS_INTERPRETATION_sRGB);
   if (!in.has_alpha()) in = in.bandjoin(255);
 
   string merged = basePath + water;
-  VImage watermark = VImage::new_from_file(merged.c_str());
+  VImage watermark = LoadAsset(merged);
 
   int width = in.width();
   int pageHeight = vips_image_get_page_height(in.get_image());
-  int nPages = type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+  int nPages = state.type == "avif" ? 1 : vips_image_get_n_pages(in.get_image());
+
+  if (resize) {
+    double scaledWidth = watermark.width();
+    double scaledHeight = watermark.height();
+    if (append) {
+      scaledHeight *= (double)width / (double)watermark.width();
+      scaledWidth = width;
+    } else if (yscale) {
+      scaledWidth = width;
+      scaledHeight = pageHeight * yscale;
+    } else {
+      scaledWidth *= (double)pageHeight / (double)watermark.height();
+      scaledHeight = pageHeight;
+    }
+    watermark = LoadAssetResized(merged, round(scaledWidth), round(scaledHeight));
+  }
 
   if (flipX) {
     watermark = watermark.flip(VIPS_DIRECTION_HORIZONTAL);
@@ -43,18 +58,6 @@ ArgumentMap Watermark(const string &type, string &outType, const char *bufferdat
     watermark = watermark.flip(VIPS_DIRECTION_VERTICAL);
   }
 
-  if (resize) {
-    if (append) {
-      watermark = watermark.resize((double)width / (double)watermark.width());
-    } else if (yscale) {
-      watermark =
-        watermark.resize((double)width / (double)watermark.width(),
-                         VImage::option()->set("vscale", (double)(pageHeight * yscale) / (double)watermark.height()));
-    } else {
-      watermark = watermark.resize((double)pageHeight / (double)watermark.height());
-    }
-  }
-
   int x = 0, y = 0;
   switch (gravity) {
     case 1:
@@ -84,69 +87,41 @@ ArgumentMap Watermark(const string &type, string &outType, const char *bufferdat
   }
 
   VImage final;
-  if (!append && !mc && !alpha) {
+  if (append) {
+    final = PageJoin(in, nPages, watermark, false, zeroVec);
+  } else if (mc) {
+    // the padding stays transparent
+    VImage padded = PageEmbed(in, nPages, 0, 0, width, pageHeight + 15, zeroVec);
+    final = PageLayer(padded, nPages, watermark, width - 190, pageHeight + 15 - 22);
+  } else if (!alpha) {
     VImage replicated = watermark.embed(x, y, width, pageHeight).replicate(1, nPages);
     final = in.composite2(replicated, VIPS_BLEND_MODE_OVER);
   } else {
+    VImage contentAlpha =
+      watermark.extract_band(0).embed(x, y, width, pageHeight, VImage::option()->set("extend", "white"));
+    VImage frameAlpha =
+      watermark.extract_band(1).embed(x, y, width, pageHeight, VImage::option()->set("extend", "black"));
+    VImage bg =
+      frameAlpha.new_from_image({0, 0, 0}).copy(VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB));
+    VImage frame = bg.bandjoin(frameAlpha);
+    if (state.outType == "jpg" || state.outType == "jpeg") {
+      state.outType = "png";
+    }
+
     vector<VImage> img;
     img.reserve(nPages);  // Pre-allocate to avoid reallocations
-    int addedHeight = 0;
-    VImage contentAlpha;
-    VImage frameAlpha;
-    VImage bg;
-    VImage frame;
     for (int i = 0; i < nPages; i++) {
       VImage img_frame = nPages > 1 ? in.crop(0, i * pageHeight, width, pageHeight) : in;
-      if (append) {
-        VImage appended = img_frame.join(watermark, VIPS_DIRECTION_VERTICAL, VImage::option()->set("expand", true));
-        addedHeight = watermark.height();
-        img.push_back(appended);
-      } else if (mc) {
-        VImage padded = img_frame.embed(0, 0, width, pageHeight + 15, VImage::option()->set("background", 0xffffff));
-        VImage composited = padded.composite2(watermark, VIPS_BLEND_MODE_OVER,
-                                              VImage::option()->set("x", width - 190)->set("y", padded.height() - 22));
-        addedHeight = 15;
-        img.push_back(composited);
-      } else {
-        VImage composited;
-        if (alpha) {
-          if (i == 0) {
-            contentAlpha =
-              watermark.extract_band(0).embed(x, y, width, pageHeight, VImage::option()->set("extend", "white"));
-            frameAlpha =
-              watermark.extract_band(1).embed(x, y, width, pageHeight, VImage::option()->set("extend", "black"));
-            bg = frameAlpha.new_from_image({0, 0, 0}).copy(
-              VImage::option()->set("interpretation", VIPS_INTERPRETATION_sRGB));
-            frame = bg.bandjoin(frameAlpha);
-            if (outType == "jpg" || outType == "jpeg") {
-              outType = "png";
-            }
-          }
-          VImage content =
-            img_frame.extract_band(0, VImage::option()->set("n", 3)).bandjoin(contentAlpha & img_frame.extract_band(3));
-
-          composited = content.composite2(frame, VIPS_BLEND_MODE_OVER, VImage::option()->set("x", x)->set("y", y));
-        } else {
-          composited =
-            img_frame.composite2(watermark, VIPS_BLEND_MODE_OVER, VImage::option()->set("x", x)->set("y", y));
-        }
-        img.push_back(composited);
-      }
+      VImage content =
+        img_frame.extract_band(0, VImage::option()->set("n", 3)).bandjoin(contentAlpha & img_frame.extract_band(3));
+      img.push_back(content.composite2(frame, VIPS_BLEND_MODE_OVER, VImage::option()->set("x", x)->set("y", y)));
     }
     final = VImage::arrayjoin(img, VImage::option()->set("across", 1));
-    final.set(VIPS_META_PAGE_HEIGHT, pageHeight + addedHeight);
+    final.set(VIPS_META_PAGE_HEIGHT, pageHeight);
   }
 
-  SetupTimeoutCallback(final, shouldKill);
-
-  char *buf;
-  size_t dataSize = 0;
-  final.write_to_buffer(("." + outType).c_str(), reinterpret_cast<void **>(&buf), &dataSize,
-                        outType == "gif" ? VImage::option()->set("dither", 0)->set("reoptimise", 1) : 0);
-
-  ArgumentMap output;
-  output["buf"] = buf;
-  output["size"] = dataSize;
+  state.dither = 0;
+  state.reoptimise = 1;
 
-  return output;
+  return final;
 }
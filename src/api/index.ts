@@ -2,17 +2,26 @@ import "dotenv/config";
 import { Buffer } from "node:buffer";
 import EventEmitter from "node:events";
 import { createServer } from "node:http";
+import path from "node:path";
 import process from "node:process";
+import { fileURLToPath } from "node:url";
 import { DiscordHTTPError, DiscordRESTError, type RawMessage } from "oceanic.js";
 import type WSocket from "ws";
 import { WebSocketServer, type ErrorEvent } from "ws";
 import { stolenEmojis } from "#utils/collections.js";
 import run from "#utils/image-runner.js";
-import { img } from "#utils/imageLib.js";
+import { type ImageProgress, img } from "#utils/imageLib.js";
 import logger from "#utils/logger.js";
 import type { ImageParams } from "#utils/types.js";
 
-const formats = Object.keys(img.imageInit());
+const formats = Object.keys(img.imageInit(path.join(path.dirname(fileURLToPath(import.meta.url)), "../../")));
+img.cacheLimits({
+  assets: process.env.ASSET_CACHE_SIZE ? Number.parseInt(process.env.ASSET_CACHE_SIZE) : undefined,
+  text: process.env.TEXT_CACHE_SIZE ? Number.parseInt(process.env.TEXT_CACHE_SIZE) : undefined,
+});
+img.threadLimits({
+  cores: process.env.IMAGE_THREADS ? Number.parseInt(process.env.IMAGE_THREADS) : undefined,
+});
 
 const Rerror = 0x01;
 const Tqueue = 0x02;
@@ -41,6 +50,8 @@ interface Job {
   num: number;
   msg: ImageParams;
   verifyEvent: EventEmitter<VerifyEvents>;
+  controller: AbortController;
+  progress?: ImageProgress;
   tag?: Buffer;
   error?: string;
   data?: Buffer;
@@ -159,11 +170,15 @@ wss.on("connection", (ws, request) => {
     if (!(msg instanceof Buffer)) return;
     const opcode = msg.readUint8(0);
     const tag = msg.subarray(1, 3);
-    const req = msg.toString().slice(3);
     if (opcode === Tqueue) {
       const id = msg.readBigInt64LE(3);
       const obj = msg.subarray(11).toString();
-      const job = { msg: JSON.parse(obj), num: jobs.size, verifyEvent: new EventEmitter<VerifyEvents>() };
+      const job = {
+        msg: JSON.parse(obj),
+        num: jobs.size,
+        verifyEvent: new EventEmitter<VerifyEvents>(),
+        controller: new AbortController(),
+      };
       jobs.set(id, job);
 
       const newBuffer = Buffer.concat([Buffer.from([Rqueue]), tag]);
@@ -172,7 +187,9 @@ wss.on("connection", (ws, request) => {
       log(`Got WS request for job ${obj} with id ${id}`, job.num);
       acceptJob(id, ws);
     } else if (opcode === Tcancel) {
-      jobs.delete(BigInt(req));
+      const id = msg.readBigUInt64LE(3);
+      jobs.get(id)?.controller.abort();
+      jobs.delete(id);
       const cancelResponse = Buffer.concat([Buffer.from([Rcancel]), tag]);
       ws.send(cancelResponse);
     } else if (opcode === Twait) {
@@ -261,6 +278,25 @@ httpServer.on("request", (req, res) => {
     jobs.delete(id);
     return res.end(data);
   }
+  if (reqUrl.pathname === "/progress" && req.method === "GET") {
+    const param = reqUrl.searchParams.get("id");
+    if (!param) {
+      res.statusCode = 400;
+      return res.end("400 Bad Request");
+    }
+    const id = BigInt(param);
+    if (!jobs.has(id)) {
+      res.statusCode = 404;
+      return res.end("404 Not Found");
+    }
+    res.setHeader("Content-Type", "application/json");
+    return res.end(JSON.stringify(jobs.get(id).progress ?? null));
+  }
+  if (reqUrl.pathname === "/stats" && req.method === "GET") {
+    log(`Sending native stats to ${req.socket.remoteAddress}:${req.socket.remotePort} via HTTP`);
+    res.setHeader("Content-Type", "application/json");
+    return res.end(JSON.stringify(img.stats(reqUrl.searchParams.get("reset") === "true")));
+  }
   if (reqUrl.pathname === "/count" && req.method === "GET") {
     log(`Sending job count to ${req.socket.remoteAddress}:${req.socket.remotePort} via HTTP`);
     return res.end(jobs.size.toString());
@@ -461,6 +497,9 @@ async function runJob(job: MiniJob, ws: WSocket): Promise<void> {
   }
 
   log(`Job ${job.id} started`, job.num);
-  const data = await run(object);
+  const data = await run(object, jobs.get(job.id)?.controller.signal, (progress) => {
+    const current = jobs.get(job.id);
+    if (current) current.progress = progress;
+  });
   await finishJob(data, job, object, ws);
 }
@@ -9,12 +9,13 @@ import {
   type User,
 } from "oceanic.js";
 import messages from "#config/messages.json" with { type: "json" };
-import { runningCommands, selectedImages } from "#utils/collections.js";
+import { imageJobs, runningCommands, selectedImages } from "#utils/collections.js";
 import { getAllLocalizations } from "#utils/i18n.js";
 import { runImageJob } from "#utils/image.js";
 import imageDetect, { type ImageMeta } from "#utils/imagedetect.js";
 import logger from "#utils/logger.js";
 import { clean, isEmpty, random } from "#utils/misc.js";
+import { uploadLimit } from "#utils/tempimages.js";
 import type { ImageParams } from "#utils/types.js";
 import Command from "./command.ts";
 
@@ -82,7 +83,7 @@ class ImageCommand extends Command {
             this.message,
             this.interaction,
             true,
-            staticProps.requiresVideo,
+            staticProps.requiresVideo || staticProps.supportsVideo,
           ).catch((e) => {
             if (e.name === "AbortError") {
               runningCommands.delete(this.author.id);
@@ -201,6 +202,9 @@ class ImageCommand extends Command {
       const TOKEN_EXPIRY_MS = 15 * 60 * 1000; // 15 minutes
       const BUFFER_MS = 60 * 1000; // 60 seconds buffer
 
+      // Nothing can be sent back once the token expires, so don't let the job run any longer than that
+      imageParams.timeout = Math.max(TOKEN_EXPIRY_MS - interactionAge, 0);
+
       if (interactionAge < TOKEN_EXPIRY_MS - BUFFER_MS) {
         imageParams.token = this.interaction.token;
       } else {
@@ -211,8 +215,22 @@ class ImageCommand extends Command {
       }
     }
 
+    const context = this.interaction ?? this.message;
+    // results that fit get attached directly instead of going through the temp site
+    if (context) imageParams.sizeLimit = uploadLimit(context);
+
+    // aborted when the message that ran the command, or its channel or guild, is deleted
+    const controller = new AbortController();
+    imageJobs.set(imageParams.id, {
+      controller,
+      channelID: context?.channelID,
+      guildID: context?.guildID ?? undefined,
+    });
+
     try {
-      const result = await runImageJob(imageParams);
+      // results that don't fit in the limit come back at full size, the temp site takes those
+      const result = await runImageJob(imageParams, controller.signal);
+      if (controller.signal.aborted) return;
       const buffer = result.buffer;
       const type = result.type;
       if (type === "sent") {
@@ -253,6 +271,8 @@ class ImageCommand extends Command {
         flags: ephemeral ? 64 : undefined,
       };
     } catch (e) {
+      // nothing left to reply to
+      if (controller.signal.aborted) return;
       const err = e as Error;
       if (err.toString().includes("image_not_working")) return this.getString("image.notWorking");
       if (err.toString().includes("Request ended prematurely due to a closed connection"))
@@ -267,6 +287,7 @@ class ImageCommand extends Command {
       } catch {
         // no-op
       }
+      imageJobs.delete(imageParams.id);
       runningCommands.delete(this.author?.id);
     }
   }
@@ -353,6 +374,8 @@ class ImageCommand extends Command {
 
   static requiresImage = true;
   static requiresVideo = false;
+  /** Also takes videos, the native side runs the command over their frames (needs Video::PerFrame there too) */
+  static supportsVideo = false;
   static requiresParam = false;
   static requiredParam = "text";
   static requiredParamType = Constants.ApplicationCommandOptionTypes.STRING;
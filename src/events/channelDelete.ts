@@ -5,10 +5,13 @@
 
 import { Constants, type AnyGuildChannel } from "oceanic.js";
 import { checkAndLogAction, handleThreat, handleOwnerThreat, isWhitelisted } from "#utils/antinuke.js";
+import { abortImageJobs } from "#utils/image.js";
 import logger from "#utils/logger.js";
 import type { EventParams } from "#utils/types.js";
 
 export default async ({ client, database }: EventParams, channel: AnyGuildChannel) => {
+    // image jobs running in the channel have nowhere to send their results
+    abortImageJobs({ channelID: channel.id });
     if (!database) return;
     if (!("guildID" in channel) || !channel.guildID) return;
 
@@ -1,4 +1,5 @@
 import type { Guild, Uncached } from "oceanic.js";
+import { abortImageJobs } from "#utils/image.js";
 import { info } from "#utils/logger.js";
 import type { EventParams } from "#utils/types.js";
 
@@ -6,4 +7,5 @@ import type { EventParams } from "#utils/types.js";
 export default (_: EventParams, guild: Guild | Uncached) => {
   const name = "name" in guild ? `${guild.name} (${guild.id})` : guild.id;
   info(`[GUILD LEAVE] ${name} removed the bot.`);
+  abortImageJobs({ guildID: guild.id });
 };
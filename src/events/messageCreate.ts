@@ -17,7 +17,7 @@ import { getString } from "#utils/i18n.js";
 import { error as _error, log, warn } from "#utils/logger.js";
 import { clean } from "#utils/misc.js";
 import parseCommand from "#utils/parseCommand.js";
-import { upload } from "#utils/tempimages.js";
+import { upload, uploadLimit } from "#utils/tempimages.js";
 import type { DBGuild, EventParams } from "#utils/types.js";
 
 let Sentry: typeof import("@sentry/node");
@@ -244,17 +244,7 @@ export default async ({ client, database }: EventParams, message: Message) => {
         `[${executionId}] Result is object, checking if ImageCommand: ${commandClass instanceof ImageCommand}`,
       );
       if (commandClass instanceof ImageCommand && result.files) {
-        let fileSize = 10485760;
-        if (message.guild) {
-          switch (message.guild.premiumTier) {
-            case 2:
-              fileSize = 52428800;
-              break;
-            case 3:
-              fileSize = 104857600;
-              break;
-          }
-        }
+        const fileSize = uploadLimit(message);
         const file = result.files[0];
         if (file.contents.length > fileSize) {
           if (process.env.TEMPDIR && process.env.TEMPDIR !== "" && commandClass.permissions.has("EMBED_LINKS")) {
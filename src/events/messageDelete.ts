@@ -0,0 +1,8 @@
+import type { PossiblyUncachedMessage } from "oceanic.js";
+import { abortImageJobs } from "#utils/image.js";
+import type { EventParams } from "#utils/types.js";
+
+// run when a message is deleted, image jobs it started have nowhere to send their result
+export default (_: EventParams, message: PossiblyUncachedMessage) => {
+  abortImageJobs({ id: message.id });
+};
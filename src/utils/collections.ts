@@ -31,6 +31,9 @@ export class TimedMap<K, V> extends Map {
 }
 
 export const runningCommands = new TimedMap<string, Date>(5000);
+// Image jobs commands are waiting on, by the ID of the message or interaction that started them. Aborting one stops the
+// job once nothing is left to send its result to.
+export const imageJobs = new Map<string, { controller: AbortController; channelID?: string; guildID?: string }>();
 export const selectedImages = new TimedMap<string, ImageMeta>(180000);
 export const stolenEmojis = new TimedMap<
   string,
@@ -1,14 +1,18 @@
 import { Buffer } from "node:buffer";
 import path from "node:path";
 import { fileURLToPath } from "node:url";
-import { img } from "./imageLib.ts";
+import { type ImageProgress, img } from "./imageLib.ts";
 import logger from "./logger.ts";
 import type { ImageParams } from "./types.ts";
 
 // Maximum image size to prevent memory issues (40MB)
 const MAX_IMAGE_SIZE = 41943040;
 
-export default async function run(object: ImageParams): Promise<{ buffer: Buffer; fileExtension: string }> {
+export default async function run(
+  object: ImageParams,
+  signal?: AbortSignal,
+  onProgress?: (progress: ImageProgress) => void,
+): Promise<{ buffer: Buffer; fileExtension: string }> {
   // Check if command exists
   if (!img.funcs.includes(object.cmd)) {
     return {
@@ -113,7 +117,15 @@ export default async function run(object: ImageParams): Promise<{ buffer: Buffer
     };
   }
 
-  const { data, type } = await img.image(object.cmd, object.params, object.input ?? {});
+  if (signal?.aborted) throw new Error("image_job_killed");
+  const job = img.image(object.cmd, object.params, object.input ?? {}, {
+    timeout: object.timeout,
+    budget: object.sizeLimit,
+    progress: onProgress,
+  });
+  const cancel = () => job.cancel();
+  signal?.addEventListener("abort", cancel, { once: true });
+  const { data, type } = await job.finally(() => signal?.removeEventListener("abort", cancel));
   return {
     buffer: data,
     fileExtension: type,
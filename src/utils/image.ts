@@ -2,10 +2,13 @@ import { Buffer } from "node:buffer";
 import { lookup } from "node:dns/promises";
 import fs from "node:fs";
 import { createRequire } from "node:module";
+import path from "node:path";
 import process from "node:process";
+import { fileURLToPath } from "node:url";
 import { fileTypeFromBuffer } from "file-type";
 import ipaddr from "ipaddr.js";
 import serversConfig from "#config/servers.json" with { type: "json" };
+import { imageJobs } from "./collections.ts";
 import ImageConnection from "./imageConnection.ts";
 import logger from "./logger.ts";
 import { random } from "./misc.ts";
@@ -39,7 +42,14 @@ export function initImageLib() {
   const imgLib = nodeRequire(
     `../../build/${process.env.DEBUG && process.env.DEBUG === "true" ? "Debug" : "Release"}/image.node`,
   );
-  imgLib.imageInit();
+  imgLib.imageInit(path.join(path.dirname(fileURLToPath(import.meta.url)), "../../"));
+  imgLib.cacheLimits({
+    assets: process.env.ASSET_CACHE_SIZE ? Number.parseInt(process.env.ASSET_CACHE_SIZE) : undefined,
+    text: process.env.TEXT_CACHE_SIZE ? Number.parseInt(process.env.TEXT_CACHE_SIZE) : undefined,
+  });
+  imgLib.threadLimits({
+    cores: process.env.IMAGE_THREADS ? Number.parseInt(process.env.IMAGE_THREADS) : undefined,
+  });
   img = imgLib;
 }
 
@@ -164,7 +174,25 @@ async function getIdeal(object: ImageParams): Promise<ImageConnection | undefine
 
 let running = 0;
 
-export async function runImageJob(params: ImageParams): Promise<{ buffer: Buffer; type: string }> {
+/**
+ * Aborts the image jobs that were started by a message, or in a channel or guild, that went away. Their results have
+ * nowhere to go anymore.
+ */
+export function abortImageJobs(gone: { id?: string; channelID?: string; guildID?: string }) {
+  for (const [id, job] of imageJobs) {
+    if (
+      id === gone.id ||
+      (gone.channelID !== undefined && job.channelID === gone.channelID) ||
+      (gone.guildID !== undefined && job.guildID === gone.guildID)
+    )
+      job.controller.abort();
+  }
+}
+
+export async function runImageJob(
+  params: ImageParams,
+  signal?: AbortSignal,
+): Promise<{ buffer: Buffer; type: string }> {
   if (process.env.API_TYPE === "ws") {
     const currentServer = await getIdeal(params);
     if (!currentServer)
@@ -172,6 +200,10 @@ export async function runImageJob(params: ImageParams): Promise<{ buffer: Buffer
         buffer: Buffer.alloc(0),
         type: "nocmd",
       };
+    const cancel = () => {
+      currentServer.cancel(BigInt(params.id)).catch(() => {});
+    };
+    signal?.addEventListener("abort", cancel, { once: true });
     try {
       await currentServer.queue(BigInt(params.id), params);
       const result = await currentServer.wait(BigInt(params.id));
@@ -187,6 +219,8 @@ export async function runImageJob(params: ImageParams): Promise<{ buffer: Buffer
         if (e === "No available servers") throw "Request ended prematurely due to a closed connection";
         throw e;
       }
+    } finally {
+      signal?.removeEventListener("abort", cancel);
     }
     return {
       buffer: Buffer.alloc(0),
@@ -200,7 +234,7 @@ export async function runImageJob(params: ImageParams): Promise<{ buffer: Buffer
   if (runner) {
     // Called from command (not using image API)
     running++;
-    const data = await runner(params).finally(() => {
+    const data = await runner(params, signal).finally(() => {
       running--;
       if (running < 0) running = 0;
       if (img && running === 0) {
@@ -208,7 +242,7 @@ export async function runImageJob(params: ImageParams): Promise<{ buffer: Buffer
       }
     });
     return {
-      buffer: Buffer.from([...data.buffer]),
+      buffer: data.buffer,
       type: data.fileExtension,
     };
   }
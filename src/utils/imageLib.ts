@@ -3,6 +3,113 @@ import { createRequire } from "node:module";
 import process from "node:process";
 import type { ImageParams } from "./types.ts";
 
+export interface CacheStats {
+  hits: number;
+  misses: number;
+  evictions: number;
+  entries: number;
+  bytes: number;
+  limit: number;
+  hitRate: number;
+}
+
+/** Log2 histogram, buckets[0] counts zeroes and buckets[i] counts values in [2^(i-1), 2^i) */
+export interface StatsHistogram {
+  count: number;
+  sum: number;
+  max: number;
+  /** Upper bound of the bucket the median falls into */
+  p50: number;
+  p95: number;
+  buckets: number[];
+}
+
+export interface CommandStats {
+  jobs: number;
+  /** Jobs that didn't produce an image, including timed out or cancelled ones */
+  failures: number;
+  timeouts: number;
+  /** Wall time in microseconds, split into the same phases as ImageProgress */
+  total: StatsHistogram;
+  decode: StatsHistogram;
+  process: StatsHistogram;
+  encode: StatsHistogram;
+  inputBytes: StatsHistogram;
+  outputBytes: StatsHistogram;
+  frames: StatsHistogram;
+  /**
+   * Highest growth in vips-tracked memory since the job started, in bytes. vips only tracks the whole process, so
+   * jobs running at the same time count towards each other's peaks.
+   */
+  memPeak: StatsHistogram;
+  /** Images in the largest vips pipeline the job built, it shouldn't grow with the number of frames */
+  graphNodes: StatsHistogram;
+}
+
+/** How the cores are currently split between the jobs in flight */
+export interface ThreadStats {
+  cores: number;
+  /** Most vips concurrency a single job gets */
+  vipsMax: number;
+  jobs: number;
+  /** Threads a job starting now gets for its codecs, filters and frame shards */
+  share: number;
+  /** Current vips concurrency, it applies to every pipeline built from now on */
+  vips: number;
+}
+
+export interface ImageStats {
+  /** Process-wide peak of vips-tracked memory, in bytes */
+  memHighwater: number;
+  threads: ThreadStats;
+  /** Only commands that have run since the last reset are included */
+  commands: Record<string, CommandStats>;
+}
+
+export interface ImageProgress {
+  /** "decode" before vips starts on the output, "process" while it computes pixels, "encode" once the saver takes over */
+  phase: "decode" | "process" | "encode";
+  percent: number;
+  pixels: number;
+  /** Seconds since the job started */
+  elapsed: number;
+}
+
+export interface ImageJobOptions {
+  /** Milliseconds the job may run for before it gets killed, defaults to 10 minutes */
+  timeout?: number;
+  /** Called from the main thread at most every 250ms while the job runs */
+  progress?: (progress: ImageProgress) => void;
+  /**
+   * Bytes the result has to fit in. Bigger GIF/WebP/JPEG/PNG results get encoded again with lower quality, fewer
+   * frames or a smaller size until they fit. If nothing does, the original result comes back with overBudget set.
+   */
+  budget?: number;
+}
+
+/** Settings the encoder ended up using to fit a result in the budget, -1 for ones that don't apply to the format */
+export interface EncodeSettings {
+  attempts: number;
+  scale: number;
+  frameStep: number;
+  quality: number;
+  effort: number;
+  bitdepth: number;
+  maxError: number;
+}
+
+/** A running native job. Cancelling it rejects the promise with "image_job_killed". */
+export interface ImageJob
+  extends Promise<{ data: Buffer; type: string; encode?: EncodeSettings; overBudget?: boolean }> {
+  cancel(): void;
+}
+
+/** One command in a pipeline, params are the same as for image() */
+export interface PipelineStep {
+  cmd: string;
+  params: ImageParams["params"];
+}
+
 export interface ImageLib {
   funcs: string[];
 
@@ -10,9 +117,20 @@ export interface ImageLib {
     cmd: string,
     params: ImageParams["params"],
     input: ImageParams["input"],
-  ): Promise<{ data: Buffer; type: string }>;
-  imageInit(): Record<string, boolean>;
+    options?: ImageJobOptions,
+  ): ImageJob;
+  /**
+   * Runs several commands on a single decode of the input, only the last result gets encoded. Commands that work on
+   * the raw file (e.g. video commands) or don't take an input can't be used here.
+   */
+  pipeline(steps: PipelineStep[], input: ImageParams["input"], options?: ImageJobOptions): ImageJob;
+  imageInit(basePath?: string): Record<string, boolean>;
   trim(): number;
+  cacheStats(): { assets: CacheStats; text: CacheStats };
+  cacheLimits(limits: { assets?: number; text?: number }): void;
+  /** Defaults to every core, with at most 2 vips threads per job */
+  threadLimits(limits: { cores?: number; vips?: number }): void;
+  stats(reset?: boolean): ImageStats;
 }
 
 const nodeRequire = createRequire(import.meta.url);
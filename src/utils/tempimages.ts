@@ -32,6 +32,19 @@ export function makeTempImageFilename(originalName: string, randomId = Math.rand
   return `${randomId}.${extension}`;
 }
 
+/** Largest attachment Discord accepts in reply to a message or interaction, in bytes */
+export function uploadLimit(context: CommandInteraction | Message) {
+  if (context instanceof CommandInteraction) return context.attachmentSizeLimit;
+  switch (context.guild?.premiumTier) {
+    case 2:
+      return 52428800;
+    case 3:
+      return 104857600;
+    default:
+      return 10485760;
+  }
+}
+
 export async function upload(
   client: Client,
   result: { flags?: number } & File,
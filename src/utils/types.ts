@@ -99,6 +99,9 @@ export interface ImageParams {
   ephemeral?: boolean;
   spoiler?: boolean;
   token?: string;
+  timeout?: number;
+  /** Bytes the result has to fit in, the native side re-encodes it with cheaper settings if it's bigger */
+  sizeLimit?: number;
 }
 
 export interface ImageTypeData {